@@ -17,17 +17,10 @@
 #include "block.h"
 #include "qemu-queue.h"
 #include "qemu_socket.h"
+#include "qemu-poll.h"
 
-typedef struct AioHandler AioHandler;
-
-/* The list of registered AIO handlers */
-static QLIST_HEAD(, AioHandler) aio_handlers;
-
-/* This is a simple lock used to protect the aio_handlers list.  Specifically,
- * it's used to ensure that no callbacks are removed while we're walking and
- * dispatching callbacks.
- */
-static int walking_handlers;
+/* The context that is run by the main loop */
+static AioContext *qemu_aio_context;
 
 struct AioHandler
 {
@@ -37,14 +30,15 @@ struct AioHandler
     AioFlushHandler *io_flush;
     int deleted;
     void *opaque;
+    QEMUPollWatch *watch;
     QLIST_ENTRY(AioHandler) node;
 };
 
-static AioHandler *find_aio_handler(int fd)
+static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
 
-    QLIST_FOREACH(node, &aio_handlers, node) {
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (node->fd == fd)
             if (!node->deleted)
                 return node;
@@ -53,21 +47,39 @@ static AioHandler *find_aio_handler(int fd)
     return NULL;
 }
 
-int qemu_aio_set_fd_handler(int fd,
-                            IOHandler *io_read,
-                            IOHandler *io_write,
-                            AioFlushHandler *io_flush,
-                            void *opaque)
+static void aio_handler_event(void *opaque, int revents)
+{
+    AioHandler *node = opaque;
+
+    if (!node->deleted && node->io_read &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        node->io_read(node->opaque);
+    }
+    if (!node->deleted && node->io_write &&
+        (revents & (G_IO_OUT | G_IO_HUP | G_IO_ERR))) {
+        node->io_write(node->opaque);
+    }
+}
+
+void aio_set_fd_handler(AioContext *ctx, int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioFlushHandler *io_flush,
+                        void *opaque)
 {
     AioHandler *node;
 
-    node = find_aio_handler(fd);
+    node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
+            /* The watch can go right away, qemu_poll_dispatch() copes */
+            qemu_poll_remove(ctx->poll, node->watch);
+            node->watch = NULL;
+
             /* If the lock is held, just mark the node as deleted */
-            if (walking_handlers)
+            if (ctx->walking_handlers)
                 node->deleted = 1;
             else {
                 /* Otherwise, delete it for real.  We can't just mark it as
@@ -83,7 +95,9 @@ int qemu_aio_set_fd_handler(int fd,
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
             node->fd = fd;
-            QLIST_INSERT_HEAD(&aio_handlers, node, node);
+            node->watch = qemu_poll_add(ctx->poll, fd, 0,
+                                        aio_handler_event, node);
+            QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -92,62 +106,134 @@ int qemu_aio_set_fd_handler(int fd,
         node->opaque = opaque;
     }
 
-    qemu_set_fd_handler2(fd, NULL, io_read, io_write, opaque);
-
-    return 0;
+    /* The main loop runs the handlers of the main context as well */
+    if (ctx == qemu_aio_context) {
+        qemu_set_fd_handler2(fd, NULL, io_read, io_write, opaque);
+    }
 }
 
-void qemu_aio_flush(void)
+int qemu_aio_set_fd_handler(int fd,
+                            IOHandler *io_read,
+                            IOHandler *io_write,
+                            AioFlushHandler *io_flush,
+                            void *opaque)
 {
-    while (qemu_aio_wait());
+    aio_set_fd_handler(qemu_get_aio_context(), fd, io_read, io_write,
+                       io_flush, opaque);
+    return 0;
 }
 
-bool qemu_aio_wait(void)
+/* Enable the watches of handlers with pending requests.  Returns the
+ * number of enabled watches; *busy tells whether any io_flush callback
+ * reported pending requests.
+ */
+static int aio_update_watches(AioContext *ctx, bool *busy)
 {
     AioHandler *node;
-    fd_set rdfds, wrfds;
-    int max_fd = -1;
-    int ret;
-    bool busy;
+    int enabled = 0;
 
-    /*
-     * If there are callbacks left that have been queued, we need to call then.
-     * Do not call select in this case, because it is possible that the caller
-     * does not need a complete flush (as is the case for qemu_aio_wait loops).
-     */
-    if (qemu_bh_poll()) {
-        return true;
-    }
+    ctx->walking_handlers++;
 
-    walking_handlers = 1;
+    *busy = false;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        int events = 0;
 
-    FD_ZERO(&rdfds);
-    FD_ZERO(&wrfds);
+        if (node->deleted) {
+            continue;
+        }
 
-    /* fill fd sets */
-    busy = false;
-    QLIST_FOREACH(node, &aio_handlers, node) {
         /* If there aren't pending AIO operations, don't invoke callbacks.
          * Otherwise, if there are no AIO requests, qemu_aio_wait() would
          * wait indefinitely.
          */
-        if (node->io_flush) {
-            if (node->io_flush(node->opaque) == 0) {
-                continue;
+        if (!node->io_flush || node->io_flush(node->opaque) != 0) {
+            if (node->io_flush) {
+                *busy = true;
+            }
+            if (node->io_read) {
+                events |= G_IO_IN;
+            }
+            if (node->io_write) {
+                events |= G_IO_OUT;
             }
-            busy = true;
         }
-        if (!node->deleted && node->io_read) {
-            FD_SET(node->fd, &rdfds);
-            max_fd = MAX(max_fd, node->fd + 1);
+        if (node->watch) {
+            qemu_poll_modify(ctx->poll, node->watch, events);
         }
-        if (!node->deleted && node->io_write) {
-            FD_SET(node->fd, &wrfds);
-            max_fd = MAX(max_fd, node->fd + 1);
+        enabled += !!events;
+    }
+
+    ctx->walking_handlers--;
+    return enabled;
+}
+
+/* Dispatch the handlers that became ready in the last wait */
+static int aio_dispatch(AioContext *ctx)
+{
+    AioHandler *node, *tmp;
+    int ret;
+
+    /* qemu_aio_set_fd_handler may be called while we're dispatching */
+    ctx->walking_handlers++;
+    ret = qemu_poll_dispatch(ctx->poll);
+    ctx->walking_handlers--;
+
+    if (!ctx->walking_handlers) {
+        QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+            if (node->deleted) {
+                QLIST_REMOVE(node, node);
+                g_free(node);
+            }
         }
     }
+    return ret;
+}
+
+/* Nanoseconds until the first timer of the context expires, or -1 */
+static int64_t aio_deadline_ns(AioContext *ctx)
+{
+    return ctx->clock ? qemu_clock_deadline_ns(ctx->clock) : -1;
+}
+
+static bool aio_run_timers(AioContext *ctx)
+{
+    if (aio_deadline_ns(ctx) != 0) {
+        return false;
+    }
+    qemu_run_timers(ctx->clock);
+    return true;
+}
 
-    walking_handlers = 0;
+void qemu_aio_flush(void)
+{
+    aio_flush(qemu_get_aio_context());
+}
+
+void aio_flush(AioContext *ctx)
+{
+    while (aio_wait(ctx));
+}
+
+bool qemu_aio_wait(void)
+{
+    return aio_wait(qemu_get_aio_context());
+}
+
+bool aio_wait(AioContext *ctx)
+{
+    int ret;
+    bool busy;
+
+    /*
+     * If there are callbacks left that have been queued, we need to call then.
+     * Do not call select in this case, because it is possible that the caller
+     * does not need a complete flush (as is the case for qemu_aio_wait loops).
+     */
+    if (aio_bh_poll(ctx)) {
+        return true;
+    }
+
+    aio_update_watches(ctx, &busy);
 
     /* No AIO operations?  Get us out of here */
     if (!busy) {
@@ -155,40 +241,250 @@ bool qemu_aio_wait(void)
     }
 
     /* wait until next event */
-    ret = select(max_fd, &rdfds, &wrfds, NULL, NULL);
+    ret = qemu_poll_wait(ctx->poll, aio_deadline_ns(ctx));
 
-    /* if we have any readable fds, dispatch event */
+    /* if we have any ready fds, dispatch event */
     if (ret > 0) {
-        walking_handlers = 1;
-
-        /* we have to walk very carefully in case
-         * qemu_aio_set_fd_handler is called while we're walking */
-        node = QLIST_FIRST(&aio_handlers);
-        while (node) {
-            AioHandler *tmp;
-
-            if (!node->deleted &&
-                FD_ISSET(node->fd, &rdfds) &&
-                node->io_read) {
-                node->io_read(node->opaque);
-            }
-            if (!node->deleted &&
-                FD_ISSET(node->fd, &wrfds) &&
-                node->io_write) {
-                node->io_write(node->opaque);
-            }
+        aio_dispatch(ctx);
+    }
+    aio_run_timers(ctx);
 
-            tmp = node;
-            node = QLIST_NEXT(node, node);
+    return true;
+}
 
-            if (tmp->deleted) {
-                QLIST_REMOVE(tmp, node);
-                g_free(tmp);
-            }
+bool aio_poll(AioContext *ctx, bool blocking)
+{
+    int64_t timeout = 0;
+    bool progress;
+    bool busy;
+    int ret;
+
+    progress = aio_bh_poll(ctx);
+
+    if (aio_update_watches(ctx, &busy) == 0 && aio_deadline_ns(ctx) < 0) {
+        /* Nothing could ever wake us up */
+        return progress;
+    }
+
+    if (blocking && !progress) {
+        timeout = aio_deadline_ns(ctx);
+    }
+    ret = qemu_poll_wait(ctx->poll, timeout);
+    if (ret > 0 && aio_dispatch(ctx) > 0) {
+        progress = true;
+    }
+    if (aio_run_timers(ctx)) {
+        progress = true;
+    }
+
+    return progress;
+}
+
+QEMUTimer *aio_timer_new(AioContext *ctx, int scale,
+                         QEMUTimerCB *cb, void *opaque)
+{
+    return qemu_new_timer(ctx->clock ? ctx->clock : rt_clock, scale,
+                          cb, opaque);
+}
+
+void aio_notify(AioContext *ctx)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    if (ctx == qemu_aio_context) {
+        qemu_notify_event();
+        return;
+    }
+
+    /* A wakeup that was not consumed yet covers this one too */
+    if (!g_atomic_int_compare_and_exchange(&ctx->notify_pending, 0, 1)) {
+        return;
+    }
+
+    do {
+        ret = write(ctx->notify_wfd, &value, sizeof(value));
+    } while (ret < 0 && errno == EINTR);
+
+    /* EAGAIN is fine, the context is going to wake up anyway */
+}
+
+static void aio_context_init(AioContext *ctx)
+{
+    ctx->poll = qemu_poll_new();
+    QLIST_INIT(&ctx->aio_handlers);
+    notifier_list_init(&ctx->free_notifiers);
+    ctx->notify_rfd = ctx->notify_wfd = -1;
+    qemu_mutex_init(&ctx->bh_lock);
+    qemu_mutex_init(&ctx->lock);
+    qemu_cond_init(&ctx->cond);
+}
+
+AioContext *qemu_get_aio_context(void)
+{
+    if (!qemu_aio_context) {
+        qemu_aio_context = g_malloc0(sizeof(AioContext));
+        aio_context_init(qemu_aio_context);
+    }
+    return qemu_aio_context;
+}
+
+#ifndef _WIN32
+static void aio_notify_read(void *opaque)
+{
+    AioContext *ctx = opaque;
+    char buffer[512];
+    ssize_t len;
+
+    /* Drain the notification channel.  For eventfd, only 8 bytes are read. */
+    do {
+        len = read(ctx->notify_rfd, buffer, sizeof(buffer));
+    } while ((len == -1 && errno == EINTR) || len == sizeof(buffer));
+
+    /* Only now may aio_notify() write again, or its wakeup could be
+     * drained above and lost.  The cmpxchg is a full barrier, so bottom
+     * halves scheduled by a notifier that saw the flag still set are
+     * found by the aio_bh_poll() that follows.
+     */
+    g_atomic_int_compare_and_exchange(&ctx->notify_pending, 1, 0);
+}
+
+static void aio_clock_notify(void *opaque)
+{
+    aio_notify(opaque);
+}
+
+AioContext *aio_context_new(void)
+{
+    AioContext *ctx;
+    int fds[2];
+
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create AioContext notifier: %s\n",
+                strerror(errno));
+        abort();
+    }
+
+    ctx = g_malloc0(sizeof(AioContext));
+    aio_context_init(ctx);
+    ctx->notify_rfd = fds[0];
+    ctx->notify_wfd = fds[1];
+    socket_set_nonblock(ctx->notify_rfd);
+    socket_set_nonblock(ctx->notify_wfd);
+    ctx->clock = qemu_new_private_rt_clock(aio_clock_notify, ctx);
+
+    aio_set_fd_handler(ctx, ctx->notify_rfd, aio_notify_read, NULL, NULL,
+                       ctx);
+    return ctx;
+}
+
+void aio_context_free(AioContext *ctx)
+{
+    assert(ctx != qemu_aio_context && !ctx->thread_running);
+
+    notifier_list_notify(&ctx->free_notifiers, ctx);
+
+    aio_set_fd_handler(ctx, ctx->notify_rfd, NULL, NULL, NULL, NULL);
+    close(ctx->notify_rfd);
+    if (ctx->notify_wfd != ctx->notify_rfd) {
+        close(ctx->notify_wfd);
+    }
+
+    /* Run the bottom halves that were deleted last */
+    aio_bh_poll(ctx);
+    assert(QLIST_EMPTY(&ctx->aio_handlers) && !ctx->first_bh);
+
+    qemu_free_clock(ctx->clock);
+    qemu_poll_free(ctx->poll);
+    qemu_cond_destroy(&ctx->cond);
+    qemu_mutex_destroy(&ctx->lock);
+    qemu_mutex_destroy(&ctx->bh_lock);
+    g_free(ctx);
+}
+#endif
+
+static void *aio_context_thread(void *opaque)
+{
+    AioContext *ctx = opaque;
+
+    qemu_mutex_lock(&ctx->lock);
+    while (!ctx->thread_stopping) {
+        /* Stay out of the way while somebody else has the context */
+        if (ctx->acquire_count) {
+            ctx->thread_parked = true;
+            qemu_cond_broadcast(&ctx->cond);
+            qemu_cond_wait(&ctx->cond, &ctx->lock);
+            continue;
         }
+        ctx->thread_parked = false;
+        qemu_mutex_unlock(&ctx->lock);
 
-        walking_handlers = 0;
+        aio_poll(ctx, true);
+
+        qemu_mutex_lock(&ctx->lock);
     }
+    ctx->thread_parked = false;
+    qemu_mutex_unlock(&ctx->lock);
 
-    return true;
+    return NULL;
+}
+
+void aio_context_start_thread(AioContext *ctx)
+{
+    assert(ctx != qemu_aio_context && !ctx->thread_running);
+
+    ctx->thread_running = true;
+    ctx->thread_stopping = false;
+    qemu_thread_create(&ctx->thread, aio_context_thread, ctx,
+                       QEMU_THREAD_JOINABLE);
+}
+
+void aio_context_stop_thread(AioContext *ctx)
+{
+    if (!ctx->thread_running) {
+        return;
+    }
+
+    qemu_mutex_lock(&ctx->lock);
+    ctx->thread_stopping = true;
+    qemu_cond_broadcast(&ctx->cond);
+    qemu_mutex_unlock(&ctx->lock);
+    aio_notify(ctx);
+
+    qemu_thread_join(&ctx->thread);
+    ctx->thread_running = false;
+}
+
+void aio_context_acquire(AioContext *ctx)
+{
+    qemu_mutex_lock(&ctx->lock);
+    if (ctx->acquire_count && qemu_thread_is_self(&ctx->owner)) {
+        ctx->acquire_count++;
+        qemu_mutex_unlock(&ctx->lock);
+        return;
+    }
+
+    while (ctx->acquire_count) {
+        qemu_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    ctx->acquire_count = 1;
+    qemu_thread_get_self(&ctx->owner);
+
+    if (ctx->thread_running && !qemu_thread_is_self(&ctx->thread)) {
+        aio_notify(ctx);
+        while (!ctx->thread_parked) {
+            qemu_cond_wait(&ctx->cond, &ctx->lock);
+        }
+    }
+    qemu_mutex_unlock(&ctx->lock);
+}
+
+void aio_context_release(AioContext *ctx)
+{
+    qemu_mutex_lock(&ctx->lock);
+    assert(ctx->acquire_count > 0);
+    if (--ctx->acquire_count == 0) {
+        qemu_cond_broadcast(&ctx->cond);
+    }
+    qemu_mutex_unlock(&ctx->lock);
 }
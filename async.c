@@ -25,46 +25,69 @@
 #include "qemu-common.h"
 #include "qemu-aio.h"
 #include "main-loop.h"
-
-/* Anchor of the list of Bottom Halves belonging to the context */
-static struct QEMUBH *first_bh;
+#include "qemu-barrier.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+/*
+ * Bottom halves can be scheduled from any thread.  Scheduling is a
+ * compare-and-swap on the scheduled flag; only the thread that flips it
+ * wakes up the context, so a burst of schedules costs a single wakeup.
+ * The context's thread runs the callbacks and owns everything else:
+ * walking the list, deleting and cancelling.  New bottom halves are
+ * pushed at the head of the list under bh_lock, which the owner also
+ * takes to unlink deleted ones, so the walk itself needs no lock.
+ */
+
 struct QEMUBH {
+    AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
     QEMUBH *next;
-    bool scheduled;
+    int scheduled;      /* accessed atomically */
     bool idle;
     bool deleted;
 };
 
-QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
     bh = g_malloc0(sizeof(QEMUBH));
+    bh->ctx = ctx;
     bh->cb = cb;
     bh->opaque = opaque;
-    bh->next = first_bh;
-    first_bh = bh;
+    qemu_mutex_lock(&ctx->bh_lock);
+    bh->next = ctx->first_bh;
+    /* Make sure the members are visible before the list walk can see it */
+    smp_wmb();
+    ctx->first_bh = bh;
+    qemu_mutex_unlock(&ctx->bh_lock);
     return bh;
 }
 
-int qemu_bh_poll(void)
+QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+{
+    return aio_bh_new(qemu_get_aio_context(), cb, opaque);
+}
+
+int aio_bh_poll(AioContext *ctx)
 {
     QEMUBH *bh, **bhp, *next;
     int ret;
-    static int nesting = 0;
 
-    nesting++;
+    ctx->walking_bh++;
 
     ret = 0;
-    for (bh = first_bh; bh; bh = next) {
+    for (bh = ctx->first_bh; bh; bh = next) {
+        /* Pairs with the barrier in aio_bh_new */
+        smp_rmb();
         next = bh->next;
-        if (!bh->deleted && bh->scheduled) {
-            bh->scheduled = 0;
+        /* The cmpxchg orders the reads of idle and of the callback's data
+         * after the flag, pairing with qemu_bh_schedule()
+         */
+        if (!bh->deleted && bh->scheduled &&
+            g_atomic_int_compare_and_exchange(&bh->scheduled, 1, 0)) {
             if (!bh->idle)
                 ret = 1;
             bh->idle = 0;
@@ -72,11 +95,12 @@ int qemu_bh_poll(void)
         }
     }
 
-    nesting--;
+    ctx->walking_bh--;
 
     /* remove deleted bhs */
-    if (!nesting) {
-        bhp = &first_bh;
+    if (!ctx->walking_bh) {
+        qemu_mutex_lock(&ctx->bh_lock);
+        bhp = &ctx->first_bh;
         while (*bhp) {
             bh = *bhp;
             if (bh->deleted) {
@@ -86,27 +110,42 @@ int qemu_bh_poll(void)
                 bhp = &bh->next;
             }
         }
+        qemu_mutex_unlock(&ctx->bh_lock);
     }
 
     return ret;
 }
 
+int qemu_bh_poll(void)
+{
+    return aio_bh_poll(qemu_get_aio_context());
+}
+
+/* Only for the thread that runs the bottom half */
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
     if (bh->scheduled)
         return;
-    bh->scheduled = 1;
     bh->idle = 1;
+    g_atomic_int_compare_and_exchange(&bh->scheduled, 0, 1);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    if (bh->scheduled)
-        return;
-    bh->scheduled = 1;
+    bool was_idle = bh->idle;
+
     bh->idle = 0;
-    /* stop the currently executing CPU to execute the BH ASAP */
-    qemu_notify_event();
+    /* The cmpxchg is a full barrier even when it fails, so whatever the
+     * caller wrote for the callback is visible before the callback runs.
+     * Only the first schedule since the bottom half last ran has to wake
+     * up the context; an idle bottom half that becomes a normal one needs
+     * a wakeup too.
+     */
+    if (g_atomic_int_compare_and_exchange(&bh->scheduled, 0, 1) || was_idle) {
+        /* stop the currently executing CPU (or wake up the context's
+         * thread) to execute the BH ASAP */
+        aio_notify(bh->ctx);
+    }
 }
 
 void qemu_bh_cancel(QEMUBH *bh)
@@ -120,11 +159,11 @@ void qemu_bh_delete(QEMUBH *bh)
     bh->deleted = 1;
 }
 
-void qemu_bh_update_timeout(uint32_t *timeout)
+void aio_bh_update_timeout(AioContext *ctx, uint32_t *timeout)
 {
     QEMUBH *bh;
 
-    for (bh = first_bh; bh; bh = bh->next) {
+    for (bh = ctx->first_bh; bh; bh = bh->next) {
         if (!bh->deleted && bh->scheduled) {
             if (bh->idle) {
                 /* idle bottom halves will be polled at least
@@ -140,3 +179,7 @@ void qemu_bh_update_timeout(uint32_t *timeout)
     }
 }
 
+void qemu_bh_update_timeout(uint32_t *timeout)
+{
+    aio_bh_update_timeout(qemu_get_aio_context(), timeout);
+}
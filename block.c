@@ -83,13 +83,6 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
 
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, int64_t *wait);
-
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
 
@@ -122,41 +115,126 @@ int is_windows_drive(const char *filename)
 }
 #endif
 
-/* throttling disk I/O limits */
-void bdrv_io_limits_disable(BlockDriverState *bs)
+/*
+ * Throttle groups: the devices of a group share one ThrottleState, so that
+ * their requests draw from a single budget, and one queue that keeps the
+ * requests of the whole group in FIFO order.  A device that is not given
+ * a group name gets a group of its own, named after the device.
+ */
+struct ThrottleGroup {
+    char *name;
+    int refcount;
+    ThrottleState ts;
+    CoQueue throttled_reqs;
+    QEMUTimer *timer;
+    QTAILQ_ENTRY(ThrottleGroup) list;
+};
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+static void throttle_group_timer(void *opaque)
 {
-    bs->io_limits_enabled = false;
+    ThrottleGroup *tg = opaque;
+
+    qemu_co_queue_next(&tg->throttled_reqs);
+}
 
-    while (qemu_co_queue_next(&bs->throttled_reqs));
+static ThrottleGroup *throttle_group_get(const char *name)
+{
+    ThrottleGroup *tg;
 
-    if (bs->block_timer) {
-        qemu_del_timer(bs->block_timer);
-        qemu_free_timer(bs->block_timer);
-        bs->block_timer = NULL;
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(tg->name, name)) {
+            tg->refcount++;
+            return tg;
+        }
     }
 
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    tg = g_malloc0(sizeof(*tg));
+    tg->name = g_strdup(name);
+    tg->refcount = 1;
+    throttle_init(&tg->ts, qemu_get_clock_ns(vm_clock));
+    qemu_co_queue_init(&tg->throttled_reqs);
+    tg->timer = qemu_new_timer_ns(vm_clock, throttle_group_timer, tg);
+    QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+    return tg;
 }
 
-static void bdrv_block_timer(void *opaque)
+static void throttle_group_put(ThrottleGroup *tg)
 {
-    BlockDriverState *bs = opaque;
+    if (--tg->refcount) {
+        return;
+    }
+
+    assert(qemu_co_queue_empty(&tg->throttled_reqs));
+    QTAILQ_REMOVE(&throttle_groups, tg, list);
+    qemu_del_timer(tg->timer);
+    qemu_free_timer(tg->timer);
+    g_free(tg->name);
+    g_free(tg);
+}
+
+static void throttle_group_config(ThrottleGroup *tg, BlockIOLimit *io_limits)
+{
+    double burst_length = io_limits->burst_length;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        throttle_config_bucket(&tg->ts.bps[i], io_limits->bps[i],
+                               io_limits->bps_max[i], burst_length);
+        throttle_config_bucket(&tg->ts.ops[i], io_limits->iops[i],
+                               io_limits->iops_max[i], burst_length);
+    }
+}
+
+/* throttling disk I/O limits */
+void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+
+    bs->io_limits_enabled = false;
+    if (!tg) {
+        return;
+    }
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+    /*
+     * Waking only the head keeps the queue in order, like the timer does.
+     * The requests of this device still wait for their turn, but then go
+     * through unthrottled and pass the turn on.  They hold a reference to
+     * the group until then.
+     */
+    bs->throttle_group = NULL;
+    qemu_co_queue_next(&tg->throttled_reqs);
+    throttle_group_put(tg);
 }
 
 void bdrv_io_limits_enable(BlockDriverState *bs)
 {
-    qemu_co_queue_init(&bs->throttled_reqs);
-    bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
-    bs->slice_time  = 5 * BLOCK_IO_SLICE_TIME;
-    bs->slice_start = qemu_get_clock_ns(vm_clock);
-    bs->slice_end   = bs->slice_start + bs->slice_time;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    const char *name = bs->io_limits_group ? bs->io_limits_group
+                                           : bs->device_name;
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *other;
+
+    if (tg && strcmp(tg->name, name)) {
+        bdrv_io_limits_disable(bs);
+        tg = NULL;
+    }
+    if (!tg) {
+        tg = bs->throttle_group = throttle_group_get(name);
+    }
+
+    /* The limits applied last hold for every member of the group */
+    throttle_group_config(tg, &bs->io_limits);
+    QTAILQ_FOREACH(other, &bdrv_states, list) {
+        if (other->throttle_group == tg) {
+            other->io_limits = bs->io_limits;
+        }
+    }
     bs->io_limits_enabled = true;
+
+    /* Let waiting requests look at the new limits */
+    qemu_mod_timer(tg->timer, qemu_get_clock_ns(vm_clock));
 }
 
 bool bdrv_io_limits_enabled(BlockDriverState *bs)
@@ -173,10 +251,14 @@ bool bdrv_io_limits_enabled(BlockDriverState *bs)
 static void bdrv_io_limits_intercept(BlockDriverState *bs,
                                      bool is_write, int nb_sectors)
 {
-    int64_t wait_time = -1;
+    ThrottleGroup *tg = bs->throttle_group;
+    int64_t now, wait;
 
-    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
-        qemu_co_queue_wait(&bs->throttled_reqs);
+    /* The device may leave the group while the request sleeps */
+    tg->refcount++;
+
+    if (!qemu_co_queue_empty(&tg->throttled_reqs)) {
+        qemu_co_queue_wait(&tg->throttled_reqs);
     }
 
     /* In fact, we hope to keep each request's timing, in FIFO mode. The next
@@ -184,15 +266,26 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
      * allowed to be serviced. So if the current request still exceeds the
      * limits, it will be inserted to the head. All requests followed it will
      * be still in throttled_reqs queue.
+     *
+     * Only one request is woken at a time, by the timer or by the request
+     * ahead of it, so that re-inserting at the head keeps the order.  If
+     * the device left the group meanwhile, the request goes through
+     * unthrottled.
      */
-
-    while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
-        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    while (bs->throttle_group == tg) {
+        now = qemu_get_clock_ns(vm_clock);
+        wait = throttle_compute_wait(&tg->ts, now, is_write);
+        if (!wait) {
+            throttle_account(&tg->ts, is_write,
+                             (uint64_t)nb_sectors * BDRV_SECTOR_SIZE);
+            break;
+        }
+        qemu_mod_timer(tg->timer, now + wait);
+        qemu_co_queue_wait_insert_head(&tg->throttled_reqs);
     }
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+    qemu_co_queue_next(&tg->throttled_reqs);
+    throttle_group_put(tg);
 }
 
 /* check if the path starts with "<protocol>:" */
@@ -861,6 +954,9 @@ unlink_and_fail:
 
 void bdrv_close(BlockDriverState *bs)
 {
+    /* Take the drive back, the main loop closes it */
+    bdrv_set_aio_context(bs, qemu_get_aio_context());
+
     bdrv_flush(bs);
     if (bs->drv) {
         if (bs->job) {
@@ -933,27 +1029,127 @@ void bdrv_drain_all(void)
     BlockDriverState *bs;
     bool busy;
 
+    /* Drives bound to another context are drained in that context */
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        AioContext *ctx = bs->aio_context;
+
+        if (ctx) {
+            aio_context_acquire(ctx);
+            aio_flush(ctx);
+            aio_context_release(ctx);
+        }
+    }
+
     do {
+        ThrottleGroup *tg;
+
         busy = qemu_aio_wait();
 
         /* FIXME: We do not have timer support here, so this is effectively
-         * a busy wait.
+         * a busy wait.  Like the timer, wake one request per group so that
+         * the queue stays in order.
          */
-        QTAILQ_FOREACH(bs, &bdrv_states, list) {
-            if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
-                qemu_co_queue_restart_all(&bs->throttled_reqs);
+        QTAILQ_FOREACH(tg, &throttle_groups, list) {
+            if (!qemu_co_queue_empty(&tg->throttled_reqs)) {
+                qemu_co_queue_next(&tg->throttled_reqs);
                 busy = true;
             }
         }
     } while (busy);
 
-    /* If requests are still pending there is a bug somewhere */
+    /* If requests are still pending there is a bug somewhere.  Drives in
+     * other contexts may have received new requests in the meantime.
+     */
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->aio_context) {
+            continue;
+        }
         assert(QLIST_EMPTY(&bs->tracked_requests));
-        assert(qemu_co_queue_empty(&bs->throttled_reqs));
+        assert(!bs->throttle_group ||
+               qemu_co_queue_empty(&bs->throttle_group->throttled_reqs));
     }
 }
 
+AioContext *bdrv_get_aio_context(BlockDriverState *bs)
+{
+    return bs->aio_context ? bs->aio_context : qemu_get_aio_context();
+}
+
+static bool bdrv_aio_context_supported(BlockDriverState *bs)
+{
+    if (bs->drv && !bs->drv->bdrv_attach_aio_context) {
+        return false;
+    }
+    return (!bs->file || bdrv_aio_context_supported(bs->file)) &&
+           (!bs->backing_hd || bdrv_aio_context_supported(bs->backing_hd));
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (bs->drv && bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv && bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+    bs->aio_context =
+        new_context == qemu_get_aio_context() ? NULL : new_context;
+}
+
+/*
+ * Move bs, together with its protocol and backing files, to another
+ * AioContext.  Pending requests are completed first.  Afterwards the
+ * drive may only be used from the thread that runs new_context, or by
+ * whoever holds it with aio_context_acquire().
+ *
+ * Returns -ENOTSUP if one of the drivers cannot be moved, -EBUSY if I/O
+ * throttling or a block job, which run in the main loop, are active.
+ */
+int bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    AioContext *old_context = bdrv_get_aio_context(bs);
+
+    if (new_context == old_context) {
+        return 0;
+    }
+    if (new_context != qemu_get_aio_context()) {
+        if (!bdrv_aio_context_supported(bs)) {
+            return -ENOTSUP;
+        }
+        if (bs->io_limits_enabled || bs->job) {
+            return -EBUSY;
+        }
+    }
+
+    aio_context_acquire(old_context);
+    aio_context_acquire(new_context);
+
+    aio_flush(old_context);
+    bdrv_detach_aio_context(bs);
+    bdrv_attach_aio_context(bs, new_context);
+
+    aio_context_release(new_context);
+    aio_context_release(old_context);
+    return 0;
+}
+
 /* make a BlockDriverState anonymous by removing from bdrv_state list.
    Also, NULL terminate the device_name to prevent double remove */
 void bdrv_make_anon(BlockDriverState *bs)
@@ -987,13 +1183,9 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
     /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
     bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
-    bs_dest->throttled_reqs     = bs_src->throttled_reqs;
-    bs_dest->block_timer        = bs_src->block_timer;
+    bs_dest->io_limits_group    = bs_src->io_limits_group;
+    bs_dest->throttle_group     = bs_src->throttle_group;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
     /* r/w error */
@@ -1004,6 +1196,10 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->iostatus_enabled   = bs_src->iostatus_enabled;
     bs_dest->iostatus           = bs_src->iostatus;
 
+    /* latency histograms */
+    memcpy(bs_dest->latency_histogram, bs_src->latency_histogram,
+           sizeof(bs_dest->latency_histogram));
+
     /* dirty bitmap */
     bs_dest->dirty_count        = bs_src->dirty_count;
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
@@ -1041,7 +1237,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1060,7 +1256,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1093,6 +1289,8 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(!bs->in_use);
@@ -1103,6 +1301,10 @@ void bdrv_delete(BlockDriverState *bs)
     bdrv_close(bs);
 
     assert(bs != bs_snapshots);
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_latency_histogram_set(bs, i, NULL, 0);
+    }
+    g_free(bs->io_limits_group);
     g_free(bs);
 }
 
@@ -1394,6 +1596,24 @@ struct BdrvTrackedRequest {
     CoQueue wait_queue; /* coroutines blocked on this request */
 };
 
+/**
+ * Account a change of the number of tracked requests
+ *
+ * The time integral of the queue depth gives the average depth over any
+ * interval; the time of the last change, when nothing is in flight, is the
+ * start of the current idle period.
+ */
+static void bdrv_in_flight_update(BlockDriverState *bs, int delta)
+{
+    int64_t now = get_clock();
+
+    bs->in_flight_time_ns += (uint64_t)bs->nr_in_flight *
+                             (now - bs->in_flight_stamp_ns);
+    bs->in_flight_stamp_ns = now;
+    bs->nr_in_flight += delta;
+    bs->max_in_flight = MAX(bs->max_in_flight, bs->nr_in_flight);
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -1402,6 +1622,7 @@ struct BdrvTrackedRequest {
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
     QLIST_REMOVE(req, list);
+    bdrv_in_flight_update(req->bs, -1);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -1424,6 +1645,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    bdrv_in_flight_update(bs, 1);
 }
 
 /**
@@ -1620,7 +1842,7 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_wait(bdrv_get_aio_context(bs));
         }
     }
     return rwco.ret;
@@ -2128,9 +2350,13 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
 
 /* throttling disk io limits */
 void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits)
+                        BlockIOLimit *io_limits, const char *group)
 {
+    char *old_group = bs->io_limits_group;
+
     bs->io_limits = *io_limits;
+    bs->io_limits_group = group ? g_strdup(group) : NULL;
+    g_free(old_group);
     bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
 }
 
@@ -2360,7 +2586,7 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
     qemu_coroutine_enter(co, &data);
     while (!data.done) {
-        qemu_aio_wait();
+        aio_wait(bdrv_get_aio_context(bs));
     }
     return data.ret;
 }
@@ -2455,18 +2681,36 @@ BlockInfoList *qmp_query_block(Error **errp)
                 bdrv_get_backing_file_depth(bs);
 
             if (bs->io_limits_enabled) {
-                info->value->inserted->bps =
-                               bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-                info->value->inserted->bps_rd =
-                               bs->io_limits.bps[BLOCK_IO_LIMIT_READ];
-                info->value->inserted->bps_wr =
-                               bs->io_limits.bps[BLOCK_IO_LIMIT_WRITE];
-                info->value->inserted->iops =
-                               bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-                info->value->inserted->iops_rd =
-                               bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
-                info->value->inserted->iops_wr =
-                               bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+                BlockDeviceInfo *inserted = info->value->inserted;
+                BlockIOLimit *limits = &bs->io_limits;
+
+                inserted->bps     = limits->bps[BLOCK_IO_LIMIT_TOTAL];
+                inserted->bps_rd  = limits->bps[BLOCK_IO_LIMIT_READ];
+                inserted->bps_wr  = limits->bps[BLOCK_IO_LIMIT_WRITE];
+                inserted->iops    = limits->iops[BLOCK_IO_LIMIT_TOTAL];
+                inserted->iops_rd = limits->iops[BLOCK_IO_LIMIT_READ];
+                inserted->iops_wr = limits->iops[BLOCK_IO_LIMIT_WRITE];
+
+                inserted->bps_max     = limits->bps_max[BLOCK_IO_LIMIT_TOTAL];
+                inserted->bps_rd_max  = limits->bps_max[BLOCK_IO_LIMIT_READ];
+                inserted->bps_wr_max  = limits->bps_max[BLOCK_IO_LIMIT_WRITE];
+                inserted->iops_max    = limits->iops_max[BLOCK_IO_LIMIT_TOTAL];
+                inserted->iops_rd_max = limits->iops_max[BLOCK_IO_LIMIT_READ];
+                inserted->iops_wr_max = limits->iops_max[BLOCK_IO_LIMIT_WRITE];
+                inserted->has_bps_max     = !!inserted->bps_max;
+                inserted->has_bps_rd_max  = !!inserted->bps_rd_max;
+                inserted->has_bps_wr_max  = !!inserted->bps_wr_max;
+                inserted->has_iops_max    = !!inserted->iops_max;
+                inserted->has_iops_rd_max = !!inserted->iops_rd_max;
+                inserted->has_iops_wr_max = !!inserted->iops_wr_max;
+
+                inserted->has_burst_length = !!limits->burst_length;
+                inserted->burst_length = limits->burst_length;
+
+                if (bs->throttle_group) {
+                    inserted->has_group = true;
+                    inserted->group = g_strdup(bs->throttle_group->name);
+                }
             }
         }
 
@@ -2483,9 +2727,31 @@ BlockInfoList *qmp_query_block(Error **errp)
 }
 
 /* Consider exposing this as a full fledged QMP command */
+static bool bdrv_query_latency_histogram(const BlockLatencyHistogram *hist,
+                                         BlockLatencyBinList **list)
+{
+    BlockLatencyBinList **next = list;
+    int i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        BlockLatencyBinList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        if (i < hist->nbins - 1) {
+            entry->value->has_upper_ns = true;
+            entry->value->upper_ns = hist->boundaries[i];
+        }
+        entry->value->count = hist->bins[i];
+        *next = entry;
+        next = &entry->next;
+    }
+    return hist->nbins != 0;
+}
+
 static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
 {
     BlockStats *s;
+    int64_t now;
 
     s = g_malloc0(sizeof(*s));
 
@@ -2504,6 +2770,28 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->rd_merged = bs->nr_merged[BDRV_ACCT_READ];
+    s->stats->wr_merged = bs->nr_merged[BDRV_ACCT_WRITE];
+
+    now = get_clock();
+    s->stats->in_flight = bs->nr_in_flight;
+    s->stats->max_in_flight = bs->max_in_flight;
+    s->stats->in_flight_time_ns = bs->in_flight_time_ns +
+        (uint64_t)bs->nr_in_flight * (now - bs->in_flight_stamp_ns);
+    if (!bs->nr_in_flight && bs->in_flight_stamp_ns) {
+        s->stats->has_idle_time_ns = true;
+        s->stats->idle_time_ns = now - bs->in_flight_stamp_ns;
+    }
+
+    s->stats->has_rd_latency_histogram =
+        bdrv_query_latency_histogram(&bs->latency_histogram[BDRV_ACCT_READ],
+                                     &s->stats->rd_latency_histogram);
+    s->stats->has_wr_latency_histogram =
+        bdrv_query_latency_histogram(&bs->latency_histogram[BDRV_ACCT_WRITE],
+                                     &s->stats->wr_latency_histogram);
+    s->stats->has_flush_latency_histogram =
+        bdrv_query_latency_histogram(&bs->latency_histogram[BDRV_ACCT_FLUSH],
+                                     &s->stats->flush_latency_histogram);
 
     if (bs->file) {
         s->has_parent = true;
@@ -3047,171 +3335,6 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
-/* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
-{
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
-    }
-
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
-
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
-{
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
-    }
-
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
-    }
-
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-                           bool is_write, int64_t *wait)
-{
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
-
-    now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
-    }
-
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
-
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
-        if (wait) {
-            *wait = max_wait;
-        }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
-        }
-
-        return true;
-    }
-
-    if (wait) {
-        *wait = 0;
-    }
-
-    return false;
-}
-
 /**************************************************************/
 /* async block device emulation */
 
@@ -3267,7 +3390,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3305,7 +3428,7 @@ typedef struct BlockDriverAIOCBCoroutine {
 
 static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 {
-    qemu_aio_flush();
+    aio_flush(bdrv_get_aio_context(blockacb->bs));
 }
 
 static AIOPool bdrv_em_co_aio_pool = {
@@ -3336,7 +3459,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, 0);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3369,7 +3492,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3394,7 +3517,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3432,7 +3555,8 @@ void *qemu_aio_get(AIOPool *pool, BlockDriverState *bs,
 {
     BlockDriverAIOCB *acb;
 
-    if (pool->free_aiocb) {
+    /* The free list is only used by the main loop's thread */
+    if (pool->free_aiocb && !(bs && bs->aio_context)) {
         acb = pool->free_aiocb;
         pool->free_aiocb = acb->next;
     } else {
@@ -3449,6 +3573,10 @@ void qemu_aio_release(void *p)
 {
     BlockDriverAIOCB *acb = (BlockDriverAIOCB *)p;
     AIOPool *pool = acb->pool;
+    if (acb->bs && acb->bs->aio_context) {
+        g_free(acb);
+        return;
+    }
     acb->next = pool->free_aiocb;
     pool->free_aiocb = acb;
 }
@@ -3617,7 +3745,7 @@ int bdrv_flush(BlockDriverState *bs)
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_wait(bdrv_get_aio_context(bs));
         }
     }
 
@@ -3678,7 +3806,7 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_wait(bdrv_get_aio_context(bs));
         }
     }
 
@@ -3769,6 +3897,33 @@ BlockDriverAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
     return NULL;
 }
 
+/**
+ * Plug the request queue of a block device.  Requests issued until the
+ * matching bdrv_io_unplug() may be held back by the driver and submitted
+ * to the host as a single batch.  Calls nest.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 void bdrv_set_buffer_alignment(BlockDriverState *bs, int align)
 {
     bs->buffer_alignment = align;
@@ -3890,11 +4045,76 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    BlockLatencyHistogram *hist;
+    int64_t latency_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
+    hist = &bs->latency_histogram[cookie->type];
+    latency_ns = get_clock() - cookie->start_time_ns;
+
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+
+    if (hist->nbins) {
+        int lo = 0, hi = hist->nbins - 1;
+
+        /* the first bin whose upper bound is above the latency */
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+
+            if (latency_ns < hist->boundaries[mid]) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        hist->bins[lo]++;
+    }
+}
+
+void bdrv_acct_merged(BlockDriverState *bs, enum BlockAcctType type,
+                      int num_requests)
+{
+    assert(type < BDRV_MAX_IOTYPE);
+
+    bs->nr_merged[type] += num_requests;
+}
+
+/**
+ * Replace the latency histogram of @type requests
+ *
+ * The histogram gets @nb_boundaries + 1 bins, all empty: below the first
+ * boundary, between each pair of boundaries, and above the last one.
+ * Boundaries are in nanoseconds and must be increasing.  With no
+ * boundaries the histogram is removed.
+ */
+int bdrv_latency_histogram_set(BlockDriverState *bs, enum BlockAcctType type,
+                               const int64_t *boundaries, int nb_boundaries)
+{
+    BlockLatencyHistogram *hist = &bs->latency_histogram[type];
+    int i;
+
+    assert(type < BDRV_MAX_IOTYPE);
+
+    for (i = 0; i < nb_boundaries; i++) {
+        if (boundaries[i] <= (i ? boundaries[i - 1] : 0)) {
+            return -EINVAL;
+        }
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    memset(hist, 0, sizeof(*hist));
+
+    if (nb_boundaries) {
+        hist->nbins = nb_boundaries + 1;
+        hist->boundaries = g_memdup(boundaries,
+                                    nb_boundaries * sizeof(*boundaries));
+        hist->bins = g_new0(uint64_t, hist->nbins);
+    }
+    return 0;
 }
 
 int bdrv_img_create(const char *filename, const char *fmt,
@@ -240,6 +240,13 @@ BlockDriverAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
 
+/* Batch submission of requests issued between plug and unplug */
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+
+AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+int bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
+
 /* Invalidate any cached metadata used by image formats */
 void bdrv_invalidate_cache(BlockDriverState *bs);
 void bdrv_invalidate_cache_all(void);
@@ -339,6 +346,10 @@ void bdrv_disable_copy_on_read(BlockDriverState *bs);
 void bdrv_set_in_use(BlockDriverState *bs, int in_use);
 int bdrv_in_use(BlockDriverState *bs);
 
+#ifdef CONFIG_LINUX_AIO
+int raw_get_aio_fd(BlockDriverState *bs);
+#endif
+
 enum BlockAcctType {
     BDRV_ACCT_READ,
     BDRV_ACCT_WRITE,
@@ -355,6 +366,10 @@ typedef struct BlockAcctCookie {
 void bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie,
         int64_t bytes, enum BlockAcctType type);
 void bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie);
+void bdrv_acct_merged(BlockDriverState *bs, enum BlockAcctType type,
+                      int num_requests);
+int bdrv_latency_histogram_set(BlockDriverState *bs, enum BlockAcctType type,
+                               const int64_t *boundaries, int nb_boundaries);
 
 typedef enum {
     BLKDBG_L1_UPDATE,
@@ -290,6 +290,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    char *lock_name;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -500,6 +501,10 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         qcow2_check_refcounts(bs, &result, 0);
     }
 #endif
+
+    lock_name = g_strdup_printf("qcow2 %s", bs->filename);
+    qemu_co_lock_stats_register(&s->lock.stats, lock_name);
+    g_free(lock_name);
     return ret;
 
  fail:
@@ -867,6 +872,8 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qemu_co_lock_stats_unregister(&s->lock.stats);
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
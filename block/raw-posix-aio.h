@@ -41,5 +41,9 @@ void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx);
+int laio_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug);
+void laio_detach_aio_context(void *aio_ctx, AioContext *old_context);
+void laio_attach_aio_context(void *aio_ctx, AioContext *new_context);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
@@ -106,6 +106,12 @@ static int raw_has_zero_init(BlockDriverState *bs)
     return bdrv_has_zero_init(bs->file);
 }
 
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    /* Nothing to do, bs->file is moved by the block layer */
+}
+
 static BlockDriver bdrv_raw = {
     .format_name        = "raw",
 
@@ -132,6 +138,8 @@ static BlockDriver bdrv_raw = {
     .bdrv_ioctl         = raw_ioctl,
     .bdrv_aio_ioctl     = raw_aio_ioctl,
 
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+
     .bdrv_create        = raw_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = raw_has_zero_init,
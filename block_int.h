@@ -29,6 +29,7 @@
 #include "qemu-queue.h"
 #include "qemu-coroutine.h"
 #include "qemu-timer.h"
+#include "throttle.h"
 #include "qapi-types.h"
 #include "qerror.h"
 
@@ -36,12 +37,9 @@
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
 
-#define BLOCK_IO_LIMIT_READ     0
-#define BLOCK_IO_LIMIT_WRITE    1
-#define BLOCK_IO_LIMIT_TOTAL    2
-
-#define BLOCK_IO_SLICE_TIME     100000000
-#define NANOSECONDS_PER_SECOND  1000000000.0
+#define BLOCK_IO_LIMIT_READ     THROTTLE_READ
+#define BLOCK_IO_LIMIT_WRITE    THROTTLE_WRITE
+#define BLOCK_IO_LIMIT_TOTAL    THROTTLE_TOTAL
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -60,12 +58,18 @@ typedef struct BdrvTrackedRequest BdrvTrackedRequest;
 typedef struct BlockIOLimit {
     int64_t bps[3];
     int64_t iops[3];
+    int64_t bps_max[3];     /* burst rates, 0 if bursts are not allowed */
+    int64_t iops_max[3];
+    int64_t burst_length;   /* seconds */
 } BlockIOLimit;
 
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+typedef struct ThrottleGroup ThrottleGroup;
+
+typedef struct BlockLatencyHistogram {
+    int nbins;              /* 0 when disabled */
+    int64_t *boundaries;    /* nbins - 1 ascending upper bounds, in ns */
+    uint64_t *bins;
+} BlockLatencyHistogram;
 
 typedef struct BlockJob BlockJob;
 
@@ -249,6 +253,23 @@ struct BlockDriver {
 
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkDebugEvent event);
 
+    /*
+     * Batch submission: while plugged, requests may be queued by the driver
+     * and are only passed to the host when the last unplug happens.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
+    /*
+     * Move the driver's handlers from the current AioContext of bs, still
+     * returned by bdrv_get_aio_context(), to new_context.  Only drivers
+     * that implement bdrv_attach_aio_context can be bound to a context
+     * other than the main one.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
     /*
      * Returns 1 if newly created images are guaranteed to contain only
      * zeros, 0 otherwise.
@@ -293,24 +314,31 @@ struct BlockDriverState {
     BlockDriverState *backing_hd;
     BlockDriverState *file;
 
+    /* event loop that runs the requests; NULL means the main context */
+    AioContext *aio_context;
+
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
+    /* I/O throttling; devices in one group share the limits and a queue */
     BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
-    CoQueue      throttled_reqs;
-    QEMUTimer    *block_timer;
+    char         *io_limits_group;  /* NULL means the device name */
+    ThrottleGroup *throttle_group;
     bool         io_limits_enabled;
 
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t nr_merged[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    BlockLatencyHistogram latency_histogram[BDRV_MAX_IOTYPE];
+
+    /* Queue depth of the tracked requests, and when it last changed */
+    unsigned int nr_in_flight;
+    unsigned int max_in_flight;
+    uint64_t in_flight_time_ns;     /* sum over time of nr_in_flight */
+    int64_t in_flight_stamp_ns;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -341,7 +369,7 @@ struct BlockDriverState {
 int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
-                        BlockIOLimit *io_limits);
+                        BlockIOLimit *io_limits, const char *group);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
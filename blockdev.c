@@ -17,6 +17,8 @@
 #include "sysemu.h"
 #include "block_int.h"
 #include "qmp-commands.h"
+#include "qapi-visit.h"
+#include "qapi/qmp-output-visitor.h"
 #include "trace.h"
 #include "arch_init.h"
 
@@ -254,10 +256,11 @@ static int parse_block_error_action(const char *buf, int is_read)
     }
 }
 
-static bool do_check_io_limits(BlockIOLimit *io_limits)
+static bool do_check_io_limits(BlockIOLimit *io_limits, Error **errp)
 {
     bool bps_flag;
     bool iops_flag;
+    int i;
 
     assert(io_limits);
 
@@ -268,12 +271,61 @@ static bool do_check_io_limits(BlockIOLimit *io_limits)
                  && ((io_limits->iops[BLOCK_IO_LIMIT_READ] != 0)
                  || (io_limits->iops[BLOCK_IO_LIMIT_WRITE] != 0));
     if (bps_flag || iops_flag) {
+        error_set(errp, ERROR_CLASS_GENERIC_ERROR,
+                  "bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
+                  "cannot be used at the same time");
+        return false;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] < 0 || io_limits->iops[i] < 0 ||
+            io_limits->bps_max[i] < 0 || io_limits->iops_max[i] < 0) {
+            error_set(errp, ERROR_CLASS_GENERIC_ERROR,
+                      "bps and iops values must be 0 or greater");
+            return false;
+        }
+        if ((io_limits->bps_max[i] && !io_limits->bps[i]) ||
+            (io_limits->iops_max[i] && !io_limits->iops[i])) {
+            error_set(errp, ERROR_CLASS_GENERIC_ERROR,
+                      "a burst rate (bps_max, iops_max...) needs the "
+                      "matching average rate to be set");
+            return false;
+        }
+        if ((io_limits->bps_max[i] &&
+             io_limits->bps_max[i] < io_limits->bps[i]) ||
+            (io_limits->iops_max[i] &&
+             io_limits->iops_max[i] < io_limits->iops[i])) {
+            error_set(errp, ERROR_CLASS_GENERIC_ERROR,
+                      "a burst rate cannot be lower than the average rate");
+            return false;
+        }
+    }
+
+    if (io_limits->burst_length < 0) {
+        error_set(errp, ERROR_CLASS_GENERIC_ERROR,
+                  "burst_length must be 0 or greater");
         return false;
     }
 
     return true;
 }
 
+/* Bursts last one second unless told otherwise */
+static void do_default_burst_length(BlockIOLimit *io_limits)
+{
+    int i;
+
+    if (io_limits->burst_length) {
+        return;
+    }
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps_max[i] || io_limits->iops_max[i]) {
+            io_limits->burst_length = 1;
+            return;
+        }
+    }
+}
+
 DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 {
     const char *buf;
@@ -293,6 +345,8 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     BlockIOLimit io_limits;
+    const char *io_limits_group;
+    Error *error = NULL;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -425,12 +479,27 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
                            qemu_opt_get_number(opts, "iops_rd", 0);
     io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
                            qemu_opt_get_number(opts, "iops_wr", 0);
-
-    if (!do_check_io_limits(&io_limits)) {
-        error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
-                     "cannot be used at the same time");
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr_max", 0);
+    io_limits.burst_length = qemu_opt_get_number(opts, "burst_length", 0);
+    io_limits_group = qemu_opt_get(opts, "throttling.group");
+
+    if (!do_check_io_limits(&io_limits, &error)) {
+        error_report("%s", error_get_pretty(error));
+        error_free(error);
         return NULL;
     }
+    do_default_burst_length(&io_limits);
 
     on_write_error = BLOCK_ERR_STOP_ENOSPC;
     if ((buf = qemu_opt_get(opts, "werror")) != NULL) {
@@ -543,7 +612,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
 
     /* disk I/O throttling */
-    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits, io_limits_group);
 
     switch(type) {
     case IF_IDE:
@@ -942,7 +1011,16 @@ void qmp_change_blockdev(const char *device, const char *filename,
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_burst_length, int64_t burst_length,
+                               bool has_group, const char *group,
+                               Error **errp)
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
@@ -953,6 +1031,7 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
+    memset(&io_limits, 0, sizeof(io_limits));
     io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
     io_limits.bps[BLOCK_IO_LIMIT_READ]  = bps_rd;
     io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
@@ -960,22 +1039,186 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
     io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
 
-    if (!do_check_io_limits(&io_limits)) {
-        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+    if (has_bps_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL] = bps_max;
+    }
+    if (has_bps_rd_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_READ] = bps_rd_max;
+    }
+    if (has_bps_wr_max) {
+        io_limits.bps_max[BLOCK_IO_LIMIT_WRITE] = bps_wr_max;
+    }
+    if (has_iops_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] = iops_max;
+    }
+    if (has_iops_rd_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_READ] = iops_rd_max;
+    }
+    if (has_iops_wr_max) {
+        io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] = iops_wr_max;
+    }
+    if (has_burst_length) {
+        io_limits.burst_length = burst_length;
+    }
+
+    if (!do_check_io_limits(&io_limits, errp)) {
         return;
     }
+    do_default_burst_length(&io_limits);
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
+    /* Without a group the device keeps the one it is in */
+    bdrv_set_io_limits(bs, &io_limits,
+                       has_group ? group : bs->io_limits_group);
 
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
+    if (bdrv_io_limits_enabled(bs)) {
         bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
     } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
+        bdrv_io_limits_disable(bs);
+    }
+}
+
+/* Parse a comma-separated list of increasing latencies */
+static bool parse_latency_boundaries(const char *name, const char *str,
+                                     int64_t **boundaries, int *nb,
+                                     Error **errp)
+{
+    const char *p = str;
+    char *end;
+    int64_t value;
+    int n = 0;
+
+    *boundaries = NULL;
+    while (*p) {
+        errno = 0;
+        value = strtoll(p, &end, 10);
+        if (errno || end == p || (*end && *end != ',') || value <= 0 ||
+            (n && value <= (*boundaries)[n - 1])) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, name,
+                      "increasing latencies in nanoseconds");
+            g_free(*boundaries);
+            *boundaries = NULL;
+            return false;
         }
+        *boundaries = g_renew(int64_t, *boundaries, n + 1);
+        (*boundaries)[n++] = value;
+        p = *end ? end + 1 : end;
+    }
+
+    *nb = n;
+    return true;
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     const char *boundaries,
+                                     bool has_boundaries_rd,
+                                     const char *boundaries_rd,
+                                     bool has_boundaries_wr,
+                                     const char *boundaries_wr,
+                                     bool has_boundaries_flush,
+                                     const char *boundaries_flush,
+                                     Error **errp)
+{
+    const char *names[BDRV_MAX_IOTYPE];
+    const char *lists[BDRV_MAX_IOTYPE];
+    int64_t *values[BDRV_MAX_IOTYPE] = { NULL };
+    int nb[BDRV_MAX_IOTYPE];
+    BlockDriverState *bs;
+    int i;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        names[i] = "boundaries";
+        lists[i] = has_boundaries ? boundaries : NULL;
+    }
+    if (has_boundaries_rd) {
+        names[BDRV_ACCT_READ] = "boundaries_rd";
+        lists[BDRV_ACCT_READ] = boundaries_rd;
+    }
+    if (has_boundaries_wr) {
+        names[BDRV_ACCT_WRITE] = "boundaries_wr";
+        lists[BDRV_ACCT_WRITE] = boundaries_wr;
+    }
+    if (has_boundaries_flush) {
+        names[BDRV_ACCT_FLUSH] = "boundaries_flush";
+        lists[BDRV_ACCT_FLUSH] = boundaries_flush;
+    }
+
+    /* Check every list before touching any histogram */
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (lists[i] &&
+            !parse_latency_boundaries(names[i], lists[i], &values[i], &nb[i],
+                                      errp)) {
+            goto out;
+        }
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (lists[i]) {
+            bdrv_latency_histogram_set(bs, i, values[i], nb[i]);
+        }
+    }
+
+out:
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        g_free(values[i]);
+    }
+}
+
+static QEMUTimer *block_stats_timer;
+static int64_t block_stats_interval;
+
+static void block_stats_event(void *opaque)
+{
+    BlockStatsList *stats_list, *stats;
+
+    stats_list = qmp_query_blockstats(NULL);
+    for (stats = stats_list; stats; stats = stats->next) {
+        QmpOutputVisitor *ov;
+        QObject *data;
+
+        if (!stats->value->has_device) {
+            continue;
+        }
+
+        ov = qmp_output_visitor_new();
+        visit_type_BlockStats(qmp_output_get_visitor(ov), &stats->value,
+                              NULL, NULL);
+        data = qmp_output_get_qobject(ov);
+        monitor_protocol_event(QEVENT_BLOCK_STATS, data);
+        qobject_decref(data);
+        qmp_output_visitor_cleanup(ov);
+    }
+    qapi_free_BlockStatsList(stats_list);
+
+    qemu_mod_timer(block_stats_timer, qemu_get_clock_ms(rt_clock) +
+                   block_stats_interval * 1000);
+}
+
+void qmp_block_stats_event_set(int64_t interval, Error **errp)
+{
+    if (interval < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "interval",
+                  "a number of seconds, or 0");
+        return;
+    }
+
+    if (!block_stats_timer) {
+        block_stats_timer = qemu_new_timer_ms(rt_clock, block_stats_event,
+                                              NULL);
+    }
+
+    block_stats_interval = interval;
+    if (interval) {
+        qemu_mod_timer(block_stats_timer, qemu_get_clock_ms(rt_clock) +
+                       interval * 1000);
+    } else {
+        qemu_del_timer(block_stats_timer);
     }
 }
 
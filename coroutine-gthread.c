@@ -165,6 +165,12 @@ Coroutine *qemu_coroutine_new(void)
     return &co->base;
 }
 
+CoroutinePool *qemu_coroutine_get_pool(void)
+{
+    /* Each coroutine is a thread that exits when the entry point returns */
+    return NULL;
+}
+
 void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineGThread *co = DO_UPCAST(CoroutineGThread, base, co_);
@@ -69,6 +69,12 @@ Coroutine *qemu_coroutine_new(void)
     return &co->base;
 }
 
+CoroutinePool *qemu_coroutine_get_pool(void)
+{
+    /* No hook to free pooled fibers on thread exit */
+    return NULL;
+}
+
 void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineWin32 *co = DO_UPCAST(CoroutineWin32, base, co_);
@@ -2824,6 +2824,25 @@ int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
     return -1;
 }
 
+/* Return the file that backs the RAM block containing addr, or -1 if
+ * the block is anonymous memory.  *offset is set to the offset of addr
+ * within that file.
+ */
+int qemu_get_ram_fd(ram_addr_t addr, ram_addr_t *offset)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            *offset = addr - block->offset;
+            return block->fd ? block->fd : -1;
+        }
+    }
+#endif
+    return -1;
+}
+
 /* Some of the softmmu routines need to translate from a host pointer
    (typically a TLB entry) back to a ram offset.  */
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
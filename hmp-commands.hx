@@ -1306,15 +1306,16 @@ ETEXI
     },
 
 STEXI
-@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr} [@var{group}]
 @findex block_set_io_throttle
-Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}.
+The limits are shared by all the drives in the throttle group @var{group}.
 ETEXI
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
-        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,group:s?",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr [group]",
         .help       = "change I/O throttle limits for a block drive",
         .mhandler.cmd = hmp_block_set_io_throttle,
     },
@@ -1429,6 +1430,14 @@ show USB devices plugged on the virtual USB hub
 show all USB host devices
 @item info profile
 show profiling information
+@item info timers
+show a histogram of how late timers fired, for each clock
+@item info lockstats
+show acquisitions, waiters and wait times of the coroutine locks of
+block devices, e.g. the metadata lock of qcow2 images
+@item info coroutines
+show how many terminated coroutines are pooled for reuse, the bound of
+each thread's pool, and how many coroutines were taken from the pools
 @item info capture
 show information about active capturing
 @item info snapshots
@@ -302,6 +302,23 @@ void hmp_info_block(Monitor *mon)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+            if (info->value->inserted->has_burst_length) {
+                monitor_printf(mon, " bps_max=%" PRId64 " bps_rd_max=%" PRId64
+                                " bps_wr_max=%" PRId64 " iops_max=%" PRId64
+                                " iops_rd_max=%" PRId64 " iops_wr_max=%" PRId64
+                                " burst_length=%" PRId64,
+                                info->value->inserted->bps_max,
+                                info->value->inserted->bps_rd_max,
+                                info->value->inserted->bps_wr_max,
+                                info->value->inserted->iops_max,
+                                info->value->inserted->iops_rd_max,
+                                info->value->inserted->iops_wr_max,
+                                info->value->inserted->burst_length);
+            }
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -332,6 +349,11 @@ void hmp_info_blockstats(Monitor *mon)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
+                       " rd_merged=%" PRId64
+                       " wr_merged=%" PRId64
+                       " in_flight=%" PRId64
+                       " max_in_flight=%" PRId64
+                       " in_flight_time_ns=%" PRId64
                        "\n",
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
@@ -340,7 +362,12 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->rd_merged,
+                       stats->value->stats->wr_merged,
+                       stats->value->stats->in_flight,
+                       stats->value->stats->max_in_flight,
+                       stats->value->stats->in_flight_time_ns);
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -915,7 +942,12 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0,
+                              false, 0,
+                              qdict_haskey(qdict, "group"),
+                              qdict_get_try_str(qdict, "group"), &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -0,0 +1,629 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * Each virtqueue gets an AioContext, run by a thread of its own, that waits
+ * on the queue's ioeventfd, takes requests directly from the vring in guest
+ * memory, submits them with Linux AIO and raises the completion interrupt
+ * through the guest notifier, which is an irqfd when KVM provides one.  None
+ * of this needs the global mutex.
+ *
+ * Only raw images opened with cache=none,aio=native are supported since
+ * requests bypass the block layer (image formats, I/O throttling,
+ * accounting and block jobs).
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "iov.h"
+#include "qemu-error.h"
+#include "qemu-aio.h"
+#include "qerror.h"
+#include "migration.h"
+#include "block.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-blk.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
+                                     * is VRING_MAX / 2 with traditional and
+                                     * VRING_MAX with indirect descriptors */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    struct virtio_blk_inhdr *inhdr; /* guest status byte */
+    unsigned int head;              /* vring descriptor index */
+    struct iovec *bounce_iov;       /* used if guest buffers are unaligned */
+    QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
+} VirtIOBlockRequest;
+
+typedef struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    unsigned int n;                 /* virtqueue index */
+    AioContext *ctx;                /* event loop, with its own thread */
+
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    EventNotifier *host_notifier;   /* doorbell */
+
+    IOQueue ioqueue;                /* Linux AIO queue of this thread */
+    VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
+                                             queue */
+
+    unsigned int num_reqs;
+} VirtIOBlockDataPlaneQueue;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool stopping;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+
+    VirtIODevice *vdev;
+
+    /* One I/O thread per virtqueue, so that each queue is serviced on its
+     * own host CPU and completes with its own MSI-X vector.
+     */
+    unsigned int num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
+
+    Error *migration_blocker;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
+{
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
+        return;
+    }
+
+    event_notifier_set(q->guest_notifier);
+}
+
+static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
+    unsigned char status;
+    int len;
+
+    if (likely(ret >= 0)) {
+        status = VIRTIO_BLK_S_OK;
+        len = ret;
+    } else {
+        status = VIRTIO_BLK_S_IOERR;
+        len = 0;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(q, req->head, ret);
+
+    if (req->read_qiov) {
+        assert(req->bounce_iov);
+        qemu_iovec_from_buf(req->read_qiov, 0, req->bounce_iov->iov_base, len);
+        qemu_iovec_destroy(req->read_qiov);
+        g_slice_free(QEMUIOVector, req->read_qiov);
+    }
+
+    if (req->bounce_iov) {
+        qemu_vfree(req->bounce_iov->iov_base);
+        g_slice_free(struct iovec, req->bounce_iov);
+    }
+
+    stb_p(&req->inhdr->status, status);
+
+    /* According to the virtio specification len should be the number of bytes
+     * written to, but for virtio-blk it seems to be the number of bytes
+     * transferred plus the status bytes.
+     */
+    vring_push(&q->vring, req->head, len + sizeof(*req->inhdr));
+
+    q->num_reqs--;
+}
+
+static void complete_request_early(VirtIOBlockDataPlaneQueue *q,
+                                   unsigned int head,
+                                   struct virtio_blk_inhdr *inhdr,
+                                   unsigned char status)
+{
+    stb_p(&inhdr->status, status);
+
+    vring_push(&q->vring, head, sizeof(*inhdr));
+    notify_guest(q);
+}
+
+/* Linux AIO with O_DIRECT needs sector-aligned buffers and lengths */
+static bool iov_is_aligned(struct iovec *iov, unsigned int iov_cnt)
+{
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+            (BDRV_SECTOR_SIZE - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Drop @bytes from the front of an iovec array */
+static void iov_drop_front(struct iovec **iov, unsigned int *iov_cnt,
+                           size_t bytes)
+{
+    while (bytes > 0 && *iov_cnt > 0) {
+        if ((*iov)->iov_len > bytes) {
+            (*iov)->iov_base += bytes;
+            (*iov)->iov_len -= bytes;
+            break;
+        }
+        bytes -= (*iov)->iov_len;
+        (*iov)++;
+        (*iov_cnt)--;
+    }
+}
+
+/* Get disk serial number */
+static void do_get_id_cmd(VirtIOBlockDataPlaneQueue *q,
+                          struct iovec *iov, unsigned int iov_cnt,
+                          unsigned int head, struct virtio_blk_inhdr *inhdr)
+{
+    char id[VIRTIO_BLK_ID_BYTES];
+
+    /* Serial number not NUL-terminated when shorter than buffer */
+    strncpy(id, q->s->blk->serial ? q->s->blk->serial : "", sizeof(id));
+    iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
+    complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
+}
+
+static int do_rdwr_cmd(VirtIOBlockDataPlaneQueue *q, bool read,
+                       struct iovec *iov, unsigned int iov_cnt,
+                       uint64_t sector, unsigned int head,
+                       struct virtio_blk_inhdr *inhdr)
+{
+    struct iocb *iocb;
+    QEMUIOVector qiov;
+    struct iovec *bounce_iov = NULL;
+    QEMUIOVector *read_qiov = NULL;
+    VirtIOBlockRequest *req;
+    int64_t length;
+
+    qemu_iovec_init_external(&qiov, iov, iov_cnt);
+
+    /* Linux AIO would happily write past the end of an image file, and
+     * grow it.  Only the size is read, which does not need the global
+     * mutex for a raw image.
+     */
+    length = bdrv_getlength(q->s->blk->conf.bs);
+    if (length < 0 || sector > length / BDRV_SECTOR_SIZE ||
+        qiov.size > length - sector * BDRV_SECTOR_SIZE) {
+        complete_request_early(q, head, inhdr, VIRTIO_BLK_S_IOERR);
+        return 0;
+    }
+
+    if (!iov_is_aligned(iov, iov_cnt)) {
+        void *bounce_buffer = qemu_blockalign(q->s->blk->conf.bs,
+                                              qiov.size);
+
+        if (read) {
+            /* Need to copy back from bounce buffer on completion, and iov[]
+             * does not outlive this notification so take a copy of it.
+             */
+            read_qiov = g_slice_new(QEMUIOVector);
+            qemu_iovec_init(read_qiov, iov_cnt);
+            qemu_iovec_concat(read_qiov, &qiov, 0, qiov.size);
+        } else {
+            qemu_iovec_to_buf(&qiov, 0, bounce_buffer, qiov.size);
+        }
+
+        /* Redirect I/O to aligned bounce buffer */
+        bounce_iov = g_slice_new(struct iovec);
+        bounce_iov->iov_base = bounce_buffer;
+        bounce_iov->iov_len = qiov.size;
+        iov = bounce_iov;
+        iov_cnt = 1;
+    }
+
+    iocb = ioq_rdwr(&q->ioqueue, read, iov, iov_cnt,
+                    sector * BDRV_SECTOR_SIZE);
+
+    /* Fill in virtio block metadata needed for completion */
+    req = container_of(iocb, VirtIOBlockRequest, iocb);
+    req->head = head;
+    req->inhdr = inhdr;
+    req->bounce_iov = bounce_iov;
+    req->read_qiov = read_qiov;
+    return 0;
+}
+
+static int process_request(VirtIOBlockDataPlaneQueue *q, struct iovec iov[],
+                           unsigned int out_num, unsigned int in_num,
+                           unsigned int head)
+{
+    struct iovec *in_iov = &iov[out_num];
+    struct virtio_blk_outhdr outhdr;
+    struct virtio_blk_inhdr *inhdr;
+    struct iovec *last;
+
+    /* Copy in outhdr */
+    if (unlikely(iov_to_buf(iov, out_num, 0, &outhdr,
+                            sizeof(outhdr)) != sizeof(outhdr))) {
+        error_report("virtio-blk request outhdr too short");
+        return -EFAULT;
+    }
+    iov_drop_front(&iov, &out_num, sizeof(outhdr));
+
+    /* The status byte is the last byte of the last in buffer */
+    if (unlikely(in_num < 1 || in_iov[in_num - 1].iov_len < sizeof(*inhdr))) {
+        error_report("virtio-blk request inhdr too short");
+        return -EFAULT;
+    }
+    last = &in_iov[in_num - 1];
+    last->iov_len -= sizeof(*inhdr);
+    inhdr = last->iov_base + last->iov_len;
+    if (last->iov_len == 0) {
+        in_num--;
+    }
+
+    switch (ldl_p(&outhdr.type)) {
+    case VIRTIO_BLK_T_IN:
+        return do_rdwr_cmd(q, true, in_iov, in_num,
+                           ldq_p(&outhdr.sector), head, inhdr);
+
+    case VIRTIO_BLK_T_OUT:
+        return do_rdwr_cmd(q, false, iov, out_num,
+                           ldq_p(&outhdr.sector), head, inhdr);
+
+    case VIRTIO_BLK_T_SCSI_CMD:
+        /* Data plane refuses scsi=on, so the guest was not offered SCSI */
+        complete_request_early(q, head, inhdr, VIRTIO_BLK_S_UNSUPP);
+        return 0;
+
+    case VIRTIO_BLK_T_FLUSH:
+        /* Linux AIO has no working fdsync, so flush synchronously in this
+         * thread.  The flush only has to cover the writes the guest has
+         * seen complete, not those still queued next to it.
+         */
+        if (qemu_fdatasync(q->s->fd) < 0) {
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_IOERR);
+        } else {
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
+        }
+        return 0;
+
+    case VIRTIO_BLK_T_GET_ID:
+        do_get_id_cmd(q, in_iov, in_num, head, inhdr);
+        return 0;
+
+    default:
+        error_report("virtio-blk unsupported request type %#x",
+                     ldl_p(&outhdr.type));
+        return -EFAULT;
+    }
+}
+
+static void handle_notify(VirtIOBlockDataPlaneQueue *q)
+{
+    struct iovec iovec[VRING_MAX];
+    struct iovec *end = &iovec[VRING_MAX];
+    struct iovec *iov = iovec;
+    unsigned int out_num = 0, in_num = 0;
+    unsigned int num_queued;
+    int head;
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(q->s->vdev, &q->vring);
+
+        for (;;) {
+            head = vring_pop(q->s->vdev, &q->vring, iov, end,
+                             &out_num, &in_num);
+            if (head < 0) {
+                break; /* no more requests */
+            }
+
+            trace_virtio_blk_data_plane_process_request(q, out_num, in_num,
+                                                        head);
+
+            if (process_request(q, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&q->vring);
+                break;
+            }
+            iov += out_num + in_num;
+        }
+
+        if (likely(head == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(q->s->vdev, &q->vring)) {
+                break;
+            }
+        } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
+            /* Since there are no iovecs[] left, stop processing for now.  Do
+             * not re-enable guest->host notifies since the I/O completion
+             * handler knows to check for more vring descriptors anyway.
+             */
+            break;
+        }
+    }
+
+    /* All requests of this notification go to the kernel in one io_submit.
+     * Linux AIO copies the iovec arrays, so iovec[] may go out of scope.
+     */
+    num_queued = ioq_num_queued(&q->ioqueue);
+    if (num_queued > 0) {
+        int rc;
+
+        q->num_reqs += num_queued;
+
+        /* Requests the kernel refuses complete with VIRTIO_BLK_S_IOERR */
+        rc = ioq_submit(&q->ioqueue, complete_request, q);
+        if (unlikely(rc < (int)num_queued)) {
+            error_report("virtio-blk failed to submit %u requests: %s",
+                         num_queued - MAX(rc, 0),
+                         strerror(rc < 0 ? -rc : EAGAIN));
+            notify_guest(q);
+        }
+    }
+}
+
+static void handle_io(VirtIOBlockDataPlaneQueue *q)
+{
+    EventNotifier *notifier = ioq_get_notifier(&q->ioqueue);
+    int rc = ioq_run_completion(&q->ioqueue, complete_request, q);
+
+    if (unlikely(rc < 0)) {
+        /* The requests in flight will never complete.  Stop taking new ones
+         * and stop listening for completions, and do not let
+         * data_plane_queue_stop() wait for them.
+         */
+        error_report("virtio-blk failed to get completions of queue %u: %s",
+                     q->n, strerror(-rc));
+        vring_set_broken(&q->vring);
+        aio_set_fd_handler(q->ctx, event_notifier_get_fd(notifier),
+                           NULL, NULL, NULL, NULL);
+        q->num_reqs = 0;
+        return;
+    }
+    if (rc > 0) {
+        notify_guest(q);
+    }
+
+    /* If there were more requests than iovecs, the vring will not be empty yet
+     * so check again.  There should now be enough resources to process more
+     * requests.
+     */
+    if (unlikely(vring_more_avail(&q->vring))) {
+        handle_notify(q);
+    }
+}
+
+static void handle_host_notifier(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+
+    event_notifier_test_and_clear(q->host_notifier);
+    handle_notify(q);
+}
+
+static void handle_io_notifier(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+
+    event_notifier_test_and_clear(ioq_get_notifier(&q->ioqueue));
+    handle_io(q);
+}
+
+static int flush_io(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+
+    return q->num_reqs > 0;
+}
+
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    unsigned int i;
+    int fd;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        return true;
+    }
+
+    if (blk->scsi) {
+        error_report("device is incompatible with x-data-plane, use scsi=off");
+        return false;
+    }
+
+    fd = raw_get_aio_fd(blk->conf.bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return false;
+    }
+
+    s = g_new0(VirtIOBlockDataPlane, 1);
+    s->vdev = vdev;
+    s->fd = fd;
+    s->blk = blk;
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].s = s;
+        s->queues[i].n = i;
+    }
+
+    /* Prevent block operations that conflict with data plane thread */
+    bdrv_set_in_use(blk->conf.bs, 1);
+
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "virtio-blk", "x-data-plane");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->blk->conf.bs, 0);
+    g_free(s->queues);
+    g_free(s);
+}
+
+static int data_plane_queue_start(VirtIOBlockDataPlaneQueue *q)
+{
+    VirtQueue *vq = virtio_get_queue(q->s->vdev, q->n);
+    int i, rc;
+
+    q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    rc = q->s->vdev->binding->set_host_notifier(q->s->vdev->binding_opaque,
+                                                q->n, true);
+    if (rc != 0) {
+        error_report("virtio-blk failed to set host notifier of queue %u",
+                     q->n);
+        return rc;
+    }
+    q->host_notifier = virtio_queue_get_host_notifier(vq);
+
+    /* Set up ioqueue */
+    rc = ioq_init(&q->ioqueue, q->s->fd, REQ_MAX);
+    if (rc != 0) {
+        error_report("virtio-blk failed to set up Linux AIO for queue %u: %s",
+                     q->n, strerror(-rc));
+        q->s->vdev->binding->set_host_notifier(q->s->vdev->binding_opaque,
+                                               q->n, false);
+        return rc;
+    }
+    for (i = 0; i < ARRAY_SIZE(q->requests); i++) {
+        ioq_put_iocb(&q->ioqueue, &q->requests[i].iocb);
+    }
+
+    q->ctx = aio_context_new();
+    aio_set_fd_handler(q->ctx, event_notifier_get_fd(q->host_notifier),
+                       handle_host_notifier, NULL, NULL, q);
+    aio_set_fd_handler(q->ctx,
+                       event_notifier_get_fd(ioq_get_notifier(&q->ioqueue)),
+                       handle_io_notifier, NULL, flush_io, q);
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(q->host_notifier);
+
+    aio_context_start_thread(q->ctx);
+    return 0;
+}
+
+static void data_plane_queue_stop(VirtIOBlockDataPlaneQueue *q)
+{
+    /* Stop the thread, then stop taking requests and wait for in-flight
+     * ones here
+     */
+    aio_context_stop_thread(q->ctx);
+    aio_set_fd_handler(q->ctx, event_notifier_get_fd(q->host_notifier),
+                       NULL, NULL, NULL, NULL);
+    aio_flush(q->ctx);
+    aio_set_fd_handler(q->ctx,
+                       event_notifier_get_fd(ioq_get_notifier(&q->ioqueue)),
+                       NULL, NULL, NULL, NULL);
+    aio_context_free(q->ctx);
+    q->ctx = NULL;
+
+    ioq_cleanup(&q->ioqueue);
+
+    q->s->vdev->binding->set_host_notifier(q->s->vdev->binding_opaque,
+                                           q->n, false);
+}
+
+/* Returns 0 on success, or a negative value once the failure was reported
+ * and everything set up so far is undone.
+ */
+int virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    unsigned int i, n;
+    int rc = -EIO;
+
+    if (s->started) {
+        return 0;
+    }
+
+    for (n = 0; n < s->num_queues; n++) {
+        if (!vring_setup(&s->queues[n].vring, s->vdev, n)) {
+            goto fail_vrings;
+        }
+    }
+
+    /* Set up guest notifiers (irqs) for all queues at once */
+    rc = s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, true);
+    if (rc != 0) {
+        error_report("virtio-blk failed to set guest notifier, "
+                     "ensure -enable-kvm is set");
+        goto fail_vrings;
+    }
+
+    trace_virtio_blk_data_plane_start(s);
+
+    for (i = 0; i < s->num_queues; i++) {
+        rc = data_plane_queue_start(&s->queues[i]);
+        if (rc != 0) {
+            while (i-- > 0) {
+                data_plane_queue_stop(&s->queues[i]);
+            }
+            s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque,
+                                                  false);
+            goto fail_vrings;
+        }
+    }
+
+    s->started = true;
+    return 0;
+
+fail_vrings:
+    while (n-- > 0) {
+        vring_teardown(&s->queues[n].vring, s->vdev, n);
+    }
+    return rc;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    unsigned int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_blk_data_plane_stop(s);
+
+    for (i = 0; i < s->num_queues; i++) {
+        data_plane_queue_stop(&s->queues[i]);
+    }
+
+    s->vdev->binding->set_guest_notifiers(s->vdev->binding_opaque, false);
+
+    for (i = 0; i < s->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+    }
+
+    s->started = false;
+    s->stopping = false;
+}
@@ -381,6 +381,8 @@ static Property s390_virtio_net_properties[] = {
     DEFINE_PROP_INT32("x-txburst", VirtIOS390Device,
                       net.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIOS390Device, net.tx),
+    DEFINE_PROP_UINT32("queues", VirtIOS390Device, net.queues, 1),
+    DEFINE_PROP_BIT("gro", VirtIOS390Device, net.gro, 0, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -407,6 +409,7 @@ static Property s390_virtio_blk_properties[] = {
 #ifdef __linux__
     DEFINE_PROP_BIT("scsi", VirtIOS390Device, blk.scsi, 0, true),
 #endif
+    DEFINE_PROP_UINT32("num-queues", VirtIOS390Device, blk.num_queues, 1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
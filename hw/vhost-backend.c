@@ -0,0 +1,51 @@
+/*
+ * vhost backend operations
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <sys/ioctl.h>
+#include "hw/vhost.h"
+#include "hw/vhost-backend.h"
+#include "qemu-error.h"
+
+static int vhost_kernel_call(struct vhost_dev *dev, unsigned long int request,
+                             void *arg)
+{
+    return ioctl(dev->control, request, arg);
+}
+
+static int vhost_kernel_init(struct vhost_dev *dev)
+{
+    return 0;
+}
+
+static int vhost_kernel_cleanup(struct vhost_dev *dev)
+{
+    return close(dev->control);
+}
+
+const VhostOps kernel_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_KERNEL,
+    .vhost_call = vhost_kernel_call,
+    .vhost_backend_init = vhost_kernel_init,
+    .vhost_backend_cleanup = vhost_kernel_cleanup,
+};
+
+int vhost_set_backend_type(struct vhost_dev *dev,
+                           VhostBackendType backend_type)
+{
+    switch (backend_type) {
+    case VHOST_BACKEND_TYPE_KERNEL:
+        dev->vhost_ops = &kernel_ops;
+        return 0;
+    case VHOST_BACKEND_TYPE_USER:
+        dev->vhost_ops = &user_ops;
+        return 0;
+    default:
+        error_report("Unknown vhost backend type");
+        return -1;
+    }
+}
@@ -0,0 +1,274 @@
+/*
+ * vhost-user backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "hw/vhost.h"
+#include "hw/vhost-backend.h"
+#include "hw/vhost-user.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "cpu-common.h"
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = size,
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    if (fd_num) {
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fd_num * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fd_num * sizeof(int));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_num * sizeof(int));
+    }
+
+    do {
+        r = sendmsg(dev->control, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        return -1;
+    }
+    if (r != size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    ssize_t r;
+
+    r = qemu_recv_full(dev->control, msg, VHOST_USER_HDR_SIZE, 0);
+    if (r != VHOST_USER_HDR_SIZE) {
+        goto fail;
+    }
+
+    if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION) ||
+        msg->size > VHOST_USER_PAYLOAD_SIZE) {
+        error_report("vhost-user: bad reply header (flags 0x%x size %u)",
+                     msg->flags, msg->size);
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (msg->size) {
+        r = qemu_recv_full(dev->control, &msg->u64, msg->size, 0);
+        if (r != msg->size) {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    error_report("vhost-user: connection to backend closed");
+    errno = EIO;
+    return -1;
+}
+
+static int vhost_user_set_mem_table(VhostUserMsg *msg, int *fds,
+                                    struct vhost_memory *mem)
+{
+    int i;
+
+    if (mem->nregions > VHOST_MEMORY_MAX_NREGIONS) {
+        error_report("vhost-user: too many memory regions (%u)",
+                     mem->nregions);
+        errno = E2BIG;
+        return -1;
+    }
+
+    for (i = 0; i < mem->nregions; i++) {
+        struct vhost_memory_region *reg = mem->regions + i;
+        ram_addr_t ram_addr, offset = 0;
+        int fd = -1;
+
+        if (qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                                    &ram_addr) == 0) {
+            fd = qemu_get_ram_fd(ram_addr, &offset);
+        }
+        if (fd < 0) {
+            error_report("vhost-user requires shared, file-backed guest "
+                         "memory (use -mem-path with -mem-prealloc)");
+            errno = EINVAL;
+            return -1;
+        }
+
+        msg->memory.regions[i].guest_phys_addr = reg->guest_phys_addr;
+        msg->memory.regions[i].memory_size = reg->memory_size;
+        msg->memory.regions[i].userspace_addr = reg->userspace_addr;
+        msg->memory.regions[i].mmap_offset = offset;
+        fds[i] = fd;
+    }
+
+    msg->memory.nregions = mem->nregions;
+    msg->memory.padding = 0;
+    msg->size = offsetof(VhostUserMemory, regions) +
+                mem->nregions * sizeof(VhostUserMemoryRegion);
+    return mem->nregions;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+                           void *arg)
+{
+    VhostUserMsg msg;
+    struct vhost_vring_file *file;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num = 0;
+    bool need_reply = false;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.flags = VHOST_USER_VERSION;
+
+    switch (request) {
+    case VHOST_GET_FEATURES:
+        msg.request = VHOST_USER_GET_FEATURES;
+        need_reply = true;
+        break;
+
+    case VHOST_SET_FEATURES:
+        msg.request = VHOST_USER_SET_FEATURES;
+        msg.u64 = *(uint64_t *)arg;
+        msg.size = sizeof(msg.u64);
+        break;
+
+    case VHOST_SET_OWNER:
+        msg.request = VHOST_USER_SET_OWNER;
+        break;
+
+    case VHOST_RESET_OWNER:
+        msg.request = VHOST_USER_RESET_OWNER;
+        break;
+
+    case VHOST_SET_MEM_TABLE:
+        msg.request = VHOST_USER_SET_MEM_TABLE;
+        fd_num = vhost_user_set_mem_table(&msg, fds, arg);
+        if (fd_num < 0) {
+            return -1;
+        }
+        break;
+
+    case VHOST_SET_VRING_NUM:
+    case VHOST_SET_VRING_BASE:
+        msg.request = request == VHOST_SET_VRING_NUM ?
+            VHOST_USER_SET_VRING_NUM : VHOST_USER_SET_VRING_BASE;
+        memcpy(&msg.state, arg, sizeof(msg.state));
+        msg.size = sizeof(msg.state);
+        break;
+
+    case VHOST_GET_VRING_BASE:
+        msg.request = VHOST_USER_GET_VRING_BASE;
+        memcpy(&msg.state, arg, sizeof(msg.state));
+        msg.size = sizeof(msg.state);
+        need_reply = true;
+        break;
+
+    case VHOST_SET_VRING_ADDR:
+        msg.request = VHOST_USER_SET_VRING_ADDR;
+        memcpy(&msg.addr, arg, sizeof(msg.addr));
+        msg.size = sizeof(msg.addr);
+        break;
+
+    case VHOST_SET_VRING_KICK:
+    case VHOST_SET_VRING_CALL:
+    case VHOST_SET_VRING_ERR:
+        msg.request = request == VHOST_SET_VRING_KICK ?
+            VHOST_USER_SET_VRING_KICK : request == VHOST_SET_VRING_CALL ?
+            VHOST_USER_SET_VRING_CALL : VHOST_USER_SET_VRING_ERR;
+        file = arg;
+        msg.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(msg.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        /* The dirty log lives in our address space, so SET_LOG_BASE
+         * is not supported for now; net_init_vhost_user() blocks
+         * migration so that the log is never needed.
+         */
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    if (need_reply) {
+        uint32_t sent = msg.request;
+
+        if (vhost_user_read(dev, &msg) < 0) {
+            return -1;
+        }
+        if (msg.request != sent) {
+            error_report("vhost-user: expected reply to request %u, "
+                         "received %u", sent, msg.request);
+            errno = EPROTO;
+            return -1;
+        }
+
+        switch (msg.request) {
+        case VHOST_USER_GET_FEATURES:
+            if (msg.size != sizeof(msg.u64)) {
+                errno = EPROTO;
+                return -1;
+            }
+            *(uint64_t *)arg = msg.u64;
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            if (msg.size != sizeof(msg.state)) {
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(arg, &msg.state, sizeof(msg.state));
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_init(struct vhost_dev *dev)
+{
+    if (dev->control < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    return close(dev->control);
+}
+
+const VhostOps user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_init = vhost_user_init,
+    .vhost_backend_cleanup = vhost_user_cleanup,
+};
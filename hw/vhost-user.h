@@ -0,0 +1,86 @@
+/*
+ * vhost-user protocol
+ *
+ * vhost-user carries the vhost requests of <linux/vhost.h> over a UNIX
+ * domain socket to a backend that runs in another process.  Every
+ * message starts with a VhostUserMsg header and is followed by @size
+ * bytes of payload.  File descriptors (guest memory, kick and call
+ * eventfds) travel as SCM_RIGHTS ancillary data.  Only the replies to
+ * GET_FEATURES and GET_VRING_BASE are sent back by the backend.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_USER_H
+#define VHOST_USER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/vhost.h>
+#include "compiler.h"
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+/* One fd is passed with SET_MEM_TABLE for each region; the backend maps
+ * memory_size bytes of it from mmap_offset.
+ */
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserMsg {
+    uint32_t request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+        /* SET_VRING_KICK/CALL/ERR: ring index, no fd is attached if
+         * VHOST_USER_VRING_NOFD_MASK is set */
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+    };
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE     offsetof(VhostUserMsg, u64)
+#define VHOST_USER_PAYLOAD_SIZE (sizeof(VhostUserMsg) - VHOST_USER_HDR_SIZE)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION      (0x1)
+
+#endif /* VHOST_USER_H */
@@ -13,7 +13,6 @@
  * GNU GPL, version 2 or (at your option) any later version.
  */
 
-#include <sys/ioctl.h>
 #include "vhost.h"
 #include "hw/hw.h"
 #include "range.h"
@@ -99,90 +98,107 @@ static void vhost_log_sync(MemoryListener *listener,
     vhost_sync_dirty_bitmap(dev, section, start_addr, end_addr);
 }
 
-/* Assign/unassign. Keep an unsorted array of non-overlapping
- * memory regions in dev->mem. */
-static void vhost_dev_unassign_memory(struct vhost_dev *dev,
-                                      uint64_t start_addr,
-                                      uint64_t size)
+/* Assign/unassign. Keep an array of non-overlapping memory regions
+ * in dev->mem, sorted by guest physical address. */
+
+/* Index of the first region that ends at or after addr. */
+static int vhost_dev_find_index(struct vhost_dev *dev, uint64_t addr)
 {
-    int from, to, n = dev->mem->nregions;
-    /* Track overlapping/split regions for sanity checking. */
-    int overlap_start = 0, overlap_end = 0, overlap_middle = 0, split = 0;
+    int lo = 0, hi = dev->mem->nregions;
 
-    for (from = 0, to = 0; from < n; ++from, ++to) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
-        uint64_t reglast;
-        uint64_t memlast;
-        uint64_t change;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct vhost_memory_region *reg = dev->mem->regions + mid;
 
-        /* clone old region */
-        if (to != from) {
-            memcpy(reg, dev->mem->regions + from, sizeof *reg);
+        if (range_get_last(reg->guest_phys_addr, reg->memory_size) < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+    return lo;
+}
 
-        /* No overlap is simple */
-        if (!ranges_overlap(reg->guest_phys_addr, reg->memory_size,
-                            start_addr, size)) {
-            continue;
-        }
+static void vhost_dev_insert_region(struct vhost_dev *dev, int i,
+                                    uint64_t start_addr,
+                                    uint64_t size,
+                                    uint64_t uaddr)
+{
+    struct vhost_memory_region *reg;
+    int n = dev->mem->nregions;
 
-        /* Split only happens if supplied region
-         * is in the middle of an existing one. Thus it can not
-         * overlap with any other existing region. */
-        assert(!split);
+    if (n == dev->mem_capacity) {
+        dev->mem_capacity = MAX(8, dev->mem_capacity * 2);
+        dev->mem = g_realloc(dev->mem, offsetof(struct vhost_memory, regions) +
+                             dev->mem_capacity * sizeof dev->mem->regions[0]);
+    }
 
-        reglast = range_get_last(reg->guest_phys_addr, reg->memory_size);
-        memlast = range_get_last(start_addr, size);
+    reg = dev->mem->regions + i;
+    memmove(reg + 1, reg, (n - i) * sizeof *reg);
+    memset(reg, 0, sizeof *reg);
+    reg->guest_phys_addr = start_addr;
+    reg->memory_size = size;
+    reg->userspace_addr = uaddr;
+    ++dev->mem->nregions;
+}
 
-        /* Remove whole region */
-        if (start_addr <= reg->guest_phys_addr && memlast >= reglast) {
-            --dev->mem->nregions;
-            --to;
-            ++overlap_middle;
-            continue;
-        }
+static void vhost_dev_remove_regions(struct vhost_dev *dev, int i, int count)
+{
+    struct vhost_memory_region *reg = dev->mem->regions + i;
 
-        /* Shrink region */
-        if (memlast >= reglast) {
+    memmove(reg, reg + count,
+            (dev->mem->nregions - i - count) * sizeof *reg);
+    dev->mem->nregions -= count;
+}
+
+static void vhost_dev_unassign_memory(struct vhost_dev *dev,
+                                      uint64_t start_addr,
+                                      uint64_t size)
+{
+    uint64_t memlast = range_get_last(start_addr, size);
+    uint64_t reglast, change;
+    struct vhost_memory_region *reg;
+    int i = vhost_dev_find_index(dev, start_addr);
+    int first;
+
+    /* The first region may start before the range: shrink or split it */
+    reg = dev->mem->regions + i;
+    if (i < dev->mem->nregions && reg->guest_phys_addr < start_addr) {
+        reglast = range_get_last(reg->guest_phys_addr, reg->memory_size);
+        if (reglast > memlast) {
+            /* Split region: shrink first part, add second part after it. */
+            change = memlast + 1 - reg->guest_phys_addr;
+            vhost_dev_insert_region(dev, i + 1,
+                                    reg->guest_phys_addr + change,
+                                    reg->memory_size - change,
+                                    reg->userspace_addr + change);
+            reg = dev->mem->regions + i;
             reg->memory_size = start_addr - reg->guest_phys_addr;
-            assert(reg->memory_size);
-            assert(!overlap_end);
-            ++overlap_end;
-            continue;
+            return;
         }
+        reg->memory_size = start_addr - reg->guest_phys_addr;
+        ++i;
+    }
 
-        /* Shift region */
-        if (start_addr <= reg->guest_phys_addr) {
-            change = memlast + 1 - reg->guest_phys_addr;
-            reg->memory_size -= change;
-            reg->guest_phys_addr += change;
-            reg->userspace_addr += change;
-            assert(reg->memory_size);
-            assert(!overlap_start);
-            ++overlap_start;
-            continue;
+    /* Remove regions that are covered completely */
+    first = i;
+    while (i < dev->mem->nregions) {
+        reg = dev->mem->regions + i;
+        if (range_get_last(reg->guest_phys_addr, reg->memory_size) > memlast) {
+            break;
         }
+        ++i;
+    }
+    vhost_dev_remove_regions(dev, first, i - first);
 
-        /* This only happens if supplied region
-         * is in the middle of an existing one. Thus it can not
-         * overlap with any other existing region. */
-        assert(!overlap_start);
-        assert(!overlap_end);
-        assert(!overlap_middle);
-        /* Split region: shrink first part, shift second part. */
-        memcpy(dev->mem->regions + n, reg, sizeof *reg);
-        reg->memory_size = start_addr - reg->guest_phys_addr;
-        assert(reg->memory_size);
+    /* The last region may extend past the range: shift it */
+    reg = dev->mem->regions + first;
+    if (first < dev->mem->nregions && reg->guest_phys_addr <= memlast) {
         change = memlast + 1 - reg->guest_phys_addr;
-        reg = dev->mem->regions + n;
         reg->memory_size -= change;
-        assert(reg->memory_size);
         reg->guest_phys_addr += change;
         reg->userspace_addr += change;
-        /* Never add more than 1 region */
-        assert(dev->mem->nregions == n);
-        ++dev->mem->nregions;
-        ++split;
+        assert(reg->memory_size);
     }
 }
 
@@ -192,58 +208,39 @@ static void vhost_dev_assign_memory(struct vhost_dev *dev,
                                     uint64_t size,
                                     uint64_t uaddr)
 {
-    int from, to;
-    struct vhost_memory_region *merged = NULL;
-    for (from = 0, to = 0; from < dev->mem->nregions; ++from, ++to) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
-        uint64_t prlast, urlast;
-        uint64_t pmlast, umlast;
-        uint64_t s, e, u;
-
-        /* clone old region */
-        if (to != from) {
-            memcpy(reg, dev->mem->regions + from, sizeof *reg);
-        }
-        prlast = range_get_last(reg->guest_phys_addr, reg->memory_size);
-        pmlast = range_get_last(start_addr, size);
-        urlast = range_get_last(reg->userspace_addr, reg->memory_size);
-        umlast = range_get_last(uaddr, size);
+    int i = vhost_dev_find_index(dev, start_addr);
+    struct vhost_memory_region *prev = NULL, *next = NULL;
 
+    if (i > 0) {
+        prev = dev->mem->regions + i - 1;
+        if (prev->guest_phys_addr + prev->memory_size != start_addr ||
+            prev->userspace_addr + prev->memory_size != uaddr) {
+            prev = NULL;
+        }
+    }
+    if (i < dev->mem->nregions) {
+        next = dev->mem->regions + i;
         /* check for overlapping regions: should never happen. */
-        assert(prlast < start_addr || pmlast < reg->guest_phys_addr);
-        /* Not an adjacent or overlapping region - do not merge. */
-        if ((prlast + 1 != start_addr || urlast + 1 != uaddr) &&
-            (pmlast + 1 != reg->guest_phys_addr ||
-             umlast + 1 != reg->userspace_addr)) {
-            continue;
+        assert(next->guest_phys_addr > range_get_last(start_addr, size));
+        if (start_addr + size != next->guest_phys_addr ||
+            uaddr + size != next->userspace_addr) {
+            next = NULL;
         }
+    }
 
-        if (merged) {
-            --to;
-            assert(to >= 0);
-        } else {
-            merged = reg;
+    if (prev) {
+        prev->memory_size += size;
+        if (next) {
+            prev->memory_size += next->memory_size;
+            vhost_dev_remove_regions(dev, i, 1);
         }
-        u = MIN(uaddr, reg->userspace_addr);
-        s = MIN(start_addr, reg->guest_phys_addr);
-        e = MAX(pmlast, prlast);
-        uaddr = merged->userspace_addr = u;
-        start_addr = merged->guest_phys_addr = s;
-        size = merged->memory_size = e - s + 1;
-        assert(merged->memory_size);
-    }
-
-    if (!merged) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
-        memset(reg, 0, sizeof *reg);
-        reg->memory_size = size;
-        assert(reg->memory_size);
-        reg->guest_phys_addr = start_addr;
-        reg->userspace_addr = uaddr;
-        ++to;
+    } else if (next) {
+        next->guest_phys_addr = start_addr;
+        next->userspace_addr = uaddr;
+        next->memory_size += size;
+    } else {
+        vhost_dev_insert_region(dev, i, start_addr, size, uaddr);
     }
-    assert(to <= dev->mem->nregions + 1);
-    dev->mem->nregions = to;
 }
 
 static uint64_t vhost_get_log_size(struct vhost_dev *dev)
@@ -275,7 +272,7 @@ static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
         log = NULL;
     }
     log_base = (uint64_t)(unsigned long)log;
-    r = ioctl(dev->control, VHOST_SET_LOG_BASE, &log_base);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_LOG_BASE, &log_base);
     assert(r >= 0);
     for (i = 0; i < dev->n_mem_sections; ++i) {
         /* Sync only the range covered by the old log */
@@ -321,13 +318,12 @@ static struct vhost_memory_region *vhost_dev_find_reg(struct vhost_dev *dev,
 						      uint64_t start_addr,
 						      uint64_t size)
 {
-    int i, n = dev->mem->nregions;
-    for (i = 0; i < n; ++i) {
-        struct vhost_memory_region *reg = dev->mem->regions + i;
-        if (ranges_overlap(reg->guest_phys_addr, reg->memory_size,
-                           start_addr, size)) {
-            return reg;
-        }
+    int i = vhost_dev_find_index(dev, start_addr);
+    struct vhost_memory_region *reg = dev->mem->regions + i;
+
+    if (i < dev->mem->nregions &&
+        reg->guest_phys_addr <= range_get_last(start_addr, size)) {
+        return reg;
     }
     return NULL;
 }
@@ -365,14 +361,8 @@ static void vhost_set_memory(MemoryListener *listener,
     target_phys_addr_t start_addr = section->offset_within_address_space;
     ram_addr_t size = section->size;
     bool log_dirty = memory_region_is_logging(section->mr);
-    int s = offsetof(struct vhost_memory, regions) +
-        (dev->mem->nregions + 1) * sizeof dev->mem->regions[0];
-    uint64_t log_size;
-    int r;
     void *ram;
 
-    dev->mem = g_realloc(dev->mem, s);
-
     if (log_dirty) {
         add = false;
     }
@@ -397,22 +387,52 @@ static void vhost_set_memory(MemoryListener *listener,
     if (add) {
         /* Add given mapping, merging adjacent regions if any */
         vhost_dev_assign_memory(dev, start_addr, size, (uintptr_t)ram);
-    } else {
-        /* Remove old mapping for this memory, if any. */
-        vhost_dev_unassign_memory(dev, start_addr, size);
     }
 
-    if (!dev->started) {
+    /* The table is pushed to the kernel once, in vhost_commit */
+    dev->mem_changed_start_addr = MIN(dev->mem_changed_start_addr, start_addr);
+    dev->mem_changed_end_addr = MAX(dev->mem_changed_end_addr,
+                                    range_get_last(start_addr, size));
+    dev->memory_changed = true;
+    ++dev->mem_region_changes;
+}
+
+static bool vhost_section(MemoryRegionSection *section)
+{
+    return section->address_space == get_system_memory()
+        && memory_region_is_ram(section->mr);
+}
+
+static void vhost_begin(MemoryListener *listener)
+{
+    struct vhost_dev *dev = container_of(listener, struct vhost_dev,
+                                         memory_listener);
+    dev->mem_changed_start_addr = -1;
+    dev->mem_changed_end_addr = 0;
+    dev->memory_changed = false;
+}
+
+static void vhost_commit(MemoryListener *listener)
+{
+    struct vhost_dev *dev = container_of(listener, struct vhost_dev,
+                                         memory_listener);
+    uint64_t start_addr, size;
+    uint64_t log_size;
+    int r;
+
+    if (!dev->memory_changed || !dev->started) {
         return;
     }
 
-    if (dev->started) {
-        r = vhost_verify_ring_mappings(dev, start_addr, size);
-        assert(r >= 0);
-    }
+    start_addr = dev->mem_changed_start_addr;
+    size = dev->mem_changed_end_addr - start_addr + 1;
+    r = vhost_verify_ring_mappings(dev, start_addr, size);
+    assert(r >= 0);
+
+    ++dev->mem_table_updates;
 
     if (!dev->log_enabled) {
-        r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+        r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
         assert(r >= 0);
         return;
     }
@@ -424,7 +444,7 @@ static void vhost_set_memory(MemoryListener *listener,
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
     assert(r >= 0);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
@@ -432,20 +452,6 @@ static void vhost_set_memory(MemoryListener *listener,
     }
 }
 
-static bool vhost_section(MemoryRegionSection *section)
-{
-    return section->address_space == get_system_memory()
-        && memory_region_is_ram(section->mr);
-}
-
-static void vhost_begin(MemoryListener *listener)
-{
-}
-
-static void vhost_commit(MemoryListener *listener)
-{
-}
-
 static void vhost_region_add(MemoryListener *listener,
                              MemoryRegionSection *section)
 {
@@ -503,7 +509,7 @@ static int vhost_virtqueue_set_addr(struct vhost_dev *dev,
         .log_guest_addr = vq->used_phys,
         .flags = enable_log ? (1 << VHOST_VRING_F_LOG) : 0,
     };
-    int r = ioctl(dev->control, VHOST_SET_VRING_ADDR, &addr);
+    int r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_ADDR, &addr);
     if (r < 0) {
         return -errno;
     }
@@ -517,7 +523,7 @@ static int vhost_dev_set_features(struct vhost_dev *dev, bool enable_log)
     if (enable_log) {
         features |= 0x1 << VHOST_F_LOG_ALL;
     }
-    r = ioctl(dev->control, VHOST_SET_FEATURES, &features);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_FEATURES, &features);
     return r < 0 ? -errno : 0;
 }
 
@@ -620,22 +626,25 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
 {
     target_phys_addr_t s, l, a;
     int r;
+    int vhost_vq_index = idx - dev->vq_index;
     struct vhost_vring_file file = {
-        .index = idx,
+        .index = vhost_vq_index,
     };
     struct vhost_vring_state state = {
-        .index = idx,
+        .index = vhost_vq_index,
     };
     struct VirtQueue *vvq = virtio_get_queue(vdev, idx);
 
+    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
+
     vq->num = state.num = virtio_queue_get_num(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_NUM, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_NUM, &state);
     if (r) {
         return -errno;
     }
 
     state.num = virtio_queue_get_last_avail_idx(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_BASE, &state);
     if (r) {
         return -errno;
     }
@@ -670,20 +679,20 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
         goto fail_alloc_ring;
     }
 
-    r = vhost_virtqueue_set_addr(dev, vq, idx, dev->log_enabled);
+    r = vhost_virtqueue_set_addr(dev, vq, vhost_vq_index, dev->log_enabled);
     if (r < 0) {
         r = -errno;
         goto fail_alloc;
     }
     file.fd = event_notifier_get_fd(virtio_queue_get_host_notifier(vvq));
-    r = ioctl(dev->control, VHOST_SET_VRING_KICK, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_KICK, &file);
     if (r) {
         r = -errno;
         goto fail_kick;
     }
 
     file.fd = event_notifier_get_fd(virtio_queue_get_guest_notifier(vvq));
-    r = ioctl(dev->control, VHOST_SET_VRING_CALL, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_CALL, &file);
     if (r) {
         r = -errno;
         goto fail_call;
@@ -715,10 +724,11 @@ static void vhost_virtqueue_cleanup(struct vhost_dev *dev,
                                     unsigned idx)
 {
     struct vhost_vring_state state = {
-        .index = idx,
+        .index = idx - dev->vq_index,
     };
     int r;
-    r = ioctl(dev->control, VHOST_GET_VRING_BASE, &state);
+    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
@@ -747,24 +757,34 @@ static void vhost_eventfd_del(MemoryListener *listener,
 {
 }
 
-int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force)
+int vhost_dev_init(struct vhost_dev *hdev, int devfd,
+                   VhostBackendType backend_type, bool force)
 {
     uint64_t features;
     int r;
+
+    if (vhost_set_backend_type(hdev, backend_type) < 0) {
+        return -EINVAL;
+    }
     if (devfd >= 0) {
         hdev->control = devfd;
-    } else {
+    } else if (backend_type == VHOST_BACKEND_TYPE_KERNEL) {
         hdev->control = open("/dev/vhost-net", O_RDWR);
         if (hdev->control < 0) {
             return -errno;
         }
+    } else {
+        return -EBADF;
+    }
+    if (hdev->vhost_ops->vhost_backend_init(hdev) < 0) {
+        return -errno;
     }
-    r = ioctl(hdev->control, VHOST_SET_OWNER, NULL);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
     if (r < 0) {
         goto fail;
     }
 
-    r = ioctl(hdev->control, VHOST_GET_FEATURES, &features);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_GET_FEATURES, &features);
     if (r < 0) {
         goto fail;
     }
@@ -786,6 +806,12 @@ int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force)
         .priority = 10
     };
     hdev->mem = g_malloc0(offsetof(struct vhost_memory, regions));
+    hdev->mem_capacity = 0;
+    hdev->mem_changed_start_addr = -1;
+    hdev->mem_changed_end_addr = 0;
+    hdev->memory_changed = false;
+    hdev->mem_region_changes = 0;
+    hdev->mem_table_updates = 0;
     hdev->n_mem_sections = 0;
     hdev->mem_sections = NULL;
     hdev->log = NULL;
@@ -797,7 +823,7 @@ int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force)
     return 0;
 fail:
     r = -errno;
-    close(hdev->control);
+    hdev->vhost_ops->vhost_backend_cleanup(hdev);
     return r;
 }
 
@@ -806,7 +832,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
     memory_listener_unregister(&hdev->memory_listener);
     g_free(hdev->mem);
     g_free(hdev->mem_sections);
-    close(hdev->control);
+    hdev->vhost_ops->vhost_backend_cleanup(hdev);
 }
 
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev)
@@ -829,7 +855,8 @@ int vhost_dev_enable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 
     for (i = 0; i < hdev->nvqs; ++i) {
-        r = vdev->binding->set_host_notifier(vdev->binding_opaque, i, true);
+        r = vdev->binding->set_host_notifier(vdev->binding_opaque,
+                                             hdev->vq_index + i, true);
         if (r < 0) {
             fprintf(stderr, "vhost VQ %d notifier binding failed: %d\n", i, -r);
             goto fail_vq;
@@ -839,7 +866,8 @@ int vhost_dev_enable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     return 0;
 fail_vq:
     while (--i >= 0) {
-        r = vdev->binding->set_host_notifier(vdev->binding_opaque, i, false);
+        r = vdev->binding->set_host_notifier(vdev->binding_opaque,
+                                             hdev->vq_index + i, false);
         if (r < 0) {
             fprintf(stderr, "vhost VQ %d notifier cleanup error: %d\n", i, -r);
             fflush(stderr);
@@ -860,7 +888,8 @@ void vhost_dev_disable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     int i, r;
 
     for (i = 0; i < hdev->nvqs; ++i) {
-        r = vdev->binding->set_host_notifier(vdev->binding_opaque, i, false);
+        r = vdev->binding->set_host_notifier(vdev->binding_opaque,
+                                             hdev->vq_index + i, false);
         if (r < 0) {
             fprintf(stderr, "vhost VQ %d notifier cleanup failed: %d\n", i, -r);
             fflush(stderr);
@@ -869,47 +898,39 @@ void vhost_dev_disable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 }
 
-/* Host notifiers must be enabled at this point. */
+/* Host and guest notifiers must be enabled at this point. */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
     int i, r;
-    if (!vdev->binding->set_guest_notifiers) {
-        fprintf(stderr, "binding does not support guest notifiers\n");
-        r = -ENOSYS;
-        goto fail;
-    }
-
-    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, true);
-    if (r < 0) {
-        fprintf(stderr, "Error binding guest notifier: %d\n", -r);
-        goto fail_notifiers;
-    }
 
     r = vhost_dev_set_features(hdev, hdev->log_enabled);
     if (r < 0) {
         goto fail_features;
     }
-    r = ioctl(hdev->control, VHOST_SET_MEM_TABLE, hdev->mem);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_MEM_TABLE, hdev->mem);
     if (r < 0) {
         r = -errno;
         goto fail_mem;
     }
+    ++hdev->mem_table_updates;
     for (i = 0; i < hdev->nvqs; ++i) {
         r = vhost_virtqueue_init(hdev,
                                  vdev,
                                  hdev->vqs + i,
-                                 i);
+                                 hdev->vq_index + i);
         if (r < 0) {
             goto fail_vq;
         }
     }
 
     if (hdev->log_enabled) {
+        uint64_t log_base;
+
         hdev->log_size = vhost_get_log_size(hdev);
         hdev->log = hdev->log_size ?
             g_malloc0(hdev->log_size * sizeof *hdev->log) : NULL;
-        r = ioctl(hdev->control, VHOST_SET_LOG_BASE,
-                  (uint64_t)(unsigned long)hdev->log);
+        log_base = (uint64_t)(unsigned long)hdev->log;
+        r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_LOG_BASE, &log_base);
         if (r < 0) {
             r = -errno;
             goto fail_log;
@@ -925,38 +946,28 @@ fail_vq:
         vhost_virtqueue_cleanup(hdev,
                                 vdev,
                                 hdev->vqs + i,
-                                i);
+                                hdev->vq_index + i);
     }
 fail_mem:
 fail_features:
-    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
-fail_notifiers:
-fail:
     return r;
 }
 
-/* Host notifiers must be enabled at this point. */
+/* Host and guest notifiers must be enabled at this point. */
 void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
-    int i, r;
+    int i;
 
     for (i = 0; i < hdev->nvqs; ++i) {
         vhost_virtqueue_cleanup(hdev,
                                 vdev,
                                 hdev->vqs + i,
-                                i);
+                                hdev->vq_index + i);
     }
     for (i = 0; i < hdev->n_mem_sections; ++i) {
         vhost_sync_dirty_bitmap(hdev, &hdev->mem_sections[i],
                                 0, (target_phys_addr_t)~0x0ull);
     }
-    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
-    if (r < 0) {
-        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
-        fflush(stderr);
-    }
-    assert (r >= 0);
-
     hdev->started = false;
     g_free(hdev->log);
     hdev->log = NULL;
@@ -4,6 +4,7 @@
 #include "hw/hw.h"
 #include "hw/virtio.h"
 #include "memory.h"
+#include "hw/vhost-backend.h"
 
 /* Generic structures common for any vhost based device. */
 struct vhost_virtqueue {
@@ -29,11 +30,21 @@ struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
     int control;
+    const VhostOps *vhost_ops;
     struct vhost_memory *mem;
+    int mem_capacity;
+    /* range of guest addresses changed since the last vhost_begin */
+    uint64_t mem_changed_start_addr;
+    uint64_t mem_changed_end_addr;
+    bool memory_changed;
+    uint64_t mem_region_changes;
+    uint64_t mem_table_updates;
     int n_mem_sections;
     MemoryRegionSection *mem_sections;
     struct vhost_virtqueue *vqs;
     int nvqs;
+    /* the first virtqueue which would be used by this vhost dev */
+    int vq_index;
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
@@ -44,7 +55,8 @@ struct vhost_dev {
     bool force;
 };
 
-int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force);
+int vhost_dev_init(struct vhost_dev *hdev, int devfd,
+                   VhostBackendType backend_type, bool force);
 void vhost_dev_cleanup(struct vhost_dev *hdev);
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev);
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev);
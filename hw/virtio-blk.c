@@ -18,6 +18,9 @@
 #include "blockdev.h"
 #include "virtio-blk.h"
 #include "scsi-defs.h"
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "hw/dataplane/virtio-blk.h"
+#endif
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
@@ -26,13 +29,16 @@ typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
     BlockDriverState *bs;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
     VirtIOBlkConf *blk;
     unsigned short sector_mask;
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
+    VirtQueue *vqs[0];
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -43,12 +49,16 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     struct virtio_scsi_inhdr *scsi;
     QEMUIOVector qiov;
+    uint64_t sector_num;                /* the guest may change req->out */
     struct VirtIOBlockReq *next;
+    struct VirtIOBlockReq *mr_next;     /* next request merged into this one */
+    QEMUIOVector mr_qiov;               /* iovecs of all merged requests */
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
@@ -59,8 +69,8 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
+    virtqueue_push(req->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtio_notify(&s->vdev, req->vq);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -93,19 +103,34 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
 
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
-    VirtIOBlockReq *req = opaque;
-
-    trace_virtio_blk_rw_complete(req, ret);
+    VirtIOBlockReq *next = opaque;
 
-    if (ret) {
-        int is_read = !(ldl_p(&req->out->type) & VIRTIO_BLK_T_OUT);
-        if (virtio_blk_handle_rw_error(req, -ret, is_read))
-            return;
+    /* Requests merged by virtio_blk_submit_multireq() share one host request
+     * and are completed together.
+     */
+    if (next->mr_next) {
+        qemu_iovec_destroy(&next->mr_qiov);
     }
 
-    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-    bdrv_acct_done(req->dev->bs, &req->acct);
-    g_free(req);
+    while (next) {
+        VirtIOBlockReq *req = next;
+
+        next = req->mr_next;
+        req->mr_next = NULL;
+
+        trace_virtio_blk_rw_complete(req, ret);
+
+        if (ret) {
+            int is_read = !(ldl_p(&req->out->type) & VIRTIO_BLK_T_OUT);
+            if (virtio_blk_handle_rw_error(req, -ret, is_read)) {
+                continue;
+            }
+        }
+
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+        bdrv_acct_done(req->dev->bs, &req->acct);
+        g_free(req);
+    }
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
@@ -123,21 +148,23 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     g_free(req);
 }
 
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req = g_malloc(sizeof(*req));
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->next = NULL;
+    req->mr_next = NULL;
     return req;
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtIOBlockReq *req = virtio_blk_alloc_request(s, vq);
 
     if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
+        if (!virtqueue_pop(vq, &req->elem)) {
             g_free(req);
             return NULL;
         }
@@ -266,29 +293,133 @@ fail:
     g_free(req);
 }
 
+/* Upper bound on the size of a request built by merging guest requests */
+#define VIRTIO_BLK_MAX_MERGE_BYTES  (1024 * 1024)
+
+#define VIRTIO_BLK_MAX_MERGE_REQS   32
+
+/*
+ * Reads and writes taken from the virtqueue in one notification are
+ * collected here.  Before submission, requests for adjacent sectors are
+ * merged into one block layer request whose QEMUIOVector simply points at
+ * the iovecs of all guest requests, so no data is copied.
+ */
 typedef struct MultiReqBuffer {
-    BlockRequest        blkreq[32];
-    unsigned int        num_writes;
+    VirtIOBlockReq      *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int        num_reqs;
+    bool                is_write;
 } MultiReqBuffer;
 
-static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
+static void virtio_blk_submit_req(BlockDriverState *bs, VirtIOBlockReq *req,
+                                  QEMUIOVector *qiov, bool is_write)
 {
-    int i, ret;
+    int64_t sector = req->sector_num;
+    int nb_sectors = qiov->size / BDRV_SECTOR_SIZE;
 
-    if (!mrb->num_writes) {
+    if (is_write) {
+        bdrv_aio_writev(bs, sector, qiov, nb_sectors,
+                        virtio_blk_rw_complete, req);
+    } else {
+        bdrv_aio_readv(bs, sector, qiov, nb_sectors,
+                       virtio_blk_rw_complete, req);
+    }
+}
+
+static int multireq_compare(const void *a, const void *b)
+{
+    const VirtIOBlockReq *req1 = *(VirtIOBlockReq **)a;
+    const VirtIOBlockReq *req2 = *(VirtIOBlockReq **)b;
+
+    if (req1->sector_num < req2->sector_num) {
+        return -1;
+    } else if (req1->sector_num > req2->sector_num) {
+        return 1;
+    }
+    return 0;
+}
+
+static void virtio_blk_submit_multireq(BlockDriverState *bs,
+                                       MultiReqBuffer *mrb)
+{
+    VirtIOBlockReq *start = NULL, *last = NULL;
+    uint64_t end_sector = 0;
+    size_t size = 0;
+    int niov = 0;
+    int num_merged = 0;
+    unsigned int i;
+
+    if (!mrb->num_reqs) {
         return;
     }
 
-    ret = bdrv_aio_multiwrite(bs, mrb->blkreq, mrb->num_writes);
-    if (ret != 0) {
-        for (i = 0; i < mrb->num_writes; i++) {
-            if (mrb->blkreq[i].error) {
-                virtio_blk_rw_complete(mrb->blkreq[i].opaque, -EIO);
+    if (mrb->num_reqs > 1) {
+        qsort(mrb->reqs, mrb->num_reqs, sizeof(mrb->reqs[0]),
+              multireq_compare);
+    }
+
+    for (i = 0; i <= mrb->num_reqs; i++) {
+        VirtIOBlockReq *req = i < mrb->num_reqs ? mrb->reqs[i] : NULL;
+
+        if (req && start &&
+            req->sector_num == end_sector &&
+            niov + req->qiov.niov <= IOV_MAX &&
+            size + req->qiov.size <= VIRTIO_BLK_MAX_MERGE_BYTES) {
+            /* Chain the request; the iovecs are concatenated below */
+            last->mr_next = req;
+            last = req;
+            end_sector += req->qiov.size / BDRV_SECTOR_SIZE;
+            niov += req->qiov.niov;
+            size += req->qiov.size;
+            num_merged++;
+            continue;
+        }
+
+        if (start) {
+            if (start->mr_next) {
+                VirtIOBlockReq *r;
+
+                qemu_iovec_init(&start->mr_qiov, niov);
+                for (r = start; r; r = r->mr_next) {
+                    qemu_iovec_concat(&start->mr_qiov, &r->qiov, 0,
+                                      r->qiov.size);
+                }
+                virtio_blk_submit_req(bs, start, &start->mr_qiov,
+                                      mrb->is_write);
+            } else {
+                virtio_blk_submit_req(bs, start, &start->qiov,
+                                      mrb->is_write);
             }
         }
+
+        start = last = req;
+        if (req) {
+            end_sector = req->sector_num + req->qiov.size / BDRV_SECTOR_SIZE;
+            niov = req->qiov.niov;
+            size = req->qiov.size;
+        }
     }
 
-    mrb->num_writes = 0;
+    if (num_merged) {
+        bdrv_acct_merged(bs, mrb->is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ,
+                         num_merged);
+    }
+    trace_virtio_blk_submit_multireq(mrb, mrb->num_reqs, num_merged,
+                                     mrb->is_write);
+
+    mrb->num_reqs = 0;
+}
+
+/* Queue a read or write for submission at the end of the batch */
+static void virtio_blk_add_multireq(VirtIOBlockReq *req, MultiReqBuffer *mrb,
+                                    bool is_write)
+{
+    if (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
+        (mrb->num_reqs && mrb->is_write != is_write)) {
+        virtio_blk_submit_multireq(req->dev->bs, mrb);
+    }
+
+    mrb->reqs[mrb->num_reqs++] = req;
+    mrb->is_write = is_write;
 }
 
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
@@ -298,16 +429,15 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     /*
      * Make sure all outstanding writes are posted to the backing device.
      */
-    virtio_submit_multiwrite(req->dev->bs, mrb);
+    virtio_blk_submit_multireq(req->dev->bs, mrb);
     bdrv_aio_flush(req->dev->bs, virtio_blk_flush_complete, req);
 }
 
 static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockRequest *blkreq;
     uint64_t sector;
 
-    sector = ldq_p(&req->out->sector);
+    sector = req->sector_num = ldq_p(&req->out->sector);
 
     bdrv_acct_start(req->dev->bs, &req->acct, req->qiov.size, BDRV_ACCT_WRITE);
 
@@ -322,26 +452,14 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
         return;
     }
 
-    if (mrb->num_writes == 32) {
-        virtio_submit_multiwrite(req->dev->bs, mrb);
-    }
-
-    blkreq = &mrb->blkreq[mrb->num_writes];
-    blkreq->sector = sector;
-    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
-    blkreq->qiov = &req->qiov;
-    blkreq->cb = virtio_blk_rw_complete;
-    blkreq->opaque = req;
-    blkreq->error = 0;
-
-    mrb->num_writes++;
+    virtio_blk_add_multireq(req, mrb, true);
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     uint64_t sector;
 
-    sector = ldq_p(&req->out->sector);
+    sector = req->sector_num = ldq_p(&req->out->sector);
 
     bdrv_acct_start(req->dev->bs, &req->acct, req->qiov.size, BDRV_ACCT_READ);
 
@@ -355,9 +473,8 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
         virtio_blk_rw_complete(req, -EIO);
         return;
     }
-    bdrv_aio_readv(req->dev->bs, sector, &req->qiov,
-                   req->qiov.size / BDRV_SECTOR_SIZE,
-                   virtio_blk_rw_complete, req);
+
+    virtio_blk_add_multireq(req, mrb, false);
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -404,7 +521,7 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
     } else {
         qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
                                  req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        virtio_blk_handle_read(req, mrb);
     }
 }
 
@@ -413,14 +530,33 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBlock *s = to_virtio_blk(vdev);
     VirtIOBlockReq *req;
     MultiReqBuffer mrb = {
-        .num_writes = 0,
+        .num_reqs = 0,
     };
 
-    while ((req = virtio_blk_get_request(s))) {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
+     * dataplane here instead of waiting for .set_status().
+     */
+    if (s->dataplane) {
+        if (virtio_blk_data_plane_start(s->dataplane) == 0) {
+            return;
+        }
+        /* Serve the device from here on, and allow migration again */
+        error_report("virtio-blk: x-data-plane disabled");
+        virtio_blk_data_plane_destroy(s->dataplane);
+        s->dataplane = NULL;
+    }
+#endif
+
+    bdrv_io_plug(s->bs);
+
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_blk_submit_multireq(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -434,7 +570,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
     MultiReqBuffer mrb = {
-        .num_writes = 0,
+        .num_reqs = 0,
     };
 
     qemu_bh_delete(s->bh);
@@ -447,7 +583,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
         req = req->next;
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_blk_submit_multireq(s->bs, &mrb);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -466,6 +602,14 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
 
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
@@ -511,6 +655,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(s->conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = bdrv_enable_write_cache(s->bs);
+    stw_raw(&blkcfg.num_queues, s->blk->num_queues);
     memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
 }
 
@@ -532,6 +677,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     features |= (1 << VIRTIO_BLK_F_TOPOLOGY);
     features |= (1 << VIRTIO_BLK_F_BLK_SIZE);
     features |= (1 << VIRTIO_BLK_F_SCSI);
+    if (s->blk->num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
 
     features |= (1 << VIRTIO_BLK_F_CONFIG_WCE);
     if (bdrv_enable_write_cache(s->bs))
@@ -548,6 +696,12 @@ static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
     VirtIOBlock *s = to_virtio_blk(vdev);
     uint32_t features;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane && !(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+
     if (!(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return;
     }
@@ -565,6 +719,15 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     
     while (req) {
         qemu_put_sbyte(f, 1);
+        /* The queue index is only sent for multiqueue devices so that
+         * single queue devices keep the old stream format.
+         */
+        if (s->blk->num_queues > 1) {
+            uint32_t n = virtio_queue_get_id(req->vq);
+
+            assert(n < s->blk->num_queues);
+            qemu_put_be32s(f, &n);
+        }
         qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
         req = req->next;
     }
@@ -585,7 +748,16 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        VirtIOBlockReq *req;
+        uint32_t n = 0;
+
+        if (s->blk->num_queues > 1) {
+            qemu_get_be32s(f, &n);
+            if (n >= s->blk->num_queues) {
+                return -EINVAL;
+            }
+        }
+        req = virtio_blk_alloc_request(s, s->vqs[n]);
         qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
         req->next = s->rq;
         s->rq = req;
@@ -614,6 +786,8 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 {
     VirtIOBlock *s;
     static int virtio_blk_id;
+    size_t sz;
+    int i;
 
     if (!blk->conf.bs) {
         error_report("drive property not set");
@@ -629,9 +803,16 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
         return NULL;
     }
 
+    if (blk->num_queues < 1 || blk->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_report("num-queues must be between 1 and %d",
+                     VIRTIO_PCI_QUEUE_MAX);
+        return NULL;
+    }
+
+    sz = sizeof(VirtIOBlock) + blk->num_queues * sizeof(VirtQueue *);
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
                                           sizeof(struct virtio_blk_config),
-                                          sizeof(VirtIOBlock));
+                                          sz);
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.set_config = virtio_blk_set_config;
@@ -644,7 +825,15 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < blk->num_queues; i++) {
+        s->vqs[i] = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    }
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (!virtio_blk_data_plane_create(&s->vdev, blk, &s->dataplane)) {
+        virtio_cleanup(&s->vdev);
+        return NULL;
+    }
+#endif
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
@@ -662,6 +851,10 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_blk_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(s->qdev, "virtio-blk", s);
     blockdev_mark_auto_del(s->bs);
     virtio_cleanup(vdev);
@@ -15,9 +15,11 @@
 #include "virtio.h"
 #include "net.h"
 #include "net/checksum.h"
+#include "net/gro.h"
 #include "net/tap.h"
 #include "qemu-error.h"
 #include "qemu-timer.h"
+#include "monitor.h"
 #include "virtio-net.h"
 #include "vhost_net.h"
 
@@ -26,26 +28,82 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* How the TX queue is flushed after the guest kicks it */
+enum {
+    VIRTIO_NET_TX_IMMEDIATE,    /* flush from the notification itself */
+    VIRTIO_NET_TX_BH,           /* flush from a bottom half */
+    VIRTIO_NET_TX_TIMER,        /* flush after tx_timeout */
+    VIRTIO_NET_TX_MODE_MAX,
+};
+
+static const char *virtio_net_tx_mode_names[VIRTIO_NET_TX_MODE_MAX] = {
+    [VIRTIO_NET_TX_IMMEDIATE] = "immediate",
+    [VIRTIO_NET_TX_BH] = "bh",
+    [VIRTIO_NET_TX_TIMER] = "timer",
+};
+
+/* With tx=adaptive the packet rate is sampled over this period and the
+ * mode is picked from it: below TX_ADAPT_LOW packets per period every
+ * kick is flushed at once, above TX_ADAPT_HIGH kicks are coalesced with
+ * the timer, and the bottom half is used in between.
+ */
+#define TX_ADAPT_PERIOD     10000000 /* 10 ms */
+#define TX_ADAPT_LOW        100
+#define TX_ADAPT_HIGH       2000
+
+/* Smallest burst the adaptive mode tunes tx_burst down to */
+#define TX_ADAPT_MIN_BURST  16
+
+typedef struct VirtIONetQueue {
+    VirtQueue *rx_vq;
+    VirtQueue *tx_vq;
+    QEMUTimer *tx_timer;
+    QEMUBH *tx_bh;
+    int tx_waiting;
+    int tx_mode;
+    int32_t tx_burst;
+    struct {
+        int64_t start;
+        uint32_t packets;
+        uint32_t flushes;
+        uint64_t switches;
+    } tx_adapt;
+    struct {
+        uint64_t flushes;
+        uint64_t packets;
+    } tx_stats[VIRTIO_NET_TX_MODE_MAX];
+    int rx_notify_pending;
+    struct {
+        uint8_t *buf;       /* header and frame of the held packet */
+        size_t size;        /* 0 if no packet is held */
+        int l4_off;
+        int hdr_len;
+        uint16_t mss;
+        uint32_t next_seq;
+        int segs;
+        uint64_t packets;
+        uint64_t segments;
+    } gro;
+    struct {
+        VirtQueueElement elem;
+        ssize_t len;
+    } async_tx;
+    struct VirtIONet *n;
+} VirtIONetQueue;
+
 typedef struct VirtIONet
 {
     VirtIODevice vdev;
     uint8_t mac[ETH_ALEN];
     uint16_t status;
-    VirtQueue *rx_vq;
-    VirtQueue *tx_vq;
+    VirtIONetQueue vqs[MAX_QUEUE_NUM];
     VirtQueue *ctrl_vq;
     NICState *nic;
-    QEMUTimer *tx_timer;
-    QEMUBH *tx_bh;
     uint32_t tx_timeout;
     int32_t tx_burst;
-    int tx_waiting;
+    int tx_adaptive;
     uint32_t has_vnet_hdr;
     uint8_t has_ufo;
-    struct {
-        VirtQueueElement elem;
-        ssize_t len;
-    } async_tx;
     int mergeable_rx_bufs;
     uint8_t promisc;
     uint8_t allmulti;
@@ -63,6 +121,10 @@ typedef struct VirtIONet
     } mac_table;
     uint32_t *vlans;
     DeviceState *qdev;
+    int multiqueue;
+    uint16_t max_queues;
+    uint16_t curr_queues;
+    size_t config_size;
 } VirtIONet;
 
 /* TODO
@@ -74,14 +136,28 @@ static VirtIONet *to_virtio_net(VirtIODevice *vdev)
     return (VirtIONet *)vdev;
 }
 
+/* Virtqueues 2n and 2n + 1 are the receive and transmit queue of pair n */
+static int vq2q(int queue_index)
+{
+    return queue_index / 2;
+}
+
+static VirtIONetQueue *virtio_net_get_queue(NetClientState *nc)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+
+    return &n->vqs[nc->queue_index];
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
     stw_p(&netcfg.status, n->status);
+    stw_p(&netcfg.max_virtqueue_pairs, n->max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
-    memcpy(config, &netcfg, sizeof(netcfg));
+    memcpy(config, &netcfg, n->config_size);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -89,7 +165,7 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
-    memcpy(&netcfg, config, sizeof(netcfg));
+    memcpy(&netcfg, config, n->config_size);
 
     if (memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
@@ -105,14 +181,9 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
 
 static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 {
-    if (!n->nic->nc.peer) {
-        return;
-    }
-    if (n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
+    int queues = n->multiqueue ? n->max_queues : 1;
 
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
+    if (!get_vhost_net(n->nic->nc.peer)) {
         return;
     }
     if (!!n->vhost_started == virtio_net_started(n, status) &&
@@ -121,10 +192,10 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
     if (!n->vhost_started) {
         int r;
-        if (!vhost_net_query(tap_get_vhost_net(n->nic->nc.peer), &n->vdev)) {
+        if (!vhost_net_query(get_vhost_net(n->nic->nc.peer), &n->vdev)) {
             return;
         }
-        r = vhost_net_start(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        r = vhost_net_start(&n->vdev, n->nic, queues);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
@@ -132,33 +203,54 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
             n->vhost_started = 1;
         }
     } else {
-        vhost_net_stop(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        vhost_net_stop(&n->vdev, n->nic, queues);
         n->vhost_started = 0;
     }
 }
 
+static void virtio_net_tx_schedule(VirtIONetQueue *q)
+{
+    if (q->tx_mode == VIRTIO_NET_TX_TIMER) {
+        qemu_mod_timer(q->tx_timer,
+                       qemu_get_clock_ns(vm_clock) + q->n->tx_timeout);
+    } else {
+        qemu_bh_schedule(q->tx_bh);
+    }
+}
+
+static void virtio_net_tx_cancel(VirtIONetQueue *q)
+{
+    if (q->tx_timer) {
+        qemu_del_timer(q->tx_timer);
+    }
+    if (q->tx_bh) {
+        qemu_bh_cancel(q->tx_bh);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q;
+    uint8_t queue_status;
+    int i;
 
     virtio_net_vhost_status(n, status);
 
-    if (!n->tx_waiting) {
-        return;
-    }
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
 
-    if (virtio_net_started(n, status) && !n->vhost_started) {
-        if (n->tx_timer) {
-            qemu_mod_timer(n->tx_timer,
-                           qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        } else {
-            qemu_bh_schedule(n->tx_bh);
+        if (!q->tx_waiting) {
+            continue;
         }
-    } else {
-        if (n->tx_timer) {
-            qemu_del_timer(n->tx_timer);
+
+        /* Pairs the guest has not enabled behave as if it was stopped */
+        queue_status = i < n->curr_queues ? status : 0;
+
+        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+            virtio_net_tx_schedule(q);
         } else {
-            qemu_bh_cancel(n->tx_bh);
+            virtio_net_tx_cancel(q);
         }
     }
 }
@@ -179,9 +271,20 @@ static void virtio_net_set_link_status(NetClientState *nc)
     virtio_net_set_status(&n->vdev, n->vdev.status);
 }
 
+/* Start a fresh adaptation period, so that the first decision of adaptive
+ * TX is based on a whole period of traffic of the running queue.
+ */
+static void virtio_net_tx_adapt_reset(VirtIONetQueue *q)
+{
+    q->tx_adapt.start = qemu_get_clock_ns(vm_clock);
+    q->tx_adapt.packets = 0;
+    q->tx_adapt.flushes = 0;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -198,6 +301,81 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.uni_overflow = 0;
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].gro.size = 0;
+        virtio_net_tx_adapt_reset(&n->vqs[i]);
+    }
+}
+
+static void peer_using_vnet_hdr(VirtIONet *n, int using_vnet_hdr)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        tap_using_vnet_hdr(qemu_get_subqueue(n->nic, i)->peer,
+                           using_vnet_hdr);
+    }
+}
+
+static void peer_set_offload(VirtIONet *n, uint32_t features)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        tap_set_offload(qemu_get_subqueue(n->nic, i)->peer,
+                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
+                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+    }
+}
+
+static int peer_attach(VirtIONet *n, int index)
+{
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+
+    if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+        return 0;
+    }
+
+    return tap_enable(nc->peer);
+}
+
+static int peer_detach(VirtIONet *n, int index)
+{
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+
+    if (!nc->peer || nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+        return 0;
+    }
+
+    return tap_disable(nc->peer);
+}
+
+/* Only deliver traffic from the backend queues the guest is using */
+static int virtio_net_set_queues(VirtIONet *n)
+{
+    int i, r;
+
+    if (n->max_queues <= 1) {
+        return 0;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (i < n->curr_queues) {
+            r = peer_attach(n, i);
+        } else {
+            r = peer_detach(n, i);
+        }
+        if (r < 0) {
+            error_report("virtio-net: failed to %s backend queue %d",
+                         i < n->curr_queues ? "enable" : "disable", i);
+            return r;
+        }
+    }
+    return 0;
 }
 
 static int peer_has_vnet_hdr(VirtIONet *n)
@@ -229,8 +407,12 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
+    if (n->max_queues <= 1 || !(features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
     if (peer_has_vnet_hdr(n)) {
-        tap_using_vnet_hdr(n->nic->nc.peer, 1);
+        peer_using_vnet_hdr(n, 1);
     } else {
         features &= ~(0x1 << VIRTIO_NET_F_CSUM);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
@@ -248,14 +430,10 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return features;
-    }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
+    if (!get_vhost_net(n->nic->nc.peer)) {
         return features;
     }
-    return vhost_net_get_features(tap_get_vhost_net(n->nic->nc.peer), features);
+    return vhost_net_get_features(get_vhost_net(n->nic->nc.peer), features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -273,28 +451,28 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
     return features;
 }
 
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue);
+
 static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
+
+    virtio_net_set_multiqueue(n, !!(features & (1 << VIRTIO_NET_F_MQ)));
 
     n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
 
     if (n->has_vnet_hdr) {
-        tap_set_offload(n->nic->nc.peer,
-                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+        peer_set_offload(n, features);
     }
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
-        return;
-    }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
-        return;
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (!get_vhost_net(nc->peer)) {
+            continue;
+        }
+        vhost_net_ack_features(get_vhost_net(nc->peer), features);
     }
-    vhost_net_ack_features(tap_get_vhost_net(n->nic->nc.peer), features);
 }
 
 static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
@@ -404,6 +582,50 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    struct virtio_net_ctrl_mq mq;
+    int old_queues, i;
+
+    if (elem->out_num != 2 || elem->out_sg[1].iov_len != sizeof(mq)) {
+        error_report("virtio-net ctrl invalid mq command");
+        return VIRTIO_NET_ERR;
+    }
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        return VIRTIO_NET_ERR;
+    }
+
+    mq.virtqueue_pairs = lduw_p(elem->out_sg[1].iov_base);
+
+    if (mq.virtqueue_pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        mq.virtqueue_pairs > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+        mq.virtqueue_pairs > n->max_queues ||
+        !n->multiqueue) {
+        return VIRTIO_NET_ERR;
+    }
+
+    old_queues = n->curr_queues;
+    n->curr_queues = mq.virtqueue_pairs;
+    /* Stop transmitting on the pairs that were just disabled before the
+     * backend stops delivering packets to them.
+     */
+    virtio_net_set_status(&n->vdev, n->vdev.status);
+    if (virtio_net_set_queues(n) < 0) {
+        /* The guest keeps using the pairs it had */
+        n->curr_queues = old_queues;
+        virtio_net_set_status(&n->vdev, n->vdev.status);
+        virtio_net_set_queues(n);
+        return VIRTIO_NET_ERR;
+    }
+
+    for (i = old_queues; i < n->curr_queues; i++) {
+        virtio_net_tx_adapt_reset(&n->vqs[i]);
+    }
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -432,6 +654,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
             status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, &elem);
 
         stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
 
@@ -442,11 +666,15 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 
 /* RX */
 
+static int virtio_net_gro_flush(VirtIONetQueue *q);
+
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int queue_index = vq2q(virtio_queue_get_id(vq));
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    virtio_net_gro_flush(&n->vqs[queue_index]);
+    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
@@ -456,35 +684,43 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 static int virtio_net_can_receive(NetClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+
     if (!n->vdev.vm_running) {
         return 0;
     }
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    if (nc->queue_index >= n->curr_queues) {
+        return 0;
+    }
+
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
+        if (virtio_queue_empty(q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0)))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -593,13 +829,15 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+static ssize_t virtio_net_receive_one(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(nc))
         return -1;
 
     /* hdr_len refers to the header we supply to the guest */
@@ -608,7 +846,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -623,7 +861,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -675,51 +913,356 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, i++);
     }
 
     if (mhdr) {
         stw_p(&mhdr->num_buffers, i);
     }
 
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    virtqueue_flush(q->rx_vq, i);
+
+    /* Within a burst from the backend, interrupt the guest only once */
+    if (nc->receive_batched) {
+        q->rx_notify_pending = 1;
+    } else {
+        virtio_notify(&n->vdev, q->rx_vq);
+    }
+
+    return size;
+}
+
+/* Receive coalescing
+ *
+ * With the gro property set, TCP segments that arrive from the backend
+ * within one burst are merged into a single large packet that is handed
+ * to the guest as a GSO frame, like the host's own GRO would do.  Only
+ * segments of guests that negotiated TSO for the address family, with a
+ * checksum we can trust, and carrying nothing but ACK and PSH flags are
+ * held back; anything else flushes the held packet first.
+ */
+
+/* Sum of the TCP pseudo header for a segment of @len bytes */
+static uint32_t virtio_net_gro_pseudo_sum(const uint8_t *frame, int l4_off,
+                                          int len)
+{
+    uint32_t sum;
+
+    if (l4_off == 34) {
+        sum = net_checksum_add(8, (uint8_t *)frame + 26);
+    } else {
+        sum = net_checksum_add(32, (uint8_t *)frame + 22);
+    }
+    return sum + GRO_PROTO_TCP + len;
+}
+
+static int virtio_net_gro_csum_ok(const uint8_t *frame, int l4_off, int end)
+{
+    uint32_t sum;
+
+    if (l4_off == 34 &&
+        net_checksum_finish(net_checksum_add(20, (uint8_t *)frame + 14))) {
+        return 0;
+    }
+
+    sum = virtio_net_gro_pseudo_sum(frame, l4_off, end - l4_off);
+    sum += net_checksum_add(end - l4_off, (uint8_t *)frame + l4_off);
+    return net_checksum_finish(sum) == 0;
+}
+
+static int virtio_net_gro_can_merge(VirtIONetQueue *q, const uint8_t *frame,
+                                    int l4_off, int hdr_len, int end)
+{
+    const uint8_t *head = q->gro.buf + sizeof(struct virtio_net_hdr);
+    const uint8_t *th = head + l4_off;
+    const uint8_t *tcp = frame + l4_off;
+    int payload = end - hdr_len;
+
+    if (l4_off != q->gro.l4_off || hdr_len != q->gro.hdr_len ||
+        payload > q->gro.mss ||
+        q->gro.size - sizeof(struct virtio_net_hdr) + payload > GRO_MAX_FRAME) {
+        return 0;
+    }
+
+    /* Ethernet header, IP header except length, id and checksum */
+    if (memcmp(head, frame, 16)) {
+        return 0;
+    }
+    if (l4_off == 34) {
+        if (memcmp(head + 20, frame + 20, 4) ||
+            memcmp(head + 26, frame + 26, 8)) {
+            return 0;
+        }
+    } else if (memcmp(head + 15, frame + 15, 3) ||
+               memcmp(head + 20, frame + 20, 34)) {
+        return 0;
+    }
+
+    /* Ports, ack, header length and options; seq must follow on */
+    return !memcmp(th, tcp, 4) &&
+           be32_to_cpupu((uint32_t *)(tcp + 4)) == q->gro.next_seq &&
+           !memcmp(th + 8, tcp + 8, 5) &&
+           !memcmp(th + 20, tcp + 20, hdr_len - l4_off - 20);
+}
+
+/* Turn the held packet into a GSO frame.  This only depends on the held
+ * payload, so it may be repeated when delivery has to be retried.
+ */
+static void virtio_net_gro_finish(VirtIONetQueue *q)
+{
+    struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)q->gro.buf;
+    uint8_t *frame = q->gro.buf + sizeof(*hdr);
+    int frame_len = q->gro.size - sizeof(*hdr);
+    int l4_off = q->gro.l4_off;
+    uint16_t csum;
+
+    if (l4_off == 34) {
+        stw_be_p(frame + 16, frame_len - 14);
+        stw_be_p(frame + 24, 0);
+        stw_be_p(frame + 24, net_checksum_finish(net_checksum_add(20,
+                                                                  frame + 14)));
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    } else {
+        stw_be_p(frame + 18, frame_len - 54);
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    }
+
+    /* The guest completes the checksum from the pseudo header sum */
+    csum = ~net_checksum_finish(virtio_net_gro_pseudo_sum(frame, l4_off,
+                                                          frame_len - l4_off));
+    stw_be_p(frame + l4_off + 16, csum);
+
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->hdr_len = q->gro.hdr_len;
+    hdr->gso_size = q->gro.mss;
+    hdr->csum_start = l4_off;
+    hdr->csum_offset = 16;
+}
+
+/* Deliver the held packet, if any.  Returns 0 if the guest has no room
+ * for it, in which case it stays held until the next attempt.
+ */
+static int virtio_net_gro_flush(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    NetClientState *nc;
+
+    if (!q->gro.size) {
+        return 1;
+    }
+
+    if (q->gro.segs > 1) {
+        virtio_net_gro_finish(q);
+    }
+
+    nc = qemu_get_subqueue(n->nic, vq2q(virtio_queue_get_id(q->rx_vq)));
+    if (virtio_net_receive_one(nc, q->gro.buf, q->gro.size) == 0) {
+        return 0;
+    }
+
+    if (q->gro.segs > 1) {
+        q->gro.packets++;
+        q->gro.segments += q->gro.segs;
+    }
+    q->gro.size = 0;
+    return 1;
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)buf;
+    const uint8_t *frame = buf + sizeof(*hdr);
+    const uint8_t *tcp;
+    int l4_off = 0, hdr_len, end, payload;
+
+    if (!q->gro.buf) {
+        return virtio_net_receive_one(nc, buf, size);
+    }
+
+    /* Segments are only held back within a burst from the backend */
+    if (nc->receive_batched && n->has_vnet_hdr && size > sizeof(*hdr) &&
+        hdr->gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+        uint32_t features = n->vdev.guest_features;
+
+        l4_off = net_gro_parse(frame, size - sizeof(*hdr),
+                               features & (1 << VIRTIO_NET_F_GUEST_TSO4),
+                               features & (1 << VIRTIO_NET_F_GUEST_TSO6),
+                               &hdr_len, &end);
+    }
+    if (l4_off && !(hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+                                  VIRTIO_NET_HDR_F_DATA_VALID)) &&
+        !virtio_net_gro_csum_ok(frame, l4_off, end)) {
+        l4_off = 0;
+    }
+
+    if (l4_off && q->gro.size &&
+        virtio_net_gro_can_merge(q, frame, l4_off, hdr_len, end)) {
+        uint8_t *th = q->gro.buf + sizeof(*hdr) + l4_off;
+
+        tcp = frame + l4_off;
+        payload = end - hdr_len;
+        memcpy(q->gro.buf + q->gro.size, frame + hdr_len, payload);
+        q->gro.size += payload;
+        q->gro.next_seq += payload;
+        q->gro.segs++;
+
+        /* Latest window; PSH or a short segment end the packet */
+        memcpy(th + 14, tcp + 14, 2);
+        th[13] |= tcp[13];
+        if (payload < q->gro.mss || (tcp[13] & TCP_FLAG_PSH)) {
+            virtio_net_gro_flush(q);
+        }
+        return size;
+    }
+
+    if (!virtio_net_gro_flush(q)) {
+        return 0;
+    }
+
+    if (!l4_off || (frame[l4_off + 13] & TCP_FLAG_PSH)) {
+        return virtio_net_receive_one(nc, buf, size);
+    }
+
+    /* Hold this segment as the head of a new packet */
+    tcp = frame + l4_off;
+    memcpy(q->gro.buf, buf, sizeof(*hdr) + end);
+    q->gro.size = sizeof(*hdr) + end;
+    q->gro.l4_off = l4_off;
+    q->gro.hdr_len = hdr_len;
+    q->gro.mss = end - hdr_len;
+    q->gro.next_seq = be32_to_cpupu((uint32_t *)(tcp + 4)) + q->gro.mss;
+    q->gro.segs = 1;
 
     return size;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+
+    virtio_net_gro_flush(q);
+
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = 0;
+        virtio_notify(&n->vdev, q->rx_vq);
+    }
+}
+
+static void virtio_net_print_info(NetClientState *nc, Monitor *mon)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    int i;
+
+    monitor_printf(mon, "    tx: mode=%s%s burst=%d",
+                   virtio_net_tx_mode_names[q->tx_mode],
+                   q->n->tx_adaptive ? " (adaptive)" : "", q->tx_burst);
+    if (q->n->tx_adaptive) {
+        monitor_printf(mon, " switches=%" PRIu64, q->tx_adapt.switches);
+    }
+    monitor_printf(mon, "\n");
+
+    for (i = 0; i < VIRTIO_NET_TX_MODE_MAX; i++) {
+        if (!q->tx_stats[i].flushes) {
+            continue;
+        }
+        monitor_printf(mon, "    tx %s: flushes=%" PRIu64 " packets=%" PRIu64
+                       "\n", virtio_net_tx_mode_names[i],
+                       q->tx_stats[i].flushes, q->tx_stats[i].packets);
+    }
+
+    if (q->gro.buf) {
+        monitor_printf(mon, "    rx gro: packets=%" PRIu64 " segments=%" PRIu64
+                       "\n", q->gro.packets, q->gro.segments);
+    }
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+    virtqueue_push(q->tx_vq, &q->async_tx.elem, q->async_tx.len);
+    virtio_notify(&n->vdev, q->tx_vq);
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+    q->async_tx.elem.out_num = q->async_tx.len = 0;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+
+/* Called at the end of each flush.  In adaptive mode, once a sampling
+ * period is over, pick the flush mode from the packet rate and size the
+ * burst to twice the average number of packets per flush, so that busy
+ * queues are drained with few notifications and idle ones stay fair.
+ */
+static void virtio_net_tx_account(VirtIONetQueue *q, int32_t num_packets)
+{
+    VirtIONet *n = q->n;
+    int64_t now;
+    int mode;
+
+    q->tx_stats[q->tx_mode].packets += num_packets;
+
+    if (!n->tx_adaptive) {
+        return;
+    }
+
+    q->tx_adapt.packets += num_packets;
+    q->tx_adapt.flushes++;
+
+    now = qemu_get_clock_ns(vm_clock);
+    if (now - q->tx_adapt.start < TX_ADAPT_PERIOD) {
+        return;
+    }
+
+    if (q->tx_adapt.packets < TX_ADAPT_LOW) {
+        mode = VIRTIO_NET_TX_IMMEDIATE;
+    } else if (q->tx_adapt.packets < TX_ADAPT_HIGH) {
+        mode = VIRTIO_NET_TX_BH;
+    } else {
+        mode = VIRTIO_NET_TX_TIMER;
+    }
+    if (mode != q->tx_mode) {
+        q->tx_mode = mode;
+        q->tx_adapt.switches++;
+    }
+
+    q->tx_burst = 2 * q->tx_adapt.packets / q->tx_adapt.flushes;
+    q->tx_burst = MAX(q->tx_burst, TX_ADAPT_MIN_BURST);
+    q->tx_burst = MIN(q->tx_burst, n->tx_burst);
+
+    q->tx_adapt.start = now;
+    q->tx_adapt.packets = 0;
+    q->tx_adapt.flushes = 0;
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
+    VirtIONet *n = q->n;
     VirtQueueElement elem;
     int32_t num_packets = 0;
+    int queue_index = vq2q(virtio_queue_get_id(q->tx_vq));
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
     assert(n->vdev.vm_running);
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->async_tx.elem.out_num) {
+        virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(vq, &elem)) {
+    q->tx_stats[q->tx_mode].flushes++;
+
+    while (virtqueue_pop(q->tx_vq, &elem)) {
         ssize_t ret, len = 0;
         unsigned int out_num = elem.out_num;
         struct iovec *out_sg = &elem.out_sg[0];
@@ -747,46 +1290,49 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             len += hdr_len;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
-                                      virtio_net_tx_complete);
+        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                      out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = elem;
+            q->async_tx.len  = len;
+            virtio_net_tx_account(q, num_packets + 1);
             return -EBUSY;
         }
 
         len += ret;
 
-        virtqueue_push(vq, &elem, len);
-        virtio_notify(&n->vdev, vq);
+        virtqueue_push(q->tx_vq, &elem, len);
+        virtio_notify(&n->vdev, q->tx_vq);
 
-        if (++num_packets >= n->tx_burst) {
+        if (++num_packets >= q->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_account(q, num_packets);
     return num_packets;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_queue_get_id(vq))];
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         return;
     }
 
-    if (n->tx_waiting) {
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_waiting = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_waiting = 0;
+        virtio_net_flush_tx(q);
     } else {
-        qemu_mod_timer(n->tx_timer,
+        qemu_mod_timer(q->tx_timer,
                        qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -794,74 +1340,170 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_queue_get_id(vq))];
 
-    if (unlikely(n->tx_waiting)) {
+    if (unlikely(q->tx_waiting)) {
         return;
     }
-    n->tx_waiting = 1;
+    q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(n->tx_bh);
+    qemu_bh_schedule(q->tx_bh);
+}
+
+static void virtio_net_handle_tx_immediate(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_queue_get_id(vq))];
+    int32_t ret;
+
+    /* A flush is already pending, let it pick up the new packets */
+    if (q->tx_waiting) {
+        return;
+    }
+    /* This happens when device was stopped but VCPU wasn't. */
+    if (!n->vdev.vm_running) {
+        q->tx_waiting = 1;
+        return;
+    }
+
+    ret = virtio_net_flush_tx(q);
+    if (ret >= q->tx_burst) {
+        /* Leave the rest to the bottom half */
+        virtio_queue_set_notification(vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+    }
+}
+
+static void virtio_net_handle_tx_adaptive(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_queue_get_id(vq))];
+
+    switch (q->tx_mode) {
+    case VIRTIO_NET_TX_IMMEDIATE:
+        virtio_net_handle_tx_immediate(vdev, vq);
+        break;
+    case VIRTIO_NET_TX_TIMER:
+        virtio_net_handle_tx_timer(vdev, vq);
+        break;
+    default:
+        virtio_net_handle_tx_bh(vdev, vq);
+        break;
+    }
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 static void virtio_net_tx_bh(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     int32_t ret;
 
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (unlikely(!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)))
         return;
 
-    ret = virtio_net_flush_tx(n, n->tx_vq);
+    ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    if (ret >= q->tx_burst) {
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
         return;
     }
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(n->tx_vq, 1);
-    if (virtio_net_flush_tx(n, n->tx_vq) > 0) {
-        virtio_queue_set_notification(n->tx_vq, 0);
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
     }
 }
 
+static void virtio_net_add_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    q->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    if (n->tx_adaptive) {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256,
+                                    virtio_net_handle_tx_adaptive);
+    } else if (q->tx_timer) {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
+    } else {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
+    }
+}
+
+/* Without VIRTIO_NET_F_MQ the control queue follows the first pair; with
+ * it all pairs come first, so lay out everything after tx0 again.
+ */
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
+{
+    int i, max = multiqueue ? n->max_queues : 1;
+
+    n->multiqueue = multiqueue;
+
+    for (i = 1; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        /* the packet of async_tx may still sit in the peer's queue, and
+         * its completion would push an element of a deleted virtqueue
+         */
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        virtio_net_tx_cancel(q);
+        q->tx_waiting = 0;
+        q->async_tx.elem.out_num = q->async_tx.len = 0;
+    }
+
+    for (i = 2; i < n->max_queues * 2 + 1; i++) {
+        virtio_del_queue(&n->vdev, i);
+    }
+
+    for (i = 1; i < max; i++) {
+        virtio_net_add_queue(n, i);
+    }
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+
+    n->curr_queues = 1;
+    virtio_net_set_queues(n);
+}
+
 static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
+    int i;
 
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
@@ -869,7 +1511,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_waiting);
+    qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -885,6 +1527,14 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+
+    if (n->max_queues > 1) {
+        qemu_put_be16(f, n->max_queues);
+        qemu_put_be16(f, n->curr_queues);
+        for (i = 1; i < n->curr_queues; i++) {
+            qemu_put_be32(f, n->vqs[i].tx_waiting);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -902,7 +1552,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_waiting = qemu_get_be32(f);
+    n->vqs[0].tx_waiting = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -941,13 +1591,8 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (n->has_vnet_hdr) {
-            tap_using_vnet_hdr(n->nic->nc.peer, 1);
-            tap_set_offload(n->nic->nc.peer,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+            peer_using_vnet_hdr(n, 1);
+            peer_set_offload(n, n->vdev.guest_features);
         }
     }
 
@@ -970,6 +1615,27 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (n->max_queues > 1) {
+        if (qemu_get_be16(f) != n->max_queues) {
+            error_report("virtio-net: saved image has a different number "
+                         "of queues");
+            return -1;
+        }
+
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues > n->max_queues) {
+            error_report("virtio-net: invalid number of queues in use: %d",
+                         n->curr_queues);
+            return -1;
+        }
+        for (i = 1; i < n->curr_queues; i++) {
+            n->vqs[i].tx_waiting = qemu_get_be32(f);
+        }
+        if (virtio_net_set_queues(n) < 0) {
+            return -1;
+        }
+    }
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -977,6 +1643,11 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
     n->mac_table.first_multi = i;
+
+    /* vm_clock jumps to the source's time */
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_tx_adapt_reset(&n->vqs[i]);
+    }
     return 0;
 }
 
@@ -984,7 +1655,9 @@ static void virtio_net_cleanup(NetClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
 
-    n->nic = NULL;
+    if (nc->queue_index == 0) {
+        n->nic = NULL;
+    }
 }
 
 static NetClientInfo net_virtio_info = {
@@ -992,14 +1665,23 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
-        .cleanup = virtio_net_cleanup,
+    .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
+    .receive_batch_end = virtio_net_receive_batch_end,
+    .print_info = virtio_net_print_info,
 };
 
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               virtio_net_conf *net)
 {
     VirtIONet *n;
+    int i;
+
+    if (net->queues < 1 || net->queues > MAX_QUEUE_NUM) {
+        error_report("virtio-net: queues must be between 1 and %d",
+                     MAX_QUEUE_NUM);
+        return NULL;
+    }
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
                                         sizeof(struct virtio_net_config),
@@ -1012,34 +1694,65 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
 
-    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
-        error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
+    qemu_macaddr_default_if_unset(&conf->macaddr);
+    memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
+    n->status = VIRTIO_NET_S_LINK_UP;
+
+    n->nic = qemu_new_nic_mq(&net_virtio_info, conf,
+                             object_get_typename(OBJECT(dev)), dev->id, n,
+                             net->queues);
+    n->max_queues = n->nic->queues;
+    n->curr_queues = 1;
+
+    /* max_virtqueue_pairs only exists with VIRTIO_NET_F_MQ; keep the old
+     * layout otherwise, so that single queue devices look and migrate
+     * as before.
+     */
+    if (n->max_queues > 1) {
+        n->config_size = sizeof(struct virtio_net_config);
+    } else {
+        n->config_size = offsetof(struct virtio_net_config,
+                                  max_virtqueue_pairs);
+    }
+    n->vdev.config_len = n->config_size;
+
+    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh") &&
+        strcmp(net->tx, "adaptive")) {
+        error_report("virtio-net: Unknown option tx=%s, "
+                     "valid options: \"timer\" \"bh\" \"adaptive\"",
                      net->tx);
         error_report("Defaulting to \"bh\"");
     }
 
-    if (net->tx && !strcmp(net->tx, "timer")) {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
-        n->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, n);
-        n->tx_timeout = net->txtimer;
-    } else {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
-        n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
+    n->tx_adaptive = net->tx && !strcmp(net->tx, "adaptive");
+    n->tx_timeout = net->txtimer;
+    n->tx_burst = net->txburst;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (n->tx_adaptive || (net->tx && !strcmp(net->tx, "timer"))) {
+            q->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, q);
+        }
+        if (n->tx_adaptive || !q->tx_timer) {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        q->tx_mode = q->tx_bh ? VIRTIO_NET_TX_BH : VIRTIO_NET_TX_TIMER;
+        if (net->gro) {
+            q->gro.buf = g_malloc(VIRTIO_NET_MAX_BUFSIZE);
+        }
+        q->tx_burst = n->tx_burst;
+        virtio_net_tx_adapt_reset(q);
+        q->tx_waiting = 0;
+        q->n = n;
     }
-    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
-    qemu_macaddr_default_if_unset(&conf->macaddr);
-    memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
-    n->status = VIRTIO_NET_S_LINK_UP;
 
-    n->nic = qemu_new_nic(&net_virtio_info, conf, object_get_typename(OBJECT(dev)), dev->id, n);
+    virtio_net_add_queue(n, 0);
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
 
     qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
 
-    n->tx_waiting = 0;
-    n->tx_burst = net->txburst;
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
 
@@ -1059,22 +1772,29 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    int i;
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
-
     unregister_savevm(n->qdev, "virtio-net", n);
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
 
-    if (n->tx_timer) {
-        qemu_del_timer(n->tx_timer);
-        qemu_free_timer(n->tx_timer);
-    } else {
-        qemu_bh_delete(n->tx_bh);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+
+        if (q->tx_timer) {
+            qemu_del_timer(q->tx_timer);
+            qemu_free_timer(q->tx_timer);
+        }
+        if (q->tx_bh) {
+            qemu_bh_delete(q->tx_bh);
+        }
+        g_free(q->gro.buf);
     }
 
     qemu_del_net_client(&n->nic->nc);
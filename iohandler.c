@@ -27,6 +27,7 @@
 #include "qemu-char.h"
 #include "qemu-queue.h"
 #include "main-loop.h"
+#include "qemu-poll.h"
 
 #ifndef _WIN32
 #include <sys/wait.h>
@@ -37,14 +38,72 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_read;
     IOHandler *fd_write;
     void *opaque;
+    QEMUPollWatch *watch;
     QLIST_ENTRY(IOHandlerRecord) next;
     int fd;
     bool deleted;
 } IOHandlerRecord;
 
-static QLIST_HEAD(, IOHandlerRecord) io_handlers =
-    QLIST_HEAD_INITIALIZER(io_handlers);
+/*
+ * Handlers stay registered in one poll set and are looked up by fd, so
+ * the cost of an iteration depends on the number of ready descriptors.
+ * Only handlers with an fd_read_poll callback must be looked at before
+ * every wait.
+ */
+static QEMUPoll *io_poll;
+static GHashTable *io_handlers;
+static QLIST_HEAD(, IOHandlerRecord) io_handlers_polled =
+    QLIST_HEAD_INITIALIZER(io_handlers_polled);
+static QLIST_HEAD(, IOHandlerRecord) io_handlers_deleted =
+    QLIST_HEAD_INITIALIZER(io_handlers_deleted);
+static int io_handlers_walking;
+
+QEMUPoll *qemu_iohandler_get_poll(void)
+{
+    if (!io_poll) {
+        io_poll = qemu_poll_new();
+        io_handlers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    return io_poll;
+}
 
+static void qemu_iohandler_event(void *opaque, int revents)
+{
+    IOHandlerRecord *ioh = opaque;
+
+    /* like select(), report errors and hangups as readiness */
+    if (!ioh->deleted && ioh->fd_read &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+        ioh->fd_read(ioh->opaque);
+    }
+    if (!ioh->deleted && ioh->fd_write &&
+        (revents & (G_IO_OUT | G_IO_HUP | G_IO_ERR))) {
+        ioh->fd_write(ioh->opaque);
+    }
+}
+
+static int qemu_iohandler_events(IOHandlerRecord *ioh)
+{
+    int events = 0;
+
+    if (ioh->fd_read &&
+        (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque) != 0)) {
+        events |= G_IO_IN;
+    }
+    if (ioh->fd_write) {
+        events |= G_IO_OUT;
+    }
+    return events;
+}
+
+static void qemu_iohandler_free(IOHandlerRecord *ioh)
+{
+    if (io_handlers_walking) {
+        QLIST_INSERT_HEAD(&io_handlers_deleted, ioh, next);
+    } else {
+        g_free(ioh);
+    }
+}
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -54,29 +113,38 @@ int qemu_set_fd_handler2(int fd,
                          IOHandler *fd_write,
                          void *opaque)
 {
+    QEMUPoll *qpoll = qemu_iohandler_get_poll();
     IOHandlerRecord *ioh;
 
+    ioh = g_hash_table_lookup(io_handlers, GINT_TO_POINTER(fd));
     if (!fd_read && !fd_write) {
-        QLIST_FOREACH(ioh, &io_handlers, next) {
-            if (ioh->fd == fd) {
-                ioh->deleted = 1;
-                break;
+        if (ioh) {
+            g_hash_table_remove(io_handlers, GINT_TO_POINTER(fd));
+            if (ioh->fd_read_poll) {
+                QLIST_REMOVE(ioh, next);
             }
+            qemu_poll_remove(qpoll, ioh->watch);
+            ioh->deleted = 1;
+            qemu_iohandler_free(ioh);
         }
     } else {
-        QLIST_FOREACH(ioh, &io_handlers, next) {
-            if (ioh->fd == fd)
-                goto found;
+        if (!ioh) {
+            ioh = g_malloc0(sizeof(IOHandlerRecord));
+            ioh->fd = fd;
+            ioh->watch = qemu_poll_add(qpoll, fd, 0, qemu_iohandler_event,
+                                       ioh);
+            g_hash_table_insert(io_handlers, GINT_TO_POINTER(fd), ioh);
+        } else if (ioh->fd_read_poll) {
+            QLIST_REMOVE(ioh, next);
         }
-        ioh = g_malloc0(sizeof(IOHandlerRecord));
-        QLIST_INSERT_HEAD(&io_handlers, ioh, next);
-    found:
-        ioh->fd = fd;
         ioh->fd_read_poll = fd_read_poll;
         ioh->fd_read = fd_read;
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
-        ioh->deleted = 0;
+        if (fd_read_poll) {
+            QLIST_INSERT_HEAD(&io_handlers_polled, ioh, next);
+        }
+        qemu_poll_modify(qpoll, ioh->watch, qemu_iohandler_events(ioh));
     }
     return 0;
 }
@@ -89,43 +157,26 @@ int qemu_set_fd_handler(int fd,
     return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
 }
 
-void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds)
+void qemu_iohandler_fill(void)
 {
     IOHandlerRecord *ioh;
 
-    QLIST_FOREACH(ioh, &io_handlers, next) {
-        if (ioh->deleted)
-            continue;
-        if (ioh->fd_read &&
-            (!ioh->fd_read_poll ||
-             ioh->fd_read_poll(ioh->opaque) != 0)) {
-            FD_SET(ioh->fd, readfds);
-            if (ioh->fd > *pnfds)
-                *pnfds = ioh->fd;
-        }
-        if (ioh->fd_write) {
-            FD_SET(ioh->fd, writefds);
-            if (ioh->fd > *pnfds)
-                *pnfds = ioh->fd;
-        }
+    QLIST_FOREACH(ioh, &io_handlers_polled, next) {
+        qemu_poll_modify(io_poll, ioh->watch, qemu_iohandler_events(ioh));
     }
 }
 
-void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int ret)
+void qemu_iohandler_poll(int ret)
 {
-    if (ret > 0) {
-        IOHandlerRecord *pioh, *ioh;
+    IOHandlerRecord *ioh, *pioh;
 
-        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
-            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, readfds)) {
-                ioh->fd_read(ioh->opaque);
-            }
-            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, writefds)) {
-                ioh->fd_write(ioh->opaque);
-            }
+    if (ret > 0) {
+        io_handlers_walking++;
+        qemu_poll_dispatch(io_poll);
+        io_handlers_walking--;
 
-            /* Do this last in case read/write handlers marked it for deletion */
-            if (ioh->deleted) {
+        if (!io_handlers_walking) {
+            QLIST_FOREACH_SAFE(ioh, &io_handlers_deleted, next, pioh) {
                 QLIST_REMOVE(ioh, next);
                 g_free(ioh);
             }
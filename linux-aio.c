@@ -10,6 +10,7 @@
 #include "qemu-common.h"
 #include "qemu-aio.h"
 #include "block/raw-posix-aio.h"
+#include "trace.h"
 
 #include <sys/eventfd.h>
 #include <libaio.h>
@@ -18,12 +19,17 @@
  * Queue size (per-device).
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ *      tunable by the guest.  Requests beyond this many outstanding ones
+ *      wait in the io queue until earlier ones complete.
  */
 #define MAX_EVENTS 128
 
+/*
+ * Maximum number of requests that are collected while the queue is plugged
+ * before they are pushed to the kernel with a single io_submit.
+ */
+#define MAX_QUEUED_IO  128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -33,12 +39,32 @@ struct qemu_laiocb {
     QEMUIOVector *qiov;
     bool is_read;
     QLIST_ENTRY(qemu_laiocb) node;
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
+typedef struct {
+    QSIMPLEQ_HEAD(laiocb_list, qemu_laiocb) pending; /* not submitted yet */
+    unsigned int in_queue;
+    int plugged;
+    bool blocked;           /* the kernel is full, retry on completion */
+
+    /* statistics, the average batch depth is nr_iocbs / nr_batches */
+    uint64_t nr_batches;
+    uint64_t nr_iocbs;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
-    int count;
+    int count;              /* requests not completed yet */
+    int in_flight;          /* requests submitted to the kernel */
+
+    /* io queue for submit at batch */
+    LaioQueue io_q;
+
+    /* requests that io_submit refused, completed from completion_bh */
+    struct laiocb_list failed;
+    QEMUBH *completion_bh;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -46,6 +72,8 @@ static inline ssize_t io_event_ret(struct io_event *ev)
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
 }
 
+static void ioq_submit(struct qemu_laio_state *s);
+
 /*
  * Completes an AIO request (calls the callback and frees the ACB).
  */
@@ -106,10 +134,27 @@ static void qemu_laio_completion_cb(void *opaque)
             struct qemu_laiocb *laiocb =
                     container_of(iocb, struct qemu_laiocb, iocb);
 
+            s->in_flight--;
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_process_completion(s, laiocb);
         }
     }
+
+    /* the kernel has room again for the requests it refused */
+    if (s->io_q.blocked) {
+        ioq_submit(s);
+    }
+}
+
+static void qemu_laio_completion_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb;
+
+    while ((laiocb = QSIMPLEQ_FIRST(&s->failed)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
+        qemu_laio_process_completion(s, laiocb);
+    }
 }
 
 static int qemu_laio_flush_cb(void *opaque)
@@ -119,15 +164,170 @@ static int qemu_laio_flush_cb(void *opaque)
     return (s->count > 0) ? 1 : 0;
 }
 
+static void ioq_init(LaioQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->in_queue = 0;
+    io_q->plugged = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Fails the first queued request with @ret.  Its completion is deferred to
+ * a bottom half: ioq_submit() runs inside laio_submit() and unplug, whose
+ * callers do not expect the callback, let alone the ACB to be gone, before
+ * they return.
+ */
+static void ioq_fail_first(struct qemu_laio_state *s, int ret)
+{
+    struct qemu_laiocb *laiocb = QSIMPLEQ_FIRST(&s->io_q.pending);
+
+    QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+    s->io_q.in_queue--;
+    laiocb->ret = ret;
+    QSIMPLEQ_INSERT_TAIL(&s->failed, laiocb, next);
+    qemu_bh_schedule(s->completion_bh);
+}
+
+/*
+ * Passes the queued requests to the kernel, MAX_QUEUED_IO at a time.  Those
+ * it does not accept for lack of room stay queued, in order, and are
+ * retried when a request completes.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    struct qemu_laiocb *laiocb;
+    int ret, i, len;
+
+    s->io_q.blocked = false;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        len = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->io_q.pending, next) {
+            iocbs[len++] = &laiocb->iocb;
+            if (len == MAX_QUEUED_IO) {
+                break;
+            }
+        }
+
+        ret = io_submit(s->ctx, len, iocbs);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret == -EAGAIN || ret == 0) {
+            if (s->in_flight == 0) {
+                /* no completion is coming that could make room */
+                ioq_fail_first(s, -EAGAIN);
+                continue;
+            }
+            s->io_q.blocked = true;
+            break;
+        }
+        if (ret < 0) {
+            /* only the first iocb was looked at */
+            ioq_fail_first(s, ret);
+            continue;
+        }
+
+        s->io_q.nr_batches++;
+        s->io_q.nr_iocbs += ret;
+        trace_laio_submit_batch(s, len, ret, s->io_q.nr_batches,
+                                s->io_q.nr_iocbs);
+
+        for (i = 0; i < ret; i++) {
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        }
+        s->io_q.in_queue -= ret;
+        s->in_flight += ret;
+
+        if (ret < len) {
+            s->io_q.blocked = true;
+            break;
+        }
+    }
+}
+
+static void ioq_enqueue(struct qemu_laio_state *s, struct qemu_laiocb *laiocb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
+    s->io_q.in_queue++;
+
+    /*
+     * Submit now unless plugged, or once a full batch is queued; while the
+     * kernel is full the request waits behind the others.
+     */
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_QUEUED_IO)) {
+        ioq_submit(s);
+    }
+}
+
+static bool laiocb_remove(struct qemu_laiocb *laiocb,
+                          struct laiocb_list *list)
+{
+    struct qemu_laiocb *p;
+
+    QSIMPLEQ_FOREACH(p, list, next) {
+        if (p == laiocb) {
+            QSIMPLEQ_REMOVE(list, laiocb, qemu_laiocb, next);
+            return true;
+        }
+    }
+    return false;
+}
+
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+int laio_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return 0;
+    }
+
+    if (!s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
     int ret;
 
+    /* io_submit refused it, and the completion is still pending */
+    if (laiocb_remove(laiocb, &s->failed)) {
+        qemu_laio_process_completion(s, laiocb);
+        return;
+    }
+
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /*
+     * The request may still sit in the queue, in which case the kernel
+     * does not know about it yet and it can simply be dropped.
+     */
+    if (laiocb_remove(laiocb, &s->io_q.pending)) {
+        s->io_q.in_queue--;
+        laiocb->ret = -ECANCELED;
+        qemu_laio_process_completion(s, laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -135,6 +335,7 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
      */
     ret = io_cancel(laiocb->ctx->ctx, &laiocb->iocb, &event);
     if (ret == 0) {
+        s->in_flight--;
         laiocb->ret = -ECANCELED;
         return;
     }
@@ -189,17 +390,31 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    ioq_enqueue(s, laiocb);
     return &laiocb->common;
 
-out_dec_count:
-    s->count--;
 out_free_aiocb:
     qemu_aio_release(laiocb);
     return NULL;
 }
 
+void laio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_fd_handler(old_context, s->efd, NULL, NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void laio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
+    aio_set_fd_handler(new_context, s->efd, qemu_laio_completion_cb, NULL,
+                       qemu_laio_flush_cb, s);
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -213,6 +428,10 @@ void *laio_init(void)
     if (io_setup(MAX_EVENTS, &s->ctx) != 0)
         goto out_close_efd;
 
+    ioq_init(&s->io_q);
+    QSIMPLEQ_INIT(&s->failed);
+    s->completion_bh = qemu_bh_new(qemu_laio_completion_bh, s);
+
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, s);
 
@@ -26,12 +26,14 @@
 #include "qemu-timer.h"
 #include "slirp/slirp.h"
 #include "main-loop.h"
+#include "qemu-poll.h"
 
 #ifndef _WIN32
 
 #include "compatfd.h"
 
 static int io_thread_fd = -1;
+static int io_thread_notify_pending;
 
 void qemu_notify_event(void)
 {
@@ -42,6 +44,14 @@ void qemu_notify_event(void)
     if (io_thread_fd == -1) {
         return;
     }
+
+    /* Bottom halves and vCPUs kick the main loop all the time; until it
+     * has woken up, one pending wakeup is enough for all of them.
+     */
+    if (!g_atomic_int_compare_and_exchange(&io_thread_notify_pending, 0, 1)) {
+        return;
+    }
+
     do {
         ret = write(io_thread_fd, &val, sizeof(val));
     } while (ret < 0 && errno == EINTR);
@@ -64,6 +74,9 @@ static void qemu_event_read(void *opaque)
     do {
         len = read(fd, buffer, sizeof(buffer));
     } while ((len == -1 && errno == EINTR) || len == sizeof(buffer));
+
+    /* Allow new wakeups only after draining, see aio_notify_read() */
+    g_atomic_int_compare_and_exchange(&io_thread_notify_pending, 1, 0);
 }
 
 static int qemu_event_init(void)
@@ -218,103 +231,112 @@ int main_loop_init(void)
     return 0;
 }
 
-static fd_set rfds, wfds, xfds;
-static int nfds;
-static GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
-static int n_poll_fds;
+#ifndef _WIN32
+/*
+ * glib's descriptors are registered in the iohandler poll set too.  glib
+ * hands out the whole list on every iteration; it rarely changes, so the
+ * registrations are only redone when it does.
+ */
+static GPollFD *poll_fds, *poll_fds_query;
+static int n_poll_fds, poll_fds_size;
+static QEMUPollWatch **poll_fd_watches;
 static int max_priority;
 
-#ifndef _WIN32
-static void glib_select_fill(int *max_fd, fd_set *rfds, fd_set *wfds,
-                             fd_set *xfds, uint32_t *cur_timeout)
+static void glib_pollfd_event(void *opaque, int revents)
+{
+    GPollFD *p = &poll_fds[(intptr_t)opaque];
+
+    p->revents |= revents;
+}
+
+static void glib_pollfds_fill(int64_t *cur_timeout)
 {
     GMainContext *context = g_main_context_default();
-    int i;
+    QEMUPoll *qpoll = qemu_iohandler_get_poll();
+    GPollFD *tmp;
     int timeout = 0;
+    int i, n;
 
     g_main_context_prepare(context, &max_priority);
 
-    n_poll_fds = g_main_context_query(context, max_priority, &timeout,
-                                      poll_fds, ARRAY_SIZE(poll_fds));
-    g_assert(n_poll_fds <= ARRAY_SIZE(poll_fds));
-
-    for (i = 0; i < n_poll_fds; i++) {
-        GPollFD *p = &poll_fds[i];
+    /* g_main_context_query returns the size it needs if the array is short */
+    while ((n = g_main_context_query(context, max_priority, &timeout,
+                                     poll_fds_query, poll_fds_size)) >
+           poll_fds_size) {
+        poll_fds_size = n;
+        poll_fds = g_renew(GPollFD, poll_fds, n);
+        poll_fds_query = g_renew(GPollFD, poll_fds_query, n);
+        poll_fd_watches = g_renew(QEMUPollWatch *, poll_fd_watches, n);
+    }
 
-        if ((p->events & G_IO_IN)) {
-            FD_SET(p->fd, rfds);
-            *max_fd = MAX(*max_fd, p->fd);
+    for (i = 0; i < n && i < n_poll_fds; i++) {
+        if (poll_fds_query[i].fd != poll_fds[i].fd ||
+            poll_fds_query[i].events != poll_fds[i].events) {
+            break;
         }
-        if ((p->events & G_IO_OUT)) {
-            FD_SET(p->fd, wfds);
-            *max_fd = MAX(*max_fd, p->fd);
+    }
+
+    if (i < n || n != n_poll_fds) {
+        for (i = 0; i < n_poll_fds; i++) {
+            qemu_poll_remove(qpoll, poll_fd_watches[i]);
         }
-        if ((p->events & G_IO_ERR)) {
-            FD_SET(p->fd, xfds);
-            *max_fd = MAX(*max_fd, p->fd);
+        tmp = poll_fds;
+        poll_fds = poll_fds_query;
+        poll_fds_query = tmp;
+        n_poll_fds = n;
+        for (i = 0; i < n_poll_fds; i++) {
+            poll_fd_watches[i] = qemu_poll_add(qpoll, poll_fds[i].fd,
+                                               poll_fds[i].events,
+                                               glib_pollfd_event,
+                                               (void *)(intptr_t)i);
         }
     }
 
-    if (timeout >= 0 && timeout < *cur_timeout) {
-        *cur_timeout = timeout;
+    for (i = 0; i < n_poll_fds; i++) {
+        poll_fds[i].revents = 0;
+    }
+
+    if (timeout >= 0) {
+        *cur_timeout = qemu_soonest_timeout(*cur_timeout,
+                                            (int64_t)timeout * SCALE_MS);
     }
 }
 
-static void glib_select_poll(fd_set *rfds, fd_set *wfds, fd_set *xfds,
-                             bool err)
+static void glib_pollfds_poll(void)
 {
     GMainContext *context = g_main_context_default();
 
-    if (!err) {
-        int i;
-
-        for (i = 0; i < n_poll_fds; i++) {
-            GPollFD *p = &poll_fds[i];
-
-            if ((p->events & G_IO_IN) && FD_ISSET(p->fd, rfds)) {
-                p->revents |= G_IO_IN;
-            }
-            if ((p->events & G_IO_OUT) && FD_ISSET(p->fd, wfds)) {
-                p->revents |= G_IO_OUT;
-            }
-            if ((p->events & G_IO_ERR) && FD_ISSET(p->fd, xfds)) {
-                p->revents |= G_IO_ERR;
-            }
-        }
-    }
-
     if (g_main_context_check(context, max_priority, poll_fds, n_poll_fds)) {
         g_main_context_dispatch(context);
     }
 }
 
-static int os_host_main_loop_wait(uint32_t timeout)
+static int os_host_main_loop_wait(int64_t timeout)
 {
-    struct timeval tv, *tvarg = NULL;
     int ret;
 
-    glib_select_fill(&nfds, &rfds, &wfds, &xfds, &timeout);
-
-    if (timeout < UINT32_MAX) {
-        tvarg = &tv;
-        tv.tv_sec = timeout / 1000;
-        tv.tv_usec = (timeout % 1000) * 1000;
-    }
+    glib_pollfds_fill(&timeout);
 
-    if (timeout > 0) {
+    if (timeout != 0) {
         qemu_mutex_unlock_iothread();
     }
 
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, tvarg);
+    ret = qemu_poll_wait(qemu_iohandler_get_poll(), timeout);
 
-    if (timeout > 0) {
+    if (timeout != 0) {
         qemu_mutex_lock_iothread();
     }
 
-    glib_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+    /* this also records the revents of glib's descriptors */
+    qemu_iohandler_poll(ret);
+    glib_pollfds_poll();
     return ret;
 }
 #else
+static GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
+static int n_poll_fds;
+static int max_priority;
+
 /***********************************************************/
 /* Polling handling */
 
@@ -404,14 +426,14 @@ void qemu_fd_register(int fd)
                    FD_CONNECT | FD_WRITE | FD_OOB);
 }
 
-static int os_host_main_loop_wait(uint32_t timeout)
+static int os_host_main_loop_wait(int64_t timeout)
 {
     GMainContext *context = g_main_context_default();
     int ret, i;
     PollingEntry *pe;
     WaitObjects *w = &wait_objects;
     gint poll_timeout;
-    static struct timeval tv0;
+    int io_ret;
 
     /* XXX: need to suppress polling by better using win32 events */
     ret = 0;
@@ -422,11 +444,9 @@ static int os_host_main_loop_wait(uint32_t timeout)
         return ret;
     }
 
-    if (nfds >= 0) {
-        ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv0);
-        if (ret != 0) {
-            timeout = 0;
-        }
+    io_ret = qemu_poll_wait(qemu_iohandler_get_poll(), 0);
+    if (io_ret != 0) {
+        timeout = 0;
     }
 
     g_main_context_prepare(context, &max_priority);
@@ -439,8 +459,14 @@ static int os_host_main_loop_wait(uint32_t timeout)
         poll_fds[n_poll_fds + i].events = G_IO_IN;
     }
 
-    if (poll_timeout < 0 || timeout < poll_timeout) {
-        poll_timeout = timeout;
+    if (timeout >= 0) {
+        /* g_poll() only has millisecond resolution; do not wake up early */
+        int64_t timeout_ms = MIN((timeout + SCALE_MS - 1) / SCALE_MS,
+                                 INT_MAX);
+
+        if (poll_timeout < 0 || timeout_ms < poll_timeout) {
+            poll_timeout = timeout_ms;
+        }
     }
 
     qemu_mutex_unlock_iothread();
@@ -457,6 +483,8 @@ static int os_host_main_loop_wait(uint32_t timeout)
         }
     }
 
+    qemu_iohandler_poll(io_ret);
+
     if (g_main_context_check(context, max_priority, poll_fds, n_poll_fds)) {
         g_main_context_dispatch(context);
     }
@@ -474,30 +502,21 @@ int main_loop_wait(int nonblocking)
 {
     int ret;
     uint32_t timeout = UINT32_MAX;
+    int64_t timeout_ns = 0;
 
-    if (nonblocking) {
-        timeout = 0;
-    } else {
+    if (!nonblocking) {
         qemu_bh_update_timeout(&timeout);
+        timeout_ns = timeout == UINT32_MAX ? -1 : (int64_t)timeout * SCALE_MS;
+
+        /* timers are run below, wake up in time for the first one */
+        timeout_ns = qemu_soonest_timeout(timeout_ns,
+                                          qemu_clock_deadline_ns_all());
     }
 
     /* poll any events */
     /* XXX: separate device handlers from system ones */
-    nfds = -1;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&xfds);
-
-#ifdef CONFIG_SLIRP
-    slirp_update_timeout(&timeout);
-    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
-#endif
-    qemu_iohandler_fill(&nfds, &rfds, &wfds, &xfds);
-    ret = os_host_main_loop_wait(timeout);
-    qemu_iohandler_poll(&rfds, &wfds, &xfds, ret);
-#ifdef CONFIG_SLIRP
-    slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
-#endif
+    qemu_iohandler_fill();
+    ret = os_host_main_loop_wait(timeout_ns);
 
     qemu_run_all_timers();
 
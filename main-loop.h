@@ -25,6 +25,8 @@
 #ifndef QEMU_MAIN_LOOP_H
 #define QEMU_MAIN_LOOP_H 1
 
+#include "qemu-poll.h"
+
 #define SIG_IPI SIGUSR1
 
 /**
@@ -276,6 +278,11 @@ QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque);
  * invoked.  This can create an infinite loop if a bottom half handler
  * schedules itself.
  *
+ * Any thread may schedule a bottom half, without holding the iothread
+ * mutex.  Memory writes made before qemu_bh_schedule are visible to the
+ * callback.  Schedules that happen before the callback runs are coalesced
+ * into a single invocation and a single wakeup of the loop.
+ *
  * @bh: The bottom half to be scheduled.
  */
 void qemu_bh_schedule(QEMUBH *bh);
@@ -356,8 +363,9 @@ void qemu_mutex_unlock_iothread(void);
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
-void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds);
-void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int rc);
+QEMUPoll *qemu_iohandler_get_poll(void);
+void qemu_iohandler_fill(void);
+void qemu_iohandler_poll(int rc);
 
 void qemu_bh_schedule_idle(QEMUBH *bh);
 int qemu_bh_poll(void);
@@ -44,6 +44,7 @@
 #include "disas.h"
 #include "balloon.h"
 #include "qemu-timer.h"
+#include "qemu-coroutine.h"
 #include "migration.h"
 #include "kvm.h"
 #include "acl.h"
@@ -455,6 +456,7 @@ static const char *monitor_event_names[] = {
     [QEVENT_SUSPEND_DISK] = "SUSPEND_DISK",
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
+    [QEVENT_BLOCK_STATS] = "BLOCK_STATS",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -2109,6 +2111,33 @@ static void do_info_profile(Monitor *mon)
 }
 #endif
 
+static void do_info_timers(Monitor *mon)
+{
+    qemu_timer_dump_latency((FILE *)mon, monitor_fprintf);
+}
+
+static void do_info_lockstats(Monitor *mon)
+{
+    qemu_co_lock_stats_dump((FILE *)mon, monitor_fprintf);
+}
+
+static void do_info_coroutines(Monitor *mon)
+{
+    CoroutinePoolStats stats;
+    uint64_t total;
+
+    qemu_coroutine_get_pool_stats(&stats);
+    total = stats.hits + stats.misses;
+
+    monitor_printf(mon, "pool: %u coroutines in %u threads, "
+                   "at most %u per thread\n",
+                   stats.size, stats.threads, stats.max_size);
+    monitor_printf(mon, "created: %" PRIu64 ", %" PRIu64 " from the pool "
+                   "(%.1f%%), %" PRIu64 " allocated\n",
+                   total, stats.hits,
+                   total ? stats.hits * 100.0 / total : 0.0, stats.misses);
+}
+
 /* Capture support */
 static QLIST_HEAD (capture_list_head, CaptureState) capture_head;
 
@@ -2826,6 +2855,27 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show profiling information",
         .mhandler.info = do_info_profile,
     },
+    {
+        .name       = "timers",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show how late timers fired",
+        .mhandler.info = do_info_timers,
+    },
+    {
+        .name       = "lockstats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show contention on coroutine locks",
+        .mhandler.info = do_info_lockstats,
+    },
+    {
+        .name       = "coroutines",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show coroutine pool statistics",
+        .mhandler.info = do_info_coroutines,
+    },
     {
         .name       = "capture",
         .args_type  = "",
@@ -43,6 +43,7 @@ typedef enum MonitorEvent {
     QEVENT_SUSPEND_DISK,
     QEVENT_WAKEUP,
     QEVENT_BALLOON_CHANGE,
+    QEVENT_BLOCK_STATS,
 
     /* Add to 'monitor_event_names' array in monitor.c when
      * defining new events here */
@@ -31,6 +31,8 @@
 #include "net/slirp.h"
 #include "net/vde.h"
 #include "net/hub.h"
+#include "net/vhost-user.h"
+#include "net/shm.h"
 #include "net/util.h"
 #include "monitor.h"
 #include "qemu-common.h"
@@ -232,10 +234,71 @@ NICState *qemu_new_nic(NetClientInfo *info,
     nic = DO_UPCAST(NICState, nc, nc);
     nic->conf = conf;
     nic->opaque = opaque;
+    nic->queues = 1;
 
     return nic;
 }
 
+/**
+ * Create a NIC with up to @max_queues queues
+ *
+ * Queue 0 is connected to conf->peer.  A multiqueue backend registers one
+ * net client per queue, all under the same name, and each of the remaining
+ * ones becomes the peer of another queue.  Every queue is a NICState of its
+ * own that shares @info, @conf and @opaque with queue 0, so the NIC's
+ * callbacks find the queue through nc->queue_index.
+ */
+NICState *qemu_new_nic_mq(NetClientInfo *info,
+                          NICConf *conf,
+                          const char *model,
+                          const char *name,
+                          void *opaque,
+                          unsigned int max_queues)
+{
+    NetClientState *peers[MAX_QUEUE_NUM];
+    NICState *nic;
+    int i, num_peers;
+
+    nic = qemu_new_nic(info, conf, model, name, opaque);
+    if (max_queues <= 1 || !conf->peer ||
+        conf->peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        return nic;
+    }
+
+    num_peers = qemu_find_net_clients_except(conf->peer->name, peers,
+                                             NET_CLIENT_OPTIONS_KIND_NIC,
+                                             MAX_QUEUE_NUM);
+    nic->subqueues = g_new0(NICState *, max_queues - 1);
+    for (i = 0; i < num_peers && nic->queues < max_queues; i++) {
+        NetClientState *nc;
+        NICState *sub;
+
+        if (peers[i] == conf->peer || peers[i]->peer) {
+            continue;
+        }
+
+        nc = qemu_new_net_client(info, peers[i], model, name);
+        nc->queue_index = nic->queues;
+        sub = DO_UPCAST(NICState, nc, nc);
+        sub->conf = conf;
+        sub->opaque = opaque;
+        nic->subqueues[nic->queues - 1] = sub;
+        nic->queues++;
+    }
+
+    return nic;
+}
+
+NetClientState *qemu_get_subqueue(NICState *nic, unsigned int queue_index)
+{
+    assert(queue_index < nic->queues);
+
+    if (queue_index == 0) {
+        return &nic->nc;
+    }
+    return &nic->subqueues[queue_index - 1]->nc;
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
@@ -260,6 +323,22 @@ static void qemu_free_net_client(NetClientState *nc)
 
 void qemu_del_net_client(NetClientState *nc)
 {
+    /* Queues of a multiqueue NIC go away together with queue 0 */
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        NICState *nic = DO_UPCAST(NICState, nc, nc);
+
+        if (nic->subqueues) {
+            unsigned int i;
+
+            for (i = 1; i < nic->queues; i++) {
+                qemu_del_net_client(&nic->subqueues[i - 1]->nc);
+            }
+            g_free(nic->subqueues);
+            nic->subqueues = NULL;
+            nic->queues = 1;
+        }
+    }
+
     /* If there is a peer NIC, delete and cleanup client, but do not free. */
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
         NICState *nic = DO_UPCAST(NICState, nc, nc->peer);
@@ -293,7 +372,8 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
     NetClientState *nc;
 
     QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC &&
+            nc->queue_index == 0) {
             func(DO_UPCAST(NICState, nc, nc), opaque);
         }
     }
@@ -389,6 +469,30 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Packets sent by @nc between qemu_send_batch_begin() and
+ * qemu_send_batch_end() form a burst.  The peer may defer work that is only
+ * needed once per burst, such as notifying the guest, to its
+ * receive_batch_end callback.
+ */
+void qemu_send_batch_begin(NetClientState *nc)
+{
+    if (nc->peer && nc->peer->info->receive_batch_end) {
+        nc->peer->receive_batched = 1;
+    }
+}
+
+void qemu_send_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (!peer || !peer->receive_batched) {
+        return;
+    }
+
+    peer->receive_batched = 0;
+    peer->info->receive_batch_end(peer);
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -468,6 +572,28 @@ NetClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/* Find up to @max net clients called @id, skipping those of type @type */
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max)
+{
+    NetClientState *nc;
+    int ret = 0;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->info->type == type) {
+            continue;
+        }
+        if (!strcmp(nc->name, id)) {
+            if (ret < max) {
+                ncs[ret] = nc;
+            }
+            ret++;
+        }
+    }
+
+    return MIN(ret, max);
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -622,6 +748,12 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_POSIX
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+#endif
+#ifdef CONFIG_EVENTFD
+        [NET_CLIENT_OPTIONS_KIND_SHM]       = net_init_shm,
+#endif
 };
 
 
@@ -652,6 +784,12 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_POSIX
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+#endif
+#ifdef CONFIG_EVENTFD
+        case NET_CLIENT_OPTIONS_KIND_SHM:
+#endif
             break;
 
         default:
@@ -839,14 +977,34 @@ void qmp_netdev_del(const char *id, Error **errp)
         return;
     }
 
-    qemu_del_net_client(nc);
+    /* A multiqueue backend has one net client per queue */
+    do {
+        qemu_del_net_client(nc);
+    } while ((nc = qemu_find_netdev(id)));
     qemu_opts_del(qemu_opts_find(qemu_find_opts_err("netdev", errp), id));
 }
 
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
+    NetQueueStats stats;
+
     monitor_printf(mon, "%s: type=%s,%s\n", nc->name,
                    NetClientOptionsKind_lookup[nc->info->type], nc->info_str);
+
+    if (nc->info->print_info) {
+        nc->info->print_info(nc, mon);
+    }
+
+    if (!nc->send_queue) {
+        return;
+    }
+    qemu_net_queue_get_stats(nc->send_queue, &stats);
+    if (stats.queued || stats.dropped) {
+        monitor_printf(mon, "    queue: depth=%u max=%u queued=%" PRIu64
+                       " copied=%" PRIu64 " dropped=%" PRIu64 "\n",
+                       stats.depth, stats.max_depth, stats.queued,
+                       stats.copied, stats.dropped);
+    }
 }
 
 void do_info_network(Monitor *mon)
@@ -13,6 +13,9 @@ struct MACAddr {
     uint8_t a[6];
 };
 
+/* Maximum number of queues of a multiqueue NIC or backend */
+#define MAX_QUEUE_NUM 8
+
 /* qdev nic properties */
 
 typedef struct NICConf {
@@ -35,6 +38,8 @@ typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
+typedef void (NetReceiveBatchEnd)(NetClientState *);
+typedef void (NetPrintInfo)(NetClientState *, Monitor *);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -46,6 +51,8 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    NetReceiveBatchEnd *receive_batch_end;
+    NetPrintInfo *print_info;
 } NetClientInfo;
 
 struct NetClientState {
@@ -58,6 +65,8 @@ struct NetClientState {
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    unsigned receive_batched : 1;
+    unsigned int queue_index;
 };
 
 typedef struct NICState {
@@ -65,6 +74,8 @@ typedef struct NICState {
     NICConf *conf;
     void *opaque;
     bool peer_deleted;
+    unsigned int queues;            /* number of queues, including nc */
+    struct NICState **subqueues;    /* queues 1 to queues - 1 */
 } NICState;
 
 NetClientState *qemu_find_netdev(const char *id);
@@ -77,6 +88,15 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *model,
                        const char *name,
                        void *opaque);
+NICState *qemu_new_nic_mq(NetClientInfo *info,
+                          NICConf *conf,
+                          const char *model,
+                          const char *name,
+                          void *opaque,
+                          unsigned int max_queues);
+NetClientState *qemu_get_subqueue(NICState *nic, unsigned int queue_index);
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max);
 void qemu_del_net_client(NetClientState *nc);
 NetClientState *qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                                               const char *client_str);
@@ -91,6 +111,8 @@ void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+void qemu_send_batch_begin(NetClientState *nc);
+void qemu_send_batch_end(NetClientState *nc);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
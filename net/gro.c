@@ -0,0 +1,60 @@
+/*
+ * TCP segment parsing for receive coalescing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "net/gro.h"
+
+int net_gro_parse(const uint8_t *frame, size_t size, bool tso4, bool tso6,
+                  int *hdr_len, int *end)
+{
+    const uint8_t *tcp;
+    int l4_off, tcp_len;
+
+    if (size < 54) {
+        return 0;
+    }
+
+    switch (be16_to_cpup((uint16_t *)(frame + 12))) {
+    case 0x0800:
+        if (!tso4 ||
+            frame[14] != 0x45 ||                /* IPv4 without options */
+            (frame[20] & 0x3f) || frame[21] ||  /* MF or fragment offset */
+            frame[23] != GRO_PROTO_TCP) {
+            return 0;
+        }
+        l4_off = 34;
+        *end = 14 + be16_to_cpup((uint16_t *)(frame + 16));
+        break;
+    case 0x86dd:
+        if (!tso6 ||
+            (frame[14] & 0xf0) != 0x60 ||
+            frame[20] != GRO_PROTO_TCP) {      /* no extension headers */
+            return 0;
+        }
+        l4_off = 54;
+        *end = 54 + be16_to_cpup((uint16_t *)(frame + 18));
+        break;
+    default:
+        return 0;
+    }
+
+    /* The held frame is copied into a buffer of GRO_MAX_FRAME bytes */
+    if (*end > size || *end > GRO_MAX_FRAME || *end < l4_off + 20) {
+        return 0;
+    }
+
+    tcp = frame + l4_off;
+    tcp_len = (tcp[12] >> 4) * 4;
+    if (tcp_len < 20 || l4_off + tcp_len >= *end) {
+        return 0;
+    }
+    if (tcp[13] != TCP_FLAG_ACK && tcp[13] != (TCP_FLAG_ACK | TCP_FLAG_PSH)) {
+        return 0;
+    }
+
+    *hdr_len = l4_off + tcp_len;
+    return l4_off;
+}
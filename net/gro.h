@@ -0,0 +1,37 @@
+/*
+ * TCP segment parsing for receive coalescing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_GRO_H
+#define QEMU_NET_GRO_H
+
+#include "qemu-common.h"
+
+/* Largest IP packet a coalesced frame may grow to, headers included */
+#define GRO_MAX_FRAME   0xffff
+
+#define GRO_PROTO_TCP   6
+
+#define TCP_FLAG_PSH    0x08
+#define TCP_FLAG_ACK    0x10
+
+/**
+ * net_gro_parse:
+ * @frame: Ethernet frame, without any virtio-net header.
+ * @size: Length of @frame.
+ * @tso4: Whether IPv4 segments may be coalesced.
+ * @tso6: Whether IPv6 segments may be coalesced.
+ * @hdr_len: Set to the length of all headers.
+ * @end: Set to the end of the IP packet, which excludes Ethernet padding.
+ *
+ * Returns the offset of the TCP header if @frame is a segment that can be
+ * coalesced, 0 otherwise.  @end is never beyond @size nor GRO_MAX_FRAME,
+ * whatever the IP length field says.
+ */
+int net_gro_parse(const uint8_t *frame, size_t size, bool tso4, bool tso6,
+                  int *hdr_len, int *end);
+
+#endif /* QEMU_NET_GRO_H */
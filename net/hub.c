@@ -16,13 +16,36 @@
 #include "net.h"
 #include "hub.h"
 #include "iov.h"
+#include "qemu-error.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * In switch mode the hub learns which port each source MAC address lives
+ * behind and forwards unicast frames only to that port.  Broadcast,
+ * multicast and unknown destinations are still flooded.
+ *
+ * With thread=on, ports accept packets into a per-hub queue and a worker
+ * thread forwards them in batches.  Like other non-vcpu threads that call
+ * into device code, the worker takes the global mutex while it forwards,
+ * so the forwarding table and the ports are only ever touched under that
+ * lock.  The queue itself is protected by the hub's own lock.  The hub,
+ * and its worker with it, goes away with its last port.
  */
 
+/* Forwarding table */
+#define NET_HUB_MAC_BUCKETS     256
+#define NET_HUB_MAC_MAX         4096
+#define NET_HUB_MAC_AGEING_MS   (300 * 1000)
+
+/* Packets waiting for the worker thread */
+#define NET_HUB_QUEUE_MAX       1024
+#define NET_HUB_BATCH           64
+
 typedef struct NetHub NetHub;
 
 typedef struct NetHubPort {
@@ -30,22 +53,162 @@ typedef struct NetHubPort {
     QLIST_ENTRY(NetHubPort) next;
     NetHub *hub;
     int id;
+    bool rx_blocked;            /* returned 0 because the queue was full */
 } NetHubPort;
 
+typedef struct NetHubMac {
+    uint8_t addr[6];
+    NetHubPort *port;
+    int64_t seen;               /* rt_clock ms */
+    QLIST_ENTRY(NetHubMac) next;
+} NetHubMac;
+
+typedef struct NetHubPacket {
+    QSIMPLEQ_ENTRY(NetHubPacket) next;
+    NetHubPort *source;
+    size_t size;
+    uint8_t data[0];
+} NetHubPacket;
+
+typedef struct NetHubStats {
+    uint64_t unicast;           /* forwarded to a single learned port */
+    uint64_t flooded;
+    uint64_t filtered;          /* destination is behind the source port */
+    uint64_t queue_full;
+} NetHubStats;
+
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    NetHubMode mode;
+
+    int num_macs;
+    QLIST_HEAD(, NetHubMac) macs[NET_HUB_MAC_BUCKETS];
+
+    bool threaded;
+    QemuThread thread;
+    QemuMutex lock;             /* protects queue and queue_len */
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, NetHubPacket) queue;
+    int queue_len;
+    bool stopping;              /* protected by lock */
+
+    NetHubStats stats;
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
+static unsigned int net_hub_mac_hash(const uint8_t *addr)
+{
+    uint32_t h = (addr[2] << 24) | (addr[3] << 16) | (addr[4] << 8) | addr[5];
+
+    h ^= addr[0] << 8 | addr[1];
+    return (h * 2654435761u) >> 24;
+}
+
+static void net_hub_mac_remove(NetHub *hub, NetHubMac *mac)
+{
+    QLIST_REMOVE(mac, next);
+    g_free(mac);
+    hub->num_macs--;
+}
+
+static NetHubMac *net_hub_mac_lookup(NetHub *hub, const uint8_t *addr,
+                                     int64_t now)
+{
+    unsigned int bucket = net_hub_mac_hash(addr);
+    NetHubMac *mac, *next_mac;
+
+    QLIST_FOREACH_SAFE(mac, &hub->macs[bucket], next, next_mac) {
+        if (memcmp(mac->addr, addr, 6) != 0) {
+            continue;
+        }
+        if (now - mac->seen > NET_HUB_MAC_AGEING_MS) {
+            net_hub_mac_remove(hub, mac);
+            return NULL;
+        }
+        return mac;
+    }
+    return NULL;
+}
+
+static void net_hub_mac_learn(NetHub *hub, NetHubPort *port,
+                              const uint8_t *addr, int64_t now)
+{
+    NetHubMac *mac;
+
+    mac = net_hub_mac_lookup(hub, addr, now);
+    if (!mac) {
+        if (hub->num_macs >= NET_HUB_MAC_MAX) {
+            return;             /* table full, keep flooding */
+        }
+        mac = g_malloc(sizeof(*mac));
+        memcpy(mac->addr, addr, 6);
+        QLIST_INSERT_HEAD(&hub->macs[net_hub_mac_hash(addr)], mac, next);
+        hub->num_macs++;
+    }
+    mac->port = port;
+    mac->seen = now;
+}
+
+static void net_hub_mac_flush_port(NetHub *hub, NetHubPort *port)
+{
+    NetHubMac *mac, *next_mac;
+    int i;
+
+    for (i = 0; i < NET_HUB_MAC_BUCKETS; i++) {
+        QLIST_FOREACH_SAFE(mac, &hub->macs[i], next, next_mac) {
+            if (mac->port == port) {
+                net_hub_mac_remove(hub, mac);
+            }
+        }
+    }
+}
+
+/* Returns the only port @buf has to go to, or NULL to flood it */
+static NetHubPort *net_hub_switch(NetHub *hub, NetHubPort *source_port,
+                                  const uint8_t *buf, size_t len)
+{
+    const uint8_t *dst = buf, *src = buf + 6;
+    int64_t now;
+    NetHubMac *mac;
+
+    if (len < 14) {
+        return NULL;
+    }
+
+    now = qemu_get_clock_ms(rt_clock);
+    if (!(src[0] & 1)) {
+        net_hub_mac_learn(hub, source_port, src, now);
+    }
+    if (dst[0] & 1) {
+        return NULL;
+    }
+    mac = net_hub_mac_lookup(hub, dst, now);
+    return mac ? mac->port : NULL;
+}
+
 static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
                                const uint8_t *buf, size_t len)
 {
     NetHubPort *port;
 
+    if (hub->mode == NET_HUB_MODE_Q_SWITCH) {
+        port = net_hub_switch(hub, source_port, buf, len);
+        if (port == source_port) {
+            hub->stats.filtered++;
+            return len;
+        }
+        if (port) {
+            hub->stats.unicast++;
+            qemu_send_packet(&port->nc, buf, len);
+            return len;
+        }
+    }
+
+    hub->stats.flooded++;
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
@@ -62,6 +225,23 @@ static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
     NetHubPort *port;
     ssize_t len = iov_size(iov, iovcnt);
 
+    if (hub->mode == NET_HUB_MODE_Q_SWITCH) {
+        uint8_t hdr[14];
+
+        iov_to_buf(iov, iovcnt, 0, hdr, sizeof(hdr));
+        port = net_hub_switch(hub, source_port, hdr, MIN(len, sizeof(hdr)));
+        if (port == source_port) {
+            hub->stats.filtered++;
+            return len;
+        }
+        if (port) {
+            hub->stats.unicast++;
+            qemu_sendv_packet(&port->nc, iov, iovcnt);
+            return len;
+        }
+    }
+
+    hub->stats.flooded++;
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
@@ -72,26 +252,204 @@ static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
     return len;
 }
 
-static NetHub *net_hub_new(int id)
+/* Called with the global mutex held */
+static void net_hub_forward_batch(NetHub *hub)
+{
+    QSIMPLEQ_HEAD(, NetHubPacket) batch = QSIMPLEQ_HEAD_INITIALIZER(batch);
+    NetHubPacket *packet;
+    NetHubPort *port;
+    bool unblock;
+    int n = 0;
+
+    qemu_mutex_lock(&hub->lock);
+    while (n < NET_HUB_BATCH && (packet = QSIMPLEQ_FIRST(&hub->queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&hub->queue, next);
+        QSIMPLEQ_INSERT_TAIL(&batch, packet, next);
+        n++;
+    }
+    hub->queue_len -= n;
+    unblock = hub->queue_len < NET_HUB_QUEUE_MAX / 2;
+    qemu_mutex_unlock(&hub->lock);
+
+    /* Let the receivers notify their guests once for the whole batch */
+    QLIST_FOREACH(port, &hub->ports, next) {
+        qemu_send_batch_begin(&port->nc);
+    }
+    while ((packet = QSIMPLEQ_FIRST(&batch))) {
+        QSIMPLEQ_REMOVE_HEAD(&batch, next);
+        net_hub_receive(hub, packet->source, packet->data, packet->size);
+        g_free(packet);
+    }
+    QLIST_FOREACH(port, &hub->ports, next) {
+        qemu_send_batch_end(&port->nc);
+    }
+
+    if (unblock) {
+        QLIST_FOREACH(port, &hub->ports, next) {
+            if (port->rx_blocked) {
+                port->rx_blocked = false;
+                qemu_flush_queued_packets(&port->nc);
+            }
+        }
+    }
+}
+
+static void *net_hub_thread(void *opaque)
+{
+    NetHub *hub = opaque;
+
+    bool stopping;
+
+    for (;;) {
+        qemu_mutex_lock(&hub->lock);
+        while (QSIMPLEQ_EMPTY(&hub->queue) && !hub->stopping) {
+            qemu_cond_wait(&hub->cond, &hub->lock);
+        }
+        stopping = hub->stopping;
+        qemu_mutex_unlock(&hub->lock);
+        if (stopping) {
+            break;
+        }
+
+        qemu_mutex_lock_iothread();
+        net_hub_forward_batch(hub);
+        qemu_mutex_unlock_iothread();
+
+        /* The receivers may have changed fd handlers or timers */
+        qemu_notify_event();
+    }
+    return NULL;
+}
+
+static ssize_t net_hub_enqueue(NetHubPort *source_port,
+                               const struct iovec *iov, int iovcnt)
+{
+    NetHub *hub = source_port->hub;
+    size_t len = iov_size(iov, iovcnt);
+    NetHubPacket *packet;
+
+    qemu_mutex_lock(&hub->lock);
+    if (hub->stopping) {
+        /* net_hub_free() is waiting for the worker, nobody forwards */
+        qemu_mutex_unlock(&hub->lock);
+        return len;
+    }
+    if (hub->queue_len >= NET_HUB_QUEUE_MAX) {
+        qemu_mutex_unlock(&hub->lock);
+        /* The net layer queues the packet until net_hub_forward_batch()
+         * flushes this port */
+        hub->stats.queue_full++;
+        source_port->rx_blocked = true;
+        return 0;
+    }
+    qemu_mutex_unlock(&hub->lock);
+
+    packet = g_malloc(sizeof(*packet) + len);
+    packet->source = source_port;
+    packet->size = len;
+    iov_to_buf(iov, iovcnt, 0, packet->data, len);
+
+    qemu_mutex_lock(&hub->lock);
+    QSIMPLEQ_INSERT_TAIL(&hub->queue, packet, next);
+    if (hub->queue_len++ == 0) {
+        qemu_cond_signal(&hub->cond);
+    }
+    qemu_mutex_unlock(&hub->lock);
+    return len;
+}
+
+/* Drop the packets @port sent that the worker has not forwarded yet */
+static void net_hub_purge_port(NetHub *hub, NetHubPort *port)
+{
+    NetHubPacket *packet, *next_packet;
+
+    qemu_mutex_lock(&hub->lock);
+    QSIMPLEQ_FOREACH_SAFE(packet, &hub->queue, next, next_packet) {
+        if (packet->source == port) {
+            QSIMPLEQ_REMOVE(&hub->queue, packet, NetHubPacket, next);
+            g_free(packet);
+            hub->queue_len--;
+        }
+    }
+    qemu_mutex_unlock(&hub->lock);
+}
+
+static NetHub *net_hub_new(int id, NetHubMode mode, bool threaded)
 {
     NetHub *hub;
+    int i;
 
-    hub = g_malloc(sizeof(*hub));
+    hub = g_malloc0(sizeof(*hub));
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
+    hub->mode = mode;
+    for (i = 0; i < NET_HUB_MAC_BUCKETS; i++) {
+        QLIST_INIT(&hub->macs[i]);
+    }
+
+    hub->threaded = threaded;
+    QSIMPLEQ_INIT(&hub->queue);
+    if (threaded) {
+        qemu_mutex_init(&hub->lock);
+        qemu_cond_init(&hub->cond);
+        qemu_thread_create(&hub->thread, net_hub_thread, hub,
+                           QEMU_THREAD_JOINABLE);
+    }
 
     QLIST_INSERT_HEAD(&hubs, hub, next);
 
     return hub;
 }
 
+/* Called with the global mutex held, once the last port is gone */
+static void net_hub_free(NetHub *hub)
+{
+    QLIST_REMOVE(hub, next);
+
+    if (hub->threaded) {
+        qemu_mutex_lock(&hub->lock);
+        hub->stopping = true;
+        qemu_cond_signal(&hub->cond);
+        qemu_mutex_unlock(&hub->lock);
+
+        /* The worker may be waiting for the global mutex to forward */
+        qemu_mutex_unlock_iothread();
+        qemu_thread_join(&hub->thread);
+        qemu_mutex_lock_iothread();
+
+        qemu_cond_destroy(&hub->cond);
+        qemu_mutex_destroy(&hub->lock);
+    }
+
+    /* The ports took their packets and table entries with them */
+    assert(QSIMPLEQ_EMPTY(&hub->queue) && hub->num_macs == 0);
+    g_free(hub);
+}
+
+static NetHub *net_hub_find(int id)
+{
+    NetHub *hub;
+
+    QLIST_FOREACH(hub, &hubs, next) {
+        if (hub->id == id) {
+            return hub;
+        }
+    }
+    return NULL;
+}
+
 static int net_hub_port_can_receive(NetClientState *nc)
 {
     NetHubPort *port;
     NetHubPort *src_port = DO_UPCAST(NetHubPort, nc, nc);
     NetHub *hub = src_port->hub;
 
+    if (hub->threaded) {
+        /* Decoupled from the other ports by the queue */
+        return 1;
+    }
+
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == src_port) {
             continue;
@@ -110,6 +468,14 @@ static ssize_t net_hub_port_receive(NetClientState *nc,
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
 
+    if (port->hub->threaded) {
+        struct iovec iov = {
+            .iov_base = (uint8_t *)buf,
+            .iov_len = len,
+        };
+
+        return net_hub_enqueue(port, &iov, 1);
+    }
     return net_hub_receive(port->hub, port, buf, len);
 }
 
@@ -118,6 +484,9 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
 
+    if (port->hub->threaded) {
+        return net_hub_enqueue(port, iov, iovcnt);
+    }
     return net_hub_receive_iov(port->hub, port, iov, iovcnt);
 }
 
@@ -126,6 +495,13 @@ static void net_hub_port_cleanup(NetClientState *nc)
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
 
     QLIST_REMOVE(port, next);
+    net_hub_mac_flush_port(port->hub, port);
+    if (port->hub->threaded) {
+        net_hub_purge_port(port->hub, port);
+    }
+    if (QLIST_EMPTY(&port->hub->ports)) {
+        net_hub_free(port->hub);
+    }
 }
 
 static NetClientInfo net_hub_port_info = {
@@ -171,14 +547,9 @@ NetClientState *net_hub_add_port(int hub_id, const char *name)
     NetHub *hub;
     NetHubPort *port;
 
-    QLIST_FOREACH(hub, &hubs, next) {
-        if (hub->id == hub_id) {
-            break;
-        }
-    }
-
+    hub = net_hub_find(hub_id);
     if (!hub) {
-        hub = net_hub_new(hub_id);
+        hub = net_hub_new(hub_id, NET_HUB_MODE_HUB, false);
     }
 
     port = net_hub_port_new(hub, name);
@@ -242,7 +613,17 @@ void net_hub_info(Monitor *mon)
     NetHubPort *port;
 
     QLIST_FOREACH(hub, &hubs, next) {
-        monitor_printf(mon, "hub %d\n", hub->id);
+        monitor_printf(mon, "hub %d", hub->id);
+        if (hub->mode == NET_HUB_MODE_Q_SWITCH) {
+            monitor_printf(mon, " (switch, %d MACs learned)", hub->num_macs);
+        }
+        monitor_printf(mon, "%s\n", hub->threaded ? " [thread]" : "");
+        if (hub->mode == NET_HUB_MODE_Q_SWITCH || hub->threaded) {
+            monitor_printf(mon, "  forwarded=%" PRIu64 " flooded=%" PRIu64
+                           " filtered=%" PRIu64 " queue full=%" PRIu64 "\n",
+                           hub->stats.unicast, hub->stats.flooded,
+                           hub->stats.filtered, hub->stats.queue_full);
+        }
         QLIST_FOREACH(port, &hub->ports, next) {
             if (port->nc.peer) {
                 monitor_printf(mon, " \\ ");
@@ -280,6 +661,9 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
                      NetClientState *peer)
 {
     const NetdevHubPortOptions *hubport;
+    NetHubMode mode;
+    bool threaded;
+    NetHub *hub;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_HUBPORT);
     hubport = opts->hubport;
@@ -289,6 +673,20 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
         return -EINVAL;
     }
 
+    mode = hubport->has_mode ? hubport->mode : NET_HUB_MODE_HUB;
+    threaded = hubport->has_thread && hubport->thread;
+
+    /* The first port to name a hub decides how it forwards */
+    hub = net_hub_find(hubport->hubid);
+    if (!hub) {
+        net_hub_new(hubport->hubid, mode, threaded);
+    } else if ((hubport->has_mode && hub->mode != mode) ||
+               (hubport->has_thread && hub->threaded != threaded)) {
+        error_report("hub %d already exists with different mode or thread "
+                     "settings", hubport->hubid);
+        return -EINVAL;
+    }
+
     net_hub_add_port(hubport->hubid, name);
     return 0;
 }
@@ -321,6 +719,7 @@ void net_hub_check_clients(void)
             case NET_CLIENT_OPTIONS_KIND_TAP:
             case NET_CLIENT_OPTIONS_KIND_SOCKET:
             case NET_CLIENT_OPTIONS_KIND_VDE:
+            case NET_CLIENT_OPTIONS_KIND_SHM:
                 has_host_dev = 1;
                 break;
             default:
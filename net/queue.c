@@ -24,6 +24,7 @@
 #include "net/queue.h"
 #include "qemu-queue.h"
 #include "net.h"
+#include "iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -33,25 +34,43 @@
  * If a sent callback is provided to send(), the caller must handle a
  * zero return from the delivery handler by not sending any more packets
  * until we have invoked the callback. Only in that case will we queue
- * the packet.
+ * the packet.  The queued packet refers to the caller's buffers rather
+ * than a copy of them, so the caller must also leave them untouched until
+ * the callback has run.
  *
- * If a sent callback isn't provided, we just drop the packet to avoid
- * unbounded queueing.
+ * If a sent callback isn't provided, the packet is copied, and it is
+ * dropped once the queue is full to avoid unbounded queueing.
  */
 
+/* Number of iovec entries that fit in the packet header itself */
+#define NET_PACKET_INLINE_IOV   4
+
+/* Number of free packet headers each queue keeps around for reuse */
+#define NET_PACKET_POOL_SIZE    256
+
+/* Maximum number of packets without a sent callback in a queue */
+#define NET_QUEUE_MAX_LEN       10000
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    struct iovec *iov;
+    int iovcnt;
+    uint8_t *data;      /* private copy of the payload, if any */
+    struct iovec inline_iov[NET_PACKET_INLINE_IOV];
 };
 
 struct NetQueue {
     void *opaque;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) free_packets;
+    unsigned int nr_free;
+
+    NetQueueStats stats;
 
     unsigned delivering : 1;
 };
@@ -65,43 +84,57 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->opaque = opaque;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->free_packets);
 
     queue->delivering = 0;
 
     return queue;
 }
 
-void qemu_del_net_queue(NetQueue *queue)
+static NetPacket *qemu_net_packet_alloc(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    NetPacket *packet = QTAILQ_FIRST(&queue->free_packets);
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->free_packets, packet, entry);
+        queue->nr_free--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket));
     }
 
-    g_free(queue);
+    return packet;
 }
 
-static ssize_t qemu_net_queue_append(NetQueue *queue,
-                                     NetClientState *sender,
-                                     unsigned flags,
-                                     const uint8_t *buf,
-                                     size_t size,
-                                     NetPacketSent *sent_cb)
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
 {
-    NetPacket *packet;
+    g_free(packet->data);
+    if (packet->iov != packet->inline_iov) {
+        g_free(packet->iov);
+    }
 
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
+    if (queue->nr_free < NET_PACKET_POOL_SIZE) {
+        QTAILQ_INSERT_HEAD(&queue->free_packets, packet, entry);
+        queue->nr_free++;
+    } else {
+        g_free(packet);
+    }
+}
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+void qemu_del_net_queue(NetQueue *queue)
+{
+    NetPacket *packet, *next;
 
-    return size;
+    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
+        QTAILQ_REMOVE(&queue->packets, packet, entry);
+        qemu_net_packet_free(queue, packet);
+    }
+
+    QTAILQ_FOREACH_SAFE(packet, &queue->free_packets, entry, next) {
+        QTAILQ_REMOVE(&queue->free_packets, packet, entry);
+        g_free(packet);
+    }
+
+    g_free(queue);
 }
 
 static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
@@ -112,29 +145,63 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
                                          NetPacketSent *sent_cb)
 {
     NetPacket *packet;
-    size_t max_len = 0;
-    int i;
+    size_t size = iov_size(iov, iovcnt);
 
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
+    if (!sent_cb && queue->stats.depth >= NET_QUEUE_MAX_LEN) {
+        queue->stats.dropped++;
+        return size;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_packet_alloc(queue);
     packet->sender = sender;
-    packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
+    packet->size = size;
+    packet->sent_cb = sent_cb;
+    packet->data = NULL;
+
+    if (sent_cb) {
+        /* Only the iovec array is copied, the payload stays with the sender */
+        if (iovcnt <= NET_PACKET_INLINE_IOV) {
+            packet->iov = packet->inline_iov;
+        } else {
+            packet->iov = g_new(struct iovec, iovcnt);
+        }
+        memcpy(packet->iov, iov, iovcnt * sizeof(*iov));
+        packet->iovcnt = iovcnt;
+    } else {
+        packet->data = g_malloc(size);
+        iov_to_buf(iov, iovcnt, 0, packet->data, size);
+        packet->inline_iov[0].iov_base = packet->data;
+        packet->inline_iov[0].iov_len = size;
+        packet->iov = packet->inline_iov;
+        packet->iovcnt = 1;
+        queue->stats.copied++;
+    }
 
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
+    queue->stats.queued++;
+    if (++queue->stats.depth > queue->stats.max_depth) {
+        queue->stats.max_depth = queue->stats.depth;
     }
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    /* The sender must hold on to its buffers until sent_cb is invoked */
+    return sent_cb ? 0 : size;
+}
 
-    return packet->size;
+static ssize_t qemu_net_queue_append(NetQueue *queue,
+                                     NetClientState *sender,
+                                     unsigned flags,
+                                     const uint8_t *buf,
+                                     size_t size,
+                                     NetPacketSent *sent_cb)
+{
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = size,
+    };
+
+    return qemu_net_queue_append_iov(queue, sender, flags, &iov, 1, sent_cb);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -223,7 +290,8 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            queue->stats.depth--;
+            qemu_net_packet_free(queue, packet);
         }
     }
 }
@@ -237,20 +305,35 @@ void qemu_net_queue_flush(NetQueue *queue)
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iovcnt == 1) {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->iov[0].iov_base,
+                                         packet->iov[0].iov_len);
+        } else {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        }
         if (ret == 0) {
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
             break;
         }
 
+        queue->stats.depth--;
+
         if (packet->sent_cb) {
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
 }
+
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    *stats = queue->stats;
+}
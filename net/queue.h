@@ -34,6 +34,14 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
+typedef struct NetQueueStats {
+    uint32_t depth;         /* packets currently queued */
+    uint32_t max_depth;     /* highest depth reached */
+    uint64_t queued;        /* packets that could not be delivered at once */
+    uint64_t copied;        /* queued packets whose payload was copied */
+    uint64_t dropped;       /* packets dropped because the queue was full */
+} NetQueueStats;
+
 NetQueue *qemu_new_net_queue(void *opaque);
 
 void qemu_del_net_queue(NetQueue *queue);
@@ -54,5 +62,6 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 void qemu_net_queue_flush(NetQueue *queue);
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
 
 #endif /* QEMU_NET_QUEUE_H */
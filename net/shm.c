@@ -0,0 +1,646 @@
+/*
+ * Shared memory network backend
+ *
+ * Two QEMU processes on the same host exchange packets through a pair of
+ * rings in a shared memory object.  The server creates the memory and two
+ * eventfd doorbells and hands them to the client over a UNIX domain
+ * socket; afterwards the socket is only watched to notice that the peer
+ * went away.
+ *
+ * The sender copies a packet into its TX ring once and the receiver hands
+ * it to its NIC straight from the ring.  A doorbell is only rung when the
+ * other side announced that it is about to go idle, so two busy guests
+ * exchange packets without any system call.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "net/shm.h"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "config-host.h"
+
+#include "net.h"
+#include "iov.h"
+#include "main-loop.h"
+#include "monitor.h"
+#include "qemu-barrier.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu_socket.h"
+
+#define NET_SHM_MAGIC           0x48534e51  /* "QNSH" */
+#define NET_SHM_VERSION         1
+#define NET_SHM_DEFAULT_SIZE    (1 << 20)
+#define NET_SHM_MIN_SIZE        (1 << 18)
+#define NET_SHM_MAX_SIZE        (1 << 28)
+#define NET_SHM_MAX_PACKET      (65536 + 4096)
+#define NET_SHM_ALIGN           8
+#define NET_SHM_WRAP            0xffffffff
+#define NET_SHM_RX_BUDGET       256
+
+/* A record is a 32-bit length followed by the packet, padded to
+ * NET_SHM_ALIGN.  Records never wrap around the end of the ring; a
+ * NET_SHM_WRAP length tells the consumer to continue at offset 0.
+ *
+ * The producer and the consumer indexes live in separate cache lines.
+ */
+typedef struct NetShmRing {
+    /* written by the producer */
+    uint32_t head;              /* free running byte count */
+    uint32_t producer_waiting;  /* kick the producer when space frees up */
+    uint8_t pad0[56];
+    /* written by the consumer */
+    uint32_t tail;
+    uint32_t consumer_waiting;  /* kick the consumer on new data */
+    uint8_t pad1[56];
+} NetShmRing;
+
+typedef struct NetShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;         /* bytes of data per ring, a power of two */
+    uint8_t pad[52];
+    NetShmRing rings[2];        /* [0] server to client, [1] client to server */
+} NetShmHeader;
+
+/* Sent by the server right after accept(), along with the fds below */
+typedef struct NetShmHello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+} NetShmHello;
+
+enum {
+    NET_SHM_FD_MEM,
+    NET_SHM_FD_SERVER_DOORBELL,
+    NET_SHM_FD_CLIENT_DOORBELL,
+    NET_SHM_NFDS,
+};
+
+typedef struct NetShmStats {
+    uint64_t tx_packets;
+    uint64_t tx_full;
+    uint64_t rx_packets;
+    uint64_t kicks_sent;
+    uint64_t kicks_received;
+} NetShmStats;
+
+typedef struct NetShmState {
+    NetClientState nc;
+    bool server;
+    char *path;
+    int listen_fd;
+    int conn_fd;                /* -1 while no peer is connected */
+    int fds[NET_SHM_NFDS];
+    NetShmHeader *hdr;
+    size_t size;
+    uint32_t ring_mask;
+    NetShmRing *tx;
+    NetShmRing *rx;
+    uint8_t *tx_data;
+    uint8_t *rx_data;
+    int doorbell;               /* rung by the peer */
+    int peer_doorbell;
+    bool tx_blocked;            /* returned 0 from receive, TX ring full */
+    bool rx_pending;            /* a packet is queued by reference */
+    uint32_t rx_pending_next;   /* tail once that packet is released */
+    QEMUBH *rx_bh;
+    NetShmStats stats;
+} NetShmState;
+
+static void net_shm_poll_rx(NetShmState *s);
+
+static size_t net_shm_record_size(size_t len)
+{
+    return QEMU_ALIGN_UP(sizeof(uint32_t) + len, NET_SHM_ALIGN);
+}
+
+static void net_shm_kick(NetShmState *s)
+{
+    uint64_t one = 1;
+
+    if (write(s->peer_doorbell, &one, sizeof(one)) == sizeof(one)) {
+        s->stats.kicks_sent++;
+    }
+}
+
+static ssize_t net_shm_receive_iov(NetClientState *nc,
+                                   const struct iovec *iov, int iovcnt)
+{
+    NetShmState *s = DO_UPCAST(NetShmState, nc, nc);
+    NetShmRing *ring = s->tx;
+    size_t len = iov_size(iov, iovcnt);
+    uint32_t head, off, need, contig, space;
+    uint8_t *rec;
+
+    if (s->conn_fd < 0 || len > NET_SHM_MAX_PACKET) {
+        return len;
+    }
+
+    head = ring->head;
+    off = head & s->ring_mask;
+    contig = s->ring_mask + 1 - off;
+    need = net_shm_record_size(len);
+    if (contig < need) {
+        need += contig;
+    }
+
+    space = s->ring_mask + 1 - (head - ring->tail);
+    if (space < need) {
+        ring->producer_waiting = 1;
+        smp_mb();
+        space = s->ring_mask + 1 - (head - ring->tail);
+        if (space < need) {
+            /* The net layer queues the packet; the peer kicks us once it
+             * has consumed something */
+            s->tx_blocked = true;
+            s->stats.tx_full++;
+            return 0;
+        }
+        ring->producer_waiting = 0;
+    }
+    /* Do not overwrite a record before the consumer has released it */
+    smp_mb();
+
+    if (contig < need) {
+        *(uint32_t *)(s->tx_data + off) = NET_SHM_WRAP;
+        off = 0;
+    }
+    rec = s->tx_data + off;
+    *(uint32_t *)rec = len;
+    iov_to_buf(iov, iovcnt, 0, rec + sizeof(uint32_t), len);
+
+    smp_wmb();
+    ring->head = head + need;
+    s->stats.tx_packets++;
+
+    smp_mb();
+    if (ring->consumer_waiting) {
+        ring->consumer_waiting = 0;
+        net_shm_kick(s);
+    }
+    return len;
+}
+
+static ssize_t net_shm_receive(NetClientState *nc, const uint8_t *buf,
+                               size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = size,
+    };
+
+    return net_shm_receive_iov(nc, &iov, 1);
+}
+
+static void net_shm_rx_release(NetShmState *s, uint32_t tail)
+{
+    NetShmRing *ring = s->rx;
+
+    /* Finish reading the record before the producer may reuse it */
+    smp_mb();
+    ring->tail = tail;
+    smp_mb();
+    if (ring->producer_waiting) {
+        ring->producer_waiting = 0;
+        net_shm_kick(s);
+    }
+}
+
+static void net_shm_send_completed(NetClientState *nc, ssize_t len)
+{
+    NetShmState *s = DO_UPCAST(NetShmState, nc, nc);
+
+    s->rx_pending = false;
+    net_shm_rx_release(s, s->rx_pending_next);
+    net_shm_poll_rx(s);
+}
+
+static void net_shm_disconnect(NetShmState *s);
+
+static void net_shm_poll_rx(NetShmState *s)
+{
+    NetShmRing *ring = s->rx;
+    int budget = NET_SHM_RX_BUDGET;
+
+    if (s->conn_fd < 0 || s->rx_pending) {
+        return;
+    }
+
+    qemu_send_batch_begin(&s->nc);
+    while (s->conn_fd >= 0) {
+        uint32_t tail = ring->tail;
+        uint32_t avail = ring->head - tail;
+        uint32_t off = tail & s->ring_mask;
+        uint32_t len, next;
+        ssize_t ret;
+
+        if (avail == 0) {
+            ring->consumer_waiting = 1;
+            smp_mb();
+            if (ring->head == tail) {
+                break;
+            }
+            ring->consumer_waiting = 0;
+            continue;
+        }
+        if (budget-- == 0) {
+            /* Let the main loop run, come back from a bottom half */
+            qemu_bh_schedule(s->rx_bh);
+            break;
+        }
+
+        /* Read head before the record it covers */
+        smp_rmb();
+        len = *(uint32_t *)(s->rx_data + off);
+        if (len == NET_SHM_WRAP) {
+            net_shm_rx_release(s, tail + s->ring_mask + 1 - off);
+            continue;
+        }
+
+        next = tail + net_shm_record_size(len);
+        if (len > NET_SHM_MAX_PACKET || next - tail > avail ||
+            off + net_shm_record_size(len) > s->ring_mask + 1) {
+            error_report("shm: malformed ring from peer, disconnecting");
+            net_shm_disconnect(s);
+            break;
+        }
+
+        s->stats.rx_packets++;
+        ret = qemu_send_packet_async(&s->nc,
+                                     s->rx_data + off + sizeof(uint32_t),
+                                     len, net_shm_send_completed);
+        if (ret == 0) {
+            /* The receiver holds on to the record until it is sent */
+            s->rx_pending = true;
+            s->rx_pending_next = next;
+            break;
+        }
+        net_shm_rx_release(s, next);
+    }
+    qemu_send_batch_end(&s->nc);
+}
+
+static void net_shm_rx_bh(void *opaque)
+{
+    net_shm_poll_rx(opaque);
+}
+
+static void net_shm_doorbell(void *opaque)
+{
+    NetShmState *s = opaque;
+    uint64_t v;
+
+    if (read(s->doorbell, &v, sizeof(v)) == sizeof(v)) {
+        s->stats.kicks_received++;
+    }
+
+    if (s->tx_blocked) {
+        s->tx_blocked = false;
+        qemu_flush_queued_packets(&s->nc);
+    }
+    net_shm_poll_rx(s);
+}
+
+static void net_shm_map(NetShmState *s)
+{
+    int tx = s->server ? 0 : 1;
+    uint8_t *data = (uint8_t *)(s->hdr + 1);
+
+    s->ring_mask = s->hdr->ring_size - 1;
+    s->tx = &s->hdr->rings[tx];
+    s->rx = &s->hdr->rings[!tx];
+    s->tx_data = data + tx * s->hdr->ring_size;
+    s->rx_data = data + !tx * s->hdr->ring_size;
+    s->doorbell = s->fds[s->server ? NET_SHM_FD_SERVER_DOORBELL :
+                                     NET_SHM_FD_CLIENT_DOORBELL];
+    s->peer_doorbell = s->fds[s->server ? NET_SHM_FD_CLIENT_DOORBELL :
+                                          NET_SHM_FD_SERVER_DOORBELL];
+}
+
+static void net_shm_reset_rings(NetShmState *s)
+{
+    memset(s->hdr->rings, 0, sizeof(s->hdr->rings));
+    s->hdr->rings[0].consumer_waiting = 1;
+    s->hdr->rings[1].consumer_waiting = 1;
+}
+
+static void net_shm_hangup(void *opaque)
+{
+    NetShmState *s = opaque;
+    char c;
+    ssize_t r;
+
+    r = qemu_recv(s->conn_fd, &c, 1, MSG_DONTWAIT);
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+        net_shm_disconnect(s);
+    }
+}
+
+static void net_shm_accept(void *opaque);
+
+static void net_shm_connected(NetShmState *s, int fd)
+{
+    s->conn_fd = fd;
+    qemu_set_fd_handler(s->conn_fd, net_shm_hangup, NULL, s);
+    qemu_set_fd_handler(s->doorbell, net_shm_doorbell, NULL, s);
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "shm: %s %s, ring size %u", s->server ? "serving" : "connected to",
+             s->path, s->hdr->ring_size);
+
+    /* The peer may have filled our RX ring before we got here */
+    net_shm_poll_rx(s);
+}
+
+static void net_shm_disconnect(NetShmState *s)
+{
+    qemu_set_fd_handler(s->conn_fd, NULL, NULL, NULL);
+    closesocket(s->conn_fd);
+    s->conn_fd = -1;
+    qemu_set_fd_handler(s->doorbell, NULL, NULL, NULL);
+
+    /* Drop the reference the receiver may still hold into the ring, and
+     * the packets that wait for room in the TX ring */
+    qemu_purge_queued_packets(&s->nc);
+    s->rx_pending = false;
+    s->tx_blocked = false;
+    qemu_flush_queued_packets(&s->nc);
+
+    if (s->server) {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "shm: waiting on %s", s->path);
+        qemu_set_fd_handler(s->listen_fd, net_shm_accept, NULL, s);
+    } else {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "shm: disconnected from %s", s->path);
+    }
+}
+
+static void net_shm_accept(void *opaque)
+{
+    NetShmState *s = opaque;
+    NetShmHello hello = {
+        .magic = NET_SHM_MAGIC,
+        .version = NET_SHM_VERSION,
+        .size = s->size,
+    };
+    char control[CMSG_SPACE(NET_SHM_NFDS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = &hello,
+        .iov_len = sizeof(hello),
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    int fd;
+
+    fd = qemu_accept(s->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msgh);
+    cmsg->cmsg_len = CMSG_LEN(NET_SHM_NFDS * sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), s->fds, NET_SHM_NFDS * sizeof(int));
+
+    /* A new peer starts with empty rings */
+    net_shm_reset_rings(s);
+    if (sendmsg(fd, &msgh, 0) != sizeof(hello)) {
+        error_report("shm: could not send setup message to peer");
+        closesocket(fd);
+        return;
+    }
+
+    /* One peer at a time */
+    qemu_set_fd_handler(s->listen_fd, NULL, NULL, NULL);
+    net_shm_connected(s, fd);
+}
+
+static int net_shm_server_init(NetShmState *s, uint64_t ring_size)
+{
+    char name[64];
+    void *p;
+
+    snprintf(name, sizeof(name), "/qemu-net-shm-%d-%p", getpid(), s);
+    s->fds[NET_SHM_FD_MEM] = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (s->fds[NET_SHM_FD_MEM] < 0) {
+        error_report("shm: could not create shared memory: %s",
+                     strerror(errno));
+        return -1;
+    }
+    /* Only reachable through the fd we pass to the peer */
+    shm_unlink(name);
+
+    s->size = sizeof(NetShmHeader) + 2 * ring_size;
+    if (ftruncate(s->fds[NET_SHM_FD_MEM], s->size) < 0) {
+        error_report("shm: could not size shared memory: %s",
+                     strerror(errno));
+        return -1;
+    }
+    p = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             s->fds[NET_SHM_FD_MEM], 0);
+    if (p == MAP_FAILED) {
+        error_report("shm: could not map shared memory: %s", strerror(errno));
+        return -1;
+    }
+    s->hdr = p;
+    s->hdr->magic = NET_SHM_MAGIC;
+    s->hdr->version = NET_SHM_VERSION;
+    s->hdr->ring_size = ring_size;
+
+    s->fds[NET_SHM_FD_SERVER_DOORBELL] = eventfd(0, EFD_NONBLOCK);
+    s->fds[NET_SHM_FD_CLIENT_DOORBELL] = eventfd(0, EFD_NONBLOCK);
+    if (s->fds[NET_SHM_FD_SERVER_DOORBELL] < 0 ||
+        s->fds[NET_SHM_FD_CLIENT_DOORBELL] < 0) {
+        error_report("shm: could not create doorbells: %s", strerror(errno));
+        return -1;
+    }
+    net_shm_map(s);
+    net_shm_reset_rings(s);
+
+    s->listen_fd = unix_listen(s->path, NULL, 0);
+    if (s->listen_fd < 0) {
+        return -1;
+    }
+    qemu_set_fd_handler(s->listen_fd, net_shm_accept, NULL, s);
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "shm: waiting on %s", s->path);
+    return 0;
+}
+
+static int net_shm_client_init(NetShmState *s)
+{
+    NetShmHello hello;
+    char control[CMSG_SPACE(NET_SHM_NFDS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = &hello,
+        .iov_len = sizeof(hello),
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    uint32_t ring_size;
+    void *p;
+    int fd;
+
+    fd = unix_connect(s->path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (recvmsg(fd, &msgh, 0) != sizeof(hello)) {
+        goto proto_err;
+    }
+    cmsg = CMSG_FIRSTHDR(&msgh);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(NET_SHM_NFDS * sizeof(int))) {
+        goto proto_err;
+    }
+    memcpy(s->fds, CMSG_DATA(cmsg), NET_SHM_NFDS * sizeof(int));
+    if (hello.magic != NET_SHM_MAGIC || hello.version != NET_SHM_VERSION ||
+        hello.size < sizeof(NetShmHeader) + 2 * NET_SHM_MIN_SIZE ||
+        hello.size > sizeof(NetShmHeader) + 2 * NET_SHM_MAX_SIZE) {
+        goto proto_err;
+    }
+
+    s->size = hello.size;
+    p = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             s->fds[NET_SHM_FD_MEM], 0);
+    if (p == MAP_FAILED) {
+        error_report("shm: could not map shared memory: %s", strerror(errno));
+        closesocket(fd);
+        return -1;
+    }
+    s->hdr = p;
+
+    ring_size = s->hdr->ring_size;
+    if (s->hdr->magic != NET_SHM_MAGIC || (ring_size & (ring_size - 1)) ||
+        s->size != sizeof(NetShmHeader) + 2 * (uint64_t)ring_size) {
+        goto proto_err;
+    }
+
+    net_shm_map(s);
+    net_shm_connected(s, fd);
+    return 0;
+
+proto_err:
+    error_report("shm: %s is not a compatible shm netdev", s->path);
+    closesocket(fd);
+    return -1;
+}
+
+static void net_shm_cleanup(NetClientState *nc)
+{
+    NetShmState *s = DO_UPCAST(NetShmState, nc, nc);
+    int i;
+
+    if (s->conn_fd >= 0) {
+        qemu_set_fd_handler(s->conn_fd, NULL, NULL, NULL);
+        qemu_set_fd_handler(s->doorbell, NULL, NULL, NULL);
+        closesocket(s->conn_fd);
+        s->conn_fd = -1;
+    }
+    if (s->listen_fd >= 0) {
+        qemu_set_fd_handler(s->listen_fd, NULL, NULL, NULL);
+        closesocket(s->listen_fd);
+        unlink(s->path);
+        s->listen_fd = -1;
+    }
+    if (s->hdr) {
+        munmap(s->hdr, s->size);
+        s->hdr = NULL;
+    }
+    for (i = 0; i < NET_SHM_NFDS; i++) {
+        if (s->fds[i] >= 0) {
+            close(s->fds[i]);
+            s->fds[i] = -1;
+        }
+    }
+    qemu_bh_delete(s->rx_bh);
+    g_free(s->path);
+}
+
+static void net_shm_print_info(NetClientState *nc, Monitor *mon)
+{
+    NetShmState *s = DO_UPCAST(NetShmState, nc, nc);
+
+    monitor_printf(mon, "    shm: tx=%" PRIu64 " tx full=%" PRIu64
+                   " rx=%" PRIu64 " kicks sent=%" PRIu64
+                   " received=%" PRIu64 "\n",
+                   s->stats.tx_packets, s->stats.tx_full,
+                   s->stats.rx_packets, s->stats.kicks_sent,
+                   s->stats.kicks_received);
+}
+
+static NetClientInfo net_shm_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_SHM,
+    .size = sizeof(NetShmState),
+    .receive = net_shm_receive,
+    .receive_iov = net_shm_receive_iov,
+    .cleanup = net_shm_cleanup,
+    .print_info = net_shm_print_info,
+};
+
+int net_init_shm(const NetClientOptions *opts, const char *name,
+                 NetClientState *peer)
+{
+    const NetdevShmOptions *shm;
+    uint64_t ring_size = NET_SHM_DEFAULT_SIZE;
+    NetClientState *nc;
+    NetShmState *s;
+    int i, ret;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_SHM);
+    shm = opts->shm;
+
+    if (shm->has_size) {
+        ring_size = shm->size;
+        if (ring_size < NET_SHM_MIN_SIZE || ring_size > NET_SHM_MAX_SIZE ||
+            (ring_size & (ring_size - 1))) {
+            error_report("shm: size must be a power of two between %d "
+                         "and %d bytes", NET_SHM_MIN_SIZE, NET_SHM_MAX_SIZE);
+            return -1;
+        }
+        if (!shm->has_server || !shm->server) {
+            error_report("shm: size= is only valid with server=on");
+            return -1;
+        }
+    }
+
+    nc = qemu_new_net_client(&net_shm_info, peer, "shm", name);
+    s = DO_UPCAST(NetShmState, nc, nc);
+    s->server = shm->has_server && shm->server;
+    s->path = g_strdup(shm->path);
+    s->listen_fd = -1;
+    s->conn_fd = -1;
+    for (i = 0; i < NET_SHM_NFDS; i++) {
+        s->fds[i] = -1;
+    }
+    s->rx_bh = qemu_bh_new(net_shm_rx_bh, s);
+
+    ret = s->server ? net_shm_server_init(s, ring_size) :
+                      net_shm_client_init(s);
+    if (ret < 0) {
+        qemu_del_net_client(nc);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,18 @@
+/*
+ * Shared memory network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_SHM_H
+#define QEMU_NET_SHM_H
+
+#include "net.h"
+#include "qapi-types.h"
+
+int net_init_shm(const NetClientOptions *opts, const char *name,
+                 NetClientState *peer);
+
+#endif /* QEMU_NET_SHM_H */
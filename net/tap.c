@@ -49,16 +49,24 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Number of packets read from the tap device in one go and then handed to
+ * the peer as a single burst
+ */
+#define TAP_RX_BATCH 16
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[TAP_BUFSIZE];
+    uint8_t *rx_ring[TAP_RX_BATCH];
+    int rx_len[TAP_RX_BATCH];
     unsigned int read_poll : 1;
     unsigned int write_poll : 1;
     unsigned int using_vnet_hdr : 1;
     unsigned int has_ufo: 1;
+    unsigned int enabled : 1;
+    unsigned int rx_queued;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
 } TAPState;
@@ -72,9 +80,9 @@ static void tap_writable(void *opaque);
 static void tap_update_fd_handler(TAPState *s)
 {
     qemu_set_fd_handler2(s->fd,
-                         s->read_poll  ? tap_can_send : NULL,
-                         s->read_poll  ? tap_send     : NULL,
-                         s->write_poll ? tap_writable : NULL,
+                         s->read_poll && s->enabled  ? tap_can_send : NULL,
+                         s->read_poll && s->enabled  ? tap_send     : NULL,
+                         s->write_poll && s->enabled ? tap_writable : NULL,
                          s);
 }
 
@@ -186,32 +194,62 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
-    tap_read_poll(s, 1);
+
+    if (--s->rx_queued == 0) {
+        tap_read_poll(s, 1);
+    }
+}
+
+static int tap_read_burst(TAPState *s)
+{
+    int count, size;
+
+    for (count = 0; count < TAP_RX_BATCH; count++) {
+        size = tap_read_packet(s->fd, s->rx_ring[count], TAP_BUFSIZE);
+        if (size <= 0) {
+            break;
+        }
+        s->rx_len[count] = size;
+    }
+
+    return count;
 }
 
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    int count, i;
 
     do {
-        uint8_t *buf = s->buf;
-
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
+        count = tap_read_burst(s);
+        if (count == 0) {
             break;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
+        qemu_send_batch_begin(&s->nc);
+        for (i = 0; i < count; i++) {
+            uint8_t *buf = s->rx_ring[i];
+            int size = s->rx_len[i];
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, 0);
+            /* Once the peer stops accepting packets the rest of the burst
+             * is queued by reference to the ring, so it may only be refilled
+             * after tap_send_completed has run for every queued packet.
+             */
+            size = qemu_send_packet_async(&s->nc, buf, size,
+                                          tap_send_completed);
+            if (size == 0) {
+                s->rx_queued++;
+                tap_read_poll(s, 0);
+            }
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+        qemu_send_batch_end(&s->nc);
+    } while (count == TAP_RX_BATCH && s->read_poll &&
+             qemu_can_send_packet(&s->nc));
 }
 
 int tap_has_ufo(NetClientState *nc)
@@ -279,6 +317,7 @@ void tap_set_offload(NetClientState *nc, int csum, int tso4,
 static void tap_cleanup(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int i;
 
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
@@ -294,6 +333,11 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, 0);
     close(s->fd);
     s->fd = -1;
+
+    for (i = 0; i < TAP_RX_BATCH; i++) {
+        g_free(s->rx_ring[i]);
+        s->rx_ring[i] = NULL;
+    }
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -303,6 +347,15 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_print_info(NetClientState *nc, Monitor *mon)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_print_info(s->vhost_net, mon);
+    }
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -320,6 +373,7 @@ static NetClientInfo net_tap_info = {
     .receive_iov = tap_receive_iov,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
+    .print_info = tap_print_info,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -330,15 +384,20 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
 {
     NetClientState *nc;
     TAPState *s;
+    int i;
 
     nc = qemu_new_net_client(&net_tap_info, peer, model, name);
 
     s = DO_UPCAST(TAPState, nc, nc);
 
     s->fd = fd;
+    for (i = 0; i < TAP_RX_BATCH; i++) {
+        s->rx_ring[i] = g_malloc(TAP_BUFSIZE);
+    }
     s->host_vnet_hdr_len = vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
     s->using_vnet_hdr = 0;
     s->has_ufo = tap_probe_has_ufo(s->fd);
+    s->enabled = 1;
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     tap_read_poll(s, 1);
     s->vhost_net = NULL;
@@ -551,17 +610,10 @@ int net_init_bridge(const NetClientOptions *opts, const char *name,
 
 static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
                         const char *setup_script, char *ifname,
-                        size_t ifname_sz)
+                        size_t ifname_sz, int mq_required)
 {
     int fd, vnet_hdr_required;
 
-    if (tap->has_ifname) {
-        pstrcpy(ifname, ifname_sz, tap->ifname);
-    } else {
-        assert(ifname_sz > 0);
-        ifname[0] = '\0';
-    }
-
     if (tap->has_vnet_hdr) {
         *vnet_hdr = tap->vnet_hdr;
         vnet_hdr_required = *vnet_hdr;
@@ -570,7 +622,8 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, ifname_sz, vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, ifname_sz, vnet_hdr, vnet_hdr_required,
+                      mq_required));
     if (fd < 0) {
         return -1;
     }
@@ -586,27 +639,100 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
     return fd;
 }
 
+static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
+                            const char *model, const char *name,
+                            const char *ifname, const char *script,
+                            const char *downscript, int vnet_hdr, int fd,
+                            unsigned int queue_index)
+{
+    TAPState *s;
+
+    s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
+    if (!s) {
+        close(fd);
+        return -1;
+    }
+
+    s->nc.queue_index = queue_index;
+
+    if (tap_set_sndbuf(s->fd, tap) < 0) {
+        goto fail;
+    }
+
+    if (tap->has_fd) {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
+    } else if (tap->has_helper) {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "helper=%s",
+                 tap->helper);
+    } else {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "ifname=%s,script=%s,downscript=%s", ifname, script,
+                 downscript);
+
+        if (strcmp(downscript, "no") != 0) {
+            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
+            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
+        }
+    }
+
+    if (tap->has_vhost ? tap->vhost :
+        tap->has_vhostfd || (tap->has_vhostforce && tap->vhostforce)) {
+        int vhostfd;
+
+        if (tap->has_vhostfd) {
+            vhostfd = net_handle_fd_param(cur_mon, tap->vhostfd);
+            if (vhostfd == -1) {
+                goto fail;
+            }
+        } else {
+            vhostfd = -1;
+        }
+
+        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
+                                      tap->has_vhostforce && tap->vhostforce);
+        if (!s->vhost_net) {
+            error_report("vhost-net requested but could not be initialized");
+            goto fail;
+        }
+    } else if (tap->has_vhostfd) {
+        error_report("vhostfd= is not valid without vhost");
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    /* closes the fd, and runs the down script if one was set up */
+    qemu_del_net_client(&s->nc);
+    return -1;
+}
+
 int net_init_tap(const NetClientOptions *opts, const char *name,
                  NetClientState *peer)
 {
     const NetdevTapOptions *tap;
-
-    int fd, vnet_hdr = 0;
-    const char *model;
-    TAPState *s;
+    int fd, vnet_hdr = 0, i;
+    unsigned int queues;
 
     /* for the no-fd, no-helper case */
     const char *script = NULL; /* suppress wrong "uninit'd use" gcc warning */
+    const char *downscript = NULL;
     char ifname[128];
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_TAP);
     tap = opts->tap;
+    queues = tap->has_queues ? tap->queues : 1;
+
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("queues= must be between 1 and %d", MAX_QUEUE_NUM);
+        return -1;
+    }
 
     if (tap->has_fd) {
         if (tap->has_ifname || tap->has_script || tap->has_downscript ||
-            tap->has_vnet_hdr || tap->has_helper) {
+            tap->has_vnet_hdr || tap->has_helper || tap->has_queues) {
             error_report("ifname=, script=, downscript=, vnet_hdr=, "
-                         "and helper= are invalid with fd=");
+                         "helper=, and queues= are invalid with fd=");
             return -1;
         }
 
@@ -619,13 +745,13 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         vnet_hdr = tap_probe_vnet_hdr(fd);
 
-        model = "tap";
-
+        return net_init_tap_one(tap, peer, "tap", name, NULL, NULL, NULL,
+                                vnet_hdr, fd, 0);
     } else if (tap->has_helper) {
         if (tap->has_ifname || tap->has_script || tap->has_downscript ||
-            tap->has_vnet_hdr) {
-            error_report("ifname=, script=, downscript=, and vnet_hdr= "
-                         "are invalid with helper=");
+            tap->has_vnet_hdr || tap->has_queues) {
+            error_report("ifname=, script=, downscript=, vnet_hdr=, "
+                         "and queues= are invalid with helper=");
             return -1;
         }
 
@@ -638,74 +764,59 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         vnet_hdr = tap_probe_vnet_hdr(fd);
 
-        model = "bridge";
-
-    } else {
-        script = tap->has_script ? tap->script : DEFAULT_NETWORK_SCRIPT;
-        fd = net_tap_init(tap, &vnet_hdr, script, ifname, sizeof ifname);
-        if (fd == -1) {
-            return -1;
-        }
-
-        model = "tap";
+        return net_init_tap_one(tap, peer, "bridge", name, NULL, NULL, NULL,
+                                vnet_hdr, fd, 0);
     }
 
-    s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
-    if (!s) {
-        close(fd);
+    if (queues > 1 && (peer || tap->has_vhostfd)) {
+        error_report("queues= is invalid with vlan= and vhostfd=");
         return -1;
     }
 
-    if (tap_set_sndbuf(s->fd, tap) < 0) {
-        return -1;
-    }
+    script = tap->has_script ? tap->script : DEFAULT_NETWORK_SCRIPT;
+    downscript = tap->has_downscript ? tap->downscript :
+                                       DEFAULT_NETWORK_DOWN_SCRIPT;
 
-    if (tap->has_fd) {
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
-    } else if (tap->has_helper) {
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "helper=%s",
-                 tap->helper);
+    if (tap->has_ifname) {
+        pstrcpy(ifname, sizeof ifname, tap->ifname);
     } else {
-        const char *downscript;
-
-        downscript = tap->has_downscript ? tap->downscript :
-                                           DEFAULT_NETWORK_DOWN_SCRIPT;
-
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
-                 "ifname=%s,script=%s,downscript=%s", ifname, script,
-                 downscript);
-
-        if (strcmp(downscript, "no") != 0) {
-            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
-            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
-        }
+        ifname[0] = '\0';
     }
 
-    if (tap->has_vhost ? tap->vhost :
-        tap->has_vhostfd || (tap->has_vhostforce && tap->vhostforce)) {
-        int vhostfd;
-
-        if (tap->has_vhostfd) {
-            vhostfd = net_handle_fd_param(cur_mon, tap->vhostfd);
-            if (vhostfd == -1) {
-                return -1;
-            }
-        } else {
-            vhostfd = -1;
+    /* All queues attach to the interface created by the first open, and
+     * only that one runs the setup and shutdown scripts.
+     */
+    for (i = 0; i < queues; i++) {
+        fd = net_tap_init(tap, &vnet_hdr, i >= 1 ? "no" : script,
+                          ifname, sizeof ifname, queues > 1);
+        if (fd == -1) {
+            goto fail;
         }
 
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
-                                      tap->has_vhostforce && tap->vhostforce);
-        if (!s->vhost_net) {
-            error_report("vhost-net requested but could not be initialized");
-            return -1;
+        if (net_init_tap_one(tap, peer, "tap", name, ifname,
+                             i >= 1 ? "no" : script,
+                             i >= 1 ? "no" : downscript,
+                             vnet_hdr, fd, i)) {
+            goto fail;
         }
-    } else if (tap->has_vhostfd) {
-        error_report("vhostfd= is not valid without vhost");
-        return -1;
     }
 
     return 0;
+
+fail:
+    /* Queue i cleaned up after itself; drop the ones that were created */
+    if (i > 0) {
+        NetClientState *ncs[MAX_QUEUE_NUM];
+        int nqueues, j;
+
+        nqueues = qemu_find_net_clients_except(name, ncs,
+                                               NET_CLIENT_OPTIONS_KIND_NIC,
+                                               MAX_QUEUE_NUM);
+        for (j = 0; j < nqueues; j++) {
+            qemu_del_net_client(ncs[j]);
+        }
+    }
+    return -1;
 }
 
 VHostNetState *tap_get_vhost_net(NetClientState *nc)
@@ -714,3 +825,41 @@ VHostNetState *tap_get_vhost_net(NetClientState *nc)
     assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP);
     return s->vhost_net;
 }
+
+int tap_enable(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    if (s->enabled) {
+        return 0;
+    }
+
+    ret = tap_fd_enable(s->fd);
+    if (ret == 0) {
+        s->enabled = 1;
+        tap_update_fd_handler(s);
+    }
+    return ret;
+}
+
+int tap_disable(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    if (!s->enabled) {
+        return 0;
+    }
+
+    ret = tap_fd_disable(s->fd);
+    if (ret == 0) {
+        qemu_purge_queued_packets(nc);
+        /* purged packets never complete */
+        s->rx_queued = 0;
+        s->read_poll = 1;
+        s->enabled = 0;
+        tap_update_fd_handler(s);
+    }
+    return ret;
+}
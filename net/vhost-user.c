@@ -0,0 +1,110 @@
+/*
+ * vhost-user network backend
+ *
+ * The guest's rings are served by another process that is reached over
+ * a UNIX domain socket, see hw/vhost-user.h.  Packets never pass through
+ * QEMU, so this client only exists to own the vhost device.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "net/vhost-user.h"
+
+#include "net.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu_socket.h"
+#include "qerror.h"
+#include "migration.h"
+#include "hw/vhost_net.h"
+
+typedef struct VhostUserState {
+    NetClientState nc;
+    VHostNetState *vhost_net;
+    Error *migration_blocker;
+} VhostUserState;
+
+static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    /* Only reached while vhost is stopped; there is nowhere to send to */
+    return size;
+}
+
+static void vhost_user_cleanup(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = NULL;
+    }
+    if (s->migration_blocker) {
+        migrate_del_blocker(s->migration_blocker);
+        error_free(s->migration_blocker);
+        s->migration_blocker = NULL;
+    }
+}
+
+static void vhost_user_print_info(NetClientState *nc, Monitor *mon)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    vhost_net_print_info(s->vhost_net, mon);
+}
+
+static NetClientInfo net_vhost_user_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_VHOST_USER,
+    .size = sizeof(VhostUserState),
+    .receive = vhost_user_receive,
+    .cleanup = vhost_user_cleanup,
+    .print_info = vhost_user_print_info,
+};
+
+VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->vhost_net;
+}
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer)
+{
+    const NetdevVhostUserOptions *vhost_user;
+    NetClientState *nc;
+    VhostUserState *s;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_user = opts->vhost_user;
+
+    fd = unix_connect(vhost_user->path);
+    if (fd < 0) {
+        error_report("vhost-user: could not connect to %s", vhost_user->path);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_vhost_user_info, peer, "vhost-user", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "path=%s",
+             vhost_user->path);
+
+    s = DO_UPCAST(VhostUserState, nc, nc);
+    s->vhost_net = vhost_net_init(nc, fd, vhost_user->has_vhostforce &&
+                                          vhost_user->vhostforce);
+    if (!s->vhost_net) {
+        error_report("vhost-user: initialization with %s failed",
+                     vhost_user->path);
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    /* The backend cannot log dirty guest memory yet, see vhost_user_call */
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "vhost-user", name);
+    migrate_add_blocker(s->migration_blocker);
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * vhost-user network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_VHOST_USER_H
+#define QEMU_NET_VHOST_USER_H
+
+#include "net.h"
+#include "qapi-types.h"
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer);
+
+struct vhost_net;
+struct vhost_net *vhost_user_get_vhost_net(NetClientState *nc);
+
+#endif /* QEMU_NET_VHOST_USER_H */
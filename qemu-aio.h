@@ -16,6 +16,9 @@
 
 #include "qemu-common.h"
 #include "qemu-char.h"
+#include "qemu-queue.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
 
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -41,6 +44,170 @@ void qemu_aio_release(void *p);
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
 typedef int (AioFlushHandler)(void *opaque);
 
+typedef struct AioHandler AioHandler;
+typedef struct ThreadPool ThreadPool;
+
+/*
+ * An AioContext is an event loop of its own: file descriptor handlers,
+ * bottom halves and timers that are only ever run by aio_poll() and
+ * aio_wait() on that context.
+ *
+ * The main context, qemu_get_aio_context(), is the one behind the
+ * qemu_aio_*() and qemu_bh_*() functions and is run by the main loop.
+ * Other contexts are created with aio_context_new() and are usually run
+ * by a thread of their own, see aio_context_start_thread().
+ *
+ * A context is run by one thread at a time.  Other threads that want to
+ * touch its handlers, or a BlockDriverState bound to it, first take it
+ * over with aio_context_acquire().
+ */
+typedef struct AioContext {
+    /* Handlers are registered here for the whole of their life */
+    QEMUPoll *poll;
+    QLIST_HEAD(, AioHandler) aio_handlers;
+
+    /* Handlers are only freed when nobody walks the list */
+    int walking_handlers;
+
+    /* Anchor of the list of bottom halves belonging to the context.
+     * bh_lock serializes adding and unlinking; walking needs no lock.
+     */
+    struct QEMUBH *first_bh;
+    int walking_bh;
+    QemuMutex bh_lock;
+
+    /* Timers, run by aio_poll(); the main context's timers use rt_clock
+     * and are run by the main loop instead.
+     */
+    QEMUClock *clock;
+
+    /* Wakes up aio_poll() from other threads.  notify_pending is set
+     * while a wakeup is in flight, so that further ones are skipped.
+     */
+    int notify_rfd, notify_wfd;
+    int notify_pending;
+
+    /* Created on demand by aio_get_thread_pool() */
+    ThreadPool *thread_pool;
+
+    /* Called with the context by aio_context_free(), before tearing down */
+    NotifierList free_notifiers;
+
+    /* Dedicated thread, see aio_context_start_thread() */
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    bool thread_running;
+    bool thread_stopping;
+    bool thread_parked;
+    QemuThread owner;       /* valid while acquire_count > 0 */
+    int acquire_count;
+} AioContext;
+
+/**
+ * aio_context_new: Create a new event loop context.
+ *
+ * The context is not run by anybody until aio_context_start_thread() is
+ * called or somebody calls aio_poll() on it.
+ */
+AioContext *aio_context_new(void);
+
+/**
+ * aio_context_free: Destroy a context.
+ *
+ * The thread must have been stopped and all handlers, bottom halves and
+ * timers of the context must be gone already.
+ */
+void aio_context_free(AioContext *ctx);
+
+/**
+ * qemu_get_aio_context: Return the context run by the main loop.
+ */
+AioContext *qemu_get_aio_context(void);
+
+/**
+ * aio_context_start_thread: Run @ctx in a thread of its own.
+ *
+ * The thread calls aio_poll() in a loop until aio_context_stop_thread().
+ */
+void aio_context_start_thread(AioContext *ctx);
+
+/**
+ * aio_context_stop_thread: Stop and join the thread of @ctx.
+ *
+ * Callbacks that are running finish first; afterwards the caller owns the
+ * context and may run it with aio_poll() itself, for example to wait for
+ * outstanding requests.
+ */
+void aio_context_stop_thread(AioContext *ctx);
+
+/**
+ * aio_context_acquire: Take over a context from its thread.
+ *
+ * Waits until the thread of @ctx is idle between two iterations and
+ * keeps it there until aio_context_release().  In the meantime the caller
+ * may run the context with aio_poll() and use the objects bound to it.
+ * Calls nest.  Does nothing special if @ctx has no thread.
+ */
+void aio_context_acquire(AioContext *ctx);
+void aio_context_release(AioContext *ctx);
+
+/**
+ * aio_notify: Force aio_poll() on @ctx to wake up.
+ *
+ * This is how bottom halves scheduled from another thread and timers
+ * armed from another thread are noticed.  Can be called from any thread;
+ * calls made before the context has woken up are coalesced into one.
+ */
+void aio_notify(AioContext *ctx);
+
+/**
+ * aio_bh_new: Allocate a bottom half that runs in @ctx.
+ *
+ * Like qemu_bh_new(), which creates bottom halves in the main context.
+ */
+QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
+
+/* Run the scheduled bottom halves of @ctx.  Returns 1 if a bottom half
+ * other than an idle one was run.
+ */
+int aio_bh_poll(AioContext *ctx);
+
+/* Shorten @timeout (in milliseconds) to suit the scheduled bottom halves */
+void aio_bh_update_timeout(AioContext *ctx, uint32_t *timeout);
+
+/**
+ * aio_timer_new: Allocate a timer that runs in @ctx.
+ *
+ * The timer counts real time; arm it with qemu_mod_timer() relative to
+ * qemu_get_clock_ns(rt_clock) scaled by @scale.
+ */
+QEMUTimer *aio_timer_new(AioContext *ctx, int scale,
+                         QEMUTimerCB *cb, void *opaque);
+
+/**
+ * aio_poll: Run one iteration of @ctx.
+ *
+ * Runs scheduled bottom halves, then the handlers that are ready and the
+ * expired timers.  If @blocking is true and nothing could be run right
+ * away, waits for an event first.  Unlike aio_wait(), handlers without
+ * an io_flush callback are enough to block.
+ *
+ * Returns whether any callback was run.
+ */
+bool aio_poll(AioContext *ctx, bool blocking);
+
+/* qemu_aio_wait() and qemu_aio_flush() for a context */
+bool aio_wait(AioContext *ctx);
+void aio_flush(AioContext *ctx);
+
+/* qemu_aio_set_fd_handler() for a context */
+void aio_set_fd_handler(AioContext *ctx, int fd,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioFlushHandler *io_flush,
+                        void *opaque);
+
 /* Flush any pending AIO operation. This function will block until all
  * outstanding AIO operations have been completed or cancelled. */
 void qemu_aio_flush(void);
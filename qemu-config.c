@@ -110,6 +110,38 @@ static QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total I/O operations per second during bursts",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations per second during bursts",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations per second during bursts",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes per second during bursts",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes per second during bursts",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes per second during bursts",
+        },{
+            .name = "burst_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "how long a burst may last, in seconds",
+        },{
+            .name = "throttling.group",
+            .type = QEMU_OPT_STRING,
+            .help = "throttle group, whose drives share their I/O limits",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
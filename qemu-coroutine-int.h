@@ -41,6 +41,40 @@ struct Coroutine {
     QTAILQ_ENTRY(Coroutine) co_queue_next;
 };
 
+/**
+ * Per-thread free list of terminated coroutines
+ *
+ * Backends whose coroutines can run another entry point after terminating
+ * keep one of these in their thread state and return it from
+ * qemu_coroutine_get_pool(); qemu_coroutine_create() then recycles them
+ * instead of allocating a new stack every time.
+ */
+typedef struct CoroutinePool {
+    QSLIST_HEAD(, Coroutine) free;
+    unsigned int size;
+    uint64_t hits;
+    uint64_t misses;
+    QLIST_ENTRY(CoroutinePool) list;
+} CoroutinePool;
+
+/**
+ * Return the calling thread's pool, or NULL if the backend cannot reuse
+ * coroutines
+ */
+CoroutinePool *qemu_coroutine_get_pool(void);
+
+/**
+ * Set up the pool of a new thread, and count it in the statistics
+ */
+void qemu_coroutine_pool_init(CoroutinePool *pool);
+
+/**
+ * Free all coroutines in a pool when its thread exits
+ *
+ * The hits and misses of the pool remain part of the statistics.
+ */
+void qemu_coroutine_pool_cleanup(CoroutinePool *pool);
+
 Coroutine *qemu_coroutine_new(void);
 void qemu_coroutine_delete(Coroutine *co);
 CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
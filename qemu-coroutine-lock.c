@@ -27,6 +27,7 @@
 #include "qemu-coroutine-int.h"
 #include "qemu-queue.h"
 #include "main-loop.h"
+#include "qemu-timer.h"
 #include "trace.h"
 
 static QTAILQ_HEAD(, Coroutine) unlock_bh_queue =
@@ -96,6 +97,67 @@ bool qemu_co_queue_empty(CoQueue *queue)
     return (QTAILQ_FIRST(&queue->entries) == NULL);
 }
 
+/* Registered locks, only touched from the main loop */
+static QTAILQ_HEAD(, CoLockStats) registered_locks =
+    QTAILQ_HEAD_INITIALIZER(registered_locks);
+
+void qemu_co_lock_stats_register(CoLockStats *stats, const char *name)
+{
+    assert(!stats->name);
+    stats->name = g_strdup(name);
+    QTAILQ_INSERT_TAIL(&registered_locks, stats, next);
+}
+
+void qemu_co_lock_stats_unregister(CoLockStats *stats)
+{
+    if (stats->name) {
+        QTAILQ_REMOVE(&registered_locks, stats, next);
+        g_free(stats->name);
+        stats->name = NULL;
+    }
+}
+
+void qemu_co_lock_stats_dump(FILE *f, fprintf_function cpu_fprintf)
+{
+    CoLockStats *stats;
+
+    if (QTAILQ_EMPTY(&registered_locks)) {
+        cpu_fprintf(f, "No coroutine locks registered\n");
+        return;
+    }
+
+    QTAILQ_FOREACH(stats, &registered_locks, next) {
+        cpu_fprintf(f, "%s: %" PRIu64 " acquisitions, %" PRIu64
+                    " contended, wait avg %" PRIu64 " us max %" PRIu64
+                    " us, waiters %u (max %u)\n",
+                    stats->name, stats->acquisitions, stats->contended,
+                    stats->contended ?
+                    stats->wait_ns / stats->contended / SCALE_US : 0,
+                    stats->max_wait_ns / SCALE_US,
+                    stats->waiters, stats->max_waiters);
+    }
+}
+
+static int64_t co_lock_wait_begin(CoLockStats *stats)
+{
+    stats->contended++;
+    if (++stats->waiters > stats->max_waiters) {
+        stats->max_waiters = stats->waiters;
+    }
+    return get_clock();
+}
+
+static void co_lock_wait_end(CoLockStats *stats, int64_t start)
+{
+    uint64_t wait_ns = get_clock() - start;
+
+    stats->waiters--;
+    stats->wait_ns += wait_ns;
+    if (wait_ns > stats->max_wait_ns) {
+        stats->max_wait_ns = wait_ns;
+    }
+}
+
 void qemu_co_mutex_init(CoMutex *mutex)
 {
     memset(mutex, 0, sizeof(*mutex));
@@ -105,14 +167,20 @@ void qemu_co_mutex_init(CoMutex *mutex)
 void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
 {
     Coroutine *self = qemu_coroutine_self();
+    int64_t start;
 
     trace_qemu_co_mutex_lock_entry(mutex, self);
 
-    while (mutex->locked) {
-        qemu_co_queue_wait(&mutex->queue);
+    if (mutex->locked) {
+        start = co_lock_wait_begin(&mutex->stats);
+        while (mutex->locked) {
+            qemu_co_queue_wait(&mutex->queue);
+        }
+        co_lock_wait_end(&mutex->stats, start);
     }
 
     mutex->locked = true;
+    mutex->stats.acquisitions++;
 
     trace_qemu_co_mutex_lock_return(mutex, self);
 }
@@ -136,14 +204,26 @@ void qemu_co_rwlock_init(CoRwlock *lock)
 {
     memset(lock, 0, sizeof(*lock));
     qemu_co_queue_init(&lock->queue);
+    qemu_co_queue_init(&lock->wqueue);
 }
 
+/*
+ * Waiters do not recheck the lock when they run: qemu_co_rwlock_unlock()
+ * already made them owners when it woke them up.
+ */
+
 void qemu_co_rwlock_rdlock(CoRwlock *lock)
 {
-    while (lock->writer) {
+    int64_t start;
+
+    if (lock->writer || !qemu_co_queue_empty(&lock->wqueue)) {
+        start = co_lock_wait_begin(&lock->stats);
         qemu_co_queue_wait(&lock->queue);
+        co_lock_wait_end(&lock->stats, start);
+    } else {
+        lock->reader++;
     }
-    lock->reader++;
+    lock->stats.acquisitions++;
 }
 
 void qemu_co_rwlock_unlock(CoRwlock *lock)
@@ -151,21 +231,31 @@ void qemu_co_rwlock_unlock(CoRwlock *lock)
     assert(qemu_in_coroutine());
     if (lock->writer) {
         lock->writer = false;
-        qemu_co_queue_restart_all(&lock->queue);
+        /* Readers that queued behind this writer go first */
+        while (qemu_co_queue_next(&lock->queue)) {
+            lock->reader++;
+        }
     } else {
         lock->reader--;
         assert(lock->reader >= 0);
-        /* Wakeup only one waiting writer */
-        if (!lock->reader) {
-            qemu_co_queue_next(&lock->queue);
-        }
+    }
+
+    /* Wakeup only one waiting writer */
+    if (!lock->reader && qemu_co_queue_next(&lock->wqueue)) {
+        lock->writer = true;
     }
 }
 
 void qemu_co_rwlock_wrlock(CoRwlock *lock)
 {
-    while (lock->writer || lock->reader) {
-        qemu_co_queue_wait(&lock->queue);
+    int64_t start;
+
+    if (lock->writer || lock->reader) {
+        start = co_lock_wait_begin(&lock->stats);
+        qemu_co_queue_wait(&lock->wqueue);
+        co_lock_wait_end(&lock->stats, start);
+    } else {
+        lock->writer = true;
     }
-    lock->writer = true;
+    lock->stats.acquisitions++;
 }
@@ -16,10 +16,130 @@
 #include "qemu-common.h"
 #include "qemu-coroutine.h"
 #include "qemu-coroutine-int.h"
+#include "qemu-thread.h"
+
+enum {
+    /* Default bound of each thread's free pool */
+    POOL_DEFAULT_MAX_SIZE = 64,
+};
+
+/* Read and written with atomics, since every thread checks it */
+static unsigned int pool_max_size = POOL_DEFAULT_MAX_SIZE;
+
+/* The pools of all threads, for the statistics */
+static QemuMutex pool_list_lock;
+static QLIST_HEAD(, CoroutinePool) pool_list =
+    QLIST_HEAD_INITIALIZER(pool_list);
+static uint64_t pool_exited_hits;
+static uint64_t pool_exited_misses;
+
+static void __attribute__((constructor)) coroutine_pool_init(void)
+{
+    qemu_mutex_init(&pool_list_lock);
+}
+
+static unsigned int coroutine_pool_max_size(void)
+{
+    return g_atomic_int_get((gint *)&pool_max_size);
+}
+
+static Coroutine *coroutine_pool_get(void)
+{
+    CoroutinePool *pool = qemu_coroutine_get_pool();
+    Coroutine *co;
+
+    if (!pool) {
+        return qemu_coroutine_new();
+    }
+
+    co = QSLIST_FIRST(&pool->free);
+    if (co) {
+        QSLIST_REMOVE_HEAD(&pool->free, pool_next);
+        pool->size--;
+        pool->hits++;
+    } else {
+        co = qemu_coroutine_new();
+        pool->misses++;
+    }
+    return co;
+}
+
+static void coroutine_pool_put(Coroutine *co)
+{
+    CoroutinePool *pool = qemu_coroutine_get_pool();
+
+    if (pool && pool->size < coroutine_pool_max_size()) {
+        co->caller = NULL;
+        QSLIST_INSERT_HEAD(&pool->free, co, pool_next);
+        pool->size++;
+        return;
+    }
+    qemu_coroutine_delete(co);
+}
+
+void qemu_coroutine_pool_init(CoroutinePool *pool)
+{
+    QSLIST_INIT(&pool->free);
+    qemu_mutex_lock(&pool_list_lock);
+    QLIST_INSERT_HEAD(&pool_list, pool, list);
+    qemu_mutex_unlock(&pool_list_lock);
+}
+
+void qemu_coroutine_pool_cleanup(CoroutinePool *pool)
+{
+    Coroutine *co;
+
+    qemu_mutex_lock(&pool_list_lock);
+    QLIST_REMOVE(pool, list);
+    pool_exited_hits += pool->hits;
+    pool_exited_misses += pool->misses;
+    qemu_mutex_unlock(&pool_list_lock);
+
+    while ((co = QSLIST_FIRST(&pool->free)) != NULL) {
+        QSLIST_REMOVE_HEAD(&pool->free, pool_next);
+        qemu_coroutine_delete(co);
+    }
+    pool->size = 0;
+}
+
+void qemu_coroutine_set_pool_max_size(unsigned int max_size)
+{
+    CoroutinePool *pool = qemu_coroutine_get_pool();
+    Coroutine *co;
+
+    g_atomic_int_set((gint *)&pool_max_size, max_size);
+
+    /* Pools of other threads only stop growing */
+    while (pool && pool->size > max_size) {
+        co = QSLIST_FIRST(&pool->free);
+        QSLIST_REMOVE_HEAD(&pool->free, pool_next);
+        pool->size--;
+        qemu_coroutine_delete(co);
+    }
+}
+
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats)
+{
+    CoroutinePool *pool;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->max_size = coroutine_pool_max_size();
+
+    qemu_mutex_lock(&pool_list_lock);
+    stats->hits = pool_exited_hits;
+    stats->misses = pool_exited_misses;
+    QLIST_FOREACH(pool, &pool_list, list) {
+        stats->size += pool->size;
+        stats->hits += pool->hits;
+        stats->misses += pool->misses;
+        stats->threads++;
+    }
+    qemu_mutex_unlock(&pool_list_lock);
+}
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
-    Coroutine *co = qemu_coroutine_new();
+    Coroutine *co = coroutine_pool_get();
     co->entry = entry;
     return co;
 }
@@ -35,7 +155,7 @@ static void coroutine_swap(Coroutine *from, Coroutine *to)
         return;
     case COROUTINE_TERMINATE:
         trace_qemu_coroutine_terminate(to);
-        qemu_coroutine_delete(to);
+        coroutine_pool_put(to);
         return;
     default:
         abort();
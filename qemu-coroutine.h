@@ -65,6 +65,38 @@ typedef void coroutine_fn CoroutineEntry(void *opaque);
  */
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry);
 
+/**
+ * Coroutine pool statistics, summed over all threads
+ *
+ * Terminated coroutines are kept in a bounded per-thread pool and reused by
+ * qemu_coroutine_create().  A hit is a creation served from the pool, a miss
+ * one that had to allocate a new coroutine.  Hits and misses of threads that
+ * have exited are included.
+ */
+typedef struct CoroutinePoolStats {
+    uint64_t hits;
+    uint64_t misses;
+    unsigned int size;          /* coroutines in the pools right now */
+    unsigned int threads;       /* threads that have a pool */
+    unsigned int max_size;      /* bound of each thread's pool */
+} CoroutinePoolStats;
+
+/**
+ * Bound the number of terminated coroutines that each thread keeps for reuse
+ *
+ * Zero disables pooling.  The calling thread's pool is trimmed immediately;
+ * other threads stop refilling theirs until they drop below the new bound.
+ */
+void qemu_coroutine_set_pool_max_size(unsigned int max_size);
+
+/**
+ * Fill in pool statistics
+ *
+ * Other threads update their counters without locking, so the sums may be
+ * slightly behind.
+ */
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats);
+
 /**
  * Transfer control to a coroutine
  *
@@ -142,12 +174,45 @@ void qemu_co_queue_restart_all(CoQueue *queue);
 bool qemu_co_queue_empty(CoQueue *queue);
 
 
+/**
+ * Contention statistics, kept by every CoMutex and CoRwlock
+ *
+ * Locks that are registered with qemu_co_lock_stats_register() are listed
+ * by qemu_co_lock_stats_dump(), e.g. for "info lockstats".
+ */
+typedef struct CoLockStats {
+    uint64_t acquisitions;      /* times the lock was taken */
+    uint64_t contended;         /* acquisitions that had to wait */
+    uint64_t wait_ns;           /* total time spent waiting */
+    uint64_t max_wait_ns;
+    unsigned int waiters;       /* coroutines waiting right now */
+    unsigned int max_waiters;
+    char *name;                 /* non-NULL while registered */
+    QTAILQ_ENTRY(CoLockStats) next;
+} CoLockStats;
+
+/**
+ * Make a lock's statistics visible under the given name
+ */
+void qemu_co_lock_stats_register(CoLockStats *stats, const char *name);
+
+/**
+ * Hide a lock's statistics again; must be called before the lock is freed
+ */
+void qemu_co_lock_stats_unregister(CoLockStats *stats);
+
+/**
+ * Print the statistics of all registered locks
+ */
+void qemu_co_lock_stats_dump(FILE *f, fprintf_function cpu_fprintf);
+
 /**
  * Provides a mutex that can be used to synchronise coroutines
  */
 typedef struct CoMutex {
     bool locked;
     CoQueue queue;
+    CoLockStats stats;
 } CoMutex;
 
 /**
@@ -168,10 +233,21 @@ void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex);
  */
 void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex);
 
+/**
+ * Provides a read/write lock that can be used to synchronise coroutines
+ *
+ * Writers are preferred: once a writer waits, new readers queue behind it.
+ * A writer that unlocks hands the lock to all readers that queued up in the
+ * meantime before the next writer gets it, so neither side can starve the
+ * other.  The lock is passed directly to the coroutines that are woken up,
+ * so that nobody can take it before they run.
+ */
 typedef struct CoRwlock {
     bool writer;
     int reader;
-    CoQueue queue;
+    CoQueue queue;              /* waiting readers */
+    CoQueue wqueue;             /* waiting writers */
+    CoLockStats stats;
 } CoRwlock;
 
 /**
@@ -182,8 +258,8 @@ void qemu_co_rwlock_init(CoRwlock *lock);
 
 /**
  * Read locks the CoRwlock. If the lock cannot be taken immediately because
- * of a parallel writer, control is transferred to the caller of the current
- * coroutine.
+ * of a parallel or waiting writer, control is transferred to the caller of
+ * the current coroutine.
  */
 void qemu_co_rwlock_rdlock(CoRwlock *lock);
 
@@ -150,6 +150,9 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [,burst_length=s][,throttling.group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -203,6 +206,14 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item bps_max=@var{b},bps_rd_max=@var{r},bps_wr_max=@var{w}
+@itemx iops_max=@var{i},iops_rd_max=@var{r},iops_wr_max=@var{w}
+Let an idle drive exceed the matching @option{bps} or @option{iops} limit,
+up to the given rate, for @option{burst_length} seconds (1 by default).
+@item throttling.group=@var{group}
+Put the drive in the throttle group @var{group}.  The drives of a group
+share one budget: the I/O limits apply to their requests taken together.
+By default every drive has a group of its own.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -1268,7 +1279,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' \n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1285,10 +1296,20 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to create n queues on a multiqueue capable TAP\n"
+    "                interface, one per virtio-net queue pair\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
     "                (default=" DEFAULT_BRIDGE_HELPER ")\n"
+    "-netdev vhost-user,id=str,path=path[,vhostforce=on|off]\n"
+    "                connect the guest's virtqueues to a vhost backend listening\n"
+    "                on the UNIX socket 'path'; guest memory must use -mem-path\n"
+#endif
+#ifdef CONFIG_EVENTFD
+    "-netdev shm,id=str,path=path[,server=on|off][,size=bytes]\n"
+    "                exchange packets with another QEMU process through shared\n"
+    "                memory rings, set up over the UNIX socket 'path'\n"
 #endif
     "-net socket[,vlan=n][,name=str][,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                connect the vlan 'n' to another VLAN using a socket connection\n"
@@ -1315,6 +1336,12 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
     "tap|"
     "bridge|"
+#ifndef _WIN32
+    "vhost-user|"
+#endif
+#ifdef CONFIG_EVENTFD
+    "shm|"
+#endif
 #ifdef CONFIG_VDE
     "vde|"
 #endif
@@ -1471,7 +1498,7 @@ processed and applied to -net user. Mixing them with the new configuration
 syntax gives undefined results. Their use for new applications is discouraged
 as they will be removed from future versions.
 
-@item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}]
+@item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}][,queues=@var{n}]
 Connect the host TAP network interface @var{name} to VLAN @var{n}.
 
 Use the network script @var{file} to configure it and the network script
@@ -1488,6 +1515,11 @@ helper executable is @file{/usr/local/libexec/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+@option{queues}=@var{n} opens @var{n} queues of a multiqueue capable host
+TAP interface.  It is only valid with @option{-netdev}; each queue is then
+used by one queue pair of a virtio-net device created with a matching
+@option{queues} property.
+
 Examples:
 
 @example
@@ -1625,6 +1657,52 @@ Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap}
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
 libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
 
+@item -netdev hubport,id=@var{id},hubid=@var{hubid}[,mode=hub|switch][,thread=on|off]
+Create a port on hub @var{hubid}, creating the hub if needed.  A hub in
+@option{mode=hub} (the default) sends every packet to all of its other ports.
+With @option{mode=switch} it learns the MAC addresses behind each port and
+forwards unicast packets only to the port that owns the destination address;
+broadcast, multicast and unknown destinations are still sent to all ports.
+@option{thread=on} moves forwarding to a worker thread of the hub, so that
+senders only queue their packets.  Both options apply to the whole hub and
+are taken from the port that creates it.
+
+@item -netdev shm,id=@var{id},path=@var{path}[,server=on|off][,size=@var{bytes}]
+Connect to another QEMU process on the same host through a pair of rings in
+shared memory.  The side started with @option{server=on} creates the shared
+memory and listens on the UNIX domain socket @var{path}; the other side
+connects to it and receives the memory and two eventfd doorbells over the
+socket.  Packets are copied once into the ring by the sender and handed to
+the receiving NIC directly from the ring, and doorbells are only rung when
+the other side is idle.  @option{size} sets the size of each ring (1M by
+default).
+
+@example
+# first instance
+qemu linux.img -device virtio-net-pci,netdev=n0 \
+     -netdev shm,id=n0,path=/tmp/vm-link.sock,server=on
+# second instance
+qemu linux.img -device virtio-net-pci,netdev=n0,mac=52:54:00:12:34:57 \
+     -netdev shm,id=n0,path=/tmp/vm-link.sock
+@end example
+
+@item -netdev vhost-user,id=@var{id},path=@var{path}[,vhostforce=on|off]
+Let another process handle the virtqueues of the virtio-net device that uses
+this netdev.  QEMU connects to the UNIX domain socket @var{path}, on which the
+backend must already be listening, and hands it the guest memory layout, the
+ring addresses and the kick and call eventfds; packets then flow between the
+guest and the backend without passing through QEMU.  The backend maps guest
+memory from the file descriptors it receives, so guest RAM must be allocated
+with @option{-mem-path} and @option{-mem-prealloc}.  Migration is not
+supported while a vhost-user netdev is in use.  @option{vhostforce=on}
+enables the backend for guests without MSI-X support, as for tap.
+
+@example
+qemu -m 1024 -mem-path /dev/hugepages -mem-prealloc \
+     -netdev vhost-user,id=net0,path=/tmp/vhost-user.sock \
+     -device virtio-net-pci,netdev=net0
+@end example
+
 @item -net none
 Indicate that no network devices should be configured. It is used to
 override the default configuration (@option{-net nic -net user}) which
@@ -2494,16 +2572,9 @@ Load the contents of @var{file} as an option ROM.
 This option is useful to load things like EtherBoot.
 ETEXI
 
-DEF("clock", HAS_ARG, QEMU_OPTION_clock, \
-    "-clock          force the use of the given methods for timer alarm.\n" \
-    "                To see what timers are available use -clock ?\n",
-    QEMU_ARCH_ALL)
-STEXI
-@item -clock @var{method}
-@findex -clock
-Force the use of the given methods for timer alarm. To see what timers
-are available use -clock ?.
-ETEXI
+HXCOMM Timers run from the main loop's poll timeout, there is no alarm
+HXCOMM timer to choose anymore.  Accepted and ignored for compatibility.
+DEF("clock", HAS_ARG, QEMU_OPTION_clock, "", QEMU_ARCH_ALL)
 
 HXCOMM Options deprecated by -rtc
 DEF("localtime", 0, QEMU_OPTION_localtime, "", QEMU_ARCH_ALL)
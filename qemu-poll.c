@@ -0,0 +1,555 @@
+/*
+ * Persistent file descriptor polling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-poll.h"
+#include "qemu_socket.h"
+
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+#if !defined(_WIN32)
+#include <poll.h>
+#endif
+
+/* Ready descriptors reported by one wait; the rest are picked up next time */
+#define QEMU_POLL_MAX_EVENTS 128
+
+typedef struct QEMUPollFd QEMUPollFd;
+
+struct QEMUPollWatch {
+    QEMUPollFd *pfd;
+    int events;
+    bool deleted;
+    QEMUPollFunc *func;
+    void *opaque;
+    QLIST_ENTRY(QEMUPollWatch) next;
+    QLIST_ENTRY(QEMUPollWatch) next_deleted;
+};
+
+struct QEMUPollFd {
+    int fd;
+    int events;         /* union of the watches' events, as registered */
+    int index;          /* slot in the pollfd array */
+    QLIST_HEAD(, QEMUPollWatch) watches;
+#ifdef CONFIG_EPOLL
+    bool always_ready;  /* not in the epoll set, see qemu_poll_backend_update */
+    QLIST_ENTRY(QEMUPollFd) next_always_ready;
+#endif
+};
+
+typedef struct QEMUPollReady {
+    int fd;
+    int revents;
+} QEMUPollReady;
+
+struct QEMUPoll {
+    GHashTable *fds;    /* fd -> QEMUPollFd */
+    QEMUPollReady ready[QEMU_POLL_MAX_EVENTS];
+    int nready;
+    bool dispatching;
+    QLIST_HEAD(, QEMUPollWatch) deleted;
+#ifdef CONFIG_EPOLL
+    int epfd;
+    struct epoll_event events[QEMU_POLL_MAX_EVENTS];
+    QLIST_HEAD(, QEMUPollFd) always_ready;
+#elif !defined(_WIN32)
+    struct pollfd *pollfds;
+    QEMUPollFd **owners;
+    int npollfds;
+    int pollfds_size;
+#endif
+};
+
+static inline int qemu_poll_timeout_ms(int64_t timeout_ns)
+{
+    if (timeout_ns < 0) {
+        return -1;
+    }
+    /* round up, so that a deadline is never reported early */
+    return MIN((timeout_ns + 999999) / 1000000, INT_MAX);
+}
+
+#ifdef CONFIG_PPOLL
+static int qemu_poll_ppoll(struct pollfd *fds, nfds_t nfds, int64_t timeout_ns)
+{
+    struct timespec ts;
+
+    if (timeout_ns < 0) {
+        return ppoll(fds, nfds, NULL, NULL);
+    }
+    ts.tv_sec = timeout_ns / 1000000000LL;
+    ts.tv_nsec = timeout_ns % 1000000000LL;
+    return ppoll(fds, nfds, &ts, NULL);
+}
+#endif
+
+#ifdef CONFIG_EPOLL
+
+static int qemu_poll_backend_init(QEMUPoll *qpoll)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    qpoll->epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    qpoll->epfd = epoll_create(QEMU_POLL_MAX_EVENTS);
+    if (qpoll->epfd >= 0) {
+        qemu_set_cloexec(qpoll->epfd);
+    }
+#endif
+    QLIST_INIT(&qpoll->always_ready);
+    return qpoll->epfd < 0 ? -errno : 0;
+}
+
+static void qemu_poll_backend_cleanup(QEMUPoll *qpoll)
+{
+    close(qpoll->epfd);
+}
+
+static void qemu_poll_backend_update(QEMUPoll *qpoll, QEMUPollFd *pfd,
+                                     int events)
+{
+    struct epoll_event ev = {
+        .events = (events & G_IO_IN ? EPOLLIN : 0) |
+                  (events & G_IO_OUT ? EPOLLOUT : 0) |
+                  (events & G_IO_PRI ? EPOLLPRI : 0),
+        .data.fd = pfd->fd,
+    };
+    int op;
+
+    if (pfd->always_ready) {
+        if (!events) {
+            QLIST_REMOVE(pfd, next_always_ready);
+            pfd->always_ready = false;
+        }
+        return;
+    }
+
+    /*
+     * An fd with nothing to wait for is taken out of the set altogether,
+     * otherwise EPOLLERR/EPOLLHUP would keep waking us up for it.
+     */
+    if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else if (!pfd->events) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    if (epoll_ctl(qpoll->epfd, op, pfd->fd, &ev) == 0) {
+        return;
+    }
+    if (op == EPOLL_CTL_ADD && errno == EPERM) {
+        goto always_ready;
+    }
+
+    /*
+     * The kernel forgets a descriptor when it is closed, and a descriptor
+     * number reused after a close may still be in the set if the old one
+     * was dup()ed.  Either way the kernel's view wins over ours.
+     */
+    if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+        op = EPOLL_CTL_ADD;
+    } else if (op == EPOLL_CTL_ADD && errno == EEXIST) {
+        op = EPOLL_CTL_MOD;
+    } else if (op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT)) {
+        /* A descriptor that was closed under our feet has left the set */
+        return;
+    } else {
+        op = -1;
+    }
+
+    if (op != -1 && epoll_ctl(qpoll->epfd, op, pfd->fd, &ev) == 0) {
+        return;
+    }
+    if (op == EPOLL_CTL_ADD && errno == EPERM) {
+        goto always_ready;
+    }
+    fprintf(stderr, "qemu_poll: epoll_ctl(%d) failed: %s\n",
+            pfd->fd, strerror(errno));
+    return;
+
+always_ready:
+    /*
+     * Regular files and devices such as /dev/null cannot be added to an
+     * epoll set.  poll() and select() report them as always ready, so
+     * do the same and make every wait return them right away.
+     */
+    pfd->always_ready = true;
+    QLIST_INSERT_HEAD(&qpoll->always_ready, pfd, next_always_ready);
+}
+
+static int qemu_poll_backend_wait(QEMUPoll *qpoll, int64_t timeout_ns)
+{
+    QEMUPollFd *pfd;
+    int ret, i;
+
+    if (!QLIST_EMPTY(&qpoll->always_ready)) {
+        timeout_ns = 0;
+    }
+
+#ifdef CONFIG_PPOLL
+    /*
+     * epoll_wait() rounds the timeout up to whole milliseconds.  For a
+     * finer deadline, sleep on the epoll descriptor itself, which polls
+     * readable as soon as one of the registered descriptors is ready.
+     */
+    if (timeout_ns > 0 && timeout_ns % 1000000) {
+        struct pollfd pfd = { .fd = qpoll->epfd, .events = POLLIN };
+
+        ret = qemu_poll_ppoll(&pfd, 1, timeout_ns);
+        if (ret <= 0) {
+            return ret < 0 ? -errno : 0;
+        }
+        timeout_ns = 0;
+    }
+#endif
+
+    ret = epoll_wait(qpoll->epfd, qpoll->events, QEMU_POLL_MAX_EVENTS,
+                     qemu_poll_timeout_ms(timeout_ns));
+    if (ret < 0) {
+        return -errno;
+    }
+    for (i = 0; i < ret; i++) {
+        uint32_t ev = qpoll->events[i].events;
+
+        qpoll->ready[i].fd = qpoll->events[i].data.fd;
+        qpoll->ready[i].revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+                                  (ev & EPOLLOUT ? G_IO_OUT : 0) |
+                                  (ev & EPOLLPRI ? G_IO_PRI : 0) |
+                                  (ev & EPOLLERR ? G_IO_ERR : 0) |
+                                  (ev & EPOLLHUP ? G_IO_HUP : 0);
+    }
+    qpoll->nready = ret;
+
+    QLIST_FOREACH(pfd, &qpoll->always_ready, next_always_ready) {
+        if (qpoll->nready == QEMU_POLL_MAX_EVENTS) {
+            break;
+        }
+        qpoll->ready[qpoll->nready].fd = pfd->fd;
+        qpoll->ready[qpoll->nready].revents =
+            pfd->events & (G_IO_IN | G_IO_OUT);
+        qpoll->nready++;
+    }
+    return qpoll->nready;
+}
+
+#elif !defined(_WIN32)
+
+static int qemu_poll_backend_init(QEMUPoll *qpoll)
+{
+    return 0;
+}
+
+static void qemu_poll_backend_cleanup(QEMUPoll *qpoll)
+{
+    g_free(qpoll->pollfds);
+    g_free(qpoll->owners);
+}
+
+static void qemu_poll_backend_update(QEMUPoll *qpoll, QEMUPollFd *pfd,
+                                     int events)
+{
+    int last;
+
+    if (!events) {
+        /* move the last slot into the hole */
+        last = --qpoll->npollfds;
+        qpoll->pollfds[pfd->index] = qpoll->pollfds[last];
+        qpoll->owners[pfd->index] = qpoll->owners[last];
+        qpoll->owners[pfd->index]->index = pfd->index;
+        pfd->index = -1;
+        return;
+    }
+
+    if (!pfd->events) {
+        if (qpoll->npollfds == qpoll->pollfds_size) {
+            qpoll->pollfds_size = MAX(16, qpoll->pollfds_size * 2);
+            qpoll->pollfds = g_renew(struct pollfd, qpoll->pollfds,
+                                     qpoll->pollfds_size);
+            qpoll->owners = g_renew(QEMUPollFd *, qpoll->owners,
+                                    qpoll->pollfds_size);
+        }
+        pfd->index = qpoll->npollfds++;
+        qpoll->owners[pfd->index] = pfd;
+        qpoll->pollfds[pfd->index].fd = pfd->fd;
+    }
+    qpoll->pollfds[pfd->index].events = (events & G_IO_IN ? POLLIN : 0) |
+                                        (events & G_IO_OUT ? POLLOUT : 0) |
+                                        (events & G_IO_PRI ? POLLPRI : 0);
+}
+
+static int qemu_poll_backend_wait(QEMUPoll *qpoll, int64_t timeout_ns)
+{
+    int ret, i;
+
+#ifdef CONFIG_PPOLL
+    ret = qemu_poll_ppoll(qpoll->pollfds, qpoll->npollfds, timeout_ns);
+#else
+    ret = poll(qpoll->pollfds, qpoll->npollfds,
+               qemu_poll_timeout_ms(timeout_ns));
+#endif
+    if (ret < 0) {
+        return -errno;
+    }
+
+    qpoll->nready = 0;
+    for (i = 0; i < qpoll->npollfds && qpoll->nready < ret &&
+                qpoll->nready < QEMU_POLL_MAX_EVENTS; i++) {
+        short ev = qpoll->pollfds[i].revents;
+
+        if (!ev) {
+            continue;
+        }
+        qpoll->ready[qpoll->nready].fd = qpoll->pollfds[i].fd;
+        qpoll->ready[qpoll->nready].revents =
+            (ev & POLLIN ? G_IO_IN : 0) |
+            (ev & POLLOUT ? G_IO_OUT : 0) |
+            (ev & POLLPRI ? G_IO_PRI : 0) |
+            (ev & POLLERR ? G_IO_ERR : 0) |
+            (ev & POLLHUP ? G_IO_HUP : 0) |
+            (ev & POLLNVAL ? G_IO_NVAL : 0);
+        qpoll->nready++;
+    }
+    return qpoll->nready;
+}
+
+#else /* _WIN32 */
+
+static int qemu_poll_backend_init(QEMUPoll *qpoll)
+{
+    return 0;
+}
+
+static void qemu_poll_backend_cleanup(QEMUPoll *qpoll)
+{
+}
+
+static void qemu_poll_backend_update(QEMUPoll *qpoll, QEMUPollFd *pfd,
+                                     int events)
+{
+}
+
+/* Windows only has select() for sockets; fd_sets are rebuilt every time */
+static int qemu_poll_backend_wait(QEMUPoll *qpoll, int64_t timeout_ns)
+{
+    fd_set rfds, wfds, xfds;
+    struct timeval tv, *tvarg = NULL;
+    GHashTableIter iter;
+    QEMUPollFd *pfd;
+    int ret, nfds = 0;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    g_hash_table_iter_init(&iter, qpoll->fds);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&pfd)) {
+        if (pfd->events & G_IO_IN) {
+            FD_SET(pfd->fd, &rfds);
+        }
+        if (pfd->events & G_IO_OUT) {
+            FD_SET(pfd->fd, &wfds);
+        }
+        if (pfd->events & G_IO_PRI) {
+            FD_SET(pfd->fd, &xfds);
+        }
+        nfds += !!pfd->events;
+    }
+    if (!nfds) {
+        /* select() fails without any socket; callers never block here */
+        return 0;
+    }
+
+    if (timeout_ns >= 0) {
+        tv.tv_sec = timeout_ns / 1000000000LL;
+        tv.tv_usec = (timeout_ns % 1000000000LL + 999) / 1000;
+        tvarg = &tv;
+    }
+    ret = select(0, &rfds, &wfds, &xfds, tvarg);
+    if (ret < 0) {
+        return -socket_error();
+    }
+
+    qpoll->nready = 0;
+    g_hash_table_iter_init(&iter, qpoll->fds);
+    while (ret > 0 && qpoll->nready < QEMU_POLL_MAX_EVENTS &&
+           g_hash_table_iter_next(&iter, NULL, (gpointer *)&pfd)) {
+        int revents = (FD_ISSET(pfd->fd, &rfds) ? G_IO_IN : 0) |
+                      (FD_ISSET(pfd->fd, &wfds) ? G_IO_OUT : 0) |
+                      (FD_ISSET(pfd->fd, &xfds) ? G_IO_PRI : 0);
+
+        if (revents) {
+            qpoll->ready[qpoll->nready].fd = pfd->fd;
+            qpoll->ready[qpoll->nready].revents = revents;
+            qpoll->nready++;
+        }
+    }
+    return qpoll->nready;
+}
+
+#endif
+
+QEMUPoll *qemu_poll_new(void)
+{
+    QEMUPoll *qpoll = g_malloc0(sizeof(*qpoll));
+
+    if (qemu_poll_backend_init(qpoll) < 0) {
+        fprintf(stderr, "qemu_poll: failed to create poll set: %s\n",
+                strerror(errno));
+        abort();
+    }
+    qpoll->fds = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                       NULL, g_free);
+    QLIST_INIT(&qpoll->deleted);
+    return qpoll;
+}
+
+void qemu_poll_free(QEMUPoll *qpoll)
+{
+    GHashTableIter iter;
+    QEMUPollFd *pfd;
+    QEMUPollWatch *watch;
+
+    g_hash_table_iter_init(&iter, qpoll->fds);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&pfd)) {
+        while ((watch = QLIST_FIRST(&pfd->watches)) != NULL) {
+            QLIST_REMOVE(watch, next);
+            g_free(watch);
+        }
+    }
+    g_hash_table_destroy(qpoll->fds);
+    qemu_poll_backend_cleanup(qpoll);
+    g_free(qpoll);
+}
+
+static void qemu_poll_update(QEMUPoll *qpoll, QEMUPollFd *pfd)
+{
+    QEMUPollWatch *watch;
+    int events = 0;
+
+    QLIST_FOREACH(watch, &pfd->watches, next) {
+        if (!watch->deleted) {
+            events |= watch->events;
+        }
+    }
+    events &= G_IO_IN | G_IO_OUT | G_IO_PRI;
+
+    if (events != pfd->events) {
+        qemu_poll_backend_update(qpoll, pfd, events);
+        pfd->events = events;
+    }
+}
+
+QEMUPollWatch *qemu_poll_add(QEMUPoll *qpoll, int fd, int events,
+                             QEMUPollFunc *func, void *opaque)
+{
+    QEMUPollWatch *watch = g_malloc0(sizeof(*watch));
+    QEMUPollFd *pfd;
+
+    pfd = g_hash_table_lookup(qpoll->fds, GINT_TO_POINTER(fd));
+    if (!pfd) {
+        pfd = g_malloc0(sizeof(*pfd));
+        pfd->fd = fd;
+        pfd->index = -1;
+        QLIST_INIT(&pfd->watches);
+        g_hash_table_insert(qpoll->fds, GINT_TO_POINTER(fd), pfd);
+    }
+
+    watch->pfd = pfd;
+    watch->events = events;
+    watch->func = func;
+    watch->opaque = opaque;
+    QLIST_INSERT_HEAD(&pfd->watches, watch, next);
+
+    qemu_poll_update(qpoll, pfd);
+    return watch;
+}
+
+void qemu_poll_modify(QEMUPoll *qpoll, QEMUPollWatch *watch, int events)
+{
+    if (watch->events != events) {
+        watch->events = events;
+        qemu_poll_update(qpoll, watch->pfd);
+    }
+}
+
+int qemu_poll_watch_events(QEMUPollWatch *watch)
+{
+    return watch->events;
+}
+
+static void qemu_poll_free_watch(QEMUPoll *qpoll, QEMUPollWatch *watch)
+{
+    QEMUPollFd *pfd = watch->pfd;
+
+    QLIST_REMOVE(watch, next);
+    g_free(watch);
+
+    if (QLIST_EMPTY(&pfd->watches)) {
+        g_hash_table_remove(qpoll->fds, GINT_TO_POINTER(pfd->fd));
+    }
+}
+
+void qemu_poll_remove(QEMUPoll *qpoll, QEMUPollWatch *watch)
+{
+    watch->deleted = true;
+    qemu_poll_update(qpoll, watch->pfd);
+
+    if (qpoll->dispatching) {
+        /* the dispatch loop may still be looking at it */
+        QLIST_INSERT_HEAD(&qpoll->deleted, watch, next_deleted);
+    } else {
+        qemu_poll_free_watch(qpoll, watch);
+    }
+}
+
+int qemu_poll_wait(QEMUPoll *qpoll, int64_t timeout_ns)
+{
+    qpoll->nready = 0;
+    return qemu_poll_backend_wait(qpoll, timeout_ns);
+}
+
+int qemu_poll_dispatch(QEMUPoll *qpoll)
+{
+    QEMUPollReady ready[QEMU_POLL_MAX_EVENTS];
+    QEMUPollWatch *watch, *next_watch;
+    QEMUPollFd *pfd;
+    int i, nready, revents, count = 0;
+    bool dispatching = qpoll->dispatching;
+
+    /* a callback may wait on the same set again, so work on a copy */
+    nready = qpoll->nready;
+    memcpy(ready, qpoll->ready, nready * sizeof(ready[0]));
+    qpoll->nready = 0;
+
+    qpoll->dispatching = true;
+    for (i = 0; i < nready; i++) {
+        /* the fd may have been removed since the wait returned */
+        pfd = g_hash_table_lookup(qpoll->fds, GINT_TO_POINTER(ready[i].fd));
+        if (!pfd) {
+            continue;
+        }
+        QLIST_FOREACH(watch, &pfd->watches, next) {
+            revents = ready[i].revents &
+                      (watch->events | G_IO_ERR | G_IO_HUP | G_IO_NVAL);
+            if (!watch->deleted && watch->events && revents) {
+                watch->func(watch->opaque, revents);
+                count++;
+            }
+        }
+    }
+    qpoll->dispatching = dispatching;
+
+    if (!dispatching) {
+        QLIST_FOREACH_SAFE(watch, &qpoll->deleted, next_deleted, next_watch) {
+            QLIST_REMOVE(watch, next_deleted);
+            qemu_poll_free_watch(qpoll, watch);
+        }
+    }
+    return count;
+}
@@ -0,0 +1,70 @@
+/*
+ * Persistent file descriptor polling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_POLL_H
+#define QEMU_POLL_H
+
+#include "qemu-common.h"
+
+/*
+ * A QEMUPoll holds a set of file descriptors that stay registered across
+ * waits.  Registrations are only touched when they change, and a wait
+ * only reports the descriptors that are ready, so the cost of a wakeup
+ * does not grow with the number of idle descriptors when the host has
+ * epoll.  Elsewhere poll() (or select() on Windows) is used underneath.
+ *
+ * Conditions are the glib G_IO_IN, G_IO_OUT and G_IO_PRI bits.  G_IO_ERR
+ * and G_IO_HUP are reported to every watch that asks for any event.
+ * Several watches may share one file descriptor.
+ */
+
+typedef struct QEMUPoll QEMUPoll;
+typedef struct QEMUPollWatch QEMUPollWatch;
+
+typedef void QEMUPollFunc(void *opaque, int revents);
+
+QEMUPoll *qemu_poll_new(void);
+void qemu_poll_free(QEMUPoll *qpoll);
+
+/**
+ * qemu_poll_add:
+ * @fd: File descriptor to watch.
+ * @events: Conditions to wait for; 0 keeps the watch but disables it.
+ * @func: Called from qemu_poll_dispatch() when a condition is met.
+ *
+ * Returns the new watch.
+ */
+QEMUPollWatch *qemu_poll_add(QEMUPoll *qpoll, int fd, int events,
+                             QEMUPollFunc *func, void *opaque);
+void qemu_poll_modify(QEMUPoll *qpoll, QEMUPollWatch *watch, int events);
+void qemu_poll_remove(QEMUPoll *qpoll, QEMUPollWatch *watch);
+int qemu_poll_watch_events(QEMUPollWatch *watch);
+
+/**
+ * qemu_poll_wait:
+ * @timeout_ns: Maximum time to block in nanoseconds, -1 to block until
+ * an event arrives, 0 to only check for pending events.
+ *
+ * Wait for registered conditions without dispatching them, so that the
+ * caller can drop locks around the wait only.
+ *
+ * Returns the number of ready file descriptors, 0 on timeout, or -errno.
+ */
+int qemu_poll_wait(QEMUPoll *qpoll, int64_t timeout_ns);
+
+/**
+ * qemu_poll_dispatch:
+ *
+ * Invoke the callbacks of the watches that became ready in the last
+ * qemu_poll_wait().  Watches may be added, modified and removed from
+ * the callbacks; removed watches are not called afterwards.
+ *
+ * Returns the number of callbacks invoked.
+ */
+int qemu_poll_dispatch(QEMUPoll *qpoll);
+
+#endif
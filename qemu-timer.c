@@ -30,10 +30,7 @@
 #include "hw/hw.h"
 
 #include "qemu-timer.h"
-
-#ifdef _WIN32
-#include <mmsystem.h>
-#endif
+#include "host-utils.h"
 
 /***********************************************************/
 /* timers */
@@ -43,13 +40,23 @@
 #define QEMU_CLOCK_HOST     2
 
 struct QEMUClock {
-    QEMUTimer *active_timers;
+    /* Pending timers, a binary min-heap ordered by expiry */
+    QEMUTimer **heap;
+    int nr_timers;
+    int heap_size;
+    uint64_t next_seq;
 
     NotifierList reset_notifiers;
     int64_t last;
 
     int type;
     bool enabled;
+
+    QEMUTimerLatency latency;
+
+    /* Private clocks call this instead of kicking the main loop */
+    QEMUClockNotifyFunc *notify;
+    void *notify_opaque;
 };
 
 struct QEMUTimer {
@@ -57,222 +64,204 @@ struct QEMUTimer {
     QEMUClock *clock;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;               /* keeps equal expiries in arming order */
+    int heap_index;             /* -1 when not pending */
     int scale;
 };
 
-struct qemu_alarm_timer {
-    char const *name;
-    int (*start)(struct qemu_alarm_timer *t);
-    void (*stop)(struct qemu_alarm_timer *t);
-    void (*rearm)(struct qemu_alarm_timer *t, int64_t nearest_delta_ns);
-#if defined(__linux__)
-    timer_t timer;
-    int fd;
-#elif defined(_WIN32)
-    HANDLE timer;
-#endif
-    bool expired;
-    bool pending;
-};
+QEMUClock *rt_clock;
+QEMUClock *vm_clock;
+QEMUClock *host_clock;
 
-static struct qemu_alarm_timer *alarm_timer;
+static QEMUClock *qemu_new_clock(int type)
+{
+    QEMUClock *clock;
+
+    clock = g_malloc0(sizeof(QEMUClock));
+    clock->type = type;
+    clock->enabled = true;
+    clock->last = INT64_MIN;
+    notifier_list_init(&clock->reset_notifiers);
+    return clock;
+}
 
-static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
+QEMUClock *qemu_new_private_rt_clock(QEMUClockNotifyFunc *notify,
+                                     void *opaque)
 {
-    return timer_head && (timer_head->expire_time <= current_time);
+    QEMUClock *clock;
+
+    clock = qemu_new_clock(QEMU_CLOCK_REALTIME);
+    clock->notify = notify;
+    clock->notify_opaque = opaque;
+    return clock;
 }
 
-static int64_t qemu_next_alarm_deadline(void)
+void qemu_free_clock(QEMUClock *clock)
 {
-    int64_t delta = INT64_MAX;
-    int64_t rtdelta;
+    assert(clock->notify && !clock->nr_timers);
+    g_free(clock->heap);
+    g_free(clock);
+}
 
-    if (!use_icount && vm_clock->enabled && vm_clock->active_timers) {
-        delta = vm_clock->active_timers->expire_time -
-                     qemu_get_clock_ns(vm_clock);
-    }
-    if (host_clock->enabled && host_clock->active_timers) {
-        int64_t hdelta = host_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(host_clock);
-        if (hdelta < delta) {
-            delta = hdelta;
-        }
-    }
-    if (rt_clock->enabled && rt_clock->active_timers) {
-        rtdelta = (rt_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(rt_clock));
-        if (rtdelta < delta) {
-            delta = rtdelta;
-        }
+/* The earliest deadline of @clock may have moved earlier */
+static void qemu_clock_notify(QEMUClock *clock)
+{
+    if (clock->notify) {
+        clock->notify(clock->notify_opaque);
+        return;
     }
 
-    return delta;
+    /* Interrupt execution to force deadline recalculation.  */
+    qemu_clock_warp(clock);
+    qemu_notify_event();
 }
 
-static void qemu_rearm_alarm_timer(struct qemu_alarm_timer *t)
+void qemu_clock_enable(QEMUClock *clock, bool enabled)
 {
-    int64_t nearest_delta_ns = qemu_next_alarm_deadline();
-    if (nearest_delta_ns < INT64_MAX) {
-        t->rearm(t, nearest_delta_ns);
+    bool old = clock->enabled;
+    clock->enabled = enabled;
+    if (enabled && !old) {
+        qemu_clock_notify(clock);
     }
 }
 
-/* TODO: MIN_TIMER_REARM_NS should be optimized */
-#define MIN_TIMER_REARM_NS 250000
-
-#ifdef _WIN32
+int64_t qemu_clock_has_timers(QEMUClock *clock)
+{
+    return clock->nr_timers > 0;
+}
 
-static int mm_start_timer(struct qemu_alarm_timer *t);
-static void mm_stop_timer(struct qemu_alarm_timer *t);
-static void mm_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+int64_t qemu_clock_expired(QEMUClock *clock)
+{
+    return (clock->nr_timers &&
+            clock->heap[0]->expire_time < qemu_get_clock_ns(clock));
+}
 
-static int win32_start_timer(struct qemu_alarm_timer *t);
-static void win32_stop_timer(struct qemu_alarm_timer *t);
-static void win32_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+int64_t qemu_clock_deadline(QEMUClock *clock)
+{
+    /* To avoid problems with overflow limit this to 2^32.  */
+    int64_t delta = INT32_MAX;
 
-#else
+    if (clock->nr_timers) {
+        delta = clock->heap[0]->expire_time - qemu_get_clock_ns(clock);
+    }
+    if (delta < 0) {
+        delta = 0;
+    }
+    return delta;
+}
 
-static int unix_start_timer(struct qemu_alarm_timer *t);
-static void unix_stop_timer(struct qemu_alarm_timer *t);
-static void unix_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+int64_t qemu_clock_deadline_ns(QEMUClock *clock)
+{
+    int64_t delta;
 
-#ifdef __linux__
+    if (!clock->enabled || !clock->nr_timers) {
+        return -1;
+    }
+    delta = clock->heap[0]->expire_time - qemu_get_clock_ns(clock);
+    return MAX(delta, 0);
+}
 
-static int dynticks_start_timer(struct qemu_alarm_timer *t);
-static void dynticks_stop_timer(struct qemu_alarm_timer *t);
-static void dynticks_rearm_timer(struct qemu_alarm_timer *t, int64_t delta);
+int64_t qemu_clock_deadline_ns_all(void)
+{
+    int64_t deadline;
 
-#endif /* __linux__ */
+    deadline = qemu_soonest_timeout(qemu_clock_deadline_ns(rt_clock),
+                                    qemu_clock_deadline_ns(host_clock));
 
-#endif /* _WIN32 */
+    /* With icount the vCPU thread waits for vm_clock deadlines itself */
+    if (!use_icount) {
+        deadline = qemu_soonest_timeout(deadline,
+                                        qemu_clock_deadline_ns(vm_clock));
+    }
+    return deadline;
+}
 
-static struct qemu_alarm_timer alarm_timers[] = {
-#ifndef _WIN32
-#ifdef __linux__
-    {"dynticks", dynticks_start_timer,
-     dynticks_stop_timer, dynticks_rearm_timer},
-#endif
-    {"unix", unix_start_timer, unix_stop_timer, unix_rearm_timer},
-#else
-    {"mmtimer", mm_start_timer, mm_stop_timer, mm_rearm_timer},
-    {"dynticks", win32_start_timer, win32_stop_timer, win32_rearm_timer},
-#endif
-    {NULL, }
-};
+/*
+ * Timer heap.  Index 0 holds the timer that expires first; each timer
+ * remembers its slot so that it can be moved or removed in O(log n).
+ */
 
-static void show_available_alarms(void)
+static inline bool qemu_timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    int i;
-
-    printf("Available alarm timers, in order of precedence:\n");
-    for (i = 0; alarm_timers[i].name; i++)
-        printf("%s\n", alarm_timers[i].name);
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
 }
 
-void configure_alarms(char const *opt)
+static inline void timer_heap_set(QEMUClock *clock, int i, QEMUTimer *ts)
 {
-    int i;
-    int cur = 0;
-    int count = ARRAY_SIZE(alarm_timers) - 1;
-    char *arg;
-    char *name;
-    struct qemu_alarm_timer tmp;
-
-    if (is_help_option(opt)) {
-        show_available_alarms();
-        exit(0);
-    }
+    clock->heap[i] = ts;
+    ts->heap_index = i;
+}
 
-    arg = g_strdup(opt);
+static void timer_heap_up(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->heap[i];
 
-    /* Reorder the array */
-    name = strtok(arg, ",");
-    while (name) {
-        for (i = 0; i < count && alarm_timers[i].name; i++) {
-            if (!strcmp(alarm_timers[i].name, name))
-                break;
-        }
+    while (i > 0) {
+        int parent = (i - 1) / 2;
 
-        if (i == count) {
-            fprintf(stderr, "Unknown clock %s\n", name);
-            goto next;
+        if (!qemu_timer_before(ts, clock->heap[parent])) {
+            break;
         }
-
-        if (i < cur)
-            /* Ignore */
-            goto next;
-
-	/* Swap */
-        tmp = alarm_timers[i];
-        alarm_timers[i] = alarm_timers[cur];
-        alarm_timers[cur] = tmp;
-
-        cur++;
-next:
-        name = strtok(NULL, ",");
-    }
-
-    g_free(arg);
-
-    if (cur) {
-        /* Disable remaining timers */
-        for (i = cur; i < count; i++)
-            alarm_timers[i].name = NULL;
-    } else {
-        show_available_alarms();
-        exit(1);
+        timer_heap_set(clock, i, clock->heap[parent]);
+        i = parent;
     }
+    timer_heap_set(clock, i, ts);
 }
 
-QEMUClock *rt_clock;
-QEMUClock *vm_clock;
-QEMUClock *host_clock;
-
-static QEMUClock *qemu_new_clock(int type)
+static void timer_heap_down(QEMUClock *clock, int i)
 {
-    QEMUClock *clock;
+    QEMUTimer *ts = clock->heap[i];
 
-    clock = g_malloc0(sizeof(QEMUClock));
-    clock->type = type;
-    clock->enabled = true;
-    clock->last = INT64_MIN;
-    notifier_list_init(&clock->reset_notifiers);
-    return clock;
-}
+    for (;;) {
+        int child = 2 * i + 1;
 
-void qemu_clock_enable(QEMUClock *clock, bool enabled)
-{
-    bool old = clock->enabled;
-    clock->enabled = enabled;
-    if (enabled && !old) {
-        qemu_rearm_alarm_timer(alarm_timer);
+        if (child >= clock->nr_timers) {
+            break;
+        }
+        if (child + 1 < clock->nr_timers &&
+            qemu_timer_before(clock->heap[child + 1], clock->heap[child])) {
+            child++;
+        }
+        if (!qemu_timer_before(clock->heap[child], ts)) {
+            break;
+        }
+        timer_heap_set(clock, i, clock->heap[child]);
+        i = child;
     }
+    timer_heap_set(clock, i, ts);
 }
 
-int64_t qemu_clock_has_timers(QEMUClock *clock)
+/* Restore the heap order after the expiry of the timer in slot @i changed */
+static void timer_heap_fix(QEMUClock *clock, int i)
 {
-    return !!clock->active_timers;
+    if (i > 0 && qemu_timer_before(clock->heap[i], clock->heap[(i - 1) / 2])) {
+        timer_heap_up(clock, i);
+    } else {
+        timer_heap_down(clock, i);
+    }
 }
 
-int64_t qemu_clock_expired(QEMUClock *clock)
+static void timer_heap_insert(QEMUClock *clock, QEMUTimer *ts)
 {
-    return (clock->active_timers &&
-            clock->active_timers->expire_time < qemu_get_clock_ns(clock));
+    if (clock->nr_timers == clock->heap_size) {
+        clock->heap_size = MAX(16, clock->heap_size * 2);
+        clock->heap = g_renew(QEMUTimer *, clock->heap, clock->heap_size);
+    }
+    timer_heap_set(clock, clock->nr_timers++, ts);
+    timer_heap_up(clock, ts->heap_index);
 }
 
-int64_t qemu_clock_deadline(QEMUClock *clock)
+static void timer_heap_remove(QEMUClock *clock, QEMUTimer *ts)
 {
-    /* To avoid problems with overflow limit this to 2^32.  */
-    int64_t delta = INT32_MAX;
+    int i = ts->heap_index;
+    int last = --clock->nr_timers;
 
-    if (clock->active_timers) {
-        delta = clock->active_timers->expire_time - qemu_get_clock_ns(clock);
-    }
-    if (delta < 0) {
-        delta = 0;
+    ts->heap_index = -1;
+    if (i != last) {
+        timer_heap_set(clock, i, clock->heap[last]);
+        timer_heap_fix(clock, i);
     }
-    return delta;
 }
 
 QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
@@ -285,6 +274,7 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
     ts->cb = cb;
     ts->opaque = opaque;
     ts->scale = scale;
+    ts->heap_index = -1;
     return ts;
 }
 
@@ -296,20 +286,8 @@ void qemu_free_timer(QEMUTimer *ts)
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (ts->heap_index >= 0) {
+        timer_heap_remove(ts->clock, ts);
     }
 }
 
@@ -317,35 +295,19 @@ void qemu_del_timer(QEMUTimer *ts)
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
+    QEMUClock *clock = ts->clock;
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
-    }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = clock->next_seq++;
+    if (ts->heap_index >= 0) {
+        timer_heap_fix(clock, ts->heap_index);
+    } else {
+        timer_heap_insert(clock, ts);
+    }
 
     /* Rearm if necessary  */
-    if (pt == &ts->clock->active_timers) {
-        if (!alarm_timer->pending) {
-            qemu_rearm_alarm_timer(alarm_timer);
-        }
-        /* Interrupt execution to force deadline recalculation.  */
-        qemu_clock_warp(ts->clock);
-        if (use_icount) {
-            qemu_notify_event();
-        }
+    if (ts->heap_index == 0) {
+        qemu_clock_notify(clock);
     }
 }
 
@@ -356,40 +318,93 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 bool qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for (t = ts->clock->active_timers; t != NULL; t = t->next) {
-        if (t == ts) {
-            return true;
+    return ts->heap_index >= 0;
+}
+
+bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
+{
+    return timer_head &&
+           timer_head->expire_time <= current_time * timer_head->scale;
+}
+
+static void qemu_clock_account_latency(QEMUClock *clock, int64_t late_ns)
+{
+    QEMUTimerLatency *lat = &clock->latency;
+    int bucket = 0;
+
+    if (late_ns < 0) {
+        late_ns = 0;
+    }
+    if (late_ns >= SCALE_US) {
+        bucket = MIN(64 - clz64(late_ns / SCALE_US),
+                     QEMU_TIMER_LATENCY_BUCKETS - 1);
+    }
+    lat->fired++;
+    lat->total_ns += late_ns;
+    lat->max_ns = MAX(lat->max_ns, late_ns);
+    lat->buckets[bucket]++;
+}
+
+const QEMUTimerLatency *qemu_clock_get_latency(QEMUClock *clock)
+{
+    return &clock->latency;
+}
+
+void qemu_clock_reset_latency(QEMUClock *clock)
+{
+    memset(&clock->latency, 0, sizeof(clock->latency));
+}
+
+static void qemu_clock_dump_latency(FILE *f, fprintf_function fprintf_func,
+                                    const char *name, QEMUClock *clock)
+{
+    const QEMUTimerLatency *lat = &clock->latency;
+    int i;
+
+    fprintf_func(f, "%s: %" PRIu64 " timers fired, average %" PRIu64
+                 " ns late, max %" PRIu64 " ns\n", name, lat->fired,
+                 lat->fired ? lat->total_ns / lat->fired : 0, lat->max_ns);
+    for (i = 0; i < QEMU_TIMER_LATENCY_BUCKETS; i++) {
+        if (!lat->buckets[i]) {
+            continue;
+        }
+        if (i == 0) {
+            fprintf_func(f, "  < 1 us");
+        } else if (i == QEMU_TIMER_LATENCY_BUCKETS - 1) {
+            fprintf_func(f, "  >= %d us", 1 << (i - 1));
+        } else {
+            fprintf_func(f, "  %d-%d us", 1 << (i - 1), 1 << i);
         }
+        fprintf_func(f, ": %" PRIu64 "\n", lat->buckets[i]);
     }
-    return false;
 }
 
-bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
+void qemu_timer_dump_latency(FILE *f, fprintf_function fprintf_func)
 {
-    return qemu_timer_expired_ns(timer_head, current_time * timer_head->scale);
+    qemu_clock_dump_latency(f, fprintf_func, "rt", rt_clock);
+    qemu_clock_dump_latency(f, fprintf_func, "vm", vm_clock);
+    qemu_clock_dump_latency(f, fprintf_func, "host", host_clock);
 }
 
 void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer **ptimer_head, *ts;
+    QEMUTimer *ts;
     int64_t current_time;
-   
+
     if (!clock->enabled)
         return;
 
     current_time = qemu_get_clock_ns(clock);
-    ptimer_head = &clock->active_timers;
-    for(;;) {
-        ts = *ptimer_head;
-        if (!qemu_timer_expired_ns(ts, current_time)) {
+    while (clock->nr_timers) {
+        ts = clock->heap[0];
+        if (ts->expire_time > current_time) {
             break;
         }
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        timer_heap_remove(clock, ts);
+        qemu_clock_account_latency(clock, current_time - ts->expire_time);
 
-        /* run the callback (the timer list can be modified) */
+        /* run the callback (the timer heap can be modified) */
         ts->cb(ts->opaque);
     }
 }
@@ -443,330 +458,8 @@ uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts)
 
 void qemu_run_all_timers(void)
 {
-    alarm_timer->pending = false;
-
     /* vm time timers */
     qemu_run_timers(vm_clock);
     qemu_run_timers(rt_clock);
     qemu_run_timers(host_clock);
-
-    /* rearm timer, if not periodic */
-    if (alarm_timer->expired) {
-        alarm_timer->expired = false;
-        qemu_rearm_alarm_timer(alarm_timer);
-    }
-}
-
-#ifdef _WIN32
-static void CALLBACK host_alarm_handler(PVOID lpParam, BOOLEAN unused)
-#else
-static void host_alarm_handler(int host_signum)
-#endif
-{
-    struct qemu_alarm_timer *t = alarm_timer;
-    if (!t)
-	return;
-
-    t->expired = true;
-    t->pending = true;
-    qemu_notify_event();
-}
-
-#if defined(__linux__)
-
-#include "compatfd.h"
-
-static int dynticks_start_timer(struct qemu_alarm_timer *t)
-{
-    struct sigevent ev;
-    timer_t host_timer;
-    struct sigaction act;
-
-    sigfillset(&act.sa_mask);
-    act.sa_flags = 0;
-    act.sa_handler = host_alarm_handler;
-
-    sigaction(SIGALRM, &act, NULL);
-
-    /* 
-     * Initialize ev struct to 0 to avoid valgrind complaining
-     * about uninitialized data in timer_create call
-     */
-    memset(&ev, 0, sizeof(ev));
-    ev.sigev_value.sival_int = 0;
-    ev.sigev_notify = SIGEV_SIGNAL;
-#ifdef SIGEV_THREAD_ID
-    if (qemu_signalfd_available()) {
-        ev.sigev_notify = SIGEV_THREAD_ID;
-        ev._sigev_un._tid = qemu_get_thread_id();
-    }
-#endif /* SIGEV_THREAD_ID */
-    ev.sigev_signo = SIGALRM;
-
-    if (timer_create(CLOCK_REALTIME, &ev, &host_timer)) {
-        perror("timer_create");
-        return -1;
-    }
-
-    t->timer = host_timer;
-
-    return 0;
-}
-
-static void dynticks_stop_timer(struct qemu_alarm_timer *t)
-{
-    timer_t host_timer = t->timer;
-
-    timer_delete(host_timer);
-}
-
-static void dynticks_rearm_timer(struct qemu_alarm_timer *t,
-                                 int64_t nearest_delta_ns)
-{
-    timer_t host_timer = t->timer;
-    struct itimerspec timeout;
-    int64_t current_ns;
-
-    if (nearest_delta_ns < MIN_TIMER_REARM_NS)
-        nearest_delta_ns = MIN_TIMER_REARM_NS;
-
-    /* check whether a timer is already running */
-    if (timer_gettime(host_timer, &timeout)) {
-        perror("gettime");
-        fprintf(stderr, "Internal timer error: aborting\n");
-        exit(1);
-    }
-    current_ns = timeout.it_value.tv_sec * 1000000000LL + timeout.it_value.tv_nsec;
-    if (current_ns && current_ns <= nearest_delta_ns)
-        return;
-
-    timeout.it_interval.tv_sec = 0;
-    timeout.it_interval.tv_nsec = 0; /* 0 for one-shot timer */
-    timeout.it_value.tv_sec =  nearest_delta_ns / 1000000000;
-    timeout.it_value.tv_nsec = nearest_delta_ns % 1000000000;
-    if (timer_settime(host_timer, 0 /* RELATIVE */, &timeout, NULL)) {
-        perror("settime");
-        fprintf(stderr, "Internal timer error: aborting\n");
-        exit(1);
-    }
-}
-
-#endif /* defined(__linux__) */
-
-#if !defined(_WIN32)
-
-static int unix_start_timer(struct qemu_alarm_timer *t)
-{
-    struct sigaction act;
-
-    /* timer signal */
-    sigfillset(&act.sa_mask);
-    act.sa_flags = 0;
-    act.sa_handler = host_alarm_handler;
-
-    sigaction(SIGALRM, &act, NULL);
-    return 0;
-}
-
-static void unix_rearm_timer(struct qemu_alarm_timer *t,
-                             int64_t nearest_delta_ns)
-{
-    struct itimerval itv;
-    int err;
-
-    if (nearest_delta_ns < MIN_TIMER_REARM_NS)
-        nearest_delta_ns = MIN_TIMER_REARM_NS;
-
-    itv.it_interval.tv_sec = 0;
-    itv.it_interval.tv_usec = 0; /* 0 for one-shot timer */
-    itv.it_value.tv_sec =  nearest_delta_ns / 1000000000;
-    itv.it_value.tv_usec = (nearest_delta_ns % 1000000000) / 1000;
-    err = setitimer(ITIMER_REAL, &itv, NULL);
-    if (err) {
-        perror("setitimer");
-        fprintf(stderr, "Internal timer error: aborting\n");
-        exit(1);
-    }
-}
-
-static void unix_stop_timer(struct qemu_alarm_timer *t)
-{
-    struct itimerval itv;
-
-    memset(&itv, 0, sizeof(itv));
-    setitimer(ITIMER_REAL, &itv, NULL);
-}
-
-#endif /* !defined(_WIN32) */
-
-
-#ifdef _WIN32
-
-static MMRESULT mm_timer;
-static TIMECAPS mm_tc;
-
-static void CALLBACK mm_alarm_handler(UINT uTimerID, UINT uMsg,
-                                      DWORD_PTR dwUser, DWORD_PTR dw1,
-                                      DWORD_PTR dw2)
-{
-    struct qemu_alarm_timer *t = alarm_timer;
-    if (!t) {
-        return;
-    }
-    t->expired = true;
-    t->pending = true;
-    qemu_notify_event();
-}
-
-static int mm_start_timer(struct qemu_alarm_timer *t)
-{
-    timeGetDevCaps(&mm_tc, sizeof(mm_tc));
-
-    timeBeginPeriod(mm_tc.wPeriodMin);
-
-    mm_timer = timeSetEvent(mm_tc.wPeriodMin,   /* interval (ms) */
-                            mm_tc.wPeriodMin,   /* resolution */
-                            mm_alarm_handler,   /* function */
-                            (DWORD_PTR)t,       /* parameter */
-                            TIME_ONESHOT | TIME_CALLBACK_FUNCTION);
-
-    if (!mm_timer) {
-        fprintf(stderr, "Failed to initialize win32 alarm timer\n");
-        timeEndPeriod(mm_tc.wPeriodMin);
-        return -1;
-    }
-
-    return 0;
 }
-
-static void mm_stop_timer(struct qemu_alarm_timer *t)
-{
-    timeKillEvent(mm_timer);
-    timeEndPeriod(mm_tc.wPeriodMin);
-}
-
-static void mm_rearm_timer(struct qemu_alarm_timer *t, int64_t delta)
-{
-    int64_t nearest_delta_ms = delta / 1000000;
-    if (nearest_delta_ms < mm_tc.wPeriodMin) {
-        nearest_delta_ms = mm_tc.wPeriodMin;
-    } else if (nearest_delta_ms > mm_tc.wPeriodMax) {
-        nearest_delta_ms = mm_tc.wPeriodMax;
-    }
-
-    timeKillEvent(mm_timer);
-    mm_timer = timeSetEvent((UINT)nearest_delta_ms,
-                            mm_tc.wPeriodMin,
-                            mm_alarm_handler,
-                            (DWORD_PTR)t,
-                            TIME_ONESHOT | TIME_CALLBACK_FUNCTION);
-
-    if (!mm_timer) {
-        fprintf(stderr, "Failed to re-arm win32 alarm timer\n");
-        timeEndPeriod(mm_tc.wPeriodMin);
-        exit(1);
-    }
-}
-
-static int win32_start_timer(struct qemu_alarm_timer *t)
-{
-    HANDLE hTimer;
-    BOOLEAN success;
-
-    /* If you call ChangeTimerQueueTimer on a one-shot timer (its period
-       is zero) that has already expired, the timer is not updated.  Since
-       creating a new timer is relatively expensive, set a bogus one-hour
-       interval in the dynticks case.  */
-    success = CreateTimerQueueTimer(&hTimer,
-                          NULL,
-                          host_alarm_handler,
-                          t,
-                          1,
-                          3600000,
-                          WT_EXECUTEINTIMERTHREAD);
-
-    if (!success) {
-        fprintf(stderr, "Failed to initialize win32 alarm timer: %ld\n",
-                GetLastError());
-        return -1;
-    }
-
-    t->timer = hTimer;
-    return 0;
-}
-
-static void win32_stop_timer(struct qemu_alarm_timer *t)
-{
-    HANDLE hTimer = t->timer;
-
-    if (hTimer) {
-        DeleteTimerQueueTimer(NULL, hTimer, NULL);
-    }
-}
-
-static void win32_rearm_timer(struct qemu_alarm_timer *t,
-                              int64_t nearest_delta_ns)
-{
-    HANDLE hTimer = t->timer;
-    int64_t nearest_delta_ms;
-    BOOLEAN success;
-
-    nearest_delta_ms = nearest_delta_ns / 1000000;
-    if (nearest_delta_ms < 1) {
-        nearest_delta_ms = 1;
-    }
-    /* ULONG_MAX can be 32 bit */
-    if (nearest_delta_ms > ULONG_MAX) {
-        nearest_delta_ms = ULONG_MAX;
-    }
-    success = ChangeTimerQueueTimer(NULL,
-                                    hTimer,
-                                    (unsigned long) nearest_delta_ms,
-                                    3600000);
-
-    if (!success) {
-        fprintf(stderr, "Failed to rearm win32 alarm timer: %ld\n",
-                GetLastError());
-        exit(-1);
-    }
-
-}
-
-#endif /* _WIN32 */
-
-static void quit_timers(void)
-{
-    struct qemu_alarm_timer *t = alarm_timer;
-    alarm_timer = NULL;
-    t->stop(t);
-}
-
-int init_timer_alarm(void)
-{
-    struct qemu_alarm_timer *t = NULL;
-    int i, err = -1;
-
-    for (i = 0; alarm_timers[i].name; i++) {
-        t = &alarm_timers[i];
-
-        err = t->start(t);
-        if (!err)
-            break;
-    }
-
-    if (err) {
-        err = -ENOENT;
-        goto fail;
-    }
-
-    /* first event is at time 0 */
-    atexit(quit_timers);
-    t->pending = true;
-    alarm_timer = t;
-
-    return 0;
-
-fail:
-    return err;
-}
-
@@ -17,6 +17,7 @@
 
 typedef struct QEMUClock QEMUClock;
 typedef void QEMUTimerCB(void *opaque);
+typedef void QEMUClockNotifyFunc(void *opaque);
 
 /* The real time clock should be used only for stuff which does not
    change the virtual machine state, as it is run even if the virtual
@@ -36,13 +37,43 @@ extern QEMUClock *vm_clock;
    the virtual clock. */
 extern QEMUClock *host_clock;
 
+/* Private real time clocks are not run by the main loop.  Their owner
+   runs them with qemu_run_timers() and is told through @notify when the
+   earliest deadline changes, for example to wake up its event loop. */
+QEMUClock *qemu_new_private_rt_clock(QEMUClockNotifyFunc *notify,
+                                     void *opaque);
+void qemu_free_clock(QEMUClock *clock);
+
 int64_t qemu_get_clock_ns(QEMUClock *clock);
 int64_t qemu_clock_has_timers(QEMUClock *clock);
 int64_t qemu_clock_expired(QEMUClock *clock);
 int64_t qemu_clock_deadline(QEMUClock *clock);
+
+/* Nanoseconds until the first timer of an enabled clock expires, 0 if
+   one already has, -1 if there is nothing to wait for.  The _all variant
+   covers the clocks run by the main loop and is used as its poll
+   timeout. */
+int64_t qemu_clock_deadline_ns(QEMUClock *clock);
+int64_t qemu_clock_deadline_ns_all(void);
 void qemu_clock_enable(QEMUClock *clock, bool enabled);
 void qemu_clock_warp(QEMUClock *clock);
 
+/* How late timers fire.  Bucket 0 counts timers that ran less than a
+   microsecond after their deadline, bucket i (i > 0) those that were 2^(i-1)
+   to 2^i microseconds late, and the last bucket anything later. */
+#define QEMU_TIMER_LATENCY_BUCKETS 16
+
+typedef struct QEMUTimerLatency {
+    uint64_t fired;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[QEMU_TIMER_LATENCY_BUCKETS];
+} QEMUTimerLatency;
+
+const QEMUTimerLatency *qemu_clock_get_latency(QEMUClock *clock);
+void qemu_clock_reset_latency(QEMUClock *clock);
+void qemu_timer_dump_latency(FILE *f, fprintf_function fprintf_func);
+
 void qemu_register_clock_reset_notifier(QEMUClock *clock, Notifier *notifier);
 void qemu_unregister_clock_reset_notifier(QEMUClock *clock,
                                           Notifier *notifier);
@@ -59,9 +90,7 @@ uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts);
 
 void qemu_run_timers(QEMUClock *clock);
 void qemu_run_all_timers(void);
-void configure_alarms(char const *opt);
 void init_clocks(void);
-int init_timer_alarm(void);
 
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
@@ -79,6 +108,12 @@ static inline QEMUTimer *qemu_new_timer_ms(QEMUClock *clock, QEMUTimerCB *cb,
     return qemu_new_timer(clock, SCALE_MS, cb, opaque);
 }
 
+/* The earlier of two timeouts in nanoseconds, where -1 means forever */
+static inline int64_t qemu_soonest_timeout(int64_t timeout1, int64_t timeout2)
+{
+    return (uint64_t)timeout1 < (uint64_t)timeout2 ? timeout1 : timeout2;
+}
+
 static inline int64_t qemu_get_clock_ms(QEMUClock *clock)
 {
     return qemu_get_clock_ns(clock) / SCALE_MS;
@@ -20,7 +20,6 @@
 #include "migration.h"
 #include "main-loop.h"
 #include "qemu_socket.h"
-#include "slirp/libslirp.h"
 
 #include <sys/time.h>
 
@@ -109,24 +108,9 @@ void qemu_clock_warp(QEMUClock *clock)
 int qemu_init_main_loop(void)
 {
     init_clocks();
-    init_timer_alarm();
     return main_loop_init();
 }
 
-void slirp_update_timeout(uint32_t *timeout)
-{
-}
-
-void slirp_select_fill(int *pnfds, fd_set *readfds,
-                       fd_set *writefds, fd_set *xfds)
-{
-}
-
-void slirp_select_poll(fd_set *readfds, fd_set *writefds,
-                       fd_set *xfds, int select_error)
-{
-}
-
 void migrate_add_blocker(Error *reason)
 {
 }
@@ -1119,7 +1119,10 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,"
+                      "burst_length:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1138,6 +1141,22 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total throughput during bursts in bytes per second
+              (json-int, optional)
+- "bps_rd_max":  read throughput during bursts in bytes per second
+                 (json-int, optional)
+- "bps_wr_max":  write throughput during bursts in bytes per second
+                 (json-int, optional)
+- "iops_max":  total I/O operations per second during bursts
+               (json-int, optional)
+- "iops_rd_max":  read I/O operations per second during bursts
+                  (json-int, optional)
+- "iops_wr_max":  write I/O operations per second during bursts
+                  (json-int, optional)
+- "burst_length":  how long a burst may last in seconds, 1 by default
+                   (json-int, optional)
+- "group":  throttle group; the devices of a group share one set of limits
+            (json-string, optional)
 
 Example:
 
@@ -1150,6 +1169,65 @@ Example:
                                                "iops_wr": "0" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:s?,boundaries_rd:s?,"
+                      "boundaries_wr:s?,boundaries_flush:s?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up the request latency histograms of a block drive. The histograms are
+reported by query-blockstats.
+
+Boundaries are comma-separated increasing latencies in nano-seconds; N
+boundaries make N + 1 bins. Setting a histogram empties it, an empty list
+removes it.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": boundaries for all request types (json-string, optional)
+- "boundaries_rd": boundaries for reads (json-string, optional)
+- "boundaries_wr": boundaries for writes (json-string, optional)
+- "boundaries_flush": boundaries for cache flushes (json-string, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": "100000,1000000,10000000",
+                    "boundaries_flush": "" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-stats-event-set",
+        .args_type  = "interval:l",
+        .mhandler.cmd_new = qmp_marshal_input_block_stats_event_set,
+    },
+
+SQMP
+block-stats-event-set
+---------------------
+
+Emit a BLOCK_STATS event for each block device every "interval" seconds.
+
+Arguments:
+
+- "interval": seconds between two rounds of events, 0 stops them (json-int)
+
+Example:
+
+-> { "execute": "block-stats-event-set", "arguments": { "interval": 10 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1491,6 +1569,22 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total bytes per second during bursts (json-int,
+                      optional)
+         - "bps_rd_max": read bytes per second during bursts (json-int,
+                         optional)
+         - "bps_wr_max": write bytes per second during bursts (json-int,
+                         optional)
+         - "iops_max": total operations per second during bursts
+                       (json-int, optional)
+         - "iops_rd_max": read operations per second during bursts
+                          (json-int, optional)
+         - "iops_wr_max": write operations per second during bursts
+                          (json-int, optional)
+         - "burst_length": how long a burst may last in seconds (json-int,
+                           optional)
+         - "group": throttle group of the device, only present when
+                    throttling is enabled (json-string, optional)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -1575,6 +1669,23 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_merged": read requests merged into other requests (json-int)
+    - "wr_merged": write requests merged into other requests (json-int)
+    - "in_flight": read and write requests being processed (json-int)
+    - "max_in_flight": highest value of "in_flight" so far (json-int)
+    - "in_flight_time_ns": sum over time of "in_flight" in nano-seconds;
+                           its increase divided by the elapsed time is the
+                           average queue depth (json-int)
+    - "idle_time_ns": time since the last request completed in
+                      nano-seconds, only present when no request is in
+                      flight (json-int, optional)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms, only present when set
+                                 up with block-latency-histogram-set
+                                 (json-array, optional). Each bin contains:
+        - "upper_ns": upper latency bound of the bin in nano-seconds,
+                      absent for the last bin (json-int, optional)
+        - "count": number of requests in the bin (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -114,6 +114,7 @@ diddit:
 		/* Update *_queued */
 		so->so_queued++;
 		so->so_nqueued++;
+		so_mark_dirty(so);
 		/*
 		 * Check if the interactive session should be downgraded to
 		 * the batchq.  A session is downgraded if it has queued 6
@@ -134,9 +135,12 @@ diddit:
 
 #ifndef FULL_BOLT
 	/*
-	 * This prevents us from malloc()ing too many mbufs
+	 * This prevents us from malloc()ing too many mbufs.  While slirp is
+	 * handling an event, the queue is flushed once when it is done.
 	 */
-	if_start(ifm->slirp);
+	if (ifm->slirp->io_depth == 0) {
+		if_start(ifm->slirp);
+	}
 #endif
 }
 
@@ -225,9 +229,12 @@ void if_start(Slirp *slirp)
         }
 
         /* Update so_queued */
-        if (ifm->ifq_so && --ifm->ifq_so->so_queued == 0) {
-            /* If there's no more queued, reset nqueued */
-            ifm->ifq_so->so_nqueued = 0;
+        if (ifm->ifq_so) {
+            so_mark_dirty(ifm->ifq_so);
+            if (--ifm->ifq_so->so_queued == 0) {
+                /* If there's no more queued, reset nqueued */
+                ifm->ifq_so->so_nqueued = 0;
+            }
         }
 
         m_free(ifm);
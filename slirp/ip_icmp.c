@@ -95,6 +95,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
     addr.sin_addr = so->so_faddr;
 
     insque(so, &so->slirp->icmp);
+    so_mark_dirty(so);
 
     if (sendto(so->s, m->m_data + hlen, m->m_len - hlen, 0,
                (struct sockaddr *)&addr, sizeof(addr)) == -1) {
@@ -109,6 +110,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
 
 void icmp_detach(struct socket *so)
 {
+    so_unwatch(so);
     closesocket(so->s);
     sofree(so);
 }
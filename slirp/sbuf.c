@@ -73,6 +73,8 @@ sbappend(struct socket *so, struct mbuf *m)
 
 	DEBUG_CALL("sbappend");
 	DEBUG_ARG("so = %lx", (long)so);
+
+	so_mark_dirty(so);
 	DEBUG_ARG("m = %lx", (long)m);
 	DEBUG_ARG("m->m_len = %d", m->m_len);
 
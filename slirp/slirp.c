@@ -39,12 +39,12 @@ static const uint8_t special_ethaddr[ETH_ALEN] = {
 
 static const uint8_t zero_ethaddr[ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
 
-/* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
-
 u_int curtime;
 static u_int time_fasttimo, last_slowtimo;
-static int do_slowtimo;
+
+/* drives tcp_fasttimo/slowtimo and session expiry for all instances */
+static QEMUTimer *slirp_timer;
+static int64_t slirp_timer_deadline;
 
 static QTAILQ_HEAD(slirp_instances, Slirp) slirp_instances =
     QTAILQ_HEAD_INITIALIZER(slirp_instances);
@@ -198,6 +198,7 @@ static void slirp_init_once(void)
 
 static void slirp_state_save(QEMUFile *f, void *opaque);
 static int slirp_state_load(QEMUFile *f, void *opaque, int version_id);
+static void slirp_timer_cb(void *opaque);
 
 Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   struct in_addr vnetmask, struct in_addr vhost,
@@ -240,6 +241,10 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     QTAILQ_INSERT_TAIL(&slirp_instances, slirp, entry);
 
+    if (!slirp_timer) {
+        slirp_timer = qemu_new_timer_ms(rt_clock, slirp_timer_cb, NULL);
+    }
+
     return slirp;
 }
 
@@ -252,6 +257,12 @@ void slirp_cleanup(Slirp *slirp)
     ip_cleanup(slirp);
     m_cleanup(slirp);
 
+    if (QTAILQ_EMPTY(&slirp_instances)) {
+        qemu_del_timer(slirp_timer);
+        qemu_free_timer(slirp_timer);
+        slirp_timer = NULL;
+    }
+
     g_free(slirp->tftp_prefix);
     g_free(slirp->bootp_filename);
     g_free(slirp);
@@ -259,352 +270,364 @@ void slirp_cleanup(Slirp *slirp)
 
 #define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
-#define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
-void slirp_update_timeout(uint32_t *timeout)
+#define SO_POLL_READ  1
+#define SO_POLL_WRITE 2
+
+static void slirp_so_read(void *opaque);
+static void slirp_so_write(void *opaque);
+
+/*
+ * Work out which events a socket is interested in.  These are the same
+ * conditions the old per-iteration scan of every socket used to apply.
+ * Only TCP sockets carry a tcpcb; UDP and ICMP are told apart by so_type.
+ */
+static int so_poll_events(struct socket *so)
 {
-    if (!QTAILQ_EMPTY(&slirp_instances)) {
-        *timeout = MIN(1000, *timeout);
+    int events = 0;
+
+    if (so->s == -1) {
+        return 0;
     }
+
+    if (so->so_type == IPPROTO_ICMP) {
+        if (so->so_state & SS_ISFCONNECTED) {
+            events |= SO_POLL_READ;
+        }
+    } else if (!so->so_tcpcb) {
+        /*
+         * When UDP packets are received from over the link, they're
+         * sendto()'d straight away, so no need for setting for writing.
+         * Limit the number of packets queued by this session to 4.  Note
+         * that even though we try and limit this to 4 packets, the session
+         * could have more queued if the packets needed to be fragmented.
+         */
+        if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
+            events |= SO_POLL_READ;
+        }
+    } else {
+        /*
+         * NOFDREF can include still connecting to local-host,
+         * newly socreated() sockets etc. Don't want to select these.
+         */
+        if (so->so_state & SS_NOFDREF) {
+            return 0;
+        }
+        if (so->so_state & SS_FACCEPTCONN) {
+            return SO_POLL_READ;
+        }
+        if (so->so_state & SS_ISFCONNECTING) {
+            return SO_POLL_WRITE;
+        }
+        /* connected, can send more, and we have something to send */
+        if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+            events |= SO_POLL_WRITE;
+        }
+        /* connected, can receive more, and we have room for it */
+        if (CONN_CANFRCV(so) &&
+            so->so_snd.sb_cc < (so->so_snd.sb_datalen / 2)) {
+            events |= SO_POLL_READ;
+        }
+    }
+    return events;
 }
 
-void slirp_select_fill(int *pnfds,
-                       fd_set *readfds, fd_set *writefds, fd_set *xfds)
+/*
+ * Queue a socket whose state or buffers changed; its main loop
+ * registration is brought up to date when the current event is done.
+ */
+void so_mark_dirty(struct socket *so)
 {
-    Slirp *slirp;
-    struct socket *so, *so_next;
-    int nfds;
+    Slirp *slirp = so->slirp;
 
-    if (QTAILQ_EMPTY(&slirp_instances)) {
+    if (!so->so_dirty) {
+        so->so_dirty = 1;
+        so->so_dirty_next = slirp->so_dirty_list;
+        slirp->so_dirty_list = so;
+    }
+}
+
+/* Must be called before the socket's descriptor is closed. */
+void so_unwatch(struct socket *so)
+{
+    if (so->so_poll_fd != -1) {
+        qemu_set_fd_handler(so->so_poll_fd, NULL, NULL, NULL);
+        so->so_poll_fd = -1;
+        so->so_poll_events = 0;
+    }
+}
+
+/* Drop a socket that is about to be freed from the dirty list. */
+void so_forget(struct socket *so)
+{
+    struct socket **p;
+
+    so_unwatch(so);
+    if (!so->so_dirty) {
         return;
     }
+    for (p = &so->slirp->so_dirty_list; *p; p = &(*p)->so_dirty_next) {
+        if (*p == so) {
+            *p = so->so_dirty_next;
+            break;
+        }
+    }
+    so->so_dirty = 0;
+    so->so_dirty_next = NULL;
+}
 
-    /* fail safe */
-    global_readfds = NULL;
-    global_writefds = NULL;
-    global_xfds = NULL;
-
-    nfds = *pnfds;
-	/*
-	 * First, TCP sockets
-	 */
-	do_slowtimo = 0;
-
-	QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
-		/*
-		 * *_slowtimo needs calling if there are IP fragments
-		 * in the fragment queue, or there are TCP connections active
-		 */
-		do_slowtimo |= ((slirp->tcb.so_next != &slirp->tcb) ||
-		    (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
-
-		for (so = slirp->tcb.so_next; so != &slirp->tcb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * See if we need a tcp_fasttimo
-			 */
-			if (time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK)
-			   time_fasttimo = curtime; /* Flag when we want a fasttimo */
-
-			/*
-			 * NOFDREF can include still connecting to local-host,
-			 * newly socreated() sockets etc. Don't want to select these.
-	 		 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-			/*
-			 * Set for reading sockets which are accepting
-			 */
-			if (so->so_state & SS_FACCEPTCONN) {
-                                FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-				continue;
-			}
-
-			/*
-			 * Set for writing sockets which are connecting
-			 */
-			if (so->so_state & SS_ISFCONNECTING) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-				continue;
-			}
-
-			/*
-			 * Set for writing if we are connected, can send more, and
-			 * we have something to send
-			 */
-			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-			}
-
-			/*
-			 * Set for reading (and urgent data) if we are connected, can
-			 * receive more, and we have room for it XXX /2 ?
-			 */
-			if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-				FD_SET(so->s, readfds);
-				FD_SET(so->s, xfds);
-				UPD_NFDS(so->s);
-			}
-		}
-
-		/*
-		 * UDP sockets
-		 */
-		for (so = slirp->udb.so_next; so != &slirp->udb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * See if it's timed out
-			 */
-			if (so->so_expire) {
-				if (so->so_expire <= curtime) {
-					udp_detach(so);
-					continue;
-				} else
-					do_slowtimo = 1; /* Let socket expire */
-			}
-
-			/*
-			 * When UDP packets are received from over the
-			 * link, they're sendto()'d straight away, so
-			 * no need for setting for writing
-			 * Limit the number of packets queued by this session
-			 * to 4.  Note that even though we try and limit this
-			 * to 4 packets, the session could have more queued
-			 * if the packets needed to be fragmented
-			 * (XXX <= 4 ?)
-			 */
-			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-				FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-			}
-		}
-
-                /*
-                 * ICMP sockets
-                 */
-                for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                     so = so_next) {
-                    so_next = so->so_next;
-
-                    /*
-                     * See if it's timed out
-                     */
-                    if (so->so_expire) {
-                        if (so->so_expire <= curtime) {
-                            icmp_detach(so);
-                            continue;
-                        } else {
-                            do_slowtimo = 1; /* Let socket expire */
-                        }
-                    }
-
-                    if (so->so_state & SS_ISFCONNECTED) {
-                        FD_SET(so->s, readfds);
-                        UPD_NFDS(so->s);
-                    }
-                }
-	}
+static void so_update_watch(struct socket *so)
+{
+    int events = so_poll_events(so);
 
-        *pnfds = nfds;
+    if (events == 0) {
+        so_unwatch(so);
+        return;
+    }
+    if (so->so_poll_fd == so->s && so->so_poll_events == events) {
+        return;
+    }
+    qemu_set_fd_handler(so->s,
+                        events & SO_POLL_READ ? slirp_so_read : NULL,
+                        events & SO_POLL_WRITE ? slirp_so_write : NULL,
+                        so);
+    so->so_poll_fd = so->s;
+    so->so_poll_events = events;
 }
 
-void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
-                       int select_error)
+static void slirp_flush_dirty(Slirp *slirp)
+{
+    struct socket *so;
+
+    while ((so = slirp->so_dirty_list) != NULL) {
+        slirp->so_dirty_list = so->so_dirty_next;
+        so->so_dirty_next = NULL;
+        so->so_dirty = 0;
+
+        /* See if we need a tcp_fasttimo */
+        if (time_fasttimo == 0 && so->so_tcpcb &&
+            (so->so_tcpcb->t_flags & TF_DELACK)) {
+            time_fasttimo = curtime;
+        }
+        so_update_watch(so);
+    }
+}
+
+static void slirp_mark_all_dirty(Slirp *slirp, struct socket *head)
+{
+    struct socket *so;
+
+    for (so = head->so_next; so != head; so = so->so_next) {
+        so_mark_dirty(so);
+    }
+}
+
+static void slirp_expire_sockets(Slirp *slirp, struct socket *head,
+                                 void (*detach)(struct socket *))
 {
-    Slirp *slirp;
     struct socket *so, *so_next;
-    int ret;
 
-    if (QTAILQ_EMPTY(&slirp_instances)) {
+    for (so = head->so_next; so != head; so = so_next) {
+        so_next = so->so_next;
+        if (so->so_expire && so->so_expire <= curtime) {
+            detach(so);
+        }
+    }
+}
+
+static bool slirp_needs_slowtimo(Slirp *slirp)
+{
+    /*
+     * *_slowtimo needs calling if there are IP fragments in the fragment
+     * queue or TCP connections active; UDP and ICMP sessions expire from
+     * it, and packets waiting for an ARP reply are retried from it.
+     */
+    return slirp->tcb.so_next != &slirp->tcb ||
+           slirp->ipq.ip_link.next != &slirp->ipq.ip_link ||
+           slirp->udb.so_next != &slirp->udb ||
+           slirp->icmp.so_next != &slirp->icmp ||
+           slirp->if_fastq.ifq_next != &slirp->if_fastq ||
+           slirp->if_batchq.ifq_next != &slirp->if_batchq;
+}
+
+static void slirp_update_timer(void)
+{
+    Slirp *slirp;
+    int64_t now, fast, delay = -1;
+    u_int elapsed;
+    bool slow = false;
+
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        slow |= slirp_needs_slowtimo(slirp);
+    }
+
+    now = qemu_get_clock_ms(rt_clock);
+    if (slow) {
+        elapsed = (u_int)now - last_slowtimo;
+        delay = elapsed >= 499 ? 0 : 499 - elapsed;
+    }
+    if (time_fasttimo) {
+        elapsed = (u_int)now - time_fasttimo;
+        fast = elapsed >= 2 ? 0 : 2 - elapsed;
+        delay = delay < 0 ? fast : MIN(delay, fast);
+    }
+    if (delay < 0) {
         return;
     }
 
-    global_readfds = readfds;
-    global_writefds = writefds;
-    global_xfds = xfds;
+    /* only ever pull the deadline in, so steady traffic can't starve it */
+    if (!qemu_timer_pending(slirp_timer) ||
+        now + delay < slirp_timer_deadline) {
+        slirp_timer_deadline = now + delay;
+        qemu_mod_timer(slirp_timer, slirp_timer_deadline);
+    }
+}
+
+/*
+ * Every entry point into slirp is bracketed by slirp_begin_io() and
+ * slirp_end_io().  Segments the stack emits meanwhile stay on the
+ * interface queues and reach the guest as one burst at the end, and
+ * sockets touched on the way get their registration updated only once.
+ */
+static void slirp_begin_io(Slirp *slirp)
+{
+    if (slirp->io_depth++ == 0) {
+        curtime = qemu_get_clock_ms(rt_clock);
+    }
+}
+
+static void slirp_end_io(Slirp *slirp)
+{
+    if (--slirp->io_depth > 0) {
+        return;
+    }
+
+    if (slirp->if_fastq.ifq_next != &slirp->if_fastq ||
+        slirp->if_batchq.ifq_next != &slirp->if_batchq) {
+        slirp_output_batch_begin(slirp->opaque);
+        if_start(slirp);
+        slirp_output_batch_end(slirp->opaque);
+    }
+    slirp_flush_dirty(slirp);
+    slirp_update_timer();
+}
+
+static void slirp_timer_cb(void *opaque)
+{
+    Slirp *slirp;
+    bool fast, slow;
 
     curtime = qemu_get_clock_ms(rt_clock);
+    fast = time_fasttimo && (curtime - time_fasttimo) >= 2;
+    slow = (curtime - last_slowtimo) >= 499;
+    if (fast) {
+        time_fasttimo = 0;
+    }
+    if (slow) {
+        last_slowtimo = curtime;
+    }
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
-	/*
-	 * See if anything has timed out
-	 */
-		if (time_fasttimo && ((curtime - time_fasttimo) >= 2)) {
-			tcp_fasttimo(slirp);
-			time_fasttimo = 0;
-		}
-		if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
-			ip_slowtimo(slirp);
-			tcp_slowtimo(slirp);
-			last_slowtimo = curtime;
-		}
-
-	/*
-	 * Check sockets
-	 */
-	if (!select_error) {
-		/*
-		 * Check TCP sockets
-		 */
-		for (so = slirp->tcb.so_next; so != &slirp->tcb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * FD_ISSET is meaningless on these sockets
-			 * (and they can crash the program)
-			 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-			/*
-			 * Check for URG data
-			 * This will soread as well, so no need to
-			 * test for readfds below if this succeeds
-			 */
-			if (FD_ISSET(so->s, xfds))
-			   sorecvoob(so);
-			/*
-			 * Check sockets for reading
-			 */
-			else if (FD_ISSET(so->s, readfds)) {
-				/*
-				 * Check for incoming connections
-				 */
-				if (so->so_state & SS_FACCEPTCONN) {
-					tcp_connect(so);
-					continue;
-				} /* else */
-				ret = soread(so);
-
-				/* Output it if we read something */
-				if (ret > 0)
-				   tcp_output(sototcpcb(so));
-			}
-
-			/*
-			 * Check sockets for writing
-			 */
-			if (FD_ISSET(so->s, writefds)) {
-			  /*
-			   * Check for non-blocking, still-connecting sockets
-			   */
-			  if (so->so_state & SS_ISFCONNECTING) {
-			    /* Connected */
-			    so->so_state &= ~SS_ISFCONNECTING;
-
-			    ret = send(so->s, (const void *) &ret, 0, 0);
-			    if (ret < 0) {
-			      /* XXXXX Must fix, zero bytes is a NOP */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    }
-			    /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-			    /*
-			     * Continue tcp_input
-			     */
-			    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-			    /* continue; */
-			  } else
-			    ret = sowrite(so);
-			  /*
-			   * XXXXX If we wrote something (a lot), there
-			   * could be a need for a window update.
-			   * In the worst case, the remote will send
-			   * a window probe to get things going again
-			   */
-			}
-
-			/*
-			 * Probe a still-connecting, non-blocking socket
-			 * to check if it's still alive
-	 	 	 */
-#ifdef PROBE_CONN
-			if (so->so_state & SS_ISFCONNECTING) {
-                          ret = qemu_recv(so->s, &ret, 0,0);
-
-			  if (ret < 0) {
-			    /* XXX */
-			    if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				errno == EINPROGRESS || errno == ENOTCONN)
-			      continue; /* Still connecting, continue */
-
-			    /* else failed */
-			    so->so_state &= SS_PERSISTENT_MASK;
-			    so->so_state |= SS_NOFDREF;
-
-			    /* tcp_input will take care of it */
-			  } else {
-			    ret = send(so->s, &ret, 0,0);
-			    if (ret < 0) {
-			      /* XXX */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    } else
-			      so->so_state &= ~SS_ISFCONNECTING;
-
-			  }
-			  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
-			} /* SS_ISFCONNECTING */
+        slirp_begin_io(slirp);
+        if (fast) {
+            tcp_fasttimo(slirp);
+        }
+        if (slow) {
+            ip_slowtimo(slirp);
+            tcp_slowtimo(slirp);
+            slirp_expire_sockets(slirp, &slirp->udb, udp_detach);
+            slirp_expire_sockets(slirp, &slirp->icmp, icmp_detach);
+
+            /* cheap resync, in case a state change went unnoticed */
+            slirp_mark_all_dirty(slirp, &slirp->tcb);
+            slirp_mark_all_dirty(slirp, &slirp->udb);
+            slirp_mark_all_dirty(slirp, &slirp->icmp);
+        }
+        slirp_end_io(slirp);
+    }
+    slirp_update_timer();
+}
+
+/* Is urgent data waiting at the head of the (OOBINLINE) stream? */
+static int so_at_oob_mark(struct socket *so)
+{
+#ifndef _WIN32
+    return sockatmark(so->s) == 1;
+#else
+    return 0;
 #endif
-		}
-
-		/*
-		 * Now UDP sockets.
-		 * Incoming packets are sent straight away, they're not buffered.
-		 * Incoming UDP data isn't buffered either.
-		 */
-		for (so = slirp->udb.so_next; so != &slirp->udb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                            sorecvfrom(so);
-                        }
-		}
-
-                /*
-                 * Check incoming ICMP relies.
-                 */
-                for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                     so = so_next) {
-                     so_next = so->so_next;
-
-                    if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                        icmp_receive(so);
-                    }
-                }
-	}
+}
 
-        if_start(slirp);
+static void slirp_so_read(void *opaque)
+{
+    struct socket *so = opaque;
+    Slirp *slirp = so->slirp;
+
+    slirp_begin_io(slirp);
+    so_mark_dirty(so);
+
+    /*
+     * The state may have changed since the descriptor was polled, e.g. by
+     * an earlier handler in the same main loop iteration.  Note that so
+     * may be freed by any of the calls below.
+     */
+    if (!(so_poll_events(so) & SO_POLL_READ)) {
+        /* nothing to do */
+    } else if (so->so_type == IPPROTO_ICMP) {
+        icmp_receive(so);
+    } else if (!so->so_tcpcb) {
+        sorecvfrom(so);
+    } else if (so->so_state & SS_FACCEPTCONN) {
+        tcp_connect(so);
+    } else if (so_at_oob_mark(so)) {
+        /* this will soread as well */
+        sorecvoob(so);
+    } else if (soread(so) > 0) {
+        /* Output it if we read something */
+        tcp_output(sototcpcb(so));
     }
 
-	/* clear global file descriptor sets.
-	 * these reside on the stack in vl.c
-	 * so they're unusable if we're not in
-	 * slirp_select_fill or slirp_select_poll.
-	 */
-	 global_readfds = NULL;
-	 global_writefds = NULL;
-	 global_xfds = NULL;
+    slirp_end_io(slirp);
+}
+
+static void slirp_so_write(void *opaque)
+{
+    struct socket *so = opaque;
+    Slirp *slirp = so->slirp;
+    int ret;
+
+    slirp_begin_io(slirp);
+    so_mark_dirty(so);
+
+    if (!(so_poll_events(so) & SO_POLL_WRITE)) {
+        /* nothing to do */
+    } else if (so->so_state & SS_ISFCONNECTING) {
+        /* Check for non-blocking, still-connecting sockets */
+        so->so_state &= ~SS_ISFCONNECTING;
+
+        ret = send(so->s, (const void *) &ret, 0, 0);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == EINPROGRESS || errno == ENOTCONN)) {
+            /* XXXXX Must fix, zero bytes is a NOP */
+        } else {
+            if (ret < 0) {
+                /* failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            }
+            /* Continue tcp_input */
+            tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+        }
+    } else {
+        /*
+         * XXXXX If we wrote something (a lot), there could be a need for
+         * a window update.  In the worst case, the remote will send a
+         * window probe to get things going again
+         */
+        sowrite(so);
+    }
+
+    slirp_end_io(slirp);
 }
 
 static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
@@ -674,6 +697,7 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     if (pkt_len < ETH_HLEN)
         return;
 
+    slirp_begin_io(slirp);
     proto = ntohs(*(uint16_t *)(pkt + 12));
     switch(proto) {
     case ETH_P_ARP:
@@ -682,7 +706,7 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     case ETH_P_IP:
         m = m_get(slirp);
         if (!m)
-            return;
+            break;
         /* Note: we add to align the IP header */
         if (M_FREEROOM(m) < pkt_len + 2) {
             m_inc(m, pkt_len + 2);
@@ -698,6 +722,7 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     default:
         break;
     }
+    slirp_end_io(slirp);
 }
 
 /* Output the IP packet to the ethernet device. Returns 0 if the packet must be
@@ -779,6 +804,7 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
             getsockname(so->s, (struct sockaddr *)&addr, &addr_len) == 0 &&
             addr.sin_addr.s_addr == host_addr.s_addr &&
             addr.sin_port == port) {
+            so_unwatch(so);
             close(so->s);
             sofree(so);
             return 0;
@@ -791,19 +817,21 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
 int slirp_add_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
                       int host_port, struct in_addr guest_addr, int guest_port)
 {
+    struct socket *so;
+
     if (!guest_addr.s_addr) {
         guest_addr = slirp->vdhcp_startaddr;
     }
+    slirp_begin_io(slirp);
     if (is_udp) {
-        if (!udp_listen(slirp, host_addr.s_addr, htons(host_port),
-                        guest_addr.s_addr, htons(guest_port), SS_HOSTFWD))
-            return -1;
+        so = udp_listen(slirp, host_addr.s_addr, htons(host_port),
+                        guest_addr.s_addr, htons(guest_port), SS_HOSTFWD);
     } else {
-        if (!tcp_listen(slirp, host_addr.s_addr, htons(host_port),
-                        guest_addr.s_addr, htons(guest_port), SS_HOSTFWD))
-            return -1;
+        so = tcp_listen(slirp, host_addr.s_addr, htons(host_port),
+                        guest_addr.s_addr, htons(guest_port), SS_HOSTFWD);
     }
-    return 0;
+    slirp_end_io(slirp);
+    return so ? 0 : -1;
 }
 
 int slirp_add_exec(Slirp *slirp, int do_pty, const void *args,
@@ -873,10 +901,13 @@ void slirp_socket_recv(Slirp *slirp, struct in_addr guest_addr, int guest_port,
     if (!so)
         return;
 
+    slirp_begin_io(slirp);
+    so_mark_dirty(so);
     ret = soreadbuf(so, (const char *)buf, size);
 
     if (ret > 0)
         tcp_output(sototcpcb(so));
+    slirp_end_io(slirp);
 }
 
 static void slirp_tcp_save(QEMUFile *f, struct tcpcb *tp)
@@ -228,6 +228,10 @@ struct Slirp {
     struct mbuf *next_m;    /* pointer to next mbuf to output */
     bool if_start_busy;     /* avoid if_start recursion */
 
+    /* main loop states */
+    int io_depth;           /* nesting of slirp_begin_io() */
+    struct socket *so_dirty_list; /* sockets to re-register */
+
     /* ip states */
     struct ipq ipq;         /* ip reass. queue */
     uint16_t ip_id;         /* ip packet ctr, for ids */
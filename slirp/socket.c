@@ -51,6 +51,7 @@ socreate(Slirp *slirp)
     so->so_state = SS_NOFDREF;
     so->s = -1;
     so->slirp = slirp;
+    so->so_poll_fd = -1;
   }
   return(so);
 }
@@ -75,6 +76,7 @@ sofree(struct socket *so)
       slirp->icmp_last_so = &slirp->icmp;
   }
   m_free(so->so_m);
+  so_forget(so);
 
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
@@ -651,6 +653,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = addr.sin_addr;
 
 	so->s = s;
+	so_mark_dirty(so);
 	return so;
 }
 
@@ -666,6 +669,7 @@ soisfconnecting(struct socket *so)
 	so->so_state &= ~(SS_NOFDREF|SS_ISFCONNECTED|SS_FCANTRCVMORE|
 			  SS_FCANTSENDMORE|SS_FWDRAIN);
 	so->so_state |= SS_ISFCONNECTING; /* Clobber other states */
+	so_mark_dirty(so);
 }
 
 void
@@ -673,6 +677,7 @@ soisfconnected(struct socket *so)
 {
 	so->so_state &= ~(SS_ISFCONNECTING|SS_FWDRAIN|SS_NOFDREF);
 	so->so_state |= SS_ISFCONNECTED; /* Clobber other states */
+	so_mark_dirty(so);
 }
 
 static void
@@ -680,10 +685,8 @@ sofcantrcvmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
 		shutdown(so->s,0);
-		if(global_writefds) {
-		  FD_CLR(so->s,global_writefds);
-		}
 	}
+	so_mark_dirty(so);
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTSENDMORE) {
 	   so->so_state &= SS_PERSISTENT_MASK;
@@ -698,13 +701,8 @@ sofcantsendmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
             shutdown(so->s,1);           /* send FIN to fhost */
-            if (global_readfds) {
-                FD_CLR(so->s,global_readfds);
-            }
-            if (global_xfds) {
-                FD_CLR(so->s,global_xfds);
-            }
 	}
+	so_mark_dirty(so);
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTRCVMORE) {
 	   so->so_state &= SS_PERSISTENT_MASK;
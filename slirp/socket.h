@@ -51,6 +51,11 @@ struct socket {
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
   void * extra;			/* Extra pointer */
+
+  int	so_poll_fd;		/* fd registered with the main loop, or -1 */
+  int	so_poll_events;		/* SO_POLL_* it is registered for */
+  int	so_dirty;		/* on slirp->so_dirty_list */
+  struct socket *so_dirty_next;
 };
 
 
@@ -77,6 +82,9 @@ struct socket {
 struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
+void so_mark_dirty(struct socket *);
+void so_unwatch(struct socket *);
+void so_forget(struct socket *);
 int soread(struct socket *);
 void sorecvoob(struct socket *);
 int sosendoob(struct socket *);
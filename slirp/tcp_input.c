@@ -379,6 +379,7 @@ findso:
 	  tp = sototcpcb(so);
 	  tp->t_state = TCPS_LISTEN;
 	}
+	so_mark_dirty(so);
 
         /*
          * If this is a still-connecting socket, this probably
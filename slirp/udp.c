@@ -316,6 +316,7 @@ udp_attach(struct socket *so)
   if((so->s = qemu_socket(AF_INET,SOCK_DGRAM,0)) != -1) {
     so->so_expire = curtime + SO_EXPIRE;
     insque(so, &so->slirp->udb);
+    so_mark_dirty(so);
   }
   return(so->s);
 }
@@ -323,6 +324,7 @@ udp_attach(struct socket *so)
 void
 udp_detach(struct socket *so)
 {
+	so_unwatch(so);
 	closesocket(so->s);
 	sofree(so);
 }
@@ -390,6 +392,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 
 	so->so_state &= SS_PERSISTENT_MASK;
 	so->so_state |= SS_ISFCONNECTED | flags;
+	so_mark_dirty(so);
 
 	return so;
 }
@@ -0,0 +1,257 @@
+/*
+ * AioContext tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu-timer.h"
+
+typedef struct {
+    QEMUBH *bh;
+    int n;
+    int max;
+} BHTestData;
+
+static void bh_test_cb(void *opaque)
+{
+    BHTestData *data = opaque;
+
+    if (++data->n < data->max) {
+        qemu_bh_schedule(data->bh);
+    }
+}
+
+static void test_bh_schedule(void)
+{
+    AioContext *ctx = aio_context_new();
+    BHTestData data = { .n = 0, .max = 1 };
+
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    qemu_bh_schedule(data.bh);
+    g_assert_cmpint(data.n, ==, 0);
+
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    qemu_bh_delete(data.bh);
+    aio_context_free(ctx);
+}
+
+static void test_bh_reschedule(void)
+{
+    AioContext *ctx = aio_context_new();
+    BHTestData data = { .n = 0, .max = 10 };
+
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    /* a bottom half that schedules itself runs once per iteration */
+    qemu_bh_schedule(data.bh);
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+    g_assert_cmpint(data.n, ==, 10);
+
+    qemu_bh_delete(data.bh);
+    aio_context_free(ctx);
+}
+
+/*
+ * Bottom halves scheduled from other threads: every increment a thread
+ * makes before scheduling must be seen by a later run of the callback.
+ */
+
+#define BH_THREADS      4
+#define BH_SCHEDULES    20000
+
+typedef struct {
+    QEMUBH *bh;
+    int produced;       /* accessed atomically */
+    int consumed;
+    int runs;
+} CrossThreadData;
+
+static void cross_thread_cb(void *opaque)
+{
+    CrossThreadData *data = opaque;
+
+    data->consumed = g_atomic_int_get(&data->produced);
+    data->runs++;
+}
+
+static void *cross_thread_fn(void *opaque)
+{
+    CrossThreadData *data = opaque;
+    int i;
+
+    for (i = 0; i < BH_SCHEDULES; i++) {
+        g_atomic_int_inc(&data->produced);
+        qemu_bh_schedule(data->bh);
+    }
+    return NULL;
+}
+
+static void test_bh_cross_thread(void)
+{
+    AioContext *ctx = aio_context_new();
+    CrossThreadData data = { .produced = 0 };
+    QemuThread threads[BH_THREADS];
+    int i;
+
+    data.bh = aio_bh_new(ctx, cross_thread_cb, &data);
+    for (i = 0; i < BH_THREADS; i++) {
+        qemu_thread_create(&threads[i], cross_thread_fn, &data,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    /* a lost wakeup would make this hang */
+    while (data.consumed < BH_THREADS * BH_SCHEDULES) {
+        aio_poll(ctx, true);
+    }
+
+    for (i = 0; i < BH_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    /* schedules that found the bottom half pending were coalesced */
+    g_assert_cmpint(data.runs, <=, BH_THREADS * BH_SCHEDULES);
+    g_test_message("%d schedules, %d runs\n", BH_THREADS * BH_SCHEDULES,
+                   data.runs);
+
+    qemu_bh_delete(data.bh);
+    aio_context_free(ctx);
+}
+
+typedef struct {
+    int fd;
+    int n;
+} HandlerTestData;
+
+static void handler_test_read(void *opaque)
+{
+    HandlerTestData *data = opaque;
+    char buf[16];
+
+    g_assert(read(data->fd, buf, sizeof(buf)) > 0);
+    data->n++;
+}
+
+static void test_fd_handler(void)
+{
+    AioContext *ctx = aio_context_new();
+    HandlerTestData data = { .n = 0 };
+    int fds[2];
+
+    g_assert(pipe(fds) == 0);
+    data.fd = fds[0];
+    aio_set_fd_handler(ctx, fds[0], handler_test_read, NULL, NULL, &data);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    g_assert(write(fds[1], "x", 1) == 1);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* removed handlers are not called anymore */
+    aio_set_fd_handler(ctx, fds[0], NULL, NULL, NULL, NULL);
+    g_assert(write(fds[1], "x", 1) == 1);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    aio_context_free(ctx);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void timer_test_cb(void *opaque)
+{
+    int *n = opaque;
+
+    (*n)++;
+}
+
+static void test_timer(void)
+{
+    AioContext *ctx = aio_context_new();
+    QEMUTimer *timer;
+    int64_t start;
+    int n = 0;
+
+    timer = aio_timer_new(ctx, SCALE_MS, timer_test_cb, &n);
+    start = qemu_get_clock_ns(rt_clock);
+    qemu_mod_timer(timer, qemu_get_clock_ms(rt_clock) + 10);
+
+    /* the timer deadline bounds the wait */
+    while (n == 0) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(n, ==, 1);
+    g_assert(qemu_get_clock_ns(rt_clock) - start >= 10 * SCALE_MS);
+    g_assert(!qemu_timer_pending(timer));
+
+    qemu_free_timer(timer);
+    aio_context_free(ctx);
+}
+
+static int get_count(AioContext *ctx, int *count)
+{
+    int n;
+
+    aio_context_acquire(ctx);
+    n = *count;
+    aio_context_release(ctx);
+    return n;
+}
+
+static void test_thread(void)
+{
+    AioContext *ctx = aio_context_new();
+    HandlerTestData data = { .n = 0 };
+    int fds[2];
+
+    g_assert(pipe(fds) == 0);
+    data.fd = fds[0];
+    aio_set_fd_handler(ctx, fds[0], handler_test_read, NULL, NULL, &data);
+
+    aio_context_start_thread(ctx);
+
+    g_assert(write(fds[1], "x", 1) == 1);
+    while (get_count(ctx, &data.n) == 0) {
+        g_usleep(1000);
+    }
+
+    /* while the context is acquired its thread stays away */
+    aio_context_acquire(ctx);
+    g_assert(write(fds[1], "x", 1) == 1);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    aio_context_release(ctx);
+
+    aio_context_stop_thread(ctx);
+    aio_set_fd_handler(ctx, fds[0], NULL, NULL, NULL, NULL);
+    aio_context_free(ctx);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks();
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/aio/bh/schedule", test_bh_schedule);
+    g_test_add_func("/aio/bh/reschedule", test_bh_reschedule);
+    g_test_add_func("/aio/bh/cross_thread", test_bh_cross_thread);
+    g_test_add_func("/aio/fd_handler", test_fd_handler);
+    g_test_add_func("/aio/timer", test_timer);
+    g_test_add_func("/aio/thread", test_thread);
+    return g_test_run();
+}
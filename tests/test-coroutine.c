@@ -12,7 +12,10 @@
  */
 
 #include <glib.h>
+#include "qemu-common.h"
 #include "qemu-coroutine.h"
+#include "main-loop.h"
+#include "qemu-thread.h"
 
 /*
  * Check that qemu_in_coroutine() works
@@ -151,22 +154,192 @@ static void test_lifecycle(void)
 }
 
 /*
- * Lifecycle benchmark
+ * Check that the CoRwlock prefers writers without starving readers
  */
 
+typedef struct {
+    CoRwlock *lock;
+    bool write;
+    int id;
+} RwlockData;
+
+static int rwlock_order[4];
+static int rwlock_order_len;
+
+static void coroutine_fn rwlock_user(void *opaque)
+{
+    RwlockData *data = opaque;
+
+    if (data->write) {
+        qemu_co_rwlock_wrlock(data->lock);
+    } else {
+        qemu_co_rwlock_rdlock(data->lock);
+    }
+    rwlock_order[rwlock_order_len++] = data->id;
+
+    /* hold the lock until the test enters us again */
+    qemu_coroutine_yield();
+    qemu_co_rwlock_unlock(data->lock);
+}
+
+static void test_rwlock(void)
+{
+    CoRwlock lock;
+    RwlockData data[4];
+    Coroutine *coroutines[4];
+    int i;
+
+    qemu_co_rwlock_init(&lock);
+    rwlock_order_len = 0;
+
+    /* reader, writer, reader, writer: only the first one gets the lock */
+    for (i = 0; i < 4; i++) {
+        data[i].lock = &lock;
+        data[i].write = i & 1;
+        data[i].id = i;
+        coroutines[i] = qemu_coroutine_create(rwlock_user);
+        qemu_coroutine_enter(coroutines[i], &data[i]);
+    }
+    g_assert_cmpint(rwlock_order_len, ==, 1);
+    g_assert_cmpint(lock.stats.waiters, ==, 3);
+
+    /* each unlock hands the lock over to the next one in line */
+    for (i = 0; i < 4; i++) {
+        qemu_coroutine_enter(coroutines[i], NULL);
+        while (qemu_bh_poll()) {
+            /* run the woken up coroutine */
+        }
+    }
+
+    g_assert_cmpint(rwlock_order_len, ==, 4);
+    for (i = 0; i < 4; i++) {
+        g_assert_cmpint(rwlock_order[i], ==, i);
+    }
+    g_assert_cmpint(lock.stats.acquisitions, ==, 4);
+    g_assert_cmpint(lock.stats.contended, ==, 3);
+    g_assert_cmpint(lock.stats.max_waiters, ==, 3);
+    g_assert_cmpint(lock.stats.waiters, ==, 0);
+}
+
 static void coroutine_fn empty_coroutine(void *opaque)
 {
     /* Do nothing */
 }
 
-static void perf_lifecycle(void)
+/*
+ * Check that terminated coroutines are recycled, up to the pool bound
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void test_pool(void)
+{
+    Coroutine *coroutines[4];
+    CoroutinePoolStats before, after;
+    unsigned int i;
+
+    qemu_coroutine_set_pool_max_size(2);
+    qemu_coroutine_get_pool_stats(&before);
+    g_assert_cmpint(before.max_size, ==, 2);
+    g_assert_cmpint(before.size, <=, 2);
+
+    coroutines[0] = qemu_coroutine_create(empty_coroutine);
+    qemu_coroutine_get_pool_stats(&after);
+    if (after.hits + after.misses == before.hits + before.misses) {
+        g_test_message("Coroutine backend does not pool\n");
+        qemu_coroutine_enter(coroutines[0], NULL);
+        return;
+    }
+    qemu_coroutine_enter(coroutines[0], NULL);
+
+    /* a terminated coroutine is handed out again */
+    coroutines[1] = qemu_coroutine_create(empty_coroutine);
+    g_assert(coroutines[1] == coroutines[0]);
+    qemu_coroutine_enter(coroutines[1], NULL);
+
+    /* only two of four terminated coroutines are kept */
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        coroutines[i] = qemu_coroutine_create(yield_once);
+        qemu_coroutine_enter(coroutines[i], NULL);
+    }
+    qemu_coroutine_get_pool_stats(&before);
+    g_assert_cmpint(before.size, ==, 0);
+    for (i = 0; i < ARRAY_SIZE(coroutines); i++) {
+        qemu_coroutine_enter(coroutines[i], NULL);
+    }
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.size, ==, 2);
+
+    coroutines[0] = qemu_coroutine_create(empty_coroutine);
+    qemu_coroutine_enter(coroutines[0], NULL);
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.hits, ==, before.hits + 1);
+    g_assert_cmpint(after.misses, ==, before.misses);
+
+    qemu_coroutine_set_pool_max_size(0);
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpint(after.size, ==, 0);
+    qemu_coroutine_set_pool_max_size(64);
+}
+
+/*
+ * Check that the statistics cover the pools of other threads
+ */
+
+static void *pool_thread_fn(void *opaque)
+{
+    Coroutine *co;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        co = qemu_coroutine_create(empty_coroutine);
+        qemu_coroutine_enter(co, NULL);
+    }
+    return NULL;
+}
+
+static void test_pool_threads(void)
+{
+    CoroutinePoolStats before, after;
+    QemuThread thread;
+
+    qemu_coroutine_get_pool_stats(&before);
+    qemu_thread_create(&thread, pool_thread_fn, NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_join(&thread);
+    qemu_coroutine_get_pool_stats(&after);
+
+    if (after.hits + after.misses == before.hits + before.misses) {
+        g_test_message("Coroutine backend does not pool\n");
+        return;
+    }
+
+    /* the thread has exited, but its creations still count */
+    g_assert_cmpint(after.hits + after.misses, ==,
+                    before.hits + before.misses + 3);
+    g_assert_cmpint(after.misses, ==, before.misses + 1);
+    g_assert_cmpint(after.threads, ==, before.threads);
+    g_assert_cmpint(after.size, ==, before.size);
+}
+
+/*
+ * Lifecycle benchmark
+ */
+
+static void perf_lifecycle_pool(unsigned int pool_max_size)
 {
     Coroutine *coroutine;
+    CoroutinePoolStats before, after;
     unsigned int i, max;
     double duration;
 
     max = 1000000;
 
+    qemu_coroutine_set_pool_max_size(pool_max_size);
+    qemu_coroutine_get_pool_stats(&before);
+
     g_test_timer_start();
     for (i = 0; i < max; i++) {
         coroutine = qemu_coroutine_create(empty_coroutine);
@@ -174,7 +347,55 @@ static void perf_lifecycle(void)
     }
     duration = g_test_timer_elapsed();
 
-    g_test_message("Lifecycle %u iterations: %f s\n", max, duration);
+    qemu_coroutine_get_pool_stats(&after);
+    g_test_message("Lifecycle %u iterations, pool size %u: %f s, "
+                   "%f ns each (%" PRIu64 " hits, %" PRIu64 " misses)\n",
+                   max, pool_max_size, duration, duration * 1e9 / max,
+                   after.hits - before.hits, after.misses - before.misses);
+}
+
+static void perf_lifecycle(void)
+{
+    perf_lifecycle_pool(64);
+    perf_lifecycle_pool(0);
+    qemu_coroutine_set_pool_max_size(64);
+}
+
+/*
+ * Switch latency benchmark: one enter plus one yield per iteration
+ */
+
+static void coroutine_fn yield_loop(void *opaque)
+{
+    unsigned int *counter = opaque;
+
+    while ((*counter) > 0) {
+        (*counter)--;
+        qemu_coroutine_yield();
+    }
+}
+
+static void perf_yield(void)
+{
+    Coroutine *coroutine;
+    unsigned int i, maxcycles;
+    double duration;
+
+    maxcycles = 10000000;
+    i = maxcycles;
+    coroutine = qemu_coroutine_create(yield_loop);
+
+    g_test_timer_start();
+    while (i > 0) {
+        qemu_coroutine_enter(coroutine, &i);
+    }
+    duration = g_test_timer_elapsed();
+
+    /* one more enter lets the coroutine return */
+    qemu_coroutine_enter(coroutine, &i);
+
+    g_test_message("Yield %u iterations: %f s, %f ns per switch\n",
+                   maxcycles, duration, duration * 1e9 / (2.0 * maxcycles));
 }
 
 static void perf_nesting(void)
@@ -205,15 +426,21 @@ static void perf_nesting(void)
 
 int main(int argc, char **argv)
 {
+    init_clocks();
+
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/basic/lifecycle", test_lifecycle);
     g_test_add_func("/basic/yield", test_yield);
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
+    g_test_add_func("/basic/pool", test_pool);
+    g_test_add_func("/basic/pool_threads", test_pool_threads);
+    g_test_add_func("/basic/rwlock", test_rwlock);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
+        g_test_add_func("/perf/yield", perf_yield);
     }
     return g_test_run();
 }
@@ -0,0 +1,121 @@
+/*
+ * Receive coalescing parser unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net/gro.h"
+
+/* Large enough for any frame the IP length fields can describe */
+#define FRAME_SIZE  (70 << 10)
+
+/* Builds an IPv4 or IPv6 TCP segment with @payload bytes of data */
+static int build_segment(uint8_t *frame, bool ipv6, int payload)
+{
+    int l4_off = ipv6 ? 54 : 34;
+
+    memset(frame, 0, FRAME_SIZE);
+    if (ipv6) {
+        cpu_to_be16wu((uint16_t *)(frame + 12), 0x86dd);
+        frame[14] = 0x60;
+        cpu_to_be16wu((uint16_t *)(frame + 18), 20 + payload);
+        frame[20] = GRO_PROTO_TCP;
+    } else {
+        cpu_to_be16wu((uint16_t *)(frame + 12), 0x0800);
+        frame[14] = 0x45;
+        cpu_to_be16wu((uint16_t *)(frame + 16), 20 + 20 + payload);
+        frame[23] = GRO_PROTO_TCP;
+    }
+    frame[l4_off + 12] = 5 << 4;
+    frame[l4_off + 13] = TCP_FLAG_ACK;
+    return l4_off + 20 + payload;
+}
+
+static void test_valid(void)
+{
+    uint8_t *frame = g_malloc(FRAME_SIZE);
+    int size, hdr_len, end;
+
+    size = build_segment(frame, false, 1448);
+    g_assert_cmpint(net_gro_parse(frame, size, true, true,
+                                  &hdr_len, &end), ==, 34);
+    g_assert_cmpint(hdr_len, ==, 54);
+    g_assert_cmpint(end, ==, size);
+
+    /* not negotiated */
+    g_assert_cmpint(net_gro_parse(frame, size, false, true,
+                                  &hdr_len, &end), ==, 0);
+
+    /* Ethernet padding is not part of the packet */
+    g_assert_cmpint(net_gro_parse(frame, size + 4, true, true,
+                                  &hdr_len, &end), ==, 34);
+    g_assert_cmpint(end, ==, size);
+
+    size = build_segment(frame, true, 1428);
+    g_assert_cmpint(net_gro_parse(frame, size, true, true,
+                                  &hdr_len, &end), ==, 54);
+    g_assert_cmpint(hdr_len, ==, 74);
+    g_assert_cmpint(end, ==, size);
+
+    /* other flags than ACK and PSH */
+    frame[54 + 13] |= 0x01;
+    g_assert_cmpint(net_gro_parse(frame, size, true, true,
+                                  &hdr_len, &end), ==, 0);
+    g_free(frame);
+}
+
+static void test_truncated(void)
+{
+    uint8_t *frame = g_malloc(FRAME_SIZE);
+    int size, hdr_len, end;
+
+    size = build_segment(frame, false, 1448);
+    g_assert_cmpint(net_gro_parse(frame, size - 1, true, true,
+                                  &hdr_len, &end), ==, 0);
+
+    size = build_segment(frame, true, 1428);
+    g_assert_cmpint(net_gro_parse(frame, size - 1, true, true,
+                                  &hdr_len, &end), ==, 0);
+    g_free(frame);
+}
+
+static void test_oversized(void)
+{
+    uint8_t *frame = g_malloc(FRAME_SIZE);
+    int hdr_len, end;
+
+    /* 14 bytes of Ethernet header plus the largest IPv4 length */
+    build_segment(frame, false, 0);
+    cpu_to_be16wu((uint16_t *)(frame + 16), 0xffff);
+    g_assert_cmpint(net_gro_parse(frame, FRAME_SIZE, true, true,
+                                  &hdr_len, &end), ==, 0);
+
+    /* still fits */
+    cpu_to_be16wu((uint16_t *)(frame + 16), GRO_MAX_FRAME - 14);
+    g_assert_cmpint(net_gro_parse(frame, FRAME_SIZE, true, true,
+                                  &hdr_len, &end), ==, 34);
+    g_assert_cmpint(end, ==, GRO_MAX_FRAME);
+
+    /* the IPv6 payload length does not even count the fixed header */
+    build_segment(frame, true, 0);
+    cpu_to_be16wu((uint16_t *)(frame + 18), 0xffff);
+    g_assert_cmpint(net_gro_parse(frame, FRAME_SIZE, true, true,
+                                  &hdr_len, &end), ==, 0);
+
+    cpu_to_be16wu((uint16_t *)(frame + 18), GRO_MAX_FRAME - 54 + 1);
+    g_assert_cmpint(net_gro_parse(frame, FRAME_SIZE, true, true,
+                                  &hdr_len, &end), ==, 0);
+    g_free(frame);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/gro/valid", test_valid);
+    g_test_add_func("/net/gro/truncated", test_truncated);
+    g_test_add_func("/net/gro/oversized", test_oversized);
+    return g_test_run();
+}
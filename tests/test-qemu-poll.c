@@ -0,0 +1,330 @@
+/*
+ * QEMUPoll unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <sys/resource.h>
+#include "qemu-common.h"
+#include "qemu-poll.h"
+
+typedef struct {
+    QEMUPoll *qpoll;
+    QEMUPollWatch *watch;
+    int fd;
+    int count;
+    int revents;
+    bool remove_self;
+} WatchData;
+
+static void watch_cb(void *opaque, int revents)
+{
+    WatchData *data = opaque;
+    char buf[16];
+
+    data->count++;
+    data->revents = revents;
+    if (revents & G_IO_IN) {
+        if (read(data->fd, buf, sizeof(buf)) < 0) {
+            g_assert_not_reached();
+        }
+    }
+    if (data->remove_self) {
+        qemu_poll_remove(data->qpoll, data->watch);
+        data->watch = NULL;
+    }
+}
+
+static void make_pipe(int fds[2])
+{
+    g_assert(pipe(fds) == 0);
+}
+
+static void kick(int fd)
+{
+    g_assert(write(fd, "x", 1) == 1);
+}
+
+static void test_add_dispatch(void)
+{
+    QEMUPoll *qpoll = qemu_poll_new();
+    WatchData data = { .qpoll = qpoll };
+    int fds[2];
+
+    make_pipe(fds);
+    data.fd = fds[0];
+    data.watch = qemu_poll_add(qpoll, fds[0], G_IO_IN, watch_cb, &data);
+
+    /* nothing pending */
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 0);
+    g_assert_cmpint(qemu_poll_dispatch(qpoll), ==, 0);
+    g_assert_cmpint(data.count, ==, 0);
+
+    kick(fds[1]);
+    g_assert_cmpint(qemu_poll_wait(qpoll, -1), ==, 1);
+    g_assert_cmpint(qemu_poll_dispatch(qpoll), ==, 1);
+    g_assert_cmpint(data.count, ==, 1);
+    g_assert(data.revents & G_IO_IN);
+
+    /* the byte was consumed by the callback */
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 0);
+
+    qemu_poll_remove(qpoll, data.watch);
+    qemu_poll_free(qpoll);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_modify(void)
+{
+    QEMUPoll *qpoll = qemu_poll_new();
+    WatchData data = { .qpoll = qpoll };
+    int fds[2];
+
+    make_pipe(fds);
+    data.fd = fds[0];
+    data.watch = qemu_poll_add(qpoll, fds[0], 0, watch_cb, &data);
+    g_assert_cmpint(qemu_poll_watch_events(data.watch), ==, 0);
+
+    /* a disabled watch does not fire */
+    kick(fds[1]);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 0);
+
+    qemu_poll_modify(qpoll, data.watch, G_IO_IN);
+    g_assert_cmpint(qemu_poll_watch_events(data.watch), ==, G_IO_IN);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 1);
+    qemu_poll_dispatch(qpoll);
+    g_assert_cmpint(data.count, ==, 1);
+
+    /* the write side of a pipe is writable right away */
+    qemu_poll_remove(qpoll, data.watch);
+    data.fd = fds[1];
+    data.watch = qemu_poll_add(qpoll, fds[1], G_IO_OUT, watch_cb, &data);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 1);
+    qemu_poll_dispatch(qpoll);
+    g_assert_cmpint(data.count, ==, 2);
+    g_assert(data.revents & G_IO_OUT);
+
+    qemu_poll_remove(qpoll, data.watch);
+    qemu_poll_free(qpoll);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_shared_fd(void)
+{
+    QEMUPoll *qpoll = qemu_poll_new();
+    WatchData rd = { .qpoll = qpoll }, wr = { .qpoll = qpoll };
+    int fds[2];
+
+    make_pipe(fds);
+
+    /* two watches on one fd with different conditions */
+    rd.fd = wr.fd = fds[1];
+    rd.watch = qemu_poll_add(qpoll, fds[1], G_IO_IN, watch_cb, &rd);
+    wr.watch = qemu_poll_add(qpoll, fds[1], G_IO_OUT, watch_cb, &wr);
+
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 1);
+    qemu_poll_dispatch(qpoll);
+    g_assert_cmpint(rd.count, ==, 0);
+    g_assert_cmpint(wr.count, ==, 1);
+
+    qemu_poll_remove(qpoll, wr.watch);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 0);
+
+    qemu_poll_remove(qpoll, rd.watch);
+    qemu_poll_free(qpoll);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_reused_fd(void)
+{
+    QEMUPoll *qpoll = qemu_poll_new();
+    WatchData data = { .qpoll = qpoll };
+    int fds[2], fds2[2];
+
+    make_pipe(fds);
+    data.fd = fds[0];
+    data.watch = qemu_poll_add(qpoll, fds[0], G_IO_IN, watch_cb, &data);
+
+    /*
+     * Closing the descriptor takes it out of an epoll set behind our back;
+     * changing the conditions of the watch must register it again.
+     */
+    make_pipe(fds2);
+    close(fds[0]);
+    g_assert(dup2(fds2[0], fds[0]) == fds[0]);
+    qemu_poll_modify(qpoll, data.watch, G_IO_IN | G_IO_PRI);
+
+    kick(fds2[1]);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 1);
+    qemu_poll_dispatch(qpoll);
+    g_assert_cmpint(data.count, ==, 1);
+    g_assert(data.revents & G_IO_IN);
+
+    qemu_poll_remove(qpoll, data.watch);
+    qemu_poll_free(qpoll);
+    close(fds[0]);
+    close(fds[1]);
+    close(fds2[0]);
+    close(fds2[1]);
+}
+
+static void test_regular_file(void)
+{
+    QEMUPoll *qpoll = qemu_poll_new();
+    WatchData data = { .qpoll = qpoll };
+    char path[] = "/tmp/test-qemu-poll.XXXXXX";
+    int fd;
+
+    fd = mkstemp(path);
+    g_assert(fd >= 0);
+    unlink(path);
+
+    /* like poll(), a regular file is always ready, even at end of file */
+    data.fd = fd;
+    data.watch = qemu_poll_add(qpoll, fd, G_IO_IN, watch_cb, &data);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 1);
+    g_assert_cmpint(qemu_poll_dispatch(qpoll), ==, 1);
+    g_assert_cmpint(data.count, ==, 1);
+    g_assert_cmpint(data.revents, ==, G_IO_IN);
+
+    qemu_poll_modify(qpoll, data.watch, G_IO_OUT);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 1);
+    qemu_poll_dispatch(qpoll);
+    g_assert_cmpint(data.count, ==, 2);
+    g_assert_cmpint(data.revents, ==, G_IO_OUT);
+
+    /* a disabled watch does not fire */
+    qemu_poll_modify(qpoll, data.watch, 0);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 0);
+
+    qemu_poll_modify(qpoll, data.watch, G_IO_IN);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 1);
+    qemu_poll_dispatch(qpoll);
+    g_assert_cmpint(data.count, ==, 3);
+
+    qemu_poll_remove(qpoll, data.watch);
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 0);
+    qemu_poll_free(qpoll);
+    close(fd);
+}
+
+static void test_remove_in_dispatch(void)
+{
+    QEMUPoll *qpoll = qemu_poll_new();
+    WatchData a = { .qpoll = qpoll, .remove_self = true };
+    WatchData b = { .qpoll = qpoll, .remove_self = true };
+    int fds[2];
+
+    make_pipe(fds);
+
+    /* whichever callback runs first removes itself, the other still runs */
+    a.fd = b.fd = fds[1];
+    a.watch = qemu_poll_add(qpoll, fds[1], G_IO_OUT, watch_cb, &a);
+    b.watch = qemu_poll_add(qpoll, fds[1], G_IO_OUT, watch_cb, &b);
+
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 1);
+    g_assert_cmpint(qemu_poll_dispatch(qpoll), ==, 2);
+    g_assert_cmpint(a.count, ==, 1);
+    g_assert_cmpint(b.count, ==, 1);
+    g_assert(a.watch == NULL && b.watch == NULL);
+
+    g_assert_cmpint(qemu_poll_wait(qpoll, 0), ==, 0);
+
+    qemu_poll_free(qpoll);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/*
+ * Wakeup benchmark: one active pipe among many idle ones
+ */
+
+static void perf_wakeup_idle(int nidle)
+{
+    QEMUPoll *qpoll = qemu_poll_new();
+    WatchData active = { .qpoll = qpoll };
+    WatchData idle = { .qpoll = qpoll };
+    QEMUPollWatch **watches;
+    int *idle_fds;
+    int fds[2];
+    unsigned int i, max;
+    double duration;
+
+    idle_fds = g_new(int, nidle * 2);
+    watches = g_new(QEMUPollWatch *, nidle);
+    for (i = 0; i < nidle; i++) {
+        make_pipe(&idle_fds[i * 2]);
+        watches[i] = qemu_poll_add(qpoll, idle_fds[i * 2], G_IO_IN,
+                                   watch_cb, &idle);
+    }
+
+    make_pipe(fds);
+    active.fd = fds[0];
+    active.watch = qemu_poll_add(qpoll, fds[0], G_IO_IN, watch_cb, &active);
+
+    max = 100000;
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        kick(fds[1]);
+        qemu_poll_wait(qpoll, -1);
+        qemu_poll_dispatch(qpoll);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_assert_cmpint(active.count, ==, max);
+    g_assert_cmpint(idle.count, ==, 0);
+    g_test_message("Wakeup with %d idle fds, %u iterations: %f s\n",
+                   nidle, max, duration);
+
+    qemu_poll_remove(qpoll, active.watch);
+    close(fds[0]);
+    close(fds[1]);
+    for (i = 0; i < nidle; i++) {
+        qemu_poll_remove(qpoll, watches[i]);
+        close(idle_fds[i * 2]);
+        close(idle_fds[i * 2 + 1]);
+    }
+    qemu_poll_free(qpoll);
+    g_free(watches);
+    g_free(idle_fds);
+}
+
+static void perf_wakeup(void)
+{
+    static const int nidle[] = { 16, 256, 1024 };
+    struct rlimit rlim;
+    int i;
+
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    for (i = 0; i < ARRAY_SIZE(nidle); i++) {
+        /* two descriptors per pipe, plus some slack */
+        if (rlim.rlim_cur != RLIM_INFINITY &&
+            nidle[i] * 2 + 32 > rlim.rlim_cur) {
+            g_test_message("Skipping %d idle fds, RLIMIT_NOFILE too low\n",
+                           nidle[i]);
+            continue;
+        }
+        perf_wakeup_idle(nidle[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/basic/add_dispatch", test_add_dispatch);
+    g_test_add_func("/basic/modify", test_modify);
+    g_test_add_func("/basic/shared_fd", test_shared_fd);
+    g_test_add_func("/basic/reused_fd", test_reused_fd);
+    g_test_add_func("/basic/regular_file", test_regular_file);
+    g_test_add_func("/basic/remove_in_dispatch", test_remove_in_dispatch);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/wakeup", perf_wakeup);
+    }
+    return g_test_run();
+}
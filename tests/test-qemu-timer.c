@@ -0,0 +1,265 @@
+/*
+ * QEMUTimer unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-timer.h"
+
+/*
+ * The tests use a private clock, which nothing but the test itself runs.
+ * Expiry times are picked in the past so that qemu_run_timers() fires
+ * them right away, or far in the future so that it never does.
+ */
+
+#define NR_TIMERS 64
+
+typedef struct {
+    QEMUTimer *timer;
+    int64_t expire;
+    int index;
+} TimerData;
+
+static TimerData *fired[NR_TIMERS];
+static int nr_fired;
+static int nr_notify;
+
+static void timer_cb(void *opaque)
+{
+    TimerData *data = opaque;
+
+    g_assert(nr_fired < NR_TIMERS);
+    fired[nr_fired++] = data;
+}
+
+static void clock_notify(void *opaque)
+{
+    nr_notify++;
+}
+
+static QEMUClock *test_clock_new(void)
+{
+    nr_fired = 0;
+    nr_notify = 0;
+    return qemu_new_private_rt_clock(clock_notify, NULL);
+}
+
+static void test_order(void)
+{
+    QEMUClock *clock = test_clock_new();
+    TimerData data[NR_TIMERS];
+    int64_t base = qemu_get_clock_ns(clock) - 1000000000LL;
+    int i;
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        data[i].timer = qemu_new_timer_ns(clock, timer_cb, &data[i]);
+        data[i].index = i;
+        /* few distinct values, so that many timers expire together */
+        data[i].expire = base + g_test_rand_int_range(0, 8);
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+        g_assert(qemu_timer_pending(data[i].timer));
+    }
+
+    qemu_run_timers(clock);
+    g_assert_cmpint(nr_fired, ==, NR_TIMERS);
+
+    /* by expiry, and in arming order for equal expiries */
+    for (i = 1; i < NR_TIMERS; i++) {
+        g_assert(fired[i - 1]->expire <= fired[i]->expire);
+        if (fired[i - 1]->expire == fired[i]->expire) {
+            g_assert_cmpint(fired[i - 1]->index, <, fired[i]->index);
+        }
+    }
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        g_assert(!qemu_timer_pending(data[i].timer));
+        qemu_free_timer(data[i].timer);
+    }
+    qemu_free_clock(clock);
+}
+
+static void test_mod_del(void)
+{
+    QEMUClock *clock = test_clock_new();
+    TimerData data[NR_TIMERS];
+    int64_t now = qemu_get_clock_ns(clock);
+    int64_t future = now + 3600 * 1000000000LL;
+    int i;
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        data[i].timer = qemu_new_timer_ns(clock, timer_cb, &data[i]);
+        data[i].index = i;
+        data[i].expire = future + i;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+    }
+
+    /* reverse the order of the even timers and pull them into the past */
+    for (i = 0; i < NR_TIMERS; i += 2) {
+        data[i].expire = now - 1000 - i;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+    }
+    /* cancel every fourth one */
+    for (i = 0; i < NR_TIMERS; i += 4) {
+        qemu_del_timer(data[i].timer);
+        g_assert(!qemu_timer_pending(data[i].timer));
+        qemu_del_timer(data[i].timer);
+    }
+
+    qemu_run_timers(clock);
+    g_assert_cmpint(nr_fired, ==, NR_TIMERS / 4);
+    for (i = 0; i < nr_fired; i++) {
+        g_assert_cmpint(fired[i]->index, ==, NR_TIMERS - 2 - i * 4);
+    }
+
+    /* the odd ones are still there, in order */
+    g_assert(qemu_clock_has_timers(clock));
+    for (i = 1; i < NR_TIMERS; i += 2) {
+        g_assert(qemu_timer_pending(data[i].timer));
+        g_assert_cmpint(qemu_timer_expire_time_ns(data[i].timer), ==,
+                        data[i].expire);
+        qemu_del_timer(data[i].timer);
+    }
+    g_assert(!qemu_clock_has_timers(clock));
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        qemu_free_timer(data[i].timer);
+    }
+    qemu_free_clock(clock);
+}
+
+static void test_deadline(void)
+{
+    QEMUClock *clock = test_clock_new();
+    TimerData a, b;
+    int64_t now = qemu_get_clock_ns(clock);
+    int64_t deadline;
+
+    a.timer = qemu_new_timer_ns(clock, timer_cb, &a);
+    b.timer = qemu_new_timer_ns(clock, timer_cb, &b);
+    g_assert_cmpint(qemu_clock_deadline_ns(clock), ==, -1);
+
+    /* nanosecond precision, no rounding to milliseconds */
+    qemu_mod_timer_ns(a.timer, now + 1000000000LL + 1);
+    g_assert_cmpint(nr_notify, ==, 1);
+    deadline = qemu_clock_deadline_ns(clock);
+    g_assert(deadline > 0 && deadline <= 1000000000LL + 1);
+
+    /* only a new first deadline is notified */
+    qemu_mod_timer_ns(b.timer, now + 2000000000LL);
+    g_assert_cmpint(nr_notify, ==, 1);
+    qemu_mod_timer_ns(b.timer, now - 1);
+    g_assert_cmpint(nr_notify, ==, 2);
+    g_assert_cmpint(qemu_clock_deadline_ns(clock), ==, 0);
+
+    /* disabled clocks have no deadline */
+    qemu_clock_enable(clock, false);
+    g_assert_cmpint(qemu_clock_deadline_ns(clock), ==, -1);
+    qemu_run_timers(clock);
+    g_assert_cmpint(nr_fired, ==, 0);
+    qemu_clock_enable(clock, true);
+
+    qemu_run_timers(clock);
+    g_assert_cmpint(nr_fired, ==, 1);
+    g_assert(fired[0] == &b);
+
+    g_assert_cmpint(qemu_soonest_timeout(-1, 5), ==, 5);
+    g_assert_cmpint(qemu_soonest_timeout(7, -1), ==, 7);
+    g_assert_cmpint(qemu_soonest_timeout(7, 5), ==, 5);
+    g_assert_cmpint(qemu_soonest_timeout(-1, -1), ==, -1);
+
+    qemu_del_timer(a.timer);
+    qemu_free_timer(a.timer);
+    qemu_free_timer(b.timer);
+    qemu_free_clock(clock);
+}
+
+static void test_latency(void)
+{
+    QEMUClock *clock = test_clock_new();
+    const QEMUTimerLatency *lat = qemu_clock_get_latency(clock);
+    TimerData a;
+    uint64_t sum = 0;
+    int i;
+
+    a.timer = qemu_new_timer_ns(clock, timer_cb, &a);
+    g_assert_cmpint(lat->fired, ==, 0);
+
+    /* 5 ms late lands in the 4096-8192 us bucket or a later one */
+    qemu_mod_timer_ns(a.timer, qemu_get_clock_ns(clock) - 5 * SCALE_MS);
+    qemu_run_timers(clock);
+    g_assert_cmpint(lat->fired, ==, 1);
+    g_assert(lat->max_ns >= 5 * SCALE_MS);
+    g_assert_cmpint(lat->total_ns, ==, lat->max_ns);
+    for (i = 0; i < QEMU_TIMER_LATENCY_BUCKETS; i++) {
+        if (i < 13) {
+            g_assert_cmpint(lat->buckets[i], ==, 0);
+        }
+        sum += lat->buckets[i];
+    }
+    g_assert_cmpint(sum, ==, 1);
+
+    qemu_clock_reset_latency(clock);
+    g_assert_cmpint(lat->fired, ==, 0);
+    g_assert_cmpint(lat->max_ns, ==, 0);
+
+    qemu_free_timer(a.timer);
+    qemu_free_clock(clock);
+}
+
+/*
+ * Rearm benchmark: many timers pending, devices keep moving them around
+ */
+
+static void perf_rearm(void)
+{
+    QEMUClock *clock = test_clock_new();
+    QEMUTimer **timers;
+    int64_t future = qemu_get_clock_ns(clock) + 3600 * 1000000000LL;
+    unsigned int i, n = 10000, max = 1000000;
+    double duration;
+
+    timers = g_new(QEMUTimer *, n);
+    for (i = 0; i < n; i++) {
+        timers[i] = qemu_new_timer_ns(clock, timer_cb, NULL);
+        qemu_mod_timer_ns(timers[i], future + g_test_rand_int_range(0, n));
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        QEMUTimer *ts = timers[g_test_rand_int_range(0, n)];
+
+        if (i & 1) {
+            qemu_mod_timer_ns(ts, future + g_test_rand_int_range(0, n));
+        } else {
+            qemu_del_timer(ts);
+            qemu_mod_timer_ns(ts, future + g_test_rand_int_range(0, n));
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("Rearmed %u times among %u timers in %f s, %f ns each\n",
+                   max, n, duration, duration * 1e9 / max);
+
+    for (i = 0; i < n; i++) {
+        qemu_del_timer(timers[i]);
+        qemu_free_timer(timers[i]);
+    }
+    g_free(timers);
+    qemu_free_clock(clock);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/timer/order", test_order);
+    g_test_add_func("/timer/mod_del", test_mod_del);
+    g_test_add_func("/timer/deadline", test_deadline);
+    g_test_add_func("/timer/latency", test_latency);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/timer/rearm", perf_rearm);
+    }
+    return g_test_run();
+}
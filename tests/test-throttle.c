@@ -0,0 +1,135 @@
+/*
+ * Leaky bucket throttling unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "throttle.h"
+
+#define NS_PER_SEC  1000000000LL
+
+/*
+ * Submit requests of @bytes bytes as fast as the limits allow, from *@now
+ * until @end, and return how many got through.
+ */
+static int run_greedy(ThrottleState *ts, int64_t *now, int64_t end,
+                      bool is_write, uint64_t bytes)
+{
+    int64_t wait;
+    int n = 0;
+
+    while (*now < end) {
+        wait = throttle_compute_wait(ts, *now, is_write);
+        if (wait) {
+            *now += wait;
+            continue;
+        }
+        throttle_account(ts, is_write, bytes);
+        n++;
+    }
+    return n;
+}
+
+static void test_disabled(void)
+{
+    ThrottleState ts;
+    int i;
+
+    throttle_init(&ts, 0);
+    g_assert(!throttle_enabled(&ts));
+
+    for (i = 0; i < 1000; i++) {
+        throttle_account(&ts, i & 1, 1 << 20);
+        g_assert_cmpint(throttle_compute_wait(&ts, 0, i & 1), ==, 0);
+    }
+
+    throttle_config_bucket(&ts.ops[THROTTLE_READ], 10, 0, 0);
+    g_assert(throttle_enabled(&ts));
+}
+
+static void test_average(void)
+{
+    ThrottleState ts;
+    int64_t now = 0, wait;
+    int n;
+
+    throttle_init(&ts, now);
+    throttle_config_bucket(&ts.bps[THROTTLE_TOTAL], 1000, 0, 0);
+
+    /* the first request always goes, however large */
+    g_assert_cmpint(throttle_compute_wait(&ts, now, false), ==, 0);
+    throttle_account(&ts, false, 1000);
+
+    /* the bucket holds 100 bytes, the other 900 take 0.9 s to drain */
+    wait = throttle_compute_wait(&ts, now, true);
+    g_assert(wait >= 0.9 * NS_PER_SEC && wait <= 0.9 * NS_PER_SEC + 1);
+    g_assert(throttle_compute_wait(&ts, now + wait, true) == 0);
+
+    /* in the long run the average is respected */
+    now = 10 * NS_PER_SEC;
+    throttle_init(&ts, now);
+    throttle_config_bucket(&ts.bps[THROTTLE_TOTAL], 1000, 0, 0);
+    n = run_greedy(&ts, &now, 20 * NS_PER_SEC, false, 100);
+    g_assert(n >= 100 && n <= 102);
+}
+
+static void test_read_write(void)
+{
+    ThrottleState ts;
+    int64_t now = 0;
+
+    throttle_init(&ts, now);
+    throttle_config_bucket(&ts.ops[THROTTLE_WRITE], 10, 0, 0);
+
+    throttle_account(&ts, true, 512);
+    throttle_account(&ts, true, 512);
+    g_assert(throttle_compute_wait(&ts, now, true) > 0);
+
+    /* reads are not limited */
+    g_assert_cmpint(throttle_compute_wait(&ts, now, false), ==, 0);
+    throttle_account(&ts, false, 512);
+    g_assert_cmpint(ts.ops[THROTTLE_READ].level, ==, 0);
+
+    /* leaking backwards, e.g. across a migration, does not refill */
+    g_assert(throttle_compute_wait(&ts, now - NS_PER_SEC, true) > 0);
+    g_assert_cmpint(ts.previous_leak, ==, now);
+}
+
+static void test_burst(void)
+{
+    ThrottleState ts;
+    int64_t now = 0;
+    int n;
+
+    throttle_init(&ts, now);
+    throttle_config_bucket(&ts.ops[THROTTLE_TOTAL], 100, 1000, 2);
+
+    /* an idle device runs at the burst rate for two seconds... */
+    n = run_greedy(&ts, &now, 2 * NS_PER_SEC, false, 4096);
+    g_assert(n >= 2000 && n <= 2300);
+
+    /* ...and a little more, as the bucket drains meanwhile... */
+    run_greedy(&ts, &now, 3 * NS_PER_SEC, false, 4096);
+
+    /* ...then drops back to the average */
+    n = run_greedy(&ts, &now, 13 * NS_PER_SEC, false, 4096);
+    g_assert(n >= 990 && n <= 1010);
+
+    /* and the burst comes back after a long enough pause */
+    now += 30 * NS_PER_SEC;
+    n = run_greedy(&ts, &now, now + NS_PER_SEC, false, 4096);
+    g_assert(n >= 1000);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/throttle/disabled", test_disabled);
+    g_test_add_func("/throttle/average", test_average);
+    g_test_add_func("/throttle/read_write", test_read_write);
+    g_test_add_func("/throttle/burst", test_burst);
+    return g_test_run();
+}
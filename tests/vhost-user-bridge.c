@@ -0,0 +1,575 @@
+/*
+ * Reference vhost-user backend
+ *
+ * Listens on a UNIX domain socket for a -netdev vhost-user connection,
+ * maps guest memory from the file descriptors passed with SET_MEM_TABLE
+ * and loops every packet the guest transmits straight back into its
+ * receive ring.  The rings are busy-polled while there is traffic; the
+ * kick eventfds are only waited on once the rings have been idle for a
+ * while.  Throughput is printed once per second.
+ *
+ * Usage: vhost-user-bridge [socket-path]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/virtio_ring.h>
+
+#include "hw/vhost-user.h"
+
+#define VUB_DEFAULT_PATH    "/tmp/vhost-user.sock"
+#define VUB_MAX_QUEUES      2
+#define VUB_RX              0
+#define VUB_TX              1
+#define VUB_IDLE_SPINS      (1 << 16)
+#define VUB_POLL_TIMEOUT    100 /* ms */
+
+typedef struct VubRegion {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t uaddr;
+    uint64_t mmap_offset;
+    void *mmap_addr;
+} VubRegion;
+
+typedef struct VubQueue {
+    unsigned int num;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t last_avail_idx;
+    int kick_fd;
+    int call_fd;
+    bool enabled;
+} VubQueue;
+
+typedef struct VubDev {
+    int sock;
+    uint64_t features;
+    unsigned int nregions;
+    VubRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    VubQueue vq[VUB_MAX_QUEUES];
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t dropped;
+} VubDev;
+
+#define smp_mb()    __sync_synchronize()
+
+static void vub_die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+static void *vub_gpa_to_va(VubDev *dev, uint64_t gpa, uint32_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubRegion *r = &dev->regions[i];
+
+        if (gpa >= r->gpa && gpa + len <= r->gpa + r->size) {
+            return (uint8_t *)r->mmap_addr + r->mmap_offset + (gpa - r->gpa);
+        }
+    }
+    return NULL;
+}
+
+static void *vub_uaddr_to_va(VubDev *dev, uint64_t uaddr)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubRegion *r = &dev->regions[i];
+
+        if (uaddr >= r->uaddr && uaddr < r->uaddr + r->size) {
+            return (uint8_t *)r->mmap_addr + r->mmap_offset +
+                   (uaddr - r->uaddr);
+        }
+    }
+    return NULL;
+}
+
+static void vub_unmap_regions(VubDev *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->nregions; i++) {
+        VubRegion *r = &dev->regions[i];
+
+        munmap(r->mmap_addr, r->size + r->mmap_offset);
+    }
+    dev->nregions = 0;
+}
+
+static void vub_reset_queue(VubQueue *vq)
+{
+    if (vq->kick_fd >= 0) {
+        close(vq->kick_fd);
+    }
+    if (vq->call_fd >= 0) {
+        close(vq->call_fd);
+    }
+    memset(vq, 0, sizeof(*vq));
+    vq->kick_fd = -1;
+    vq->call_fd = -1;
+}
+
+/* Returns the number of file descriptors received, or -1 on EOF/error */
+static int vub_read_msg(int sock, VhostUserMsg *msg, int *fds, int max_fds)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov = {
+        .iov_base = msg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+    int fd_num = 0;
+
+    r = recvmsg(sock, &msgh, 0);
+    if (r != VHOST_USER_HDR_SIZE) {
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (fd_num > max_fds) {
+                fd_num = max_fds;
+            }
+            memcpy(fds, CMSG_DATA(cmsg), fd_num * sizeof(int));
+            break;
+        }
+    }
+
+    if (msg->size > VHOST_USER_PAYLOAD_SIZE) {
+        fprintf(stderr, "message payload too large (%u)\n", msg->size);
+        return -1;
+    }
+    if (msg->size) {
+        r = recv(sock, &msg->u64, msg->size, MSG_WAITALL);
+        if (r != msg->size) {
+            return -1;
+        }
+    }
+    return fd_num;
+}
+
+static void vub_send_reply(VubDev *dev, VhostUserMsg *msg)
+{
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+
+    msg->flags = VHOST_USER_REPLY_MASK | VHOST_USER_VERSION;
+    if (send(dev->sock, msg, size, 0) != size) {
+        vub_die("send");
+    }
+}
+
+static void vub_set_mem_table(VubDev *dev, VhostUserMsg *msg, int *fds,
+                              int fd_num)
+{
+    VhostUserMemory *mem = &msg->memory;
+    unsigned int i;
+
+    vub_unmap_regions(dev);
+
+    if (mem->nregions != fd_num || mem->nregions > VHOST_MEMORY_MAX_NREGIONS) {
+        fprintf(stderr, "SET_MEM_TABLE: %u regions but %d fds\n",
+                mem->nregions, fd_num);
+        exit(1);
+    }
+
+    for (i = 0; i < mem->nregions; i++) {
+        VhostUserMemoryRegion *m = &mem->regions[i];
+        VubRegion *r = &dev->regions[i];
+
+        r->gpa = m->guest_phys_addr;
+        r->size = m->memory_size;
+        r->uaddr = m->userspace_addr;
+        r->mmap_offset = m->mmap_offset;
+        r->mmap_addr = mmap(NULL, r->size + r->mmap_offset,
+                            PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+        if (r->mmap_addr == MAP_FAILED) {
+            vub_die("mmap");
+        }
+        close(fds[i]);
+        printf("region %u: gpa 0x%" PRIx64 " size 0x%" PRIx64
+               " uaddr 0x%" PRIx64 "\n", i, r->gpa, r->size, r->uaddr);
+    }
+    dev->nregions = mem->nregions;
+}
+
+/* Returns false when the connection should be closed */
+static bool vub_handle_msg(VubDev *dev)
+{
+    VhostUserMsg msg;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num;
+    unsigned int index;
+    VubQueue *vq;
+
+    fd_num = vub_read_msg(dev->sock, &msg, fds, VHOST_MEMORY_MAX_NREGIONS);
+    if (fd_num < 0) {
+        return false;
+    }
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        /* No offloads, no mergeable buffers, no event index */
+        msg.u64 = 0;
+        msg.size = sizeof(msg.u64);
+        vub_send_reply(dev, &msg);
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+        dev->features = msg.u64;
+        break;
+
+    case VHOST_USER_SET_OWNER:
+        break;
+
+    case VHOST_USER_RESET_OWNER:
+        for (index = 0; index < VUB_MAX_QUEUES; index++) {
+            vub_reset_queue(&dev->vq[index]);
+        }
+        dev->features = 0;
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        vub_set_mem_table(dev, &msg, fds, fd_num);
+        break;
+
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+    case VHOST_USER_SET_VRING_ADDR:
+        index = msg.request == VHOST_USER_SET_VRING_ADDR ?
+                msg.addr.index : msg.state.index;
+        if (index >= VUB_MAX_QUEUES) {
+            fprintf(stderr, "bad ring index %u\n", index);
+            return false;
+        }
+        vq = &dev->vq[index];
+
+        if (msg.request == VHOST_USER_SET_VRING_NUM) {
+            vq->num = msg.state.num;
+        } else if (msg.request == VHOST_USER_SET_VRING_BASE) {
+            vq->last_avail_idx = msg.state.num;
+        } else if (msg.request == VHOST_USER_GET_VRING_BASE) {
+            /* QEMU stops the ring by asking where we are */
+            vq->enabled = false;
+            msg.state.num = vq->last_avail_idx;
+            vub_send_reply(dev, &msg);
+        } else {
+            vq->desc = vub_uaddr_to_va(dev, msg.addr.desc_user_addr);
+            vq->used = vub_uaddr_to_va(dev, msg.addr.used_user_addr);
+            vq->avail = vub_uaddr_to_va(dev, msg.addr.avail_user_addr);
+            if (!vq->desc || !vq->used || !vq->avail) {
+                fprintf(stderr, "ring %u is outside guest memory\n", index);
+                return false;
+            }
+        }
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        index = msg.u64 & VHOST_USER_VRING_IDX_MASK;
+        if (index >= VUB_MAX_QUEUES) {
+            fprintf(stderr, "bad ring index %u\n", index);
+            return false;
+        }
+        vq = &dev->vq[index];
+        if (!(msg.u64 & VHOST_USER_VRING_NOFD_MASK) && fd_num != 1) {
+            fprintf(stderr, "missing fd for ring %u\n", index);
+            return false;
+        }
+        fd_num = (msg.u64 & VHOST_USER_VRING_NOFD_MASK) ? -1 : fds[0];
+
+        if (msg.request == VHOST_USER_SET_VRING_KICK) {
+            if (vq->kick_fd >= 0) {
+                close(vq->kick_fd);
+            }
+            vq->kick_fd = fd_num;
+            /* The kick fd is the last thing QEMU sets up */
+            vq->enabled = vq->desc != NULL;
+        } else if (msg.request == VHOST_USER_SET_VRING_CALL) {
+            if (vq->call_fd >= 0) {
+                close(vq->call_fd);
+            }
+            vq->call_fd = fd_num;
+        } else if (fd_num >= 0) {
+            close(fd_num);
+        }
+        break;
+
+    default:
+        fprintf(stderr, "unsupported request %u\n", msg.request);
+        return false;
+    }
+
+    return true;
+}
+
+static void vub_signal(VubQueue *vq)
+{
+    uint64_t one = 1;
+
+    smp_mb();
+    if (vq->call_fd >= 0 &&
+        !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+        if (write(vq->call_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            vub_die("write call fd");
+        }
+    }
+}
+
+static void vub_push_used(VubQueue *vq, uint16_t head, uint32_t len)
+{
+    struct vring_used_elem *elem;
+
+    elem = &vq->used->ring[vq->used->idx % vq->num];
+    elem->id = head;
+    elem->len = len;
+    smp_mb();
+    vq->used->idx++;
+}
+
+/* Copy one TX chain into one RX chain.  Returns the number of bytes
+ * written to the RX chain.
+ */
+static uint32_t vub_copy_chain(VubDev *dev, VubQueue *tx, uint16_t tx_head,
+                               VubQueue *rx, uint16_t rx_head)
+{
+    struct vring_desc *td = &tx->desc[tx_head];
+    struct vring_desc *rd = &rx->desc[rx_head];
+    uint32_t td_off = 0, rd_off = 0, total = 0;
+
+    for (;;) {
+        uint32_t chunk;
+        uint8_t *src, *dst;
+
+        if (td_off == td->len) {
+            if (!(td->flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            td = &tx->desc[td->next];
+            td_off = 0;
+            continue;
+        }
+        if (rd_off == rd->len) {
+            if (!(rd->flags & VRING_DESC_F_NEXT)) {
+                dev->dropped++;
+                break;
+            }
+            rd = &rx->desc[rd->next];
+            rd_off = 0;
+            continue;
+        }
+
+        chunk = td->len - td_off;
+        if (chunk > rd->len - rd_off) {
+            chunk = rd->len - rd_off;
+        }
+        src = vub_gpa_to_va(dev, td->addr + td_off, chunk);
+        dst = vub_gpa_to_va(dev, rd->addr + rd_off, chunk);
+        if (!src || !dst) {
+            fprintf(stderr, "descriptor outside guest memory\n");
+            exit(1);
+        }
+        memcpy(dst, src, chunk);
+        td_off += chunk;
+        rd_off += chunk;
+        total += chunk;
+    }
+    return total;
+}
+
+/* Returns the number of packets moved from the TX to the RX ring */
+static unsigned int vub_loopback(VubDev *dev)
+{
+    VubQueue *tx = &dev->vq[VUB_TX];
+    VubQueue *rx = &dev->vq[VUB_RX];
+    unsigned int moved = 0;
+
+    if (!tx->enabled || !rx->enabled) {
+        return 0;
+    }
+
+    while (tx->last_avail_idx != tx->avail->idx &&
+           rx->last_avail_idx != rx->avail->idx) {
+        uint16_t tx_head, rx_head;
+        uint32_t len;
+
+        smp_mb();
+        tx_head = tx->avail->ring[tx->last_avail_idx++ % tx->num];
+        rx_head = rx->avail->ring[rx->last_avail_idx++ % rx->num];
+
+        len = vub_copy_chain(dev, tx, tx_head, rx, rx_head);
+        vub_push_used(rx, rx_head, len);
+        vub_push_used(tx, tx_head, 0);
+
+        dev->packets++;
+        dev->bytes += len;
+        moved++;
+    }
+
+    if (moved) {
+        vub_signal(rx);
+        vub_signal(tx);
+    }
+    return moved;
+}
+
+static void vub_drain_kick(VubQueue *vq)
+{
+    uint64_t v;
+
+    if (vq->kick_fd >= 0 && read(vq->kick_fd, &v, sizeof(v)) < 0 &&
+        errno != EAGAIN) {
+        vub_die("read kick fd");
+    }
+}
+
+static int64_t vub_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void vub_run(VubDev *dev)
+{
+    int64_t last_report = vub_now_ns();
+    uint64_t last_packets = 0, last_bytes = 0;
+    unsigned int idle = 0, iter = 0;
+
+    for (;;) {
+        struct pollfd pfd[1 + VUB_MAX_QUEUES];
+        int kick[1 + VUB_MAX_QUEUES];
+        int nfds = 0, timeout, i;
+        int64_t now;
+
+        if (vub_loopback(dev)) {
+            idle = 0;
+        } else if (idle < VUB_IDLE_SPINS) {
+            idle++;
+        }
+
+        /* Busy-poll while traffic is flowing, sleep on the kicks once the
+         * rings have been idle for a while.  Control messages are picked
+         * up either way.
+         */
+        timeout = idle >= VUB_IDLE_SPINS ? VUB_POLL_TIMEOUT : 0;
+        if (timeout || !(++iter & 1023)) {
+            pfd[nfds].fd = dev->sock;
+            pfd[nfds++].events = POLLIN;
+            for (i = 0; i < VUB_MAX_QUEUES; i++) {
+                if (dev->vq[i].kick_fd >= 0) {
+                    kick[nfds] = i;
+                    pfd[nfds].fd = dev->vq[i].kick_fd;
+                    pfd[nfds++].events = POLLIN;
+                }
+            }
+            if (poll(pfd, nfds, timeout) < 0) {
+                if (errno != EINTR) {
+                    vub_die("poll");
+                }
+                continue;
+            }
+            for (i = 1; i < nfds; i++) {
+                if (pfd[i].revents & POLLIN) {
+                    vub_drain_kick(&dev->vq[kick[i]]);
+                }
+            }
+            if (pfd[0].revents & (POLLIN | POLLHUP)) {
+                if (!vub_handle_msg(dev)) {
+                    return;
+                }
+            }
+        }
+
+        now = vub_now_ns();
+        if (now - last_report >= 1000000000LL) {
+            double secs = (now - last_report) / 1e9;
+
+            printf("%.0f pps, %.1f Mbps, %" PRIu64 " truncated\n",
+                   (dev->packets - last_packets) / secs,
+                   (dev->bytes - last_bytes) * 8 / secs / 1e6, dev->dropped);
+            fflush(stdout);
+            last_packets = dev->packets;
+            last_bytes = dev->bytes;
+            last_report = now;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : VUB_DEFAULT_PATH;
+    struct sockaddr_un un;
+    VubDev dev;
+    int lsock, i;
+
+    lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lsock < 0) {
+        vub_die("socket");
+    }
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", path);
+    unlink(path);
+    if (bind(lsock, (struct sockaddr *)&un, sizeof(un)) < 0) {
+        vub_die("bind");
+    }
+    if (listen(lsock, 1) < 0) {
+        vub_die("listen");
+    }
+
+    for (;;) {
+        printf("waiting for QEMU on %s\n", path);
+        memset(&dev, 0, sizeof(dev));
+        for (i = 0; i < VUB_MAX_QUEUES; i++) {
+            dev.vq[i].kick_fd = -1;
+            dev.vq[i].call_fd = -1;
+        }
+
+        dev.sock = accept(lsock, NULL, NULL);
+        if (dev.sock < 0) {
+            vub_die("accept");
+        }
+        vub_run(&dev);
+
+        printf("connection closed\n");
+        for (i = 0; i < VUB_MAX_QUEUES; i++) {
+            vub_reset_queue(&dev.vq[i]);
+        }
+        vub_unmap_regions(&dev);
+        close(dev.sock);
+    }
+    return 0;
+}
@@ -0,0 +1,540 @@
+/*
+ * QEMU block layer thread pool
+ *
+ * Copyright IBM, Corp. 2008
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * Contributions after 2012-01-13 are licensed under the terms of the
+ * GNU GPL, version 2 or (at your option) any later version.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-timer.h"
+#include "qemu-aio.h"
+#include "osdep.h"
+#include "trace.h"
+#include "thread-pool.h"
+
+/* Seconds an idle worker waits for new requests before exiting */
+#define THREAD_POOL_IDLE_TIMEOUT    10
+
+/*
+ * Idle workers beyond min_threads only exit while requests wait less than
+ * this in the queue on average, so that the pool does not shrink right
+ * after a burst that it was too small for.
+ */
+#define THREAD_POOL_WAIT_TARGET_NS  (100 * SCALE_US)
+
+enum ThreadState {
+    THREAD_QUEUED,
+    THREAD_ACTIVE,
+    THREAD_DONE,
+};
+
+typedef struct ThreadPoolElement {
+    BlockDriverAIOCB common;
+    ThreadPool *pool;
+    ThreadPoolFunc *func;
+    void *arg;
+    int64_t submit_time;
+
+    /* Moving state from THREAD_ACTIVE to THREAD_DONE is protected by the
+     * pool lock, and so is the list the element is on.
+     */
+    enum ThreadState state;
+    int ret;
+
+    /* Access to this list is protected by the pool lock.  */
+    QTAILQ_ENTRY(ThreadPoolElement) reqs;
+} ThreadPoolElement;
+
+struct ThreadPool {
+    AioContext *ctx;
+    int rfd, wfd;
+    QEMUBH *new_thread_bh;
+
+    /* The following variables are only accessed from the main thread */
+    int in_flight;
+
+    /* The following variables are protected by lock.  */
+    pthread_mutex_t lock;
+    pthread_cond_t request_cond;
+    pthread_cond_t check_cancel;
+    pthread_cond_t worker_stopped;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    QTAILQ_HEAD(, ThreadPoolElement) completed_list;
+    int queue_depth;
+    int min_threads;
+    int max_threads;
+    int cur_threads;
+    int idle_threads;
+    int new_threads;     /* backlog of threads we need to create */
+    int pending_threads; /* threads created but not running yet */
+    int pending_cancellations;
+    bool notify_pending; /* completion notification not consumed yet */
+    int64_t avg_wait_ns; /* moving average of the queueing delay */
+    bool stopping;       /* thread_pool_free() waits for the workers */
+    Notifier ctx_free;   /* frees the pool of aio_get_thread_pool() */
+};
+
+static pthread_attr_t attr;
+
+static void die2(int err, const char *what)
+{
+    fprintf(stderr, "%s failed: %s\n", what, strerror(err));
+    abort();
+}
+
+static void die(const char *what)
+{
+    die2(errno, what);
+}
+
+static void mutex_lock(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_lock(mutex);
+    if (ret) {
+        die2(ret, "pthread_mutex_lock");
+    }
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_unlock(mutex);
+    if (ret) {
+        die2(ret, "pthread_mutex_unlock");
+    }
+}
+
+static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                          struct timespec *ts)
+{
+    int ret = pthread_cond_timedwait(cond, mutex, ts);
+    if (ret && ret != ETIMEDOUT) {
+        die2(ret, "pthread_cond_timedwait");
+    }
+    return ret;
+}
+
+static void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int ret = pthread_cond_wait(cond, mutex);
+    if (ret) {
+        die2(ret, "pthread_cond_wait");
+    }
+}
+
+static void cond_signal(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_signal(cond);
+    if (ret) {
+        die2(ret, "pthread_cond_signal");
+    }
+}
+
+static void cond_broadcast(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_broadcast(cond);
+    if (ret) {
+        die2(ret, "pthread_cond_broadcast");
+    }
+}
+
+static void thread_create(pthread_t *thread, pthread_attr_t *attr,
+                          void *(*start_routine)(void*), void *arg)
+{
+    int ret = pthread_create(thread, attr, start_routine, arg);
+    if (ret) {
+        die2(ret, "pthread_create");
+    }
+}
+
+static void thread_pool_notify(ThreadPool *pool)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(pool->wfd, &value, sizeof(value));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno != EAGAIN) {
+        die("write()");
+    }
+}
+
+static void do_spawn_thread(ThreadPool *pool);
+
+static void *worker_thread(void *opaque)
+{
+    ThreadPool *pool = opaque;
+
+    mutex_lock(&pool->lock);
+    pool->pending_threads--;
+    mutex_unlock(&pool->lock);
+    do_spawn_thread(pool);
+
+    mutex_lock(&pool->lock);
+    while (1) {
+        ThreadPoolElement *req;
+        qemu_timeval tv;
+        struct timespec ts;
+        bool notify;
+        int ret = 0;
+
+        qemu_gettimeofday(&tv);
+        ts.tv_sec = tv.tv_sec + THREAD_POOL_IDLE_TIMEOUT;
+        ts.tv_nsec = 0;
+
+        while (QTAILQ_EMPTY(&pool->request_list) && ret != ETIMEDOUT &&
+               !pool->stopping) {
+            pool->idle_threads++;
+            ret = cond_timedwait(&pool->request_cond, &pool->lock, &ts);
+            pool->idle_threads--;
+        }
+
+        if (pool->stopping) {
+            break;
+        }
+
+        if (QTAILQ_EMPTY(&pool->request_list)) {
+            /* a whole timeout without work counts as a request that did
+             * not wait, so that the average decays on an idle pool too
+             */
+            pool->avg_wait_ns -= pool->avg_wait_ns / 8;
+            if (pool->cur_threads > pool->min_threads &&
+                pool->avg_wait_ns <= THREAD_POOL_WAIT_TARGET_NS) {
+                break;
+            }
+            continue;
+        }
+
+        req = QTAILQ_FIRST(&pool->request_list);
+        QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        pool->queue_depth--;
+        req->state = THREAD_ACTIVE;
+        pool->avg_wait_ns += (get_clock() - req->submit_time -
+                              pool->avg_wait_ns) / 8;
+        mutex_unlock(&pool->lock);
+
+        ret = req->func(req->arg);
+
+        mutex_lock(&pool->lock);
+        req->ret = ret;
+        req->state = THREAD_DONE;
+        QTAILQ_INSERT_TAIL(&pool->completed_list, req, reqs);
+        if (pool->pending_cancellations) {
+            cond_broadcast(&pool->check_cancel);
+        }
+
+        /* Only the first completion of a batch kicks the main loop, the
+         * others are picked up by the same run of the completion handler.
+         */
+        notify = !pool->notify_pending;
+        pool->notify_pending = true;
+        mutex_unlock(&pool->lock);
+
+        if (notify) {
+            thread_pool_notify(pool);
+        }
+        mutex_lock(&pool->lock);
+    }
+
+    pool->cur_threads--;
+    if (pool->stopping) {
+        cond_broadcast(&pool->worker_stopped);
+    }
+    mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void do_spawn_thread(ThreadPool *pool)
+{
+    sigset_t set, oldset;
+    pthread_t thread_id;
+
+    mutex_lock(&pool->lock);
+    if (!pool->new_threads) {
+        mutex_unlock(&pool->lock);
+        return;
+    }
+
+    pool->new_threads--;
+    pool->pending_threads++;
+
+    mutex_unlock(&pool->lock);
+
+    /* block all signals */
+    if (sigfillset(&set)) {
+        die("sigfillset");
+    }
+    if (sigprocmask(SIG_SETMASK, &set, &oldset)) {
+        die("sigprocmask");
+    }
+
+    thread_create(&thread_id, &attr, worker_thread, pool);
+
+    if (sigprocmask(SIG_SETMASK, &oldset, NULL)) {
+        die("sigprocmask restore");
+    }
+}
+
+static void spawn_thread_bh_fn(void *opaque)
+{
+    ThreadPool *pool = opaque;
+
+    do_spawn_thread(pool);
+}
+
+/* Called with the pool lock held */
+static void spawn_thread(ThreadPool *pool)
+{
+    pool->cur_threads++;
+    pool->new_threads++;
+    /* If there are threads being created, they will spawn new workers, so
+     * we don't spend time creating many threads in a loop holding a mutex or
+     * starving the current vcpu.
+     *
+     * If there are no idle threads, ask the main thread to create one, so we
+     * inherit the correct affinity instead of the vcpu affinity.
+     */
+    if (!pool->pending_threads) {
+        qemu_bh_schedule(pool->new_thread_bh);
+    }
+}
+
+/* Called with the pool lock held, after a request was queued */
+static bool thread_pool_need_thread(ThreadPool *pool)
+{
+    int avail = pool->idle_threads + pool->new_threads + pool->pending_threads;
+
+    /* Every queued request gets a worker; a cold burst must not wait for
+     * the average wait to catch up before the pool grows.
+     */
+    return pool->cur_threads < pool->max_threads &&
+           pool->queue_depth > avail;
+}
+
+static void thread_pool_completion_cb(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    ThreadPoolElement *elem;
+    char buffer[512];
+    ssize_t len;
+    int nr = 0;
+
+    /* Drain the notification channel.  For eventfd, only 8 bytes are read. */
+    do {
+        len = read(pool->rfd, buffer, sizeof(buffer));
+    } while ((len == -1 && errno == EINTR) || len == sizeof(buffer));
+
+    mutex_lock(&pool->lock);
+    pool->notify_pending = false;
+    while ((elem = QTAILQ_FIRST(&pool->completed_list)) != NULL) {
+        QTAILQ_REMOVE(&pool->completed_list, elem, reqs);
+        mutex_unlock(&pool->lock);
+
+        trace_thread_pool_complete(pool, elem, elem->common.opaque,
+                                   elem->ret);
+        pool->in_flight--;
+        nr++;
+        elem->common.cb(elem->common.opaque, elem->ret);
+        g_free(elem->arg);
+        qemu_aio_release(elem);
+
+        mutex_lock(&pool->lock);
+    }
+    mutex_unlock(&pool->lock);
+
+    trace_thread_pool_complete_batch(pool, nr);
+}
+
+static int thread_pool_flush_cb(void *opaque)
+{
+    ThreadPool *pool = opaque;
+
+    return pool->in_flight > 0;
+}
+
+static void thread_pool_cancel(BlockDriverAIOCB *acb)
+{
+    ThreadPoolElement *elem = (ThreadPoolElement *)acb;
+    ThreadPool *pool = elem->pool;
+
+    trace_thread_pool_cancel(elem, elem->common.opaque);
+
+    mutex_lock(&pool->lock);
+    if (elem->state == THREAD_QUEUED) {
+        /* No worker has picked the request up yet, just drop it */
+        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        pool->queue_depth--;
+    } else {
+        /* fail safe: if the request could not be canceled, we wait for it */
+        pool->pending_cancellations++;
+        while (elem->state != THREAD_DONE) {
+            cond_wait(&pool->check_cancel, &pool->lock);
+        }
+        pool->pending_cancellations--;
+        QTAILQ_REMOVE(&pool->completed_list, elem, reqs);
+    }
+    mutex_unlock(&pool->lock);
+
+    pool->in_flight--;
+    g_free(elem->arg);
+    qemu_aio_release(elem);
+}
+
+static AIOPool thread_pool_cb_pool = {
+    .aiocb_size         = sizeof(ThreadPoolElement),
+    .cancel             = thread_pool_cancel,
+};
+
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg, BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    ThreadPoolElement *req;
+
+    req = qemu_aio_get(&thread_pool_cb_pool, bs, cb, opaque);
+    req->pool = pool;
+    req->func = func;
+    req->arg = arg;
+    req->state = THREAD_QUEUED;
+    req->submit_time = get_clock();
+
+    pool->in_flight++;
+    trace_thread_pool_submit(pool, req, arg);
+
+    mutex_lock(&pool->lock);
+    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    pool->queue_depth++;
+    if (thread_pool_need_thread(pool)) {
+        spawn_thread(pool);
+    }
+    mutex_unlock(&pool->lock);
+    cond_signal(&pool->request_cond);
+    return &req->common;
+}
+
+ThreadPool *thread_pool_new(AioContext *ctx, int min_threads, int max_threads)
+{
+    static bool attr_initialized;
+    ThreadPool *pool;
+    int fds[2];
+    int ret;
+
+    assert(min_threads >= 0 && max_threads > 0 && min_threads <= max_threads);
+
+    if (!attr_initialized) {
+        ret = pthread_attr_init(&attr);
+        if (ret) {
+            die2(ret, "pthread_attr_init");
+        }
+
+        ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (ret) {
+            die2(ret, "pthread_attr_setdetachstate");
+        }
+        attr_initialized = true;
+    }
+
+    if (qemu_eventfd(fds) == -1) {
+        die("thread pool notifier");
+    }
+
+    pool = g_malloc0(sizeof(*pool));
+    pool->ctx = ctx;
+    pool->rfd = fds[0];
+    pool->wfd = fds[1];
+    fcntl(pool->rfd, F_SETFL, O_NONBLOCK);
+    fcntl(pool->wfd, F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->request_cond, NULL);
+    pthread_cond_init(&pool->check_cancel, NULL);
+    pthread_cond_init(&pool->worker_stopped, NULL);
+    QTAILQ_INIT(&pool->request_list);
+    QTAILQ_INIT(&pool->completed_list);
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
+
+    aio_set_fd_handler(ctx, pool->rfd, thread_pool_completion_cb, NULL,
+                       thread_pool_flush_cb, pool);
+
+    mutex_lock(&pool->lock);
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+    mutex_unlock(&pool->lock);
+
+    return pool;
+}
+
+void thread_pool_free(ThreadPool *pool)
+{
+    assert(pool->in_flight == 0);
+
+    aio_set_fd_handler(pool->ctx, pool->rfd, NULL, NULL, NULL, NULL);
+    qemu_bh_delete(pool->new_thread_bh);
+
+    /* Workers that were never created do not need to be waited for */
+    mutex_lock(&pool->lock);
+    pool->cur_threads -= pool->new_threads;
+    pool->new_threads = 0;
+    pool->stopping = true;
+    cond_broadcast(&pool->request_cond);
+    while (pool->cur_threads > 0) {
+        cond_wait(&pool->worker_stopped, &pool->lock);
+    }
+    mutex_unlock(&pool->lock);
+
+    pthread_cond_destroy(&pool->worker_stopped);
+    pthread_cond_destroy(&pool->check_cancel);
+    pthread_cond_destroy(&pool->request_cond);
+    pthread_mutex_destroy(&pool->lock);
+    close(pool->rfd);
+    if (pool->wfd != pool->rfd) {
+        close(pool->wfd);
+    }
+    g_free(pool);
+}
+
+static void thread_pool_ctx_free(Notifier *notifier, void *data)
+{
+    ThreadPool *pool = container_of(notifier, ThreadPool, ctx_free);
+    AioContext *ctx = data;
+
+    ctx->thread_pool = NULL;
+    thread_pool_free(pool);
+}
+
+ThreadPool *aio_get_thread_pool(AioContext *ctx)
+{
+    if (!ctx->thread_pool) {
+        ctx->thread_pool = thread_pool_new(ctx, 0, 64);
+        ctx->thread_pool->ctx_free.notify = thread_pool_ctx_free;
+        notifier_list_add(&ctx->free_notifiers, &ctx->thread_pool->ctx_free);
+    }
+    return ctx->thread_pool;
+}
+
+ThreadPool *thread_pool_get_default(void)
+{
+    return aio_get_thread_pool(qemu_get_aio_context());
+}
@@ -0,0 +1,81 @@
+/*
+ * QEMU block layer thread pool
+ *
+ * Copyright IBM, Corp. 2008
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * Contributions after 2012-01-13 are licensed under the terms of the
+ * GNU GPL, version 2 or (at your option) any later version.
+ */
+
+#ifndef QEMU_THREAD_POOL_H
+#define QEMU_THREAD_POOL_H 1
+
+#include "qemu-common.h"
+#include "qemu-aio.h"
+
+typedef int ThreadPoolFunc(void *opaque);
+
+/**
+ * thread_pool_new:
+ * @ctx: Context that runs the completion callbacks.
+ * @min_threads: Number of worker threads that are kept alive when idle.
+ * @max_threads: Upper bound on the number of worker threads.
+ *
+ * Create a pool of worker threads with its own request queue.  Workers are
+ * spawned whenever more requests are queued than there are idle workers,
+ * and exit after being idle for a while unless requests have recently
+ * been waiting long in the queue.
+ * Completions are reported to @ctx through a single event notification
+ * per batch of finished requests.
+ *
+ * Aborts if the notification channel cannot be created, like the other
+ * pool primitives, so callers never get a NULL pool.
+ */
+ThreadPool *thread_pool_new(AioContext *ctx, int min_threads, int max_threads);
+
+/**
+ * thread_pool_free:
+ *
+ * Destroy a pool after all its requests have completed.  Waits for the
+ * worker threads to exit.
+ */
+void thread_pool_free(ThreadPool *pool);
+
+/**
+ * aio_get_thread_pool:
+ *
+ * Return the pool whose completions run in @ctx, creating it on first
+ * use.  The pool goes away together with the context.
+ */
+ThreadPool *aio_get_thread_pool(AioContext *ctx);
+
+/**
+ * thread_pool_get_default:
+ *
+ * Return the pool of the main context, which is shared by all block
+ * drivers that have no pool of their own, creating it on first use.
+ */
+ThreadPool *thread_pool_get_default(void);
+
+/**
+ * thread_pool_submit_aio:
+ * @pool: The pool that runs the request.
+ * @func: Function that is called in a worker thread.
+ * @arg: Argument for @func.  The pool takes ownership of it and frees it
+ * with g_free() once the request has completed or was cancelled.
+ * @bs: Block device the request belongs to, if any.
+ * @cb: Completion function, called in the pool's context with the return
+ * value of @func.
+ * @opaque: Opaque pointer value passed to @cb.
+ */
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg, BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Leaky bucket I/O throttling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "throttle.h"
+
+#define NANOSECONDS_PER_SECOND  1000000000.0
+
+void throttle_init(ThrottleState *ts, int64_t now)
+{
+    memset(ts, 0, sizeof(*ts));
+    ts->previous_leak = now;
+}
+
+void throttle_config_bucket(LeakyBucket *bkt, double avg, double max,
+                            double burst_length)
+{
+    bkt->avg = avg;
+    bkt->max = max;
+    bkt->burst_length = burst_length;
+    bkt->level = 0;
+    bkt->burst_level = 0;
+}
+
+bool throttle_enabled(ThrottleState *ts)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (ts->bps[i].avg || ts->ops[i].avg) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void throttle_leak_bucket(LeakyBucket *bkt, double seconds)
+{
+    bkt->level = MAX(bkt->level - bkt->avg * seconds, 0);
+    if (bkt->max) {
+        bkt->burst_level = MAX(bkt->burst_level - bkt->max * seconds, 0);
+    }
+}
+
+static void throttle_do_leak(ThrottleState *ts, int64_t now)
+{
+    double seconds;
+    int i;
+
+    /* vm_clock stops with the guest; never leak backwards */
+    if (now <= ts->previous_leak) {
+        return;
+    }
+    seconds = (now - ts->previous_leak) / NANOSECONDS_PER_SECOND;
+    ts->previous_leak = now;
+
+    for (i = 0; i < 3; i++) {
+        throttle_leak_bucket(&ts->bps[i], seconds);
+        throttle_leak_bucket(&ts->ops[i], seconds);
+    }
+}
+
+/* Seconds until @bkt is back within its size */
+static double throttle_bucket_wait(LeakyBucket *bkt)
+{
+    double size, extra, wait = 0;
+
+    if (!bkt->avg) {
+        return 0;
+    }
+
+    size = bkt->max ? bkt->max * bkt->burst_length : bkt->avg / 10;
+    extra = bkt->level - size;
+    if (extra > 0) {
+        wait = extra / bkt->avg;
+    }
+
+    if (bkt->max) {
+        extra = bkt->burst_level - bkt->max / 10;
+        if (extra > 0) {
+            wait = MAX(wait, extra / bkt->max);
+        }
+    }
+    return wait;
+}
+
+int64_t throttle_compute_wait(ThrottleState *ts, int64_t now, bool is_write)
+{
+    double wait;
+
+    throttle_do_leak(ts, now);
+
+    wait = throttle_bucket_wait(&ts->bps[THROTTLE_TOTAL]);
+    wait = MAX(wait, throttle_bucket_wait(&ts->bps[is_write]));
+    wait = MAX(wait, throttle_bucket_wait(&ts->ops[THROTTLE_TOTAL]));
+    wait = MAX(wait, throttle_bucket_wait(&ts->ops[is_write]));
+    if (wait == 0) {
+        return 0;
+    }
+
+    /* round up, so that the bucket has really drained when the timer fires */
+    return (int64_t)(wait * NANOSECONDS_PER_SECOND) + 1;
+}
+
+static void throttle_fill_bucket(LeakyBucket *bkt, double units)
+{
+    if (!bkt->avg) {
+        return;
+    }
+    bkt->level += units;
+    if (bkt->max) {
+        bkt->burst_level += units;
+    }
+}
+
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t bytes)
+{
+    throttle_fill_bucket(&ts->bps[THROTTLE_TOTAL], bytes);
+    throttle_fill_bucket(&ts->bps[is_write], bytes);
+    throttle_fill_bucket(&ts->ops[THROTTLE_TOTAL], 1);
+    throttle_fill_bucket(&ts->ops[is_write], 1);
+}
@@ -0,0 +1,80 @@
+/*
+ * Leaky bucket I/O throttling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_THROTTLE_H
+#define QEMU_THROTTLE_H
+
+#include "qemu-common.h"
+
+/*
+ * Every limit is a leaky bucket: each request pours its size (bytes, or
+ * one operation) into the bucket, which drains continuously at the
+ * average rate.  A request has to wait while the bucket is over its size.
+ *
+ * Without a burst rate the bucket holds a tenth of a second worth of the
+ * average rate, which is enough to smooth the rate out without letting
+ * the guest run far ahead of it.  With a burst rate @max the bucket holds
+ * @burst_length seconds worth of it, so an idle device may run up to
+ * @max for that long before dropping back to @avg.  A second, smaller
+ * bucket draining at @max keeps the burst itself from going faster.
+ *
+ * The state does not read any clock; callers pass the current time in
+ * nanoseconds, which keeps the arithmetic easy to test.
+ */
+
+#define THROTTLE_READ   0
+#define THROTTLE_WRITE  1
+#define THROTTLE_TOTAL  2
+
+typedef struct LeakyBucket {
+    double avg;             /* average rate, units per second; 0 is no limit */
+    double max;             /* burst rate, units per second; 0 is no burst */
+    double burst_length;    /* how long a burst at @max may last, seconds */
+    double level;           /* units currently in the bucket */
+    double burst_level;     /* units in the bucket draining at @max */
+} LeakyBucket;
+
+typedef struct ThrottleState {
+    LeakyBucket bps[3];     /* indexed by THROTTLE_READ/WRITE/TOTAL */
+    LeakyBucket ops[3];
+    int64_t previous_leak;  /* last time the buckets were drained, ns */
+} ThrottleState;
+
+void throttle_init(ThrottleState *ts, int64_t now);
+
+/**
+ * throttle_config_bucket:
+ * @avg: Average rate, or 0 to disable the bucket.
+ * @max: Burst rate, or 0 for no bursts.
+ * @burst_length: Duration of a burst in seconds; ignored without @max.
+ *
+ * Sets the limits of @bkt and empties it.
+ */
+void throttle_config_bucket(LeakyBucket *bkt, double avg, double max,
+                            double burst_length);
+
+bool throttle_enabled(ThrottleState *ts);
+
+/**
+ * throttle_compute_wait:
+ * @now: Current time in nanoseconds.
+ * @is_write: Direction of the request.
+ *
+ * Drains the buckets up to @now and returns how many nanoseconds a
+ * request has to wait before it may be submitted, 0 if it may go now.
+ */
+int64_t throttle_compute_wait(ThrottleState *ts, int64_t now, bool is_write);
+
+/**
+ * throttle_account:
+ *
+ * Pours a request of @bytes bytes into the buckets.  Called once the
+ * request has been let through.
+ */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t bytes);
+
+#endif